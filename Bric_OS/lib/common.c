@@ -106,6 +106,12 @@ void irqrestore( unsigned long flags )
 
 #pragma endregion
 
+#pragma region CPUs
+
+uint32_t this_cpu( void ) { return 0; }
+
+#pragma endregion
+
 #pragma region Atomic Operations
 
 int atomic_test_and_set( int* value, int compare, int swap )  // NOLINT
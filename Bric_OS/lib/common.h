@@ -31,6 +31,10 @@
 # define __weak         __attribute__( ( weak ) )
 # define __aligned( x ) __attribute__( ( aligned( x ) ) )
 
+// Code and data only used while the system is initialized, freed by `MMU_free_init_mem()`
+# define __init     __attribute__( ( section( ".init.text" ) ) )
+# define __initdata __attribute__( ( section( ".init.data" ) ) )
+
 # define NO_CHAR ( -1 )
 
 /* Macros */
@@ -105,6 +109,25 @@ void irqrestore( unsigned long flags );
 
 # pragma endregion
 
+# pragma region CPUs
+
+// Most CPUs that per-CPU data is kept for
+# define MAX_CPUS ( 8U )
+
+// Get the number of the running CPU. Only the boot CPU is started so far, the others will read it
+// from their per-CPU data.
+uint32_t this_cpu( void );
+
+// Read the time stamp counter of the running CPU
+static inline uint64_t rdtsc( void )
+{
+    uint32_t lo, hi;
+    asm volatile( "rdtsc" : "=a"( lo ), "=d"( hi ) );
+    return ( (uint64_t)hi << 32U ) | lo;
+}
+
+# pragma endregion
+
 # pragma region Atomic Operations
 
 // Atomically compare and swap a value
@@ -0,0 +1,208 @@
+/** @file karena.c
+ *
+ * @brief Arena allocator for kernel data that is freed all at once. Each chunk starts with a small
+ * header, and the arena only keeps a pointer to the next free byte of the newest chunk. Chunks
+ * that a reset or rollback frees are kept on a spare list, so a reused arena stops allocating
+ * pages once it has grown to the size it needs.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#include "karena.h"
+
+#include "errno.h"
+#include "mmu_driver.h"
+
+/* Private Defines and Macros */
+
+// Largest allocation, the same as `kmalloc()`
+#define KARENA_MAX_ALLOC ( (size_t)( UINT32_MAX ) )
+
+/* Private Types and Enums */
+
+// Header at the start of every chunk, the allocations follow it
+struct karena_chunk_s
+{
+    karena_chunk_t *next;
+    uint64_t num_pages;
+};
+
+/* Private Functions */
+
+// Make a chunk with room for `size` bytes aligned to `align` the newest chunk of the arena. A
+// spare chunk is used if one is big enough, otherwise a new one is allocated.
+bool karena_grow( karena_t *arena, size_t size, size_t align )
+{
+    uint64_t need = sizeof( karena_chunk_t ) + size + align;
+    uint64_t num_pages = ALIGN( need, PAGE_SIZE ) / PAGE_SIZE;
+    karena_chunk_t **prev, *chunk;
+
+    for ( prev = &arena->spare; ( chunk = *prev ) != NULL; prev = &chunk->next )
+    {
+        if ( chunk->num_pages >= num_pages )
+        {
+            *prev = chunk->next;
+            break;
+        }
+    }
+
+    if ( chunk == NULL )
+    {
+        num_pages = ( num_pages < arena->chunk_pages ? arena->chunk_pages : num_pages );
+        chunk = (karena_chunk_t *)MMU_alloc_pages( num_pages, MMU_VADDR_KHEAP );
+
+        if ( chunk == NULL )
+        {
+            return false;
+        }
+
+        chunk->num_pages = num_pages;
+    }
+
+    if ( arena->chunks == NULL )
+    {
+        arena->oldest = chunk;
+    }
+
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->curr = (uint8_t *)( chunk + 1 );
+    arena->end = (uint8_t *)chunk + chunk->num_pages * PAGE_SIZE;
+
+    return true;
+}
+
+/* Public Functions */
+
+void karena_init( karena_t *arena, uint64_t chunk_pages )
+{
+    memset( arena, 0, sizeof( karena_t ) );
+    arena->chunk_pages = ( chunk_pages == 0 ? KARENA_CHUNK_PAGES : chunk_pages );
+}
+
+void *karena_alloc( karena_t *arena, size_t size )
+{
+    return karena_alloc_aligned( arena, size, KARENA_ALIGN );
+}
+
+void *karena_alloc_aligned( karena_t *arena, size_t size, size_t align )
+{
+    uint8_t *ptr;
+
+    if ( align == 0 || ( align & ( align - 1 ) ) != 0 || align > PAGE_SIZE )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ( size > KARENA_MAX_ALLOC )
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Every allocation gets its own address
+    size = ( size == 0 ? 1 : size );
+
+    ptr = (uint8_t *)ALIGN( (uintptr_t)arena->curr, align );
+
+    if ( arena->chunks == NULL || ptr + size > arena->end )
+    {
+        if ( !karena_grow( arena, size, align ) )
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        ptr = (uint8_t *)ALIGN( (uintptr_t)arena->curr, align );
+    }
+
+    arena->curr = ptr + size;
+
+    return ptr;
+}
+
+void *karena_calloc( karena_t *arena, size_t nmemb, size_t size )
+{
+    void *ptr;
+
+    // Check if the size overflows
+    if ( nmemb > UINT32_MAX || size > UINT32_MAX )
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ptr = karena_alloc( arena, nmemb * size );
+
+    if ( ptr != NULL )
+    {
+        memset( ptr, 0, nmemb * size );
+    }
+
+    return ptr;
+}
+
+karena_mark_t karena_save( karena_t *arena )
+{
+    karena_mark_t mark = { .chunk = arena->chunks, .curr = arena->curr };
+
+    return mark;
+}
+
+void karena_rollback( karena_t *arena, karena_mark_t mark )
+{
+    karena_chunk_t *chunk;
+
+    // Move the chunks started since the mark to the spare list
+    while ( arena->chunks != NULL && arena->chunks != mark.chunk )
+    {
+        chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        chunk->next = arena->spare;
+        arena->spare = chunk;
+    }
+
+    if ( arena->chunks == NULL )
+    {
+        karena_reset( arena );
+        return;
+    }
+
+    arena->curr = mark.curr;
+    arena->end = (uint8_t *)arena->chunks + arena->chunks->num_pages * PAGE_SIZE;
+}
+
+void karena_reset( karena_t *arena )
+{
+    // The chunks in use are a list from `chunks` to `oldest`, so they join the spares at once
+    if ( arena->chunks != NULL )
+    {
+        arena->oldest->next = arena->spare;
+        arena->spare = arena->chunks;
+    }
+
+    arena->chunks = NULL;
+    arena->oldest = NULL;
+    arena->curr = NULL;
+    arena->end = NULL;
+}
+
+void karena_destroy( karena_t *arena )
+{
+    karena_chunk_t *chunk;
+
+    karena_reset( arena );
+
+    while ( ( chunk = arena->spare ) != NULL )
+    {
+        arena->spare = chunk->next;
+        MMU_free_pages( chunk, chunk->num_pages );
+    }
+}
+
+/*** End of File ***/
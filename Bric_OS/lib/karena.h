@@ -0,0 +1,105 @@
+/** @file karena.h
+ *
+ * @brief Arena allocator for kernel data that is freed all at once. Allocations are bumped out of
+ * chunks of pages with no header per object, and nothing is freed until the whole arena is reset,
+ * rolled back to a savepoint or destroyed.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#ifndef KARENA_H
+# define KARENA_H
+
+/* Includes */
+
+# include "common.h"
+
+/* Defines */
+
+// Pages in a chunk, unless the arena asks for more or an allocation needs a bigger one
+# define KARENA_CHUNK_PAGES ( 4U )
+
+// Alignment of `karena_alloc()`, the same as `kmalloc()`
+# define KARENA_ALIGN ( 16U )
+
+/* Typedefs */
+
+typedef struct karena_chunk_s karena_chunk_t;
+
+// Arena set up by `karena_init()`. It can be embedded anywhere, only its chunks are allocated.
+typedef struct karena_s
+{
+    karena_chunk_t *chunks;  // Chunks in use, newest first
+    karena_chunk_t *oldest;  // Last chunk in use, so a reset moves them all at once
+    karena_chunk_t *spare;   // Chunks kept for reuse after a reset or rollback
+    uint8_t *curr;           // Next free byte of the newest chunk
+    uint8_t *end;            // End of the newest chunk
+    uint64_t chunk_pages;    // Pages in a new chunk
+} karena_t;
+
+// Savepoint of an arena, see `karena_save()`
+typedef struct karena_mark_s
+{
+    karena_chunk_t *chunk;
+    uint8_t *curr;
+} karena_mark_t;
+
+/* Public Functions */
+
+/**
+ * @brief Sets up an empty arena. No memory is allocated until the first allocation.
+ * @param arena The arena
+ * @param chunk_pages Pages in each chunk, or 0 for `KARENA_CHUNK_PAGES`
+ */
+void karena_init( karena_t *arena, uint64_t chunk_pages );
+
+/**
+ * @brief Allocates `size` bytes aligned to `KARENA_ALIGN` from an arena. A size of 0 still gets a
+ * unique pointer.
+ * @return A pointer to the memory, or NULL and `errno` set to ENOMEM.
+ */
+void *karena_alloc( karena_t *arena, size_t size );
+
+/**
+ * @brief Allocates `size` bytes aligned to `align` from an arena.
+ * @param align Power of 2 of at most a page
+ * @return A pointer to the memory, or NULL and `errno` set to EINVAL or ENOMEM.
+ */
+void *karena_alloc_aligned( karena_t *arena, size_t size, size_t align );
+
+/**
+ * @brief Allocates an array of `nmemb` elements of `size` bytes from an arena, set to zero.
+ * @return A pointer to the memory, or NULL and `errno` set to ENOMEM.
+ */
+void *karena_calloc( karena_t *arena, size_t nmemb, size_t size );
+
+/**
+ * @brief Saves the current end of an arena. Everything allocated after it can be freed at once
+ * by `karena_rollback()`.
+ */
+karena_mark_t karena_save( karena_t *arena );
+
+/**
+ * @brief Frees everything allocated since `mark` was saved. The chunks filled since then are kept
+ * for reuse. Marks saved after `mark` are no longer valid.
+ */
+void karena_rollback( karena_t *arena, karena_mark_t mark );
+
+/**
+ * @brief Frees everything in an arena in constant time. The chunks are kept for reuse.
+ */
+void karena_reset( karena_t *arena );
+
+/**
+ * @brief Frees everything in an arena and gives its chunks back to the memory manager. The cost
+ * is per chunk, not per object. The arena is empty and can be used again afterwards.
+ */
+void karena_destroy( karena_t *arena );
+
+#endif /* KARENA_H */
+
+/*** End of File ***/
@@ -1,65 +1,100 @@
 /** @file kmalloc.c
  *
  * @brief A custom implementation of kmalloc, kfree, kcalloc, and krealloc.
+ *
+ * Blocks live on a single linked list that is locked with interrupts disabled. Blocks of up to
+ * 2 KiB are rounded up to a power of 2 size class, and freed ones are cached per CPU in magazines,
+ * arrays of free blocks of one class. Each CPU has a loaded and a previous magazine per class, and
+ * swaps whole magazines with the class' depot when both are full or empty, so most allocations
+ * and frees only touch the running CPU's cache, guarded by an atomic flag instead of a lock.
  */
 
 #include "kmalloc.h"
 
 #include "errno.h"
+#include "kmalloc_prof.h"
+#include "kmalloc_trace.h"
 #include "mmu_driver.h"
 
 #define DEBUG_MSG_ENABLE 0
 
-static header_t *kernel_heap_head = NULL;
+// Size classes are the powers of 2 from ALIGN_SIZE up to 2 KiB
+#define NUM_CLASSES ( 8U )
+
+// Blocks that `kfree_bulk()` gives back to the block list under one lock
+#define BULK_BATCH ( 32U )
+
+// Profiler hooks of the public functions, the frame pointer is the public function's
+#if KMALLOC_PROFILE
+# define PROFILE_ALLOC( ptr ) profile_alloc( ptr, __builtin_frame_address( 0 ) )
+# define PROFILE_FREE( ptr )  profile_free( ptr )
+#else
+# define PROFILE_ALLOC( ptr )
+# define PROFILE_FREE( ptr )
+#endif
+
+// Trace hooks of the public functions
+#if KMALLOC_TRACE
+# define TRACE_LOG( op, ptr, size )             ktrace_log( op, ptr, size )
+# define TRACE_REALLOC( old_ptr, new_ptr, size ) ktrace_log_realloc( old_ptr, new_ptr, size )
+#else
+# define TRACE_LOG( op, ptr, size )
+# define TRACE_REALLOC( old_ptr, new_ptr, size )
+#endif
+
+/* Magazine of free blocks of one size class */
+typedef struct kmag_s kmag_t;
+struct kmag_s
+{
+    kmag_t *next;
+    uint32_t rounds;
+    void *objs[MAG_ROUNDS];
+};
 
-/**
- * @brief Attemps to return memory allocated with `kbrk()` to the OS.
- */
-void kmalloc_cleanup( void )
+/* Magazines of one size class shared by all CPUs */
+typedef struct kdepot_s
 {
-    // kernel_heap_head must exist
-    if ( !IS_VALID( kernel_heap_head ) )
-    {
-        return;
-    }
+    binary_semaphore_t lock;
+    kmag_t *full;
+    kmag_t *empty;
+    uint32_t num_full;
+} kdepot_t;
+
+/* Heap state of one CPU */
+typedef struct kcpu_s
+{
+    int busy;                     // Set while the CPU is in its magazines
+    bool in_heap;                 // Set while the CPU holds the block list
+    void **deferred;              // Pointers freed while `in_heap` was set, see `kfree_defer()`
+    kmag_t *loaded[NUM_CLASSES];  // Partly full magazines
+    kmag_t *prev[NUM_CLASSES];    // Full or empty magazines
+} kcpu_t;
 
-    int num_unfree_blks = 0;
-    header_t *b = kernel_heap_head;
-    void *ret = NULL;
+static header_t *kernel_heap_head = NULL;
 
-    // Traverse to the end of the linked list
-    while ( IS_VALID( b ) && IS_VALID( b->next ) )
-    {
-        // Count the number of unfreed blocks and free them
-        if ( b->free == false )
-        {
-            num_unfree_blks++;
+static binary_semaphore_t heap_lock_sem = { 0 };
 
-            kfree( b->ptr );
-            b = kernel_heap_head;
-        }
-        b = b->next;
-    }
+static kdepot_t kdepots[NUM_CLASSES];
+static kcpu_t kcpus[MAX_CPUS];
 
-    // Report unfreed blocks
-    if ( num_unfree_blks > 0 )
+/**
+ * @brief Gets the size class of a block size aligned to 16 bytes.
+ * @return The size class, or `NUM_CLASSES` if the size is too big to be cached.
+ */
+uint32_t size_class( size_t size )
+{
+    if ( size <= ALIGN_SIZE )
     {
-        OS_WARN( "There are %d unfreed blocks!\n", num_unfree_blks );
+        return 0;
     }
 
-    // Check if we can give memory back to the OS
-    if ( (uintptr_t)kernel_heap_head->ptr + kernel_heap_head->size == (uintptr_t)kbrk( 0 ) )
+    if ( size > ( ALIGN_SIZE << ( NUM_CLASSES - 1 ) ) )
     {
-        ret = (header_t *)kbrk( (int64_t)kernel_heap_head->size * -1 );
-
-        if ( ret != (void *)( -1 ) )
-        {
-            OS_INFO( "All memory was successfully returned!\n" );
-            return;
-        }
+        return NUM_CLASSES;
     }
 
-    OS_ERROR( "An error occurred while cleaning up! :(\n" );
+    // log2 of the next power of 2, minus log2( ALIGN_SIZE )
+    return (uint32_t)( 64 - __builtin_clzl( size - 1 ) - 4 );
 }
 
 /**
@@ -117,6 +152,9 @@ void split_block( header_t *block, size_t size )
     new_b->ptr = new_b + 1;
     new_b->size = block->size - size - HEADER_SIZE;
     new_b->free = true;
+    new_b->cached = false;
+    new_b->sampled = false;
+    new_b->deferred = false;
     new_b->prev = block;
 
     // If we aren't at the end of the linked list, connect the next block and
@@ -169,6 +207,9 @@ header_t *extend_mem( size_t min_blk_size, header_t *prev, header_t *next )
     b->ptr = b + 1;
     b->size = total_size;
     b->free = true;
+    b->cached = false;
+    b->sampled = false;
+    b->deferred = false;
     b->next = next;
     b->prev = prev;
 
@@ -256,205 +297,1112 @@ header_t *get_empty_mem( size_t size )
     return b;
 }
 
-void *kmalloc( size_t size )
+/**
+ * @brief Finds the block that `ptr` points into. Pointers returned by `kmalloc()` are checked
+ *        against their header first, anything else is looked up on the block list, which has to
+ *        be locked.
+ * @param ptr A pointer into a block.
+ * @return The block, or NULL if `ptr` isn't in any block.
+ */
+header_t *block_of( void *ptr )
 {
-    // Check for size = 0 so we never have a block of size 0
-    if ( size < 1 )
+    header_t *b = GET_HEADER( ptr );
+
+    if ( (void *)b >= (void *)kernel_heap_head && b->ptr == ptr )
     {
-        ++size;
+        return b;
     }
 
-    // Align the size to 16 bytes
-    size_t total_size = ROUND_UP( size, ALIGN_SIZE );
-
-    // Check if the size is too big
-    if ( size > UINT32_MAX || total_size > UINT32_MAX )
+    // Traverse the linked list to get the ptr's corrsponding block
+    b = kernel_heap_head;
+    while ( IS_VALID( b ) )
     {
-        errno = ENOMEM;
-        return NULL;
+        // Check if the ptr is within the current block's memory space
+        if ( (void *)b <= ptr && ptr < (void *)( (uintptr_t)b->ptr + b->size ) )
+        {
+            break;
+        }
+
+        b = b->next;
     }
 
-    // Get a new block of empty memory
-    header_t *b = get_empty_mem( total_size );
+    return b;
+}
 
-    // Error checking
-    if ( IS_VALID( b ) == false )
+/**
+ * @brief Marks a block as free and merges it with its neighbors. The block list must be locked.
+ * @param b The block to free.
+ */
+void heap_free( header_t *b )
+{
+    // Mark the current block as free
+    b->free = true;
+    b->cached = false;
+
+    // Try to merge the current block with the next block
+    merge_blocks( b, b->next );
+
+    // Try to merge the current block with the previous block
+    merge_blocks( b->prev, b );
+}
+
+/**
+ * @brief Locks the block list and disables interrupts. Touching a new heap page can fault, and
+ *        the page fault can reclaim memory, which allocates and frees. A CPU can't wait for a lock
+ *        it holds itself, so it fails instead.
+ * @param flags Where the interrupt flags are saved.
+ * @return true if the block list was locked, false if the running CPU already holds it.
+ */
+bool heap_lock( unsigned long *flags )
+{
+    kcpu_t *cpu;
+
+    *flags = save_irqdisable();
+    cpu = &kcpus[this_cpu()];
+
+    if ( cpu->in_heap )
     {
-        errno = ENOMEM;
-        return NULL;
+        irqrestore( *flags );
+        return false;
     }
 
-    if ( DEBUG_MSG_ENABLE )
+    binary_semaphore_lock( heap_lock_sem );
+    cpu->in_heap = true;
+
+    return true;
+}
+
+/**
+ * @brief Frees the blocks that were freed while the running CPU held the block list, then unlocks
+ *        it and restores interrupts.
+ * @param flags The interrupt flags saved by `heap_lock()`.
+ */
+void heap_unlock( unsigned long flags )
+{
+    kcpu_t *cpu = &kcpus[this_cpu()];
+    void **link;
+    header_t *b;
+
+    while ( ( link = cpu->deferred ) != NULL )
     {
-        OS_INFO( "kmalloc(%lu) => (ptr=%p, size=%u)\n", size, b->ptr, b->size );
+        cpu->deferred = (void **)*link;
+        b = block_of( link );
+
+        if ( IS_VALID( b ) && !b->free && !b->cached )
+        {
+            b->deferred = false;
+            heap_free( b );
+        }
     }
 
-    return b->ptr;
+    cpu->in_heap = false;
+    binary_semaphore_unlock( heap_lock_sem );
+    irqrestore( flags );
 }
 
-void *kcalloc( size_t nmemb, size_t size )
+/**
+ * @brief Allocates a block from the block list.
+ * @param size The size of the block, aligned to 16 bytes.
+ * @return The block, or NULL if the heap is out of memory or the running CPU holds the list.
+ */
+header_t *heap_alloc( size_t size )
 {
-    // Align the size to 16 bytes
-    size_t total_size = ROUND_UP( nmemb * size, ALIGN_SIZE );
+    unsigned long flags;
+    header_t *b;
 
-    // Check if the size is too big
-    if ( nmemb > UINT32_MAX || size > UINT32_MAX || total_size > UINT32_MAX )
+    if ( !heap_lock( &flags ) )
     {
-        errno = ENOMEM;
         return NULL;
     }
 
-    // Allocate and check for errors
-    void *ptr = kmalloc( total_size );
-    if ( IS_NULL( ptr ) )
+    b = get_empty_mem( size );
+    heap_unlock( flags );
+
+    return b;
+}
+
+/**
+ * @brief Gives a magazine's blocks back to the block list, and with `destroy` the magazine's own
+ *        block as well.
+ * @return false if the running CPU holds the block list, the magazine is unchanged then.
+ */
+bool mag_flush( kmag_t *mag, bool destroy )
+{
+    unsigned long flags;
+
+    if ( !heap_lock( &flags ) )
     {
-        return NULL;
+        return false;
     }
 
-    memset( ptr, 0, GET_HEADER( ptr )->size );
+    while ( mag->rounds > 0 )
+    {
+        heap_free( GET_HEADER( mag->objs[--mag->rounds] ) );
+    }
 
-    if ( DEBUG_MSG_ENABLE )
+    if ( destroy )
     {
-        OS_INFO(
-            "kcalloc(%lu, %lu) => (ptr=%p, size=%u)\n", nmemb, size, ptr, GET_HEADER( ptr )->size
-        );
+        heap_free( GET_HEADER( mag ) );
     }
 
-    return ptr;
+    heap_unlock( flags );
+
+    return true;
 }
 
-void *krealloc( void *ptr, size_t size )
+/**
+ * @brief Allocates an empty magazine from the block list. Magazines are marked as cached, so a
+ *        stray `kfree()` can't give them back.
+ * @return The magazine, or NULL if there is no memory for it.
+ */
+kmag_t *mag_create( void )
 {
-    // krealloc(NULL, size) --> kmalloc(size)
-    if ( IS_NULL( ptr ) )
-    {
-        return kmalloc( size );
-    }
+    header_t *b = heap_alloc( ROUND_UP( sizeof( kmag_t ), ALIGN_SIZE ) );
+    kmag_t *mag;
 
-    // krealloc(p, 0) --> kfree(p)
-    if ( size == 0 )
+    if ( !IS_VALID( b ) )
     {
-        kfree( ptr );
         return NULL;
     }
 
-    // Align the size to 16 bytes
-    size_t total_size = ROUND_UP( size, ALIGN_SIZE );
+    b->cached = true;
 
-    // Check if the size is too big
-    if ( size > UINT32_MAX || total_size > UINT32_MAX )
+    mag = (kmag_t *)b->ptr;
+    mag->next = NULL;
+    mag->rounds = 0;
+
+    return mag;
+}
+
+/**
+ * @brief Takes a full or an empty magazine from a depot.
+ * @return The magazine, or NULL if the depot has none.
+ */
+kmag_t *depot_get( kdepot_t *depot, bool full )
+{
+    kmag_t **list = ( full ? &depot->full : &depot->empty );
+    kmag_t *mag;
+    unsigned long flags;
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( depot->lock );
+
+    if ( ( mag = *list ) != NULL )
     {
-        errno = ENOMEM;
-        return NULL;
+        *list = mag->next;
+        depot->num_full -= ( full ? 1 : 0 );
     }
 
-    header_t *b = GET_HEADER( ptr );
+    binary_semaphore_unlock( depot->lock );
+    irqrestore( flags );
+
+    return mag;
+}
+
+/**
+ * @brief Gives a magazine to a depot. Once the depot holds `DEPOT_MAX_FULL` full magazines, the
+ *        blocks of a full one go back to the block list and it's kept as an empty one, so the
+ *        caches can't hold on to the whole heap.
+ */
+void depot_put( kdepot_t *depot, kmag_t *mag )
+{
+    unsigned long flags;
+    bool full;
 
-    // If the new size is smaller than the current size, just split the block
-    if ( total_size < b->size )
+    // The count is only a hint, flushing is done without the depot locked
+    if ( mag->rounds > 0 && depot->num_full >= DEPOT_MAX_FULL )
     {
-        split_block( b, total_size );
-        return ptr;
+        mag_flush( mag, false );
     }
 
-    void *new_ptr = NULL;
-
-    // Set the current block to free for the merge operations
-    b->free = true;
+    full = ( mag->rounds > 0 );
 
-    // First try to extend the current block
-    merge_blocks( b, b->next );
+    flags = save_irqdisable();
+    binary_semaphore_lock( depot->lock );
 
-    // If that wasn't enough, try to extend the previous block as well
-    if ( b->size < total_size )
+    if ( full )
     {
-        merge_blocks( b->prev, b );
+        mag->next = depot->full;
+        depot->full = mag;
+        depot->num_full++;
     }
     else
     {
-        // If b + b->next was enough, b->ptr is the new pointer
-        new_ptr = b->ptr;
+        mag->next = depot->empty;
+        depot->empty = mag;
     }
 
-    // Reset free
-    b->free = false;
+    binary_semaphore_unlock( depot->lock );
+    irqrestore( flags );
+}
 
-    // If that wasn't enough, get a new block of memory
-    if ( b->size < total_size )
-    {
-        new_ptr = kmalloc( total_size );
+/**
+ * @brief Takes a block of a size class from a CPU's magazines. If both are empty, the previous
+ *        one is traded for a full one from the depot.
+ * @return The block's pointer, or NULL if the CPU and the depot have none cached.
+ */
+void *mag_alloc( kcpu_t *cpu, uint32_t cls )
+{
+    kmag_t *mag = cpu->loaded[cls], *full;
+    void *ptr;
 
-        // Copy the data from the old block to the new one
-        memcpy( new_ptr, ptr, b->size );
+    if ( mag == NULL || mag->rounds == 0 )
+    {
+        if ( cpu->prev[cls] != NULL && cpu->prev[cls]->rounds > 0 )
+        {
+            cpu->loaded[cls] = cpu->prev[cls];
+            cpu->prev[cls] = mag;
+        }
+        else
+        {
+            if ( ( full = depot_get( &kdepots[cls], true ) ) == NULL )
+            {
+                return NULL;
+            }
 
-        // Free the old block
-        kfree( ptr );
-    }
+            if ( cpu->prev[cls] != NULL )
+            {
+                depot_put( &kdepots[cls], cpu->prev[cls] );
+            }
 
-    // Split the new block if necessary
-    split_block( GET_HEADER( new_ptr ), size );
+            cpu->prev[cls] = mag;
+            cpu->loaded[cls] = full;
+        }
 
-    if ( DEBUG_MSG_ENABLE )
-    {
-        OS_INFO(  // NOLINT
-            "krealloc(%p, %lu) => (ptr=%p, size=%u)\n", ptr, size, new_ptr,
-            GET_HEADER( new_ptr )->size
-        );
+        mag = cpu->loaded[cls];
     }
 
-    return new_ptr;
+    ptr = mag->objs[--mag->rounds];
+    GET_HEADER( ptr )->cached = false;
+
+    return ptr;
 }
 
-void kfree( void *ptr )
+/**
+ * @brief Caches a block of a size class in a CPU's magazines. If both are full, the previous one
+ *        is traded for an empty one from the depot, or a new one.
+ * @return false if there is no room for the block.
+ */
+bool mag_free( kcpu_t *cpu, uint32_t cls, void *ptr )
 {
-    // Check for NULL input
-    if ( IS_NULL( ptr ) )
-    {
-        return;
-    }
-
-    // Simple check to make sure the pointer is within the know address space
-    if ( ptr < (void *)kernel_heap_head || (void *)( (uintptr_t)kbrk( 0 ) - MIN_BLK_SIZE ) < ptr )
-    {
-        OS_WARN( "kfree(%p): Invalid pointer!\n", ptr );
-        errno = EFAULT;
-        return;
-    }
+    kmag_t *mag = cpu->loaded[cls], *empty;
 
-    // Traverse the linked list to get the ptr's corrsponding block
-    header_t *b = kernel_heap_head;
-    while ( IS_VALID( b ) )
+    if ( mag == NULL || mag->rounds == MAG_ROUNDS )
     {
-        // Check if the ptr is within the current block's memory space
-        if ( (void *)b <= ptr && ptr < (void *)( (uintptr_t)b->ptr + b->size ) )
+        if ( cpu->prev[cls] != NULL && cpu->prev[cls]->rounds == 0 )
         {
-            break;
+            cpu->loaded[cls] = cpu->prev[cls];
+            cpu->prev[cls] = mag;
         }
+        else
+        {
+            if ( ( empty = depot_get( &kdepots[cls], false ) ) == NULL &&
+                 ( empty = mag_create() ) == NULL )
+            {
+                return false;
+            }
 
-        b = b->next;
-    }
+            if ( cpu->prev[cls] != NULL )
+            {
+                depot_put( &kdepots[cls], cpu->prev[cls] );
+            }
 
-    // Check if we found a valid block
-    if ( IS_NULL( b ) )
-    {
-        OS_ERROR( "kfree(%p): Invalid pointer!\n", ptr );
-        errno = EFAULT;
-        return;
+            cpu->prev[cls] = mag;
+            cpu->loaded[cls] = empty;
+        }
+
+        mag = cpu->loaded[cls];
     }
 
-    // Mark the current block as free
-    b->free = true;
+    GET_HEADER( ptr )->cached = true;
+    mag->objs[mag->rounds++] = ptr;
 
-    // Try to merge the current block with the next block
-    merge_blocks( b, b->next );
+    return true;
+}
 
-    // Try to merge the current block with the previous block
-    merge_blocks( b->prev, b );
+/**
+ * @brief Enters the running CPU's cache. No lock is taken and interrupts stay enabled. An
+ *        interrupt or page fault that hits while the CPU is in its cache finds it busy, and goes
+ *        to the block list instead.
+ * @return The CPU's heap state, or NULL if the CPU is already in its cache.
+ */
+kcpu_t *cache_enter( void )
+{
+    kcpu_t *cpu = &kcpus[this_cpu()];
 
-    if ( DEBUG_MSG_ENABLE )
+    return ( atomic_test_and_set( &cpu->busy, false, true ) ? NULL : cpu );
+}
+
+/**
+ * @brief Leaves a CPU's cache entered with `cache_enter()`.
+ */
+void cache_exit( kcpu_t *cpu ) { __atomic_store_n( &cpu->busy, false, __ATOMIC_RELEASE ); }
+
+/**
+ * @brief Gets the size class of a block being freed. Only whole blocks of a size class that are
+ *        in use can be cached.
+ * @return The size class, or `NUM_CLASSES` if the block has to go back to the block list.
+ */
+uint32_t cache_class( void *ptr )
+{
+    header_t *b = GET_HEADER( ptr );
+    uint32_t cls;
+
+    if ( (void *)b < (void *)kernel_heap_head || b->ptr != ptr || b->free || b->cached )
     {
-        OS_INFO( "kfree(%p)\n", ptr );
+        return NUM_CLASSES;
     }
+
+    cls = size_class( b->size );
+
+    return ( cls < NUM_CLASSES && ( ALIGN_SIZE << cls ) == b->size ? cls : NUM_CLASSES );
+}
+
+/**
+ * @brief Allocates a block of a size class from the running CPU's cache.
+ * @return The block's pointer, or NULL on a cache miss.
+ */
+void *cache_alloc( uint32_t cls )
+{
+    kcpu_t *cpu = cache_enter();
+    void *ptr;
+
+    if ( cpu == NULL )
+    {
+        return NULL;
+    }
+
+    ptr = mag_alloc( cpu, cls );
+    cache_exit( cpu );
+
+    return ptr;
+}
+
+/**
+ * @brief Caches a freed block in the running CPU's cache.
+ * @return false if the block has to go back to the block list.
+ */
+bool cache_free( void *ptr )
+{
+    uint32_t cls = cache_class( ptr );
+    kcpu_t *cpu;
+    bool cached;
+
+    if ( cls == NUM_CLASSES || ( cpu = cache_enter() ) == NULL )
+    {
+        return false;
+    }
+
+    cached = mag_free( cpu, cls, ptr );
+    cache_exit( cpu );
+
+    return cached;
+}
+
+/**
+ * @brief Puts off freeing a block until the running CPU is done with the block list. The block
+ *        can't be looked up without the list, so it's chained to the CPU's deferred frees through
+ *        the 8 bytes at `ptr`, aligned down. Blocks are 16 byte aligned, so those bytes always lie
+ *        in the block, which is free to use now that it's being freed.
+ */
+void kfree_defer( void *ptr )
+{
+    void **link = (void **)( (uintptr_t)ptr & ~( sizeof( void * ) - 1 ) );
+    header_t *b = GET_HEADER( ptr );
+    unsigned long flags;
+    kcpu_t *cpu;
+
+    // A magazine is still using its block, and a cached block is already on a magazine. Chaining
+    // a block twice would link it to itself.
+    if ( (void *)b >= (void *)kernel_heap_head && b->ptr == ptr )
+    {
+        if ( b->free || b->cached || b->deferred )
+        {
+            OS_WARN( "kfree(%p): Block was already freed!\n", ptr );
+            return;
+        }
+
+        b->deferred = true;
+    }
+
+    flags = save_irqdisable();
+    cpu = &kcpus[this_cpu()];
+
+    *link = cpu->deferred;
+    cpu->deferred = link;
+
+    irqrestore( flags );
+}
+
+/**
+ * @brief Gives blocks back to the block list under one lock. If the running CPU is changing the
+ *        block list, the blocks are freed once it's done.
+ * @param ptrs Pointers into the blocks to free.
+ * @param n The number of pointers.
+ */
+void heap_free_ptrs( void **ptrs, size_t n )
+{
+    unsigned long flags;
+    header_t *b;
+    size_t i;
+
+    if ( !heap_lock( &flags ) )
+    {
+        for ( i = 0; i < n; ++i )
+        {
+            kfree_defer( ptrs[i] );
+        }
+
+        return;
+    }
+
+    for ( i = 0; i < n; ++i )
+    {
+        b = block_of( ptrs[i] );
+
+        // Check if we found a valid block
+        if ( IS_NULL( b ) )
+        {
+            OS_ERROR( "kfree(%p): Invalid pointer!\n", ptrs[i] );
+            errno = EFAULT;
+        }
+        // Cached blocks and magazines were already freed
+        else if ( b->cached )
+        {
+            OS_WARN( "kfree(%p): Block was already freed!\n", ptrs[i] );
+        }
+        else
+        {
+            heap_free( b );
+        }
+    }
+
+    heap_unlock( flags );
+}
+
+/**
+ * @brief Simple check to make sure a pointer is within the known address space.
+ * @param ptr The pointer to check.
+ * @param top The heap's program break.
+ */
+bool heap_contains( void *ptr, void *top )
+{
+    return (void *)kernel_heap_head <= ptr && ptr <= (void *)( (uintptr_t)top - MIN_BLK_SIZE );
+}
+
+/**
+ * @brief Gets the block size of a request, aligned to 16 bytes, or the size of its size class for
+ *        blocks that are cached.
+ * @param size The requested size.
+ * @param cls Set to the size class, or `NUM_CLASSES` for blocks that aren't cached.
+ * @return The block size, or 0 if the size is too big.
+ */
+size_t block_size( size_t size, uint32_t *cls )
+{
+    // Check for size = 0 so we never have a block of size 0
+    if ( size < 1 )
+    {
+        ++size;
+    }
+
+    // Check if the size is too big
+    if ( size > UINT32_MAX || ROUND_UP( size, ALIGN_SIZE ) > UINT32_MAX )
+    {
+        return 0;
+    }
+
+    // Align the size to 16 bytes
+    size = ROUND_UP( size, ALIGN_SIZE );
+    *cls = size_class( size );
+
+    return ( *cls < NUM_CLASSES ? ALIGN_SIZE << *cls : size );
+}
+
+/**
+ * @brief Gives every cached block and magazine back to the block list. CPUs that are in their
+ *        caches are skipped.
+ */
+void kmalloc_drain( void )
+{
+    kmag_t *mag;
+    uint32_t cpu, cls;
+
+    for ( cpu = 0; cpu < MAX_CPUS; ++cpu )
+    {
+        if ( atomic_test_and_set( &kcpus[cpu].busy, false, true ) )
+        {
+            continue;
+        }
+
+        for ( cls = 0; cls < NUM_CLASSES; ++cls )
+        {
+            if ( kcpus[cpu].loaded[cls] != NULL && mag_flush( kcpus[cpu].loaded[cls], true ) )
+            {
+                kcpus[cpu].loaded[cls] = NULL;
+            }
+
+            if ( kcpus[cpu].prev[cls] != NULL && mag_flush( kcpus[cpu].prev[cls], true ) )
+            {
+                kcpus[cpu].prev[cls] = NULL;
+            }
+        }
+
+        __atomic_store_n( &kcpus[cpu].busy, false, __ATOMIC_RELEASE );
+    }
+
+    for ( cls = 0; cls < NUM_CLASSES; ++cls )
+    {
+        while ( ( mag = depot_get( &kdepots[cls], true ) ) != NULL ||
+                ( mag = depot_get( &kdepots[cls], false ) ) != NULL )
+        {
+            mag_flush( mag, true );
+        }
+    }
+}
+
+/**
+ * @brief Counts the whole pages at the top of the heap that are free. The last block keeps its
+ *        header and at least `ALIGN_SIZE` bytes. The block list must be locked.
+ * @param last Set to the last block.
+ * @return The number of free pages.
+ */
+uint64_t heap_top_pages( header_t **last )
+{
+    uintptr_t top, min_top;
+    header_t *b;
+
+    for ( b = kernel_heap_head; IS_VALID( b->next ); b = b->next )
+    {
+    }
+
+    *last = b;
+    top = (uintptr_t)kbrk( 0 );
+    min_top = ROUND_UP( (uintptr_t)b->ptr + ALIGN_SIZE, PAGE_SIZE );
+
+    if ( !IS_FREE( b ) || (uintptr_t)b->ptr + b->size != top || top <= min_top )
+    {
+        return 0;
+    }
+
+    return ( top - min_top ) / PAGE_SIZE;
+}
+
+/**
+ * @brief Gives up to `num_pages` free pages at the top of the heap back with `kbrk()`.
+ * @param num_pages The most pages to give back.
+ * @return The number of pages given back.
+ */
+uint64_t heap_trim( uint64_t num_pages )
+{
+    uint64_t trimmed;
+    unsigned long flags;
+    header_t *b;
+
+    if ( !IS_VALID( kernel_heap_head ) || !heap_lock( &flags ) )
+    {
+        return 0;
+    }
+
+    trimmed = heap_top_pages( &b );
+    trimmed = ( trimmed < num_pages ? trimmed : num_pages );
+
+    if ( trimmed > 0 && kbrk( -(int64_t)( trimmed * PAGE_SIZE ) ) != (void *)( -1 ) )
+    {
+        b->size -= trimmed * PAGE_SIZE;
+    }
+    else
+    {
+        trimmed = 0;
+    }
+
+    heap_unlock( flags );
+
+    return trimmed;
+}
+
+uint64_t kmalloc_shrink_count( void )
+{
+    uint64_t bytes = 0, num_pages = 0;
+    unsigned long flags;
+    header_t *b;
+    uint32_t cls;
+
+    // The magazines loaded on the CPUs change under us, so only the depots are counted
+    for ( cls = 0; cls < NUM_CLASSES; ++cls )
+    {
+        bytes += (uint64_t)kdepots[cls].num_full * MAG_ROUNDS * ( ALIGN_SIZE << cls );
+    }
+
+    if ( IS_VALID( kernel_heap_head ) && heap_lock( &flags ) )
+    {
+        num_pages = heap_top_pages( &b );
+        heap_unlock( flags );
+    }
+
+    return num_pages + bytes / PAGE_SIZE;
+}
+
+uint64_t kmalloc_shrink_scan( uint64_t num_pages )
+{
+    kmalloc_drain();
+
+    return heap_trim( num_pages );
+}
+
+/**
+ * @brief Attemps to return memory allocated with `kbrk()` to the OS.
+ */
+void kmalloc_cleanup( void )
+{
+    // kernel_heap_head must exist
+    if ( !IS_VALID( kernel_heap_head ) )
+    {
+        return;
+    }
+
+    int num_unfree_blks = 0;
+    header_t *b;
+    void *ret = NULL;
+    unsigned long flags;
+
+    kmalloc_drain();
+
+    if ( !heap_lock( &flags ) )
+    {
+        return;
+    }
+
+    b = kernel_heap_head;
+
+    // Traverse to the end of the linked list
+    while ( IS_VALID( b ) && IS_VALID( b->next ) )
+    {
+        // Count the number of unfreed blocks and free them
+        if ( b->free == false )
+        {
+            num_unfree_blks++;
+
+            heap_free( b );
+            b = kernel_heap_head;
+        }
+        b = b->next;
+    }
+
+    heap_unlock( flags );
+
+    // Report unfreed blocks
+    if ( num_unfree_blks > 0 )
+    {
+        OS_WARN( "There are %d unfreed blocks!\n", num_unfree_blks );
+    }
+
+    // Check if we can give memory back to the OS
+    if ( (uintptr_t)kernel_heap_head->ptr + kernel_heap_head->size == (uintptr_t)kbrk( 0 ) )
+    {
+        ret = (header_t *)kbrk( (int64_t)kernel_heap_head->size * -1 );
+
+        if ( ret != (void *)( -1 ) )
+        {
+            OS_INFO( "All memory was successfully returned!\n" );
+            return;
+        }
+    }
+
+    OS_ERROR( "An error occurred while cleaning up! :(\n" );
+}
+
+/**
+ * @brief Allocates a block the same as `kmalloc()`, without profiling it, so the heap functions
+ *        built on it are profiled as their own call sites.
+ */
+void *kmalloc_block( size_t size )
+{
+    uint32_t cls;
+    size_t total_size = block_size( size, &cls );
+    void *ptr = NULL;
+    header_t *b;
+
+    // Check if the size is too big
+    if ( total_size == 0 )
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Small blocks come from the cache if possible
+    if ( cls < NUM_CLASSES )
+    {
+        ptr = cache_alloc( cls );
+    }
+
+    // Get a new block of empty memory
+    if ( IS_NULL( ptr ) )
+    {
+        b = heap_alloc( total_size );
+
+        // Error checking
+        if ( IS_VALID( b ) == false )
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        ptr = b->ptr;
+    }
+
+    if ( DEBUG_MSG_ENABLE )
+    {
+        OS_INFO( "kmalloc(%lu) => (ptr=%p, size=%u)\n", size, ptr, GET_HEADER( ptr )->size );
+    }
+
+    return ptr;
+}
+
+#if KMALLOC_PROFILE
+
+/**
+ * @brief Samples one in `KPROF_SAMPLE_RATE` allocations, the block is marked so its free can be
+ *        found without a lookup.
+ */
+void profile_alloc( void *ptr, void *fp )
+{
+    if ( kprof_should_sample() )
+    {
+        GET_HEADER( ptr )->sampled = true;
+        kprof_alloc( ptr, GET_HEADER( ptr )->size, fp );
+    }
+}
+
+/**
+ * @brief Tells the profiler that a sampled block is being freed.
+ */
+void profile_free( void *ptr )
+{
+    header_t *b = GET_HEADER( ptr );
+
+    if ( (void *)b >= (void *)kernel_heap_head && b->ptr == ptr && b->sampled )
+    {
+        b->sampled = false;
+        kprof_free( ptr );
+    }
+}
+
+#endif
+
+void *kmalloc( size_t size )
+{
+    void *ptr = kmalloc_block( size );
+
+    if ( IS_VALID( ptr ) )
+    {
+        PROFILE_ALLOC( ptr );
+        TRACE_LOG( KTRACE_ALLOC, ptr, size );
+    }
+
+    return ptr;
+}
+
+void *kcalloc( size_t nmemb, size_t size )
+{
+    // Align the size to 16 bytes
+    size_t total_size = ROUND_UP( nmemb * size, ALIGN_SIZE );
+
+    // Check if the size is too big
+    if ( nmemb > UINT32_MAX || size > UINT32_MAX || total_size > UINT32_MAX )
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Allocate and check for errors
+    void *ptr = kmalloc_block( total_size );
+    if ( IS_NULL( ptr ) )
+    {
+        return NULL;
+    }
+
+    memset( ptr, 0, GET_HEADER( ptr )->size );
+    PROFILE_ALLOC( ptr );
+    TRACE_LOG( KTRACE_CALLOC, ptr, nmemb * size );
+
+    if ( DEBUG_MSG_ENABLE )
+    {
+        OS_INFO(
+            "kcalloc(%lu, %lu) => (ptr=%p, size=%u)\n", nmemb, size, ptr, GET_HEADER( ptr )->size
+        );
+    }
+
+    return ptr;
+}
+
+void *krealloc( void *ptr, size_t size )
+{
+    void *new_ptr;
+
+    // krealloc(NULL, size) --> kmalloc(size)
+    if ( IS_NULL( ptr ) )
+    {
+        new_ptr = kmalloc_block( size );
+
+        if ( IS_VALID( new_ptr ) )
+        {
+            PROFILE_ALLOC( new_ptr );
+            TRACE_LOG( KTRACE_ALLOC, new_ptr, size );
+        }
+
+        return new_ptr;
+    }
+
+    // krealloc(p, 0) --> kfree(p)
+    if ( size == 0 )
+    {
+        kfree( ptr );
+        return NULL;
+    }
+
+    // Align the size to 16 bytes
+    size_t total_size = ROUND_UP( size, ALIGN_SIZE );
+
+    // Check if the size is too big
+    if ( size > UINT32_MAX || total_size > UINT32_MAX )
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    header_t *b = GET_HEADER( ptr ), *new_b;
+    unsigned long flags;
+
+    new_ptr = ptr;
+
+    // A sampled block counts as freed here, the profile loses it if the resize fails
+    PROFILE_FREE( ptr );
+
+    if ( !heap_lock( &flags ) )
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // First try to extend the current block
+    if ( b->size < total_size )
+    {
+        // Set the current block to free for the merge operation
+        b->free = true;
+        merge_blocks( b, b->next );
+        b->free = false;
+    }
+
+    // If that wasn't enough, get a new block of memory. Merging with the previous block would
+    // move the data under the old pointer.
+    if ( b->size < total_size )
+    {
+        new_b = get_empty_mem( total_size );
+
+        // Out of memory, the old block stays as it is
+        if ( !IS_VALID( new_b ) )
+        {
+            heap_unlock( flags );
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        // Copy the data from the old block to the new one
+        new_ptr = new_b->ptr;
+        memcpy( new_ptr, ptr, b->size );
+    }
+
+    // Split the block if necessary
+    split_block( GET_HEADER( new_ptr ), total_size );
+
+    // Log the resize before the old block can be handed out again, or an allocation reusing it
+    // could be logged ahead of the move
+    TRACE_REALLOC( ptr, new_ptr, size );
+
+    // Free the old block
+    if ( new_ptr != ptr )
+    {
+        heap_free( b );
+    }
+
+    heap_unlock( flags );
+
+    PROFILE_ALLOC( new_ptr );
+
+    if ( DEBUG_MSG_ENABLE )
+    {
+        OS_INFO(  // NOLINT
+            "krealloc(%p, %lu) => (ptr=%p, size=%u)\n", ptr, size, new_ptr,
+            GET_HEADER( new_ptr )->size
+        );
+    }
+
+    return new_ptr;
+}
+
+bool kmalloc_busy( void ) { return kcpus[this_cpu()].in_heap; }
+
+void kfree( void *ptr )
+{
+    // Check for NULL input
+    if ( IS_NULL( ptr ) )
+    {
+        return;
+    }
+
+    if ( !heap_contains( ptr, kbrk( 0 ) ) )
+    {
+        OS_WARN( "kfree(%p): Invalid pointer!\n", ptr );
+        errno = EFAULT;
+        return;
+    }
+
+    PROFILE_FREE( ptr );
+    TRACE_LOG( KTRACE_FREE, ptr, 0 );
+
+    // Most blocks go back to the running CPU's cache, the rest to the block list
+    if ( !cache_free( ptr ) )
+    {
+        heap_free_ptrs( &ptr, 1 );
+    }
+
+    if ( DEBUG_MSG_ENABLE )
+    {
+        OS_INFO( "kfree(%p)\n", ptr );
+    }
+}
+
+void kfree_bulk( size_t n, void **ptrs )
+{
+    void *rest[BULK_BATCH];
+    void *top = kbrk( 0 );
+    kcpu_t *cpu = cache_enter();
+    size_t i, num_rest = 0;
+    uint32_t cls;
+
+    for ( i = 0; i < n; ++i )
+    {
+        if ( IS_NULL( ptrs[i] ) )
+        {
+            continue;
+        }
+
+        if ( !heap_contains( ptrs[i], top ) )
+        {
+            OS_WARN( "kfree(%p): Invalid pointer!\n", ptrs[i] );
+            errno = EFAULT;
+            continue;
+        }
+
+        PROFILE_FREE( ptrs[i] );
+        TRACE_LOG( KTRACE_FREE, ptrs[i], 0 );
+
+        cls = cache_class( ptrs[i] );
+
+        if ( cpu != NULL && cls < NUM_CLASSES && mag_free( cpu, cls, ptrs[i] ) )
+        {
+            continue;
+        }
+
+        // The rest go back to the block list a batch at a time
+        rest[num_rest++] = ptrs[i];
+
+        if ( num_rest == BULK_BATCH )
+        {
+            heap_free_ptrs( rest, num_rest );
+            num_rest = 0;
+        }
+    }
+
+    if ( cpu != NULL )
+    {
+        cache_exit( cpu );
+    }
+
+    if ( num_rest > 0 )
+    {
+        heap_free_ptrs( rest, num_rest );
+    }
+}
+
+size_t kmalloc_bulk( size_t size, size_t n, void **out )
+{
+    uint32_t cls;
+    size_t total_size = block_size( size, &cls ), i = 0;
+    unsigned long flags;
+    kcpu_t *cpu;
+    header_t *b = NULL;
+
+    // Check if the size is too big
+    if ( total_size == 0 )
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    // Take what the running CPU has cached in one go
+    if ( cls < NUM_CLASSES && ( cpu = cache_enter() ) != NULL )
+    {
+        while ( i < n && ( out[i] = mag_alloc( cpu, cls ) ) != NULL )
+        {
+            ++i;
+        }
+
+        cache_exit( cpu );
+    }
+
+    if ( i < n && heap_lock( &flags ) )
+    {
+        // The rest is carved out of one span of the block list, if a block can hold it
+        if ( n - i <= ( (size_t)UINT32_MAX + HEADER_SIZE ) / ( total_size + HEADER_SIZE ) )
+        {
+            b = get_empty_mem( ( n - i ) * ( total_size + HEADER_SIZE ) - HEADER_SIZE );
+        }
+
+        for ( ; IS_VALID( b ) && i < n; b = b->next )
+        {
+            split_block( b, total_size );
+            b->free = false;
+            b->cached = false;
+            out[i++] = b->ptr;
+        }
+
+        // Otherwise get the blocks one at a time
+        for ( ; i < n; ++i )
+        {
+            b = get_empty_mem( total_size );
+
+            if ( !IS_VALID( b ) )
+            {
+                break;
+            }
+
+            out[i] = b->ptr;
+        }
+
+        heap_unlock( flags );
+    }
+
+    // All or nothing
+    if ( i < n )
+    {
+        kfree_bulk( i, out );
+        errno = ENOMEM;
+        return 0;
+    }
+
+    if ( DEBUG_MSG_ENABLE )
+    {
+        OS_INFO( "kmalloc_bulk(%lu, %lu) => (ptr=%p, size=%lu)\n", size, n, out[0], total_size );
+    }
+
+    for ( i = 0; i < n; ++i )
+    {
+        PROFILE_ALLOC( out[i] );
+        TRACE_LOG( KTRACE_ALLOC, out[i], size );
+    }
+
+    return n;
 }
 
-/*** end of file ***/
\ No newline at end of file
+/*** end of file ***/
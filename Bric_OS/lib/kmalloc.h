@@ -15,6 +15,13 @@
 # define MAX_ALLOC_SIZE ( (size_t)( UINT32_MAX ) )
 # define MIN_BLK_SIZE   ( (size_t)( HEADER_SIZE + ALIGN_SIZE ) )
 
+/* Block Caches */
+// Blocks held by a magazine, so that a magazine fills a 256 byte block itself
+# define MAG_ROUNDS ( 30U )
+
+// Full magazines a depot keeps per class before it gives the blocks back to the list
+# define DEPOT_MAX_FULL ( 8U )
+
 /* Macros */
 # define ROUND_UP( n, d )  ( ( ( n - 1 ) | ( d - 1 ) ) + 1 )
 # define GET_HEADER( ptr ) ( (header_t *)( (uintptr_t)ptr - HEADER_SIZE ) )
@@ -30,7 +37,9 @@ struct __packed _header_s
     void *ptr;        // 8 bytes
     uint32_t size;    // 4 bytes
     bool free;        // 1 byte
-    uint8_t _pad[3];  // 3 bytes
+    bool cached;      // 1 byte, owned by the magazine caches
+    bool sampled;     // 1 byte, followed by the allocation profiler
+    bool deferred;    // 1 byte, waiting on a CPU's deferred frees
     header_t *next;   // 8 bytes
     header_t *prev;   // 8 bytes
 };
@@ -95,6 +104,49 @@ void *kcalloc( size_t nmemb, size_t size );
  */
 void *krealloc( void *ptr, size_t size );
 
+/**
+ * @brief Allocates `n` blocks of `size` bytes each, the same as calling `kmalloc(size)` `n` times.
+ *        The size class is picked, the cache is entered and the block list is locked once for the
+ *        whole batch, and blocks that aren't cached are carved out of one span of the heap.
+ * @param size The size of each block, aligned to 16 bytes.
+ * @param n The number of blocks.
+ * @param out An array of `n` pointers that the blocks are stored in.
+ * @return `n`, or 0 if an error occurred. Either every block is allocated or none are.
+ */
+size_t kmalloc_bulk( size_t size, size_t n, void **out );
+
+/**
+ * @brief Frees `n` blocks, the same as calling `kfree()` on each pointer, with the cache entered
+ *        once and the blocks that aren't cached freed under one lock per batch. NULL pointers are
+ *        skipped.
+ * @param n The number of pointers.
+ * @param ptrs An array of pointers to the blocks to free.
+ */
+void kfree_bulk( size_t n, void **ptrs );
+
+/**
+ * @brief Checks if the running CPU is in the middle of changing the heap's block list, for example
+ *        when growing the heap runs the memory manager. Allocations on that CPU can only be served
+ *        from its caches until it is done, and frees are put off.
+ * @return true if the running CPU holds the block list.
+ */
+bool kmalloc_busy( void );
+
+/**
+ * @brief Counts the page frames the heap could give back under memory pressure, the free pages at
+ *        its top and a best guess of the pages held by the magazine depots.
+ * @return The number of page frames.
+ */
+uint64_t kmalloc_shrink_count( void );
+
+/**
+ * @brief Gives every cached block back to the block list, then gives the free pages at the top of
+ *        the heap back to the memory manager. Registered as a shrinker by the memory manager.
+ * @param num_pages The most page frames to give back.
+ * @return The number of pages given back.
+ */
+uint64_t kmalloc_shrink_scan( uint64_t num_pages );
+
 #endif /* KMALLOC_H */
 
 /*** end of file ***/
\ No newline at end of file
@@ -0,0 +1,335 @@
+/** @file kmalloc_prof.c
+ *
+ * @brief Allocation site profiler for the kernel heap. Call sites and sampled blocks are kept in
+ * two fixed size hash tables, so the profiler never allocates itself. Both are changed under one
+ * lock, which only sampled allocations and their frees take.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#include "kmalloc_prof.h"
+
+#if KMALLOC_PROFILE
+
+/* Private Defines and Macros */
+
+// Frames further apart than this aren't on the same stack, and end the backtrace
+# define KPROF_STACK_SPAN ( 0x10000UL )
+
+/* Private Types and Enums */
+
+// Call site and what its sampled allocations added up to
+typedef struct kprof_site_s
+{
+    void *frames[KPROF_DEPTH];  // Return addresses, innermost first
+    uint64_t hash;              // 0 if the entry is unused
+    uint64_t num_allocs;        // Sampled allocations
+    uint64_t num_frees;         // Sampled allocations that were freed
+    uint64_t live_bytes;        // Bytes of the sampled allocations that are still live
+    uint64_t lifetime;          // Cycles the freed samples lived, added up
+} kprof_site_t;
+
+// Sampled block that hasn't been freed yet
+typedef struct kprof_live_s
+{
+    void *ptr;      // NULL if the entry is unused
+    uint64_t tsc;   // Time stamp of the allocation
+    uint32_t size;  // Block size
+    uint32_t site;  // Index of the call site
+} kprof_live_t;
+
+/* Global Variables */
+
+static kprof_site_t kprof_sites[KPROF_MAX_SITES];
+static kprof_live_t kprof_live[KPROF_MAX_LIVE];
+
+static uint64_t num_dropped = 0;
+
+// Allocations each CPU skips until its next sample
+static uint32_t sample_countdown[MAX_CPUS];
+
+static binary_semaphore_t kprof_lock = { 0 };
+
+/* Private Functions */
+
+// Follow the frame pointers from `fp` for up to `KPROF_DEPTH` return addresses. Unused frames
+// are left NULL.
+void kprof_backtrace( void **frames, void **fp )
+{
+    void **next;
+    uint32_t i;
+
+    memset( frames, 0, KPROF_DEPTH * sizeof( void * ) );
+
+    for ( i = 0; i < KPROF_DEPTH && fp != NULL; ++i )
+    {
+        frames[i] = fp[1];
+        next = (void **)fp[0];
+
+        // The stack grows down, so the callers' frames are above
+        if ( next <= fp || (uintptr_t)next - (uintptr_t)fp > KPROF_STACK_SPAN ||
+             (uintptr_t)next % sizeof( void * ) != 0 )
+        {
+            break;
+        }
+
+        fp = next;
+    }
+}
+
+uint64_t kprof_hash( void *const *frames )
+{
+    uint64_t hash = 14695981039346656037UL;
+    uint32_t i;
+
+    for ( i = 0; i < KPROF_DEPTH; ++i )
+    {
+        hash = ( hash ^ (uint64_t)frames[i] ) * 1099511628211UL;
+    }
+
+    // 0 marks unused entries
+    return ( hash == 0 ? 1 : hash );
+}
+
+bool kprof_same_frames( void *const *a, void *const *b )
+{
+    uint32_t i;
+
+    for ( i = 0; i < KPROF_DEPTH && a[i] == b[i]; ++i )
+    {
+    }
+
+    return ( i == KPROF_DEPTH );
+}
+
+// Find the call site of a backtrace, adding it if it's new. Returns `KPROF_MAX_SITES` if the
+// table is full.
+uint32_t kprof_site_of( void *const *frames )
+{
+    uint64_t hash = kprof_hash( frames );
+    uint32_t i, idx;
+
+    for ( i = 0; i < KPROF_MAX_SITES; ++i )
+    {
+        idx = ( hash + i ) % KPROF_MAX_SITES;
+
+        if ( kprof_sites[idx].hash == 0 )
+        {
+            memcpy( kprof_sites[idx].frames, frames, sizeof( kprof_sites[idx].frames ) );
+            kprof_sites[idx].hash = hash;
+            return idx;
+        }
+
+        if ( kprof_sites[idx].hash == hash && kprof_same_frames( kprof_sites[idx].frames, frames ) )
+        {
+            return idx;
+        }
+    }
+
+    return KPROF_MAX_SITES;
+}
+
+uint32_t kprof_live_slot( void *ptr ) { return ( (uintptr_t)ptr >> 4 ) % KPROF_MAX_LIVE; }
+
+// Remove a sampled block, shifting back the entries that were probed past it so the linear
+// probing never needs tombstones
+void kprof_live_remove( uint32_t idx )
+{
+    uint32_t next, home;
+
+    kprof_live[idx].ptr = NULL;
+
+    for ( next = ( idx + 1 ) % KPROF_MAX_LIVE; kprof_live[next].ptr != NULL;
+          next = ( next + 1 ) % KPROF_MAX_LIVE )
+    {
+        home = kprof_live_slot( kprof_live[next].ptr );
+
+        // Entries whose home slot is after the hole, up to where they are, can stay
+        if ( idx < next ? ( idx < home && home <= next ) : ( idx < home || home <= next ) )
+        {
+            continue;
+        }
+
+        kprof_live[idx] = kprof_live[next];
+        kprof_live[next].ptr = NULL;
+        idx = next;
+    }
+}
+
+/* Public Functions */
+
+bool kprof_should_sample( void )
+{
+    // Interrupts can race this, which only moves a sample by one allocation
+    uint32_t *countdown = &sample_countdown[this_cpu()];
+
+    if ( *countdown > 0 )
+    {
+        ( *countdown )--;
+        return false;
+    }
+
+    *countdown = KPROF_SAMPLE_RATE - 1;
+    return true;
+}
+
+void kprof_alloc( void *ptr, size_t size, void *fp )
+{
+    void *frames[KPROF_DEPTH];
+    unsigned long flags;
+    uint32_t site, idx, i;
+
+    kprof_backtrace( frames, (void **)fp );
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( kprof_lock );
+
+    site = kprof_site_of( frames );
+
+    for ( i = 0, idx = kprof_live_slot( ptr ); i < KPROF_MAX_LIVE && kprof_live[idx].ptr != NULL;
+          ++i, idx = ( idx + 1 ) % KPROF_MAX_LIVE )
+    {
+    }
+
+    if ( site == KPROF_MAX_SITES || i == KPROF_MAX_LIVE )
+    {
+        num_dropped++;
+    }
+    else
+    {
+        kprof_live[idx].ptr = ptr;
+        kprof_live[idx].tsc = rdtsc();
+        kprof_live[idx].size = (uint32_t)size;
+        kprof_live[idx].site = site;
+
+        kprof_sites[site].num_allocs++;
+        kprof_sites[site].live_bytes += size;
+    }
+
+    binary_semaphore_unlock( kprof_lock );
+    irqrestore( flags );
+}
+
+void kprof_free( void *ptr )
+{
+    kprof_site_t *site;
+    unsigned long flags;
+    uint32_t idx, i;
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( kprof_lock );
+
+    for ( i = 0, idx = kprof_live_slot( ptr ); i < KPROF_MAX_LIVE && kprof_live[idx].ptr != NULL;
+          ++i, idx = ( idx + 1 ) % KPROF_MAX_LIVE )
+    {
+        if ( kprof_live[idx].ptr == ptr )
+        {
+            site = &kprof_sites[kprof_live[idx].site];
+            site->num_frees++;
+            site->live_bytes -= kprof_live[idx].size;
+            site->lifetime += rdtsc() - kprof_live[idx].tsc;
+
+            kprof_live_remove( idx );
+            break;
+        }
+    }
+
+    binary_semaphore_unlock( kprof_lock );
+    irqrestore( flags );
+}
+
+void kprof_dump( uint32_t top_n )
+{
+    static uint16_t order[KPROF_MAX_SITES];
+    kprof_site_t *site;
+    unsigned long flags;
+    uint32_t count = 0, i, j, best;
+    uint16_t tmp;
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( kprof_lock );
+
+    for ( i = 0; i < KPROF_MAX_SITES; ++i )
+    {
+        if ( kprof_sites[i].hash != 0 )
+        {
+            order[count++] = (uint16_t)i;
+        }
+    }
+
+    // Only the first `top_n` need to be in order
+    top_n = ( top_n < count ? top_n : count );
+
+    for ( i = 0; i < top_n; ++i )
+    {
+        for ( best = i, j = i + 1; j < count; ++j )
+        {
+            if ( kprof_sites[order[j]].live_bytes > kprof_sites[order[best]].live_bytes )
+            {
+                best = j;
+            }
+        }
+
+        tmp = order[i];
+        order[i] = order[best];
+        order[best] = tmp;
+    }
+
+    binary_semaphore_unlock( kprof_lock );
+    irqrestore( flags );
+
+    // The counts are scaled up by the sample rate, the lifetimes are averages of the samples
+    OS_INFO(
+        "kmalloc profile: 1 in %u allocations sampled, %u sites, %lu samples dropped\n",
+        KPROF_SAMPLE_RATE, count, num_dropped
+    );
+
+    for ( i = 0; i < top_n; ++i )
+    {
+        site = &kprof_sites[order[i]];
+
+        OS_INFO(
+            "#%u: ~%lu live bytes, ~%lu allocs, ~%lu frees, avg lifetime %lu cycles\n", i + 1,
+            site->live_bytes * KPROF_SAMPLE_RATE, site->num_allocs * KPROF_SAMPLE_RATE,
+            site->num_frees * KPROF_SAMPLE_RATE,
+            ( site->num_frees == 0 ? 0 : site->lifetime / site->num_frees )
+        );
+
+        for ( j = 0; j < KPROF_DEPTH && site->frames[j] != NULL; ++j )
+        {
+            printk( "        at %p\n", site->frames[j] );
+        }
+    }
+}
+
+void kprof_reset( void )
+{
+    unsigned long flags;
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( kprof_lock );
+
+    memset( kprof_sites, 0, sizeof( kprof_sites ) );
+    memset( kprof_live, 0, sizeof( kprof_live ) );
+    num_dropped = 0;
+
+    binary_semaphore_unlock( kprof_lock );
+    irqrestore( flags );
+}
+
+#else
+
+void kprof_dump( uint32_t top_n __unused )
+{
+    OS_WARN( "kmalloc profiling isn't built in, see `make profile`\n" );
+}
+
+void kprof_reset( void ) {}
+
+#endif /* KMALLOC_PROFILE */
+
+/*** End of File ***/
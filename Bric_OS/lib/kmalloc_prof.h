@@ -0,0 +1,72 @@
+/** @file kmalloc_prof.h
+ *
+ * @brief Allocation site profiler for the kernel heap. One in `KPROF_SAMPLE_RATE` allocations is
+ * recorded against its call site, a short backtrace that follows the frame pointers, and followed
+ * until it's freed. The sites holding the most memory can be dumped over serial.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#ifndef KMALLOC_PROF_H
+# define KMALLOC_PROF_H
+
+/* Includes */
+
+# include "common.h"
+
+/* Defines */
+
+// Built in by `make profile`, which also keeps the frame pointers the backtraces follow
+# ifndef KMALLOC_PROFILE
+#  define KMALLOC_PROFILE 0
+# endif
+
+// One in this many allocations is sampled
+# define KPROF_SAMPLE_RATE ( 64U )
+
+// Return addresses in a call site, 1 to only tell the callers of the heap functions apart
+# define KPROF_DEPTH ( 4U )
+
+// Call sites and sampled blocks that can be followed at once
+# define KPROF_MAX_SITES ( 512U )
+# define KPROF_MAX_LIVE  ( 4096U )
+
+/* Public Functions */
+
+/**
+ * @brief Decides if an allocation is sampled. Counts down per CPU, so it's one decrement for the
+ * allocations that aren't.
+ */
+bool kprof_should_sample( void );
+
+/**
+ * @brief Records a sampled allocation against its call site.
+ * @param ptr The block's pointer
+ * @param size The block's size
+ * @param fp Frame pointer of the heap function that was called. Its return address is the call
+ * site, and the backtrace continues with its callers.
+ */
+void kprof_alloc( void *ptr, size_t size, void *fp );
+
+/**
+ * @brief Records that a sampled block was freed, and how long it lived.
+ */
+void kprof_free( void *ptr );
+
+/**
+ * @brief Prints the `top_n` call sites with the most live memory, estimated from the samples.
+ */
+void kprof_dump( uint32_t top_n );
+
+/**
+ * @brief Forgets every call site and sampled block, for example between load tests.
+ */
+void kprof_reset( void );
+
+#endif /* KMALLOC_PROF_H */
+
+/*** End of File ***/
@@ -0,0 +1,132 @@
+/** @file kmalloc_trace.c
+ *
+ * @brief Allocation trace of the kernel heap. The records go to a fixed ring under one lock, so
+ * tracing never allocates and costs a few stores per call. A dump is written with interrupts off
+ * and the lock held, which stops the heap functions on other CPUs until it's done.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#include "kmalloc_trace.h"
+
+#include "serial_io_driver.h"
+
+#if KMALLOC_TRACE
+
+/* Global Variables */
+
+static ktrace_rec_t ktrace_ring[KTRACE_RING_LEN];
+
+// Records logged since the last dump, the newest is at `num_logged % KTRACE_RING_LEN`
+static uint64_t num_logged = 0;
+
+static bool ktrace_on = true;
+
+static binary_semaphore_t ktrace_lock = { 0 };
+
+/* Private Functions */
+
+// Add a record to the ring, with the lock held
+void ktrace_put( ktrace_op_t op, void *ptr, size_t size, uint64_t tsc )
+{
+    ktrace_rec_t *rec = &ktrace_ring[num_logged % KTRACE_RING_LEN];
+
+    rec->tsc = tsc;
+    rec->op = op;
+    rec->id = (uint32_t)( (uintptr_t)ptr >> 4 );
+    rec->size = (uint32_t)size;
+
+    num_logged++;
+}
+
+/* Public Functions */
+
+void ktrace_log( ktrace_op_t op, void *ptr, size_t size )
+{
+    unsigned long flags;
+
+    if ( !ktrace_on )
+    {
+        return;
+    }
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( ktrace_lock );
+
+    ktrace_put( op, ptr, size, rdtsc() );
+
+    binary_semaphore_unlock( ktrace_lock );
+    irqrestore( flags );
+}
+
+void ktrace_log_realloc( void *old_ptr, void *new_ptr, size_t size )
+{
+    unsigned long flags;
+    uint64_t tsc;
+
+    if ( !ktrace_on )
+    {
+        return;
+    }
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( ktrace_lock );
+
+    // The move has to follow its resize, so both are added under the lock
+    tsc = rdtsc();
+    ktrace_put( KTRACE_REALLOC, old_ptr, size, tsc );
+
+    if ( new_ptr != old_ptr )
+    {
+        ktrace_put( KTRACE_MOVE, new_ptr, 0, tsc );
+    }
+
+    binary_semaphore_unlock( ktrace_lock );
+    irqrestore( flags );
+}
+
+void ktrace_enable( bool enable ) { ktrace_on = enable; }
+
+void ktrace_dump( void )
+{
+    ktrace_hdr_t hdr = { .magic = KTRACE_MAGIC, .version = KTRACE_VERSION };
+    unsigned long flags;
+    uint64_t start;
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( ktrace_lock );
+
+    hdr.rec_size = sizeof( ktrace_rec_t );
+    hdr.num_recs = ( num_logged < KTRACE_RING_LEN ? num_logged : KTRACE_RING_LEN );
+    hdr.num_lost = num_logged - hdr.num_recs;
+
+    serial_write_polled( &hdr, sizeof( hdr ) );
+
+    // Once the ring has wrapped, the oldest record is the one the next would overwrite
+    start = ( num_logged < KTRACE_RING_LEN ? 0 : num_logged % KTRACE_RING_LEN );
+
+    serial_write_polled( &ktrace_ring[start], ( hdr.num_recs - start ) * sizeof( ktrace_rec_t ) );
+    serial_write_polled( &ktrace_ring[0], start * sizeof( ktrace_rec_t ) );
+
+    num_logged = 0;
+
+    binary_semaphore_unlock( ktrace_lock );
+    irqrestore( flags );
+}
+
+#else
+
+void ktrace_enable( bool enable __unused ) {}
+
+void ktrace_dump( void )
+{
+    OS_WARN( "kmalloc tracing isn't built in, see `make trace`\n" );
+}
+
+#endif /* KMALLOC_TRACE */
+
+/*** End of File ***/
@@ -0,0 +1,92 @@
+/** @file kmalloc_trace.h
+ *
+ * @brief Allocation trace of the kernel heap. Every allocation, free and resize is logged to a
+ * ring of 16 byte records, which can be dumped over serial and replayed on the host by
+ * `utils/kmalloc_replay`.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#ifndef KMALLOC_TRACE_H
+# define KMALLOC_TRACE_H
+
+/* Includes */
+
+# include "common.h"
+
+/* Defines */
+
+// Built in by `make trace`
+# ifndef KMALLOC_TRACE
+#  define KMALLOC_TRACE 0
+# endif
+
+// Records in the ring, the oldest are overwritten once it's full
+# ifndef KTRACE_RING_LEN
+#  define KTRACE_RING_LEN ( 65536U )
+# endif
+
+// Start of a dump, and the version of its format
+# define KTRACE_MAGIC   "KTRACE\0\0"
+# define KTRACE_VERSION ( 1U )
+
+/* Typedefs */
+
+typedef enum ktrace_op_e
+{
+    KTRACE_ALLOC = 1,    // `size` bytes were allocated at `id`
+    KTRACE_CALLOC = 2,   // The same, set to zero
+    KTRACE_FREE = 3,     // The block at `id` was freed
+    KTRACE_REALLOC = 4,  // The block at `id` was resized to `size` bytes
+    KTRACE_MOVE = 5,     // Follows a resize that moved the block, to `id`
+} ktrace_op_t;
+
+// One traced call, the host tool has a copy of the layout
+typedef struct __packed ktrace_rec_s
+{
+    uint64_t tsc : 56;  // Time stamp counter
+    uint64_t op : 8;    // ktrace_op_t
+    uint32_t id;        // Address id of the block, its address divided by 16
+    uint32_t size;      // Requested size, 0 if the call has none
+} ktrace_rec_t;
+
+// Start of a dump, the records follow it
+typedef struct __packed ktrace_hdr_s
+{
+    char magic[8];      // KTRACE_MAGIC
+    uint32_t version;   // KTRACE_VERSION
+    uint32_t rec_size;  // Size of a record
+    uint64_t num_recs;  // Records in the dump
+    uint64_t num_lost;  // Records overwritten since the last dump
+} ktrace_hdr_t;
+
+/* Public Functions */
+
+/**
+ * @brief Logs one call to the ring. Does nothing while the trace is stopped.
+ */
+void ktrace_log( ktrace_op_t op, void *ptr, size_t size );
+
+/**
+ * @brief Logs a resize of `old_ptr` to `size` bytes, and the block it moved to if it moved.
+ */
+void ktrace_log_realloc( void *old_ptr, void *new_ptr, size_t size );
+
+/**
+ * @brief Starts or stops the trace. It starts out running.
+ */
+void ktrace_enable( bool enable );
+
+/**
+ * @brief Writes the ring to serial as a `ktrace_hdr_t` followed by the records, oldest first, and
+ * empties it. Interrupts are off while it's written, so no other output ends up in the middle.
+ */
+void ktrace_dump( void );
+
+#endif /* KMALLOC_TRACE_H */
+
+/*** End of File ***/
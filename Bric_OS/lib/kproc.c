@@ -14,10 +14,13 @@
 /* Private Includes */
 
 #include "idt.h"
+#include "mmu_driver.h"
 
 /* Private Defines and Macros */
 
-#define PROC_STACK_SIZE ( 0x1000U )
+// Each thread reserves 64 KiB of stack, but only the pages it touches get backed by page frames
+#define PROC_STACK_PAGES ( 16U )
+#define PROC_STACK_SIZE  ( PROC_STACK_PAGES * PAGE_SIZE )
 
 /* Private Types and Enums */
 
@@ -34,6 +37,9 @@ scheduler rr_scheduler = &rr_sched_struct;
 kthread curr_kthread = NULL, next_kthread = NULL;
 scheduler active_sched = NULL;
 
+// Thread that exited but still owns the stack it exited on
+kthread dead_kthread = NULL;
+
 // Counter and array for thread IDs
 pid_t pid_cnt = NO_THREAD;
 // kthread *kthread_list = NULL;
@@ -111,12 +117,13 @@ void PROC_init( void )
     }
 
     // Initialize the main thread
-    main_kthread = (kthread)kmalloc( sizeof( kthread ) );
+    main_kthread = (kthread)kmalloc( sizeof( struct threadinfo_st ) );
 
     main_kthread->pid = 0;
     main_kthread->status = SET_TERM_STAT( 0, PROC_LIVE );
     main_kthread->stack = NULL;  // The main thread runs on the kernel stack
     main_kthread->stacksize = 0;
+    main_kthread->as = NULL;  // The main thread is a kernel thread
 
     // Set the current thread to the main thread
     curr_kthread = main_kthread;
@@ -138,6 +145,18 @@ void PROC_init( void )
     setup = true;
 }
 
+// Frees the stack and state of the last thread that exited. Must not run on that thread's stack.
+void reap_kthread( void )
+{
+    if ( dead_kthread == NULL ) return;
+
+    MMU_free_stack( (uint8_t *)dead_kthread->stack + dead_kthread->stacksize, PROC_STACK_PAGES );
+    MMU_addr_space_put( dead_kthread->as );
+    kfree( dead_kthread );
+
+    dead_kthread = NULL;
+}
+
 /* Public Functions */
 
 // DEBUG: This function is only for debugging purposes
@@ -168,32 +187,46 @@ void PROC_run( void )
 // NOTE: This function does not actually schedule the thread.
 kthread PROC_create_kthread( kproc_t entry_point, void *arg )
 {
-    kthread new_kthread = (kthread)kmalloc( sizeof( kthread ) );
+    kthread new_kthread = (kthread)kmalloc( sizeof( struct threadinfo_st ) );
+
+    if ( new_kthread == NULL )
+    {
+        return NULL;
+    }
+
+    // Allocate a new stack in the kernel stack region, with a guard page below it
+    uint64_t *stack_top = (uint64_t *)MMU_alloc_stack( PROC_STACK_PAGES, MMU_VADDR_KSTACK );
+
+    if ( stack_top == NULL )
+    {
+        kfree( new_kthread );
+        return NULL;
+    }
 
     // Initialize the new thread
     new_kthread->pid = ++pid_cnt;
     new_kthread->status = SET_TERM_STAT( 0, PROC_LIVE );
 
-    // Allocate a new stack in the virtual address space
-    new_kthread->stack = (uint64_t *)kmalloc( PROC_STACK_SIZE );
+    new_kthread->stack = (uint64_t *)( (uint8_t *)stack_top - PROC_STACK_SIZE );
     new_kthread->stacksize = PROC_STACK_SIZE;
 
-    // Initialize the thread's context
-    new_kthread->state.rsp = (uint64_t)new_kthread->stack;
-    new_kthread->state.rbp = (uint64_t)new_kthread->stack;
+    // Kernel threads don't own an address space, they borrow whichever one is loaded
+    new_kthread->as = NULL;
 
     // The entry_point function gets executed the next time this thread is scheduled
     // new_kthread->state.rip = (uint64_t)entry_point;
     new_kthread->state.rdi = (uint64_t)arg;
 
+    // Push the address of the kexit function onto the thread's stack, so returning from the
+    // entry_point function exits the thread
+    stack_top[-1] = (uint64_t)kexit;
+
     // Push the address of the entry_point function onto the thread's stack
-    // new_kthread->state.rsp -= sizeof( uint64_t );
-    // *(uint64_t *)new_kthread->state.rsp = (uint64_t)entry_point;
-    new_kthread->stack[1] = (uint64_t)entry_point;
+    stack_top[-2] = (uint64_t)entry_point;
 
-    // Push the address of the kexit function onto the thread's stack
-    // new_kthread->state.rsp -= sizeof( uint64_t );
-    // *(uint64_t *)new_kthread->state.rsp = (uint64_t)kexit;
+    // Initialize the thread's context
+    new_kthread->state.rsp = (uint64_t)&stack_top[-2];
+    new_kthread->state.rbp = (uint64_t)stack_top;
 
     return new_kthread;
 }
@@ -202,11 +235,18 @@ kthread PROC_create_kthread( kproc_t entry_point, void *arg )
 // threads are available to run. This function does not actually perform a context switch.
 void PROC_reschedule( void )
 {
+    // The previous thread is off its stack now, so it can be freed
+    reap_kthread();
+
     // Select the next thread to run
     curr_kthread = active_sched->next();
 
     // If no thread is able to run then PROC_run() returns
     if ( curr_kthread == NULL ) return;
+
+    // Only reloads CR3 if the next thread lives in a different address space, kernel threads keep
+    // the current one loaded
+    MMU_addr_space_switch( curr_kthread->as );
 }
 
 // Invokes the scheduler and passes control to the next eligible thread. It is possible to return to
@@ -217,11 +257,18 @@ void PROC_reschedule( void )
 // TODO: Implement yield() as a trap that performs a context swap
 void yield( void )
 {
+    // The previous thread is off its stack now, so it can be freed
+    reap_kthread();
+
     // Select the next thread to run
     curr_kthread = active_sched->next();
 
     // If no thread is able to run then PROC_run() returns
     if ( curr_kthread == NULL ) return;
+
+    // Only reloads CR3 if the next thread lives in a different address space, kernel threads keep
+    // the current one loaded
+    MMU_addr_space_switch( curr_kthread->as );
 }
 
 // Exits and destroys all the state of the thread that calls kexit. Needs to run the scheduler to
@@ -230,17 +277,22 @@ void yield( void )
 // to free the thread's stack without pulling the rug out from under yourself.
 void kexit( void )
 {
-    // Free the thread's stack
-    kfree( curr_kthread->stack );
+    // Free the last thread that exited, this thread is still running on its own stack
+    reap_kthread();
 
-    // Free the thread's state
-    kfree( curr_kthread );
+    // Defer freeing this thread's stack and state until the next context switch, unmapping the
+    // stack here would pull the rug out from under ourselves
+    dead_kthread = curr_kthread;
 
     // Select the next thread to run
     curr_kthread = active_sched->next();
 
     // If no thread is able to run then PROC_run() returns
     if ( curr_kthread == NULL ) return;
+
+    // Only reloads CR3 if the next thread lives in a different address space, kernel threads keep
+    // the current one loaded
+    MMU_addr_space_switch( curr_kthread->as );
 }
 
 /*** End of File ***/
\ No newline at end of file
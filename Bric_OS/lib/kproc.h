@@ -16,6 +16,7 @@
 
 # include "common.h"
 # include "kmalloc.h"
+# include "mmu_driver.h"
 
 /* Defines */
 
@@ -78,6 +79,7 @@ struct threadinfo_st
     uint64_t *stack;   /* Base of allocated stack */
     size_t stacksize;  /* Size of allocated stack */
     rfile state;       /* saved registers         */
+    addr_space_t *as;  /* NULL for kernel threads */
     uint32_t status;   /* exited? exit status?    */
     kthread lib_one;   /* Two pointers reserved   */
     kthread lib_two;   /* for use by the library  */
@@ -0,0 +1,231 @@
+/** @file lz4.c
+ *
+ * @brief LZ4 block compressor. Produces and reads the standard LZ4 block format, tuned for
+ * compressing single pages rather than for ratio.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#include "lz4.h"
+
+/* Private Defines and Macros */
+
+#define LZ4_MIN_MATCH     ( 4U )
+#define LZ4_LAST_LITERALS ( 5U )   // The last 5 bytes are always literals
+#define LZ4_MF_LIMIT      ( 12U )  // The last match must start 12 bytes before the end
+#define LZ4_MAX_OFFSET    ( 0xFFFFU )
+#define LZ4_RUN_MASK      ( 15U )
+
+#define LZ4_HASH_BITS ( 12U )
+#define LZ4_HASH( v ) ( ( ( v ) * 2654435761U ) >> ( 32U - LZ4_HASH_BITS ) )
+
+/* Global Variables */
+
+// Last position of every hashed 4 byte sequence
+static uint16_t hash_table[1U << LZ4_HASH_BITS];
+
+/* Private Functions */
+
+static inline uint32_t read32( const uint8_t *p )
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Write the extra bytes of a length that didn't fit in its nibble
+static inline uint8_t *write_length( uint8_t *op, uint64_t len )
+{
+    for ( len -= LZ4_RUN_MASK; len >= 255; len -= 255 )
+    {
+        *op++ = 255;
+    }
+
+    *op++ = (uint8_t)len;
+
+    return op;
+}
+
+// Worst case size of a sequence, so the output can be checked once per sequence
+static inline uint64_t sequence_size( uint64_t lit_len, uint64_t match_len )
+{
+    return 1 + ( lit_len / 255 + 1 ) + lit_len + 2 + ( match_len / 255 + 1 );
+}
+
+/* Public Functions */
+
+uint64_t LZ4_compress( const void *src, uint64_t src_len, void *dst, uint64_t dst_cap )
+{
+    const uint8_t *in = (const uint8_t *)src, *end = in + src_len;
+    const uint8_t *ip = in, *anchor = in, *ref, *mp;
+    uint8_t *op = (uint8_t *)dst, *oend = op + dst_cap, *token;
+    uint64_t lit_len, match_len;
+    uint32_t h;
+
+    if ( src_len > LZ4_MAX_INPUT_SIZE )
+    {
+        return 0;
+    }
+
+    if ( src_len > LZ4_MF_LIMIT )
+    {
+        const uint8_t *mf_limit = end - LZ4_MF_LIMIT;
+        const uint8_t *match_limit = end - LZ4_LAST_LITERALS;
+
+        memset( hash_table, 0, sizeof( hash_table ) );
+
+        // The first byte can never be a match
+        ip++;
+
+        while ( ip < mf_limit )
+        {
+            h = LZ4_HASH( read32( ip ) );
+            ref = in + hash_table[h];
+            hash_table[h] = (uint16_t)( ip - in );
+
+            if ( ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32( ref ) != read32( ip ) )
+            {
+                ip++;
+                continue;
+            }
+
+            // Extend the match backwards into the pending literals
+            while ( ip > anchor && ref > in && ip[-1] == ref[-1] )
+            {
+                ip--;
+                ref--;
+            }
+
+            // Extend the match forwards
+            for ( mp = ip + LZ4_MIN_MATCH; mp < match_limit && *mp == ref[mp - ip]; ++mp )
+            {
+            }
+
+            lit_len = ip - anchor;
+            match_len = mp - ip - LZ4_MIN_MATCH;
+
+            if ( sequence_size( lit_len, match_len ) > (uint64_t)( oend - op ) )
+            {
+                return 0;
+            }
+
+            // Literals
+            token = op++;
+            *token = (uint8_t)( ( lit_len < LZ4_RUN_MASK ? lit_len : LZ4_RUN_MASK ) << 4 );
+
+            if ( lit_len >= LZ4_RUN_MASK )
+            {
+                op = write_length( op, lit_len );
+            }
+
+            memcpy( op, anchor, lit_len );
+            op += lit_len;
+
+            // Match
+            *op++ = (uint8_t)( ( ip - ref ) & 0xFF );
+            *op++ = (uint8_t)( ( ip - ref ) >> 8 );
+
+            *token |= (uint8_t)( match_len < LZ4_RUN_MASK ? match_len : LZ4_RUN_MASK );
+
+            if ( match_len >= LZ4_RUN_MASK )
+            {
+                op = write_length( op, match_len );
+            }
+
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    // The last sequence only has literals
+    lit_len = end - anchor;
+
+    if ( 1 + ( lit_len / 255 + 1 ) + lit_len > (uint64_t)( oend - op ) )
+    {
+        return 0;
+    }
+
+    token = op++;
+    *token = (uint8_t)( ( lit_len < LZ4_RUN_MASK ? lit_len : LZ4_RUN_MASK ) << 4 );
+
+    if ( lit_len >= LZ4_RUN_MASK )
+    {
+        op = write_length( op, lit_len );
+    }
+
+    memcpy( op, anchor, lit_len );
+    op += lit_len;
+
+    return op - (uint8_t *)dst;
+}
+
+int64_t LZ4_decompress( const void *src, uint64_t src_len, void *dst, uint64_t dst_cap )
+{
+    const uint8_t *ip = (const uint8_t *)src, *iend = ip + src_len, *ref;
+    uint8_t *op = (uint8_t *)dst, *oend = op + dst_cap;
+    uint64_t len, offset;
+    uint8_t token, b;
+
+    while ( ip < iend )
+    {
+        token = *ip++;
+
+        // Literals
+        len = token >> 4;
+        if ( len == LZ4_RUN_MASK )
+        {
+            do
+            {
+                if ( ip >= iend ) return -1;
+
+                b = *ip++;
+                len += b;
+            } while ( b == 255 );
+        }
+
+        if ( len > (uint64_t)( iend - ip ) || len > (uint64_t)( oend - op ) ) return -1;
+
+        memcpy( op, ip, len );
+        ip += len;
+        op += len;
+
+        // The last sequence ends after its literals
+        if ( ip == iend ) break;
+
+        // Match
+        if ( iend - ip < 2 ) return -1;
+
+        offset = ip[0] | (uint64_t)ip[1] << 8;
+        ip += 2;
+
+        if ( offset == 0 || offset > (uint64_t)( op - (uint8_t *)dst ) ) return -1;
+
+        len = token & LZ4_RUN_MASK;
+        if ( len == LZ4_RUN_MASK )
+        {
+            do
+            {
+                if ( ip >= iend ) return -1;
+
+                b = *ip++;
+                len += b;
+            } while ( b == 255 );
+        }
+
+        len += LZ4_MIN_MATCH;
+
+        if ( len > (uint64_t)( oend - op ) ) return -1;
+
+        // Copy byte by byte, matches can overlap their own output
+        for ( ref = op - offset; len > 0; --len )
+        {
+            *op++ = *ref++;
+        }
+    }
+
+    return op - (uint8_t *)dst;
+}
+
+/*** End of File ***/
@@ -0,0 +1,40 @@
+/** @file lz4.h
+ *
+ * @brief Header for the LZ4 block compressor.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#ifndef LZ4_H
+# define LZ4_H
+
+/* Includes */
+
+# include "common.h"
+
+/* Defines */
+
+# define LZ4_MAX_INPUT_SIZE ( 0x10000U )  // 64 KiB, offsets are 16 bits
+
+/* Public Functions */
+
+/**
+ * @brief Compresses `src_len` bytes of `src` into `dst` using the LZ4 block format. Uses a static
+ * hash table, so it must not be called from two contexts at once.
+ * @return The compressed size, or 0 if the output doesn't fit in `dst_cap` bytes
+ */
+uint64_t LZ4_compress( const void *src, uint64_t src_len, void *dst, uint64_t dst_cap );
+
+/**
+ * @brief Decompresses an LZ4 block of `src_len` bytes into `dst`.
+ * @return The decompressed size, or -1 if the block is malformed or doesn't fit in `dst_cap` bytes
+ */
+int64_t LZ4_decompress( const void *src, uint64_t src_len, void *dst, uint64_t dst_cap );
+
+#endif /* LZ4_H */
+
+/*** End of File ***/
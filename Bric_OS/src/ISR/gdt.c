@@ -96,7 +96,7 @@ static tss_t tss;
 
 extern void reload_segments( uint16_t code_offset, uint16_t data_offset );
 
-void encode_gdt_entry( gdt_t *target, gdt_entry_t source )
+void __init encode_gdt_entry( gdt_t *target, gdt_entry_t source )
 {
     // Lower 16 bits of the limit
     target->bytes[0] = source.limit & 0xFFU;
@@ -117,7 +117,7 @@ void encode_gdt_entry( gdt_t *target, gdt_entry_t source )
     target->bytes[7] = ( source.base >> 24 ) & 0xFFU;
 }
 
-void tss_init( void )
+void __init tss_init( void )
 {
     // Setup the stack pointers
     tss.rsp0 = 0x0;
@@ -151,7 +151,7 @@ void tss_init( void )
 
 /* Public Functions */
 
-void gdt_init( void )
+void __init gdt_init( void )
 {
     gdt_entry_t gdt_entries = { 0 };
 
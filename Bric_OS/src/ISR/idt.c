@@ -43,7 +43,7 @@ static __unused bool vectors[IDT_MAX_IRQ];
 
 /* Private Functions */
 
-void idt_set_descriptor( uint16_t irq, void* isr_addr, uint8_t flags )
+void __init idt_set_descriptor( uint16_t irq, void* isr_addr, uint8_t flags )
 {
     idt_entry_t* descriptor = &idt[irq];
 
@@ -56,7 +56,7 @@ void idt_set_descriptor( uint16_t irq, void* isr_addr, uint8_t flags )
     descriptor->reserved = 0;
 }
 
-void idt_set_ist( uint16_t irq, uint8_t ist )
+void __init idt_set_ist( uint16_t irq, uint8_t ist )
 {
     idt_entry_t* descriptor = &idt[irq];
 
@@ -65,7 +65,7 @@ void idt_set_ist( uint16_t irq, uint8_t ist )
 
 /* Public Functions */
 
-void idt_init( void )
+void __init idt_init( void )
 {
     uint32_t irq, flags = ( PRESENT_FLAG | INTERRUPT_GATE_FLAG );
 
@@ -197,7 +197,7 @@ void interrupt_handler( int irq, int error )
 
 /* Public Functions */
 
-driver_status_t IRQ_init( void )
+driver_status_t __init IRQ_init( void )
 {
     // Disable interrupts
     IRQ_disable();
@@ -42,7 +42,7 @@
 
 /* Public Functions */
 
-void PIC_init( void )
+void __init PIC_init( void )
 {
     // Remap the PICs to the specified offsets
     PIC_remap( PIC1_OFFSET, PIC2_OFFSET );
@@ -59,7 +59,7 @@ void PIC_init( void )
  * @param offset1 Vector offset for controller PIC
  * @param offset2 Vector offset for peripheral PIC
  */
-void PIC_remap( int offset1, int offset2 )
+void __init PIC_remap( int offset1, int offset2 )
 {
     uint8_t a1, a2;
 
@@ -0,0 +1,275 @@
+/** @file acpi.c
+ *
+ * @brief ACPI table discovery. The RSDP comes from the multiboot2 tags, and the tables are read
+ * through the identity map set up at boot, so this has to run before the memory manager loads its
+ * own page tables.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#include "acpi.h"
+
+#include "multiboot2.h"
+
+/* Private Defines and Macros */
+
+#define ACPI_RSDP_SIGNATURE "RSD PTR "
+#define ACPI_SRAT_SIGNATURE "SRAT"
+
+// Bytes of the RSDP covered by the ACPI 1.0 checksum
+#define ACPI_RSDP_V1_LEN ( 20U )
+
+// SRAT entry types
+#define SRAT_TYPE_CPU_AFFINITY    ( 0U )
+#define SRAT_TYPE_MEM_AFFINITY    ( 1U )
+#define SRAT_TYPE_X2APIC_AFFINITY ( 2U )
+
+#define SRAT_FLAG_ENABLED ( 1U << 0U )
+
+/* Private Types and Structs */
+
+// Root System Description Pointer
+typedef struct acpi_rsdp_s
+{
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_addr;
+    uint32_t length;  // ACPI 2.0 and up
+    uint64_t xsdt_addr;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+} __packed acpi_rsdp_t;
+
+// Header shared by every System Description Table
+typedef struct acpi_sdt_header_s
+{
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __packed acpi_sdt_header_t;
+
+// System Resource Affinity Table, followed by its entries
+typedef struct acpi_srat_s
+{
+    acpi_sdt_header_t header;
+    uint32_t table_revision;
+    uint64_t reserved;
+} __packed acpi_srat_t;
+
+typedef struct srat_entry_s
+{
+    uint8_t type;
+    uint8_t length;
+} __packed srat_entry_t;
+
+typedef struct srat_cpu_affinity_s
+{
+    uint8_t type;
+    uint8_t length;
+    uint8_t domain_lo;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_hi[3];
+    uint32_t clock_domain;
+} __packed srat_cpu_affinity_t;
+
+typedef struct srat_mem_affinity_s
+{
+    uint8_t type;
+    uint8_t length;
+    uint32_t domain;
+    uint16_t reserved1;
+    uint64_t base;
+    uint64_t len;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __packed srat_mem_affinity_t;
+
+typedef struct srat_x2apic_affinity_s
+{
+    uint8_t type;
+    uint8_t length;
+    uint16_t reserved1;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __packed srat_x2apic_affinity_t;
+
+/* Private Functions */
+
+// ACPI tables are valid if all of their bytes add up to 0
+bool __init acpi_checksum_ok( const void *table, uint64_t len )
+{
+    const uint8_t *bytes = (const uint8_t *)table;
+    uint8_t sum = 0;
+    uint64_t i;
+
+    for ( i = 0; i < len; ++i )
+    {
+        sum += bytes[i];
+    }
+
+    return sum == 0;
+}
+
+// Find a table by signature in the XSDT, or in the RSDT on ACPI 1.0 machines
+acpi_sdt_header_t __init *acpi_find_table( acpi_rsdp_t *rsdp, const char *signature )
+{
+    bool use_xsdt = ( rsdp->revision >= 2 && rsdp->xsdt_addr != 0 );
+    acpi_sdt_header_t *root, *table;
+    uint64_t i, num_entries, entry_size;
+
+    root = (acpi_sdt_header_t *)( use_xsdt ? rsdp->xsdt_addr : (uint64_t)rsdp->rsdt_addr );
+
+    if ( root == NULL || !acpi_checksum_ok( root, root->length ) )
+    {
+        OS_ERROR( "Invalid ACPI root table at %p!\n", (void *)root );
+        return NULL;
+    }
+
+    // The XSDT holds 64 bit table addresses, the RSDT 32 bit ones
+    entry_size = ( use_xsdt ? sizeof( uint64_t ) : sizeof( uint32_t ) );
+    num_entries = ( root->length - sizeof( acpi_sdt_header_t ) ) / entry_size;
+
+    for ( i = 0; i < num_entries; ++i )
+    {
+        uint8_t *entry = (uint8_t *)( root + 1 ) + i * entry_size;
+
+        table = (acpi_sdt_header_t *)( use_xsdt ? *(uint64_t *)entry : *(uint32_t *)entry );
+
+        if ( table != NULL && strncmp( table->signature, signature, 4 ) == 0 &&
+             acpi_checksum_ok( table, table->length ) )
+        {
+            return table;
+        }
+    }
+
+    return NULL;
+}
+
+// Record an enabled processor
+void __init srat_add_cpu( acpi_numa_info_t *info, srat_cpu_affinity_t *cpu )
+{
+    if ( !( cpu->flags & SRAT_FLAG_ENABLED ) || info->num_cpus == ACPI_MAX_CPUS )
+    {
+        return;
+    }
+
+    // The proximity domain is split in two
+    info->cpus[info->num_cpus].apic_id = cpu->apic_id;
+    info->cpus[info->num_cpus].domain = cpu->domain_lo | ( (uint32_t)cpu->domain_hi[0] << 8 ) |
+                                        ( (uint32_t)cpu->domain_hi[1] << 16 ) |
+                                        ( (uint32_t)cpu->domain_hi[2] << 24 );
+    info->num_cpus++;
+}
+
+// Record an enabled processor with an x2APIC ID
+void __init srat_add_x2apic( acpi_numa_info_t *info, srat_x2apic_affinity_t *cpu )
+{
+    if ( !( cpu->flags & SRAT_FLAG_ENABLED ) || info->num_cpus == ACPI_MAX_CPUS )
+    {
+        return;
+    }
+
+    info->cpus[info->num_cpus].apic_id = cpu->x2apic_id;
+    info->cpus[info->num_cpus].domain = cpu->domain;
+    info->num_cpus++;
+}
+
+// Record an enabled memory range
+void __init srat_add_mem( acpi_numa_info_t *info, srat_mem_affinity_t *mem )
+{
+    if ( !( mem->flags & SRAT_FLAG_ENABLED ) || mem->len == 0 )
+    {
+        return;
+    }
+
+    if ( info->num_mem_ranges == ACPI_MAX_MEM_RANGES )
+    {
+        OS_WARN( "Ignoring SRAT memory range at 0x%lX!\n", mem->base );
+        return;
+    }
+
+    info->mem_ranges[info->num_mem_ranges].base = mem->base;
+    info->mem_ranges[info->num_mem_ranges].len = mem->len;
+    info->mem_ranges[info->num_mem_ranges].domain = mem->domain;
+    info->num_mem_ranges++;
+}
+
+/* Public Functions */
+
+// Read the proximity domains of the memory ranges and processors from the SRAT. Fails if the
+// machine has no ACPI tables or no SRAT, in which case it should be treated as a single node.
+driver_status_t __init ACPI_get_numa_info( void *tag_ptr, acpi_numa_info_t *info )
+{
+    acpi_rsdp_t *rsdp = (acpi_rsdp_t *)get_multiboot2_rsdp( tag_ptr );
+    acpi_srat_t *srat;
+    uint8_t *entry, *end;
+
+    memset( info, 0, sizeof( acpi_numa_info_t ) );
+
+    if ( rsdp == NULL || strncmp( rsdp->signature, ACPI_RSDP_SIGNATURE, 8 ) != 0 ||
+         !acpi_checksum_ok( rsdp, ACPI_RSDP_V1_LEN ) )
+    {
+        return FAILURE;
+    }
+
+    srat = (acpi_srat_t *)acpi_find_table( rsdp, ACPI_SRAT_SIGNATURE );
+
+    if ( srat == NULL )
+    {
+        return FAILURE;
+    }
+
+    end = (uint8_t *)srat + srat->header.length;
+
+    for ( entry = (uint8_t *)( srat + 1 ); entry + sizeof( srat_entry_t ) <= end;
+          entry += ( (srat_entry_t *)entry )->length )
+    {
+        // A zero length entry would never end
+        if ( ( (srat_entry_t *)entry )->length == 0 )
+        {
+            OS_ERROR( "Malformed SRAT entry at %p!\n", (void *)entry );
+            break;
+        }
+
+        switch ( ( (srat_entry_t *)entry )->type )
+        {
+            case SRAT_TYPE_CPU_AFFINITY:
+                srat_add_cpu( info, (srat_cpu_affinity_t *)entry );
+                break;
+
+            case SRAT_TYPE_X2APIC_AFFINITY:
+                srat_add_x2apic( info, (srat_x2apic_affinity_t *)entry );
+                break;
+
+            case SRAT_TYPE_MEM_AFFINITY:
+                srat_add_mem( info, (srat_mem_affinity_t *)entry );
+                break;
+
+            default:
+                // Ignore the other affinity structures
+                break;
+        }
+    }
+
+    return ( info->num_mem_ranges == 0 ? FAILURE : SUCCESS );
+}
+
+/*** End of File ***/
@@ -0,0 +1,54 @@
+/** @file acpi.h
+ *
+ * @brief ACPI table discovery. Only the NUMA topology in the SRAT is read for now.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#ifndef ACPI_H
+# define ACPI_H
+
+# include "common.h"
+
+/* Public Defines and Macros */
+
+# define ACPI_MAX_MEM_RANGES ( 32U )
+# define ACPI_MAX_CPUS       ( 64U )
+
+/* Public Types and Structs */
+
+// Physical memory range and the proximity domain it belongs to
+typedef struct acpi_mem_range_s
+{
+    uint64_t base;
+    uint64_t len;
+    uint32_t domain;
+} acpi_mem_range_t;
+
+// Processor and the proximity domain it belongs to
+typedef struct acpi_cpu_s
+{
+    uint32_t apic_id;
+    uint32_t domain;
+} acpi_cpu_t;
+
+// NUMA topology from the System Resource Affinity Table
+typedef struct acpi_numa_info_s
+{
+    acpi_mem_range_t mem_ranges[ACPI_MAX_MEM_RANGES];
+    uint32_t num_mem_ranges;
+    acpi_cpu_t cpus[ACPI_MAX_CPUS];
+    uint32_t num_cpus;
+} acpi_numa_info_t;
+
+/* Public Functions */
+
+driver_status_t ACPI_get_numa_info( void *tag_ptr, acpi_numa_info_t *info );
+
+#endif /* ACPI_H */
+
+/*** End of File ***/
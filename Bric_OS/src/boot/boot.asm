@@ -2,7 +2,9 @@ global start
 
 extern long_mode_start
 
-section .rodata
+; Everything here is only used before the kernel sets up its own GDT and page tables, so it goes
+; in the init sections that are freed after initialization
+section .init.rodata progbits alloc noexec nowrite
 gdt64:
 .null_desc: equ $ - gdt64 ; Null descriptor
     dq 0x0000000000000000
@@ -17,7 +19,7 @@ gdt64:
     dw $ - gdt64 - 1
     dq gdt64
 
-section .text
+section .init.text progbits alloc exec nowrite
 bits 32
 start:
     mov esp, stack_top
@@ -169,7 +171,7 @@ enable_paging:
 
     ret
 
-section .bss
+section .init.bss nobits alloc noexec write
 align 4096
 p4_table:
     resb 4096
@@ -177,6 +179,10 @@ p3_table:
     resb 4096
 p2_table:
     resb 4096
+
+; kernel_main never returns, so the boot stack stays
+section .bss
+align 4096
 stack_btm:
     resb 4096
 stack_top:
\ No newline at end of file
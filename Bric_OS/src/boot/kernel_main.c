@@ -13,6 +13,8 @@
 
 #include "common.h"
 #include "irq_handler.h"
+#include "kmalloc_prof.h"
+#include "kmalloc_trace.h"
 #include "kproc.h"
 #include "multiboot2.h"
 #include "ps2_keyboard_driver.h"
@@ -20,6 +22,7 @@
 #include "splash.h"
 #include "tests.h"
 #include "vga_driver.h"
+#include "zram.h"
 
 /* Testing Area */
 
@@ -138,6 +141,9 @@ int kernel_main( unsigned long magic, unsigned long addr )
         OS_ERROR_HALT( "System initialization failed!\n" );
     }
 
+    // The init code and data are done with, including system_initialization() itself
+    MMU_free_init_mem();
+
     // parse_multiboot2( magic, addr );
 
     // printk( "\n--------------------\n\n" );
@@ -150,11 +156,32 @@ int kernel_main( unsigned long magic, unsigned long addr )
     //// Test the kernel heap
     // test_kmalloc_all();
     // printk( "\n--------------------\n\n" );
+    //// Test the kernel arenas
+    // test_karena_all();
+    // printk( "\n--------------------\n\n" );
+    //// Test compaction and the huge pages it makes
+    // test_mmu_all();
+    // printk( "\n--------------------\n\n" );
+    //// Test compression and the zram pool
+    // test_zram_all();
+    // printk( "\n--------------------\n\n" );
 
     OS_INFO( "Testing PROC_run()...\n" );
     // Run PROC_run() just once for debugging
     PROC_run();
 
+    // Where the heap memory went, with `make profile`
+    if ( KMALLOC_PROFILE )
+    {
+        kprof_dump( 10 );
+    }
+
+    // The allocations so far, for `utils/kmalloc_replay`, with `make trace`
+    if ( KMALLOC_TRACE )
+    {
+        ktrace_dump();
+    }
+
     OS_INFO( "Done!\n" );
 
     HLT();
@@ -162,7 +189,7 @@ int kernel_main( unsigned long magic, unsigned long addr )
     return 0;
 }
 
-int MEM_init( unsigned long magic, unsigned long addr )
+int __init MEM_init( unsigned long magic, unsigned long addr )
 {
     // Check if the multiboot2 header is valid
     if ( magic != MULTIBOOT2_BOOTLOADER_MAGIC )
@@ -178,12 +205,19 @@ int MEM_init( unsigned long magic, unsigned long addr )
         return 1;
     }
 
+    // Compress cold pages in memory before they have to go to a swap device
+    if ( ZRAM_POOL_PAGES > 0 && ZRAM_init( ZRAM_POOL_PAGES ) == FAILURE )
+    {
+        OS_ERROR( "\nzram initialization failed!\n" );
+        return 1;
+    }
+
     OS_INFO( "Memory manager initialization is complete!\n\n" );
 
     return 0;
 }
 
-int VGA_init( void )
+int __init VGA_init( void )
 {
     // Initialize the VGA driver
     if ( VGA_driver_init() == FAILURE )
@@ -199,7 +233,7 @@ int VGA_init( void )
     return 0;
 }
 
-int SER_init( void )
+int __init SER_init( void )
 {
     // Initialize the serial driver
     if ( serial_driver_init() == FAILURE )
@@ -216,7 +250,7 @@ int SER_init( void )
     return 0;
 }
 
-int ISR_init( void )
+int __init ISR_init( void )
 {
     // Initialize the ISR
     if ( IRQ_init() == FAILURE )
@@ -230,7 +264,7 @@ int ISR_init( void )
     return 0;
 }
 
-int KB_init( void )
+int __init KB_init( void )
 {
     // Initialize the keyboard driver
     if ( ps2_keyboard_driver_init( true ) == FAILURE )
@@ -244,7 +278,7 @@ int KB_init( void )
     return 0;
 }
 
-int system_initialization( unsigned long magic, unsigned long addr )
+int __init system_initialization( unsigned long magic, unsigned long addr )
 {
     if ( VGA_init() ) return 1;
 
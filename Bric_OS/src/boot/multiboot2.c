@@ -18,6 +18,8 @@
 #define MULTIBOOT_TAG_TYPE_END          ( 0U )
 #define MULTIBOOT_TAG_TYPE_MMAP         ( 6U )
 #define MULTIBOOT_TAG_TYPE_ELF_SECTIONS ( 9U )
+#define MULTIBOOT_TAG_TYPE_ACPI_OLD     ( 14U )
+#define MULTIBOOT_TAG_TYPE_ACPI_NEW     ( 15U )
 
 #define VERIFY_MAGIC( mb_head ) ( ( mb_head ).magic == MULTIBOOT2_HEADER_MAGIC )
 #define VERIFY_CHECKSUM( mb_head )                                                                 \
@@ -273,7 +275,7 @@ int parse_multiboot2( unsigned long magic, unsigned long addr )
     return 0;
 }
 
-mb_tag_t *find_multiboot2_tag( unsigned long addr, uint32_t tag_type )
+mb_tag_t __init *find_multiboot2_tag( unsigned long addr, uint32_t tag_type )
 {
     mb_tag_t *tag, *section_addr = NULL;
 
@@ -295,7 +297,7 @@ mb_tag_t *find_multiboot2_tag( unsigned long addr, uint32_t tag_type )
     return section_addr;
 }
 
-void get_multiboot2_mmap_info(
+void __init get_multiboot2_mmap_info(
     void *tag_addr, mb_mmap_entry_t **mmap_entreies, uint32_t *num_entries
 )
 {
@@ -305,14 +307,47 @@ void get_multiboot2_mmap_info(
     *num_entries = ( tag->size - sizeof( mb_mmap_tag_t ) ) / ( (mb_mmap_tag_t *)tag )->entry_size;
 }
 
-void get_multiboot2_elf_info(
+void __init get_multiboot2_elf_info(
     void *tag_addr, elf_shdr_tbl_t **elf_sections, uint32_t *num_sections
 )
 {
     mb_tag_t *tag = find_multiboot2_tag( (unsigned long)tag_addr, MULTIBOOT_TAG_TYPE_ELF_SECTIONS );
 
+    if ( tag == NULL )
+    {
+        *elf_sections = NULL;
+        *num_sections = 0;
+        return;
+    }
+
     *elf_sections = (elf_shdr_tbl_t *)( (mb_elf_sections_tag_t *)tag )->sections;
     *num_sections = ( (mb_elf_sections_tag_t *)tag )->num;
 }
 
+// Get the size of the multiboot2 information, tags included
+uint32_t __init get_multiboot2_size( void *tag_addr ) { return *(uint32_t *)tag_addr; }
+
+// Get the copy of the ACPI RSDP, preferring the ACPI 2.0 one, or NULL if there is neither. Not
+// every machine has ACPI, so a missing tag isn't an error.
+void __init *get_multiboot2_rsdp( void *tag_addr )
+{
+    mb_tag_t *tag, *old_rsdp = NULL;
+
+    for ( tag = (mb_tag_t *)( tag_addr ) + 1; tag->type != MULTIBOOT_TAG_TYPE_END;
+          tag = (mb_tag_t *)( (uint8_t *)tag + ( ( tag->size + 7 ) & ~7 ) ) )
+    {
+        if ( tag->type == MULTIBOOT_TAG_TYPE_ACPI_NEW )
+        {
+            return tag + 1;
+        }
+
+        if ( tag->type == MULTIBOOT_TAG_TYPE_ACPI_OLD )
+        {
+            old_rsdp = tag + 1;
+        }
+    }
+
+    return old_rsdp;
+}
+
 /*** End of File ***/
\ No newline at end of file
@@ -64,6 +64,10 @@ void get_multiboot2_elf_info(
     void *tag_addr, elf_shdr_tbl_t **elf_sections, uint32_t *num_sections
 );
 
+uint32_t get_multiboot2_size( void *tag_addr );
+
+void *get_multiboot2_rsdp( void *tag_addr );
+
 #endif /* MULTIBOOT2_H */
 
 /*** End of File ***/
\ No newline at end of file
@@ -1,34 +1,111 @@
-///** @file block_dev.c
-// *
-// * @brief
-// *
-// * @author Bryce Melander
-// * @date Feb-20-2024
-// *
-// * @copyright (c) 2024 by Bryce Melander under MIT License. All rights reserved.
-// * (See http://opensource.org/licenses/MIT for more details.)
-// */
+/** @file block_dev.c
+ *
+ * @brief Generic block device interface and a RAM-backed block device.
+ *
+ * @author Bryce Melander
+ * @date Feb-20-2024
+ *
+ * @copyright (c) 2024 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
 
 #include "block_dev.h"
 
-#include "common.h"
+#include "errno.h"
+#include "mmu_driver.h"
+
+/* Private Defines and Macros */
+
+#define BLKS_TO_PAGES( n ) ( ( ( n ) * BLOCK_DEV_SIZE + PAGE_SIZE - 1 ) / PAGE_SIZE )
 
 // #define ATA_PORT ( 0x01F0U )  // 0x01F0-0x01F7
 
-//// 512 Byte blocks
-// #define BLOCK_DEV_SIZE ( 512U )
 //// Read ATA as an array of uint16_t containing 256 entries
 // #define ATA_READ_LEN ( 256U )
 
-// int BD_read( BlockDevice_t* a, int offset, void* dst );
-// int BD_write( BlockDevice_t* a, int offset, void* src );
+/* Private Functions */
 
-//
-// struct __BD_vtable_s
-//{
-//    int ( *read )( BlockDevice_t*, int, void* );
-//    int ( *write )( BlockDevice_t*, int, void* );
-//} BD_vtable = { &BD_read, &BD_write };
+// Check that a block exists on the device
+bool BD_check_blk( BlockDevice_t *bd, uint64_t blk )
+{
+    if ( bd == NULL || bd->table == NULL || blk >= bd->num_blks )
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    return true;
+}
+
+int RamDisk_read( BlockDevice_t *a, uint64_t blk, void *dst )
+{
+    RamDisk_t *self = (RamDisk_t *)a;
+
+    memcpy( dst, self->data + blk * a->blk_size, a->blk_size );
+
+    return 0;
+}
+
+int RamDisk_write( BlockDevice_t *a, uint64_t blk, const void *src )
+{
+    RamDisk_t *self = (RamDisk_t *)a;
+
+    memcpy( self->data + blk * a->blk_size, src, a->blk_size );
+
+    return 0;
+}
+
+/* Global Variables */
+
+static const BD_vtable_t RamDisk_vtable = { &RamDisk_read, &RamDisk_write };
+
+/* Public Functions */
+
+// Read a single block into `dst`
+int BD_read( BlockDevice_t *bd, uint64_t blk, void *dst )
+{
+    if ( !BD_check_blk( bd, blk ) ) return -1;
+
+    return bd->table->read( bd, blk, dst );
+}
+
+// Write a single block from `src`
+int BD_write( BlockDevice_t *bd, uint64_t blk, const void *src )
+{
+    if ( !BD_check_blk( bd, blk ) ) return -1;
+
+    return bd->table->write( bd, blk, src );
+}
+
+// RAM Disk Constructor. The backing pages come from the kernel heap region and are only allocated
+// once they are written to.
+RamDisk_t *RamDisk_init( RamDisk_t *self, uint64_t num_blks )
+{
+    self->data = (uint8_t *)MMU_alloc_pages( BLKS_TO_PAGES( num_blks ), MMU_VADDR_KHEAP );
+
+    if ( self->data == NULL )
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    self->block_dev.table = &RamDisk_vtable;
+    self->block_dev.blk_size = BLOCK_DEV_SIZE;
+    self->block_dev.num_blks = num_blks;
+
+    return self;
+}
+
+// RAM Disk Destructor
+void RamDisk_destroy( RamDisk_t *self )
+{
+    MMU_free_pages( self->data, BLKS_TO_PAGES( self->block_dev.num_blks ) );
+
+    self->data = NULL;
+    self->block_dev.num_blks = 0;
+}
+
+// TODO: ATA Device
 
 // int register_BlockDevice( BlockDevice_t* BD )
 //{
@@ -45,17 +122,6 @@
 //    return 0;
 //}
 
-//// Block Device Constructor
-// BlockDevice_t* BlockDevice_init( BlockDevice_t* self )
-//{
-//     self->blk_size = BLOCK_DEV_SIZE;
-//     self->total_len = 0;
-//     self->table->read = NULL;
-//     self->table->write = NULL;
-
-//    return self;
-//}
-
 // int ATAD_read( BlockDevice_t* a, int offset, void* dst );
 // int ATAD_write( BlockDevice_t* a, int offset, void* src );
 
@@ -97,4 +163,4 @@
 //    return 0;
 //}
 
-///*** End of File ***/
\ No newline at end of file
+/*** End of File ***/
\ No newline at end of file
@@ -1,36 +1,63 @@
-///** @file block_dev.h
-// *
-// * @brief
-// *
-// * @author Bryce Melander
-// * @date Feb-20-2024
-// *
-// * @copyright (c) 2024 by Bryce Melander under MIT License. All rights reserved.
-// * (See http://opensource.org/licenses/MIT for more details.)
-// */
-
-// #ifndef BLOCK_DEV_H
-// # define BLOCK_DEV_H
-
-// typedef struct __BD_vtable_s BD_vtable_t;
-// typedef struct __BlockDevice_s BlockDevice_t;
-// typedef struct __ATADevice_s ATADevice_t;
-
-//// Block Device Class
-// struct __BlockDevice_s
-//{
-//     BD_vtable_t* table;
-//     int blk_size;
-//     int total_len;
-// };
-
-//// ATA Device Class
-// struct __ATADevice_s
-//{
-//     BlockDevice_t block_dev;
-//     char* name;
-// };
-
-// #endif /* BLOCK_DEV_H */
-
-///*** End of File ***/
\ No newline at end of file
+/** @file block_dev.h
+ *
+ * @brief Generic block device interface and a RAM-backed block device.
+ *
+ * @author Bryce Melander
+ * @date Feb-20-2024
+ *
+ * @copyright (c) 2024 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#ifndef BLOCK_DEV_H
+# define BLOCK_DEV_H
+
+/* Includes */
+
+# include "common.h"
+
+/* Defines */
+
+// 512 Byte blocks
+# define BLOCK_DEV_SIZE ( 512U )
+
+/* Typedefs */
+
+typedef struct __BD_vtable_s BD_vtable_t;
+typedef struct __BlockDevice_s BlockDevice_t;
+typedef struct __RamDisk_s RamDisk_t;
+
+// Block Device Operations, both return 0 on success
+struct __BD_vtable_s
+{
+    int ( *read )( BlockDevice_t *self, uint64_t blk, void *dst );
+    int ( *write )( BlockDevice_t *self, uint64_t blk, const void *src );
+};
+
+// Block Device Class
+struct __BlockDevice_s
+{
+    const BD_vtable_t *table;
+    uint32_t blk_size;
+    uint64_t num_blks;
+};
+
+// RAM Disk Class
+struct __RamDisk_s
+{
+    BlockDevice_t block_dev;
+    uint8_t *data;
+};
+
+/* Public Functions */
+
+int BD_read( BlockDevice_t *bd, uint64_t blk, void *dst );
+int BD_write( BlockDevice_t *bd, uint64_t blk, const void *src );
+
+// RAM Disk Functions
+RamDisk_t *RamDisk_init( RamDisk_t *self, uint64_t num_blks );
+void RamDisk_destroy( RamDisk_t *self );
+
+#endif /* BLOCK_DEV_H */
+
+/*** End of File ***/
@@ -0,0 +1,311 @@
+/** @file memblock.c
+ *
+ * @brief Early boot memory allocator. Usable and reserved memory are kept as two arrays of ranges
+ * sorted by address, with overlapping and touching ranges merged. Free memory is whatever usable
+ * memory isn't reserved, and allocations are carved out of either end of it and reserved.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#include "memblock.h"
+
+#include "mmu_driver.h"
+#include "multiboot2.h"
+
+/* Private Defines and Macros */
+
+#define ALIGN_DOWN( x, n ) ( ( x ) & ~( ( n ) - 1 ) )
+
+/* Private Types and Enums */
+
+// Range of physical memory, the end is exclusive
+typedef struct memblock_region_s
+{
+    uint64_t base;
+    uint64_t end;
+} memblock_region_t;
+
+// Sorted array of ranges that don't overlap or touch
+typedef struct memblock_type_s
+{
+    memblock_region_t regions[MEMBLOCK_MAX_REGIONS];
+    uint32_t count;
+    const char *name;
+} memblock_type_t;
+
+/* Global Variables */
+
+// Linker symbols at the ends of the kernel image
+extern uint64_t kernel_start, kernel_end;
+
+static memblock_type_t memblock_memory __initdata = { .name = "usable" };
+static memblock_type_t memblock_reserved __initdata = { .name = "reserved" };
+
+static bool memblock_retired = false;
+
+/* Private Functions */
+
+// Add `[base, end)` to a type, merging it with every range it overlaps or touches
+driver_status_t __init memblock_insert( memblock_type_t *type, uint64_t base, uint64_t end )
+{
+    memblock_region_t *regions = type->regions;
+    uint32_t i, j, k;
+
+    if ( base >= end )
+    {
+        return SUCCESS;
+    }
+
+    // Skip the ranges that end before the new one
+    for ( i = 0; i < type->count && regions[i].end < base; ++i )
+    {
+    }
+
+    // Absorb the ranges that start before the new one ends
+    for ( j = i; j < type->count && regions[j].base <= end; ++j )
+    {
+        base = ( regions[j].base < base ? regions[j].base : base );
+        end = ( regions[j].end > end ? regions[j].end : end );
+    }
+
+    if ( j > i )
+    {
+        // The absorbed ranges collapse into the first of them
+        for ( k = j; k < type->count; ++k )
+        {
+            regions[k - ( j - i - 1 )] = regions[k];
+        }
+
+        type->count -= j - i - 1;
+    }
+    else
+    {
+        if ( type->count == MEMBLOCK_MAX_REGIONS )
+        {
+            OS_ERROR( "Too many %s memory ranges!\n", type->name );
+            return FAILURE;
+        }
+
+        for ( k = type->count; k > i; --k )
+        {
+            regions[k] = regions[k - 1];
+        }
+
+        type->count++;
+    }
+
+    regions[i].base = base;
+    regions[i].end = end;
+
+    return SUCCESS;
+}
+
+// Reserve the sections the boot loader loaded, including the symbol and string tables that are
+// placed past the end of the kernel image
+void __init memblock_reserve_elf( void *tag_ptr )
+{
+    elf_shdr_tbl_t *sections;
+    uint32_t i, num_sections;
+
+    get_multiboot2_elf_info( tag_ptr, &sections, &num_sections );
+
+    for ( i = 0; i < num_sections; ++i )
+    {
+        if ( sections[i].addr != 0 && sections[i].size != 0 )
+        {
+            MEMBLOCK_reserve( sections[i].addr, sections[i].size );
+        }
+    }
+}
+
+// Find the lowest, or with `top_down` the highest, free `size` bytes aligned to `align` that end
+// at or below `max_addr`. Returns 0 if there is no room, page 0 is always reserved.
+uint64_t __init memblock_find( uint64_t size, uint64_t align, uint64_t max_addr, bool top_down )
+{
+    uint64_t addr = 0, base, end, cand, best = 0;
+
+    while ( MEMBLOCK_next_free( &addr, &base, &end ) && base < max_addr )
+    {
+        end = ( end > max_addr ? max_addr : end );
+        cand = ( top_down ? ALIGN_DOWN( end - size, align ) : ALIGN( base, align ) );
+
+        if ( end - base < size || cand < base || cand + size > end )
+        {
+            continue;
+        }
+
+        if ( !top_down )
+        {
+            return cand;
+        }
+
+        best = cand;
+    }
+
+    return best;
+}
+
+// Allocate and reserve `size` bytes, rounded up to whole pages
+void __init *memblock_alloc( uint64_t size, uint64_t align, uint64_t max_addr, bool top_down )
+{
+    uint64_t addr;
+
+    if ( memblock_retired )
+    {
+        OS_ERROR( "memblock is retired, can't allocate %lu bytes!\n", size );
+        return NULL;
+    }
+
+    size = ALIGN( size, PAGE_SIZE );
+    align = ( align < PAGE_SIZE ? PAGE_SIZE : align );
+    max_addr = ( max_addr == 0 ? ~0UL : max_addr );
+
+    addr = memblock_find( size, align, max_addr, top_down );
+
+    if ( addr == 0 || MEMBLOCK_reserve( addr, size ) == FAILURE )
+    {
+        return NULL;
+    }
+
+    return (void *)addr;
+}
+
+/* Public Functions */
+
+driver_status_t __init MEMBLOCK_init( void *tag_ptr )
+{
+    mb_mmap_entry_t *mmap_entries;
+    uint32_t i, num_mmap_entries;
+
+    get_multiboot2_mmap_info( tag_ptr, &mmap_entries, &num_mmap_entries );
+
+    for ( i = 0; i < num_mmap_entries; ++i )
+    {
+        if ( mmap_entries[i].type == MULTIBOOT_MEMORY_AVAILABLE )
+        {
+            MEMBLOCK_add( mmap_entries[i].addr, mmap_entries[i].len );
+        }
+    }
+
+    if ( memblock_memory.count == 0 )
+    {
+        OS_ERROR( "No usable memory in the memory map!\n" );
+        return FAILURE;
+    }
+
+    // Page 0 catches NULL pointers
+    MEMBLOCK_reserve( 0, PAGE_SIZE );
+    MEMBLOCK_reserve( (uint64_t)&kernel_start, (uint64_t)&kernel_end - (uint64_t)&kernel_start );
+    MEMBLOCK_reserve( (uint64_t)tag_ptr, get_multiboot2_size( tag_ptr ) );
+    memblock_reserve_elf( tag_ptr );
+
+    OS_INFO(
+        "memblock: %u usable and %u reserved ranges, %lu MiB usable\n", memblock_memory.count,
+        memblock_reserved.count, MEMBLOCK_total() >> 20
+    );
+
+    return SUCCESS;
+}
+
+// Add usable memory, only the whole pages inside the range are used
+driver_status_t __init MEMBLOCK_add( uint64_t base, uint64_t size )
+{
+    if ( memblock_retired )
+    {
+        OS_ERROR( "memblock is retired, can't add %p!\n", (void *)base );
+        return FAILURE;
+    }
+
+    return memblock_insert(
+        &memblock_memory, ALIGN( base, PAGE_SIZE ), ALIGN_DOWN( base + size, PAGE_SIZE )
+    );
+}
+
+// Reserve memory, every page the range touches is reserved
+driver_status_t __init MEMBLOCK_reserve( uint64_t base, uint64_t size )
+{
+    if ( memblock_retired )
+    {
+        OS_ERROR( "memblock is retired, can't reserve %p!\n", (void *)base );
+        return FAILURE;
+    }
+
+    return memblock_insert(
+        &memblock_reserved, ALIGN_DOWN( base, PAGE_SIZE ), ALIGN( base + size, PAGE_SIZE )
+    );
+}
+
+void __init *MEMBLOCK_alloc( uint64_t size, uint64_t align, uint64_t max_addr )
+{
+    return memblock_alloc( size, align, max_addr, false );
+}
+
+void __init *MEMBLOCK_alloc_top( uint64_t size, uint64_t align, uint64_t max_addr )
+{
+    return memblock_alloc( size, align, max_addr, true );
+}
+
+bool __init MEMBLOCK_next_free( uint64_t *addr, uint64_t *base, uint64_t *end )
+{
+    memblock_region_t *mem, *res;
+    uint64_t start;
+    uint32_t i, j = 0;
+
+    for ( i = 0; i < memblock_memory.count; ++i )
+    {
+        mem = &memblock_memory.regions[i];
+        start = ( mem->base > *addr ? mem->base : *addr );
+
+        // Step over the reserved ranges that cover the start
+        while ( start < mem->end )
+        {
+            for ( ; j < memblock_reserved.count && memblock_reserved.regions[j].end <= start; ++j )
+            {
+            }
+
+            res = ( j < memblock_reserved.count ? &memblock_reserved.regions[j] : NULL );
+
+            if ( res == NULL || start < res->base )
+            {
+                *base = start;
+                *end = ( res != NULL && res->base < mem->end ? res->base : mem->end );
+                *addr = *end;
+
+                return true;
+            }
+
+            start = res->end;
+        }
+    }
+
+    return false;
+}
+
+// End of the highest usable memory
+uint64_t __init MEMBLOCK_phys_end( void )
+{
+    return ( memblock_memory.count == 0 ? 0
+                                        : memblock_memory.regions[memblock_memory.count - 1].end );
+}
+
+// Bytes of usable memory, reserved or not
+uint64_t __init MEMBLOCK_total( void )
+{
+    uint64_t total = 0;
+    uint32_t i;
+
+    for ( i = 0; i < memblock_memory.count; ++i )
+    {
+        total += memblock_memory.regions[i].end - memblock_memory.regions[i].base;
+    }
+
+    return total;
+}
+
+void __init MEMBLOCK_retire( void ) { memblock_retired = true; }
+
+/*** End of File ***/
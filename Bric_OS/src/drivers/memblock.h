@@ -0,0 +1,71 @@
+/** @file memblock.h
+ *
+ * @brief Early boot memory allocator. Tracks the usable and reserved physical memory until the page
+ * frame allocator takes over the free ranges.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#ifndef MEMBLOCK_H
+# define MEMBLOCK_H
+
+/* Includes */
+
+# include "common.h"
+
+/* Defines */
+
+// Sorted and merged ranges kept of each kind
+# define MEMBLOCK_MAX_REGIONS ( 128U )
+
+/* Public Functions */
+
+/**
+ * @brief Collects the usable memory from the multiboot2 memory map, and reserves the first page,
+ * the kernel image, the multiboot2 information and the ELF sections the boot loader loaded.
+ * @param tag_ptr Multiboot2 information
+ * @return SUCCESS, or FAILURE if the memory map has no usable memory
+ */
+driver_status_t MEMBLOCK_init( void *tag_ptr );
+
+driver_status_t MEMBLOCK_add( uint64_t base, uint64_t size );
+driver_status_t MEMBLOCK_reserve( uint64_t base, uint64_t size );
+
+/**
+ * @brief Allocates and reserves the lowest free `size` bytes that end at or below `max_addr`. Low
+ * memory stays identity mapped the longest, so early data structures go there.
+ * @param size Bytes to allocate, rounded up to whole pages
+ * @param align Power of 2 alignment of the allocation, at least a page
+ * @param max_addr Address the allocation has to end below, or 0 for anywhere
+ * @return Physical address of the allocation, or NULL
+ */
+void *MEMBLOCK_alloc( uint64_t size, uint64_t align, uint64_t max_addr );
+
+/**
+ * @brief Same as `MEMBLOCK_alloc()`, but allocates the highest free `size` bytes instead.
+ */
+void *MEMBLOCK_alloc_top( uint64_t size, uint64_t align, uint64_t max_addr );
+
+/**
+ * @brief Finds the next free range of usable memory at or above `*addr`, and moves `*addr` past it.
+ * @return false once there are no more free ranges
+ */
+bool MEMBLOCK_next_free( uint64_t *addr, uint64_t *base, uint64_t *end );
+
+// Memory Size Functions
+uint64_t MEMBLOCK_phys_end( void );
+uint64_t MEMBLOCK_total( void );
+
+/**
+ * @brief Hands the free ranges over to the page frame allocator. Nothing can be allocated or
+ * reserved after this.
+ */
+void MEMBLOCK_retire( void );
+
+#endif /* MEMBLOCK_H */
+
+/*** End of File ***/
@@ -11,7 +11,13 @@
 
 #include "mmu_driver.h"
 
+#include "acpi.h"
+#include "block_dev.h"
 #include "irq_handler.h"
+#include "kmalloc.h"
+#include "memblock.h"
+#include "page_cache.h"
+#include "zram.h"
 
 /* Private Defines and Macros */
 
@@ -28,7 +34,10 @@
 //   - Text and globals
 //   - Heap
 
-// Virtual Memory Layout - 256 TiB Total
+// Memory identity mapped by the boot code, early data structures have to be cleared below it
+#define BOOT_MAP_SIZE ( 1UL << 30U )
+
+// Virtual Memory Layout - 128 TiB Total (Lower Canonical Half)
 #define PHYS_START   ( 0x000000000000U )  // Physical Map ( 1 TiB )
 #define PHYS_END     ( 0x00FFFFFFFFFFU )
 #define KHEAP_START  ( 0x010000000000U )  // Kernel Heap ( 1 TiB )
@@ -47,8 +56,8 @@
 #define KSTACK_START ( 0x0FFFFFFFFFFFU )
 #define USTACK_END   ( 0x100000000000U )  // User Stack ( 16 TiB )
 #define USTACK_START ( 0x1FFFFFFFFFFFU )
-#define UHEAP_START  ( 0x200000000000U )  // User Heap ( 240 TiB )
-#define UHEAP_END    ( 0xFFFFFFFFFFFFU )
+#define UHEAP_START  ( 0x200000000000U )  // User Heap ( 96 TiB )
+#define UHEAP_END    ( 0x7FFFFFFFFFFFU )
 
 #define ALIGN_ADDR_8_BYTES( addr ) ( (void *)ALIGN( (uint64_t)( addr ), 8U ) )
 #define PAGE_ALIGN_ADDR( addr )    ( (void *)ALIGN( (uint64_t)( addr ), PAGE_SIZE ) )
@@ -72,9 +81,24 @@
 #define GET_PAGE_TBL_INDEX( x )     ( ( (uint64_t)( x ) >> 12U ) & PAGE_TBL_OFFSET_MASK )
 #define GET_PHYS_PAGE_INDEX( x )    ( ( (uint64_t)( x ) >> 00U ) & PHYS_PAGE_OFFSET_MASK )
 
+// Paging levels, from the PML4 (Level 4) down to the page table (Level 1)
+#define PT_LEVELS     ( 4U )
+#define PT_LEVEL_PML4 ( 0U )
+#define PT_LEVEL_PDPT ( 1U )
+#define PT_LEVEL_PD   ( 2U )
+#define PT_LEVEL_PT   ( 3U )
+
+#define GET_TBL_INDEX( x, level ) ( ( (uint64_t)( x ) >> ( 39U - 9U * ( level ) ) ) & 0x1FFU )
+
+// An entry is in use if any of its bits are set (present, allocate on demand, etc.)
+#define IS_ENTRY_USED( entry ) ( *(uint64_t *)( entry ) != 0 )
+
 #define READ_FRAME_ADDR( entry )        ( (uint8_t *)( (uint64_t)( ( entry )->frame_addr ) << 12 ) )
 #define WRITE_FRAME_ADDR( entry, addr ) ( ( entry )->frame_addr = ( (uint64_t)( addr ) >> 12 ) )
 
+// Bytes mapped by a leaf entry, a huge PD entry or a PT entry
+#define LEAF_ENTRY_SIZE( entry ) ( ( entry )->huge ? HUGE_PAGE_SIZE : (uint64_t)PAGE_SIZE )
+
 #define CHECK_PAGE_ALIGNED( x )                                      \
     do                                                               \
     {                                                                \
@@ -87,14 +111,156 @@
 #define USER_SUPER_BIT_MASK ( 1U << 2U )
 #define ACCESSED_BIT_MASK   ( 1U << 5U )
 #define DIRTY_BIT_MASK      ( 1U << 6U )
+#define GLOBAL_BIT_MASK     ( 1U << 8U )
+
+// Everything below the user stack belongs to the kernel and is mapped as global
+#define IS_KERNEL_ADDR( addr ) ( (uint64_t)( addr ) < USTACK_END )
+
+// Kernel heap and user pages are the anonymous pages compaction finds by walking the page tables.
+// Kernel stacks are left where they are, one of them is running.
+#define IS_KHEAP_ADDR( addr ) \
+    ( (uint64_t)( addr ) >= KHEAP_START && (uint64_t)( addr ) <= KHEAP_END )
+#define IS_MOVABLE_ADDR( addr ) ( IS_KHEAP_ADDR( addr ) || !IS_KERNEL_ADDR( addr ) )
+
+// CPUID feature bits
+#define CPUID_1_EDX_PGE     ( 1U << 13U )  // Page Global Enable
+#define CPUID_1_ECX_PCID    ( 1U << 17U )  // Process-Context Identifiers
+#define CPUID_7_EBX_INVPCID ( 1U << 10U )  // INVPCID Instruction
+
+// Control register bits
+#define CR4_PGE_BIT   ( 1UL << 7U )
+#define CR4_PCIDE_BIT ( 1UL << 17U )
+#define CR3_NO_FLUSH  ( 1UL << 63U )  // Keep the TLB entries tagged with the loaded PCID
+#define CR3_PCID_MASK ( 0xFFFUL )
+
+// INVPCID invalidation types
+#define INVPCID_SINGLE_ADDR    ( 0UL )
+#define INVPCID_SINGLE_CONTEXT ( 1UL )
+#define INVPCID_ALL_GLOBAL     ( 2UL )
+#define INVPCID_ALL_NON_GLOBAL ( 3UL )
+
+// PCID used by the kernel address space
+#define KERNEL_PCID ( 0U )
+
+// PML4 entries below this index map the kernel half and are shared by every address space, the
+// entries from here up to the end of the user heap are private
+#define KERNEL_PML4_ENTRIES ( GET_PAGE_MAP_INDEX( USTACK_END ) )
+#define USER_PML4_END       ( GET_PAGE_MAP_INDEX( UHEAP_END ) + 1U )
+
+// User regions are kept per address space
+#define IS_USER_REGION( id ) ( ( id ) >= MMU_VADDR_USTACK && ( id ) < MMU_VADDR_MAX )
+#define NUM_USER_REGIONS     ( MMU_VADDR_MAX - MMU_VADDR_USTACK )
+
+// Process-context identifiers. PCIDs are handed out to address spaces until they run out, after
+// that address spaces share `SHARED_PCID` and flush it on every load.
+#define PCID_MAX    ( 4096U )
+#define SHARED_PCID ( PCID_MAX - 1U )
+
+// Page fault error code bits
+#define PF_ERR_PRESENT ( 1U << 0U )
+#define PF_ERR_WRITE   ( 1U << 1U )
+
+// Swapped out PT entries keep their swap slot where the frame address would be
+#define READ_SWAP_SLOT( entry )        ( ( entry )->frame_addr )
+#define WRITE_SWAP_SLOT( entry, slot ) ( ( entry )->frame_addr = ( slot ) )
+
+// Swap slots are one page each, slot 0 is never handed out so it can mean "no slot"
+#define SWAP_NO_SLOT     ( 0U )
+#define SWAP_SLOT_MAX    ( 0xFFFFU )  // Maximum number of PT entries sharing a swap slot
+#define SWAP_BATCH_PAGES ( 32U )      // Pages reclaimed every time the frame allocator runs dry
+
+// Slots with this bit set are zram handles rather than swap area slots
+#define SWAP_ZRAM_BIT        ( 1UL << 39U )  // Top bit of the frame address field
+#define IS_ZRAM_SLOT( slot ) ( ( ( slot ) & SWAP_ZRAM_BIT ) != 0 )
+
+// Entries with both the swapped and alloc bits set map a page of an object, present or not. Leaf
+// entries have no child table to count, so they keep their mapping id in the occupancy count bits.
+#define IS_OBJECT_ENTRY( entry )  ( ( entry )->swapped && ( entry )->alloc )
+#define READ_MAP_ID( entry )      ( ( entry )->num_used )
+#define WRITE_MAP_ID( entry, id ) ( ( entry )->num_used = ( id ) )
+#define MAP_AREAS_MAX             ( 2048U )  // Mapping ids have to fit in 11 bits
+
+// Read-ahead window of sequential faults on an object mapping
+#define MAP_RA_MIN_PAGES ( 4U )
+#define MAP_RA_MAX_PAGES ( 32U )
+
+// Unmapped pages left below every stack to catch overflows
+#define STACK_GUARD_PAGES ( 1U )
+
+// NUMA nodes with their own page frame pool, proximity domains past the last node share node 0
+#define NUMA_MAX_NODES ( 8U )
+
+// Contiguous memory area, an eighth of memory up to 64 MiB, placed below 4 GiB for 32 bit DMA
+#define CMA_FRACTION ( 8U )
+#define CMA_MAX_SIZE ( 64UL << 20U )
+#define CMA_LIMIT    ( 4UL << 30U )
+
+// Huge page frames, 512 page frames aligned to 2 MiB
+#define HUGE_PAGE_SIZE ( 0x200000UL )
+#define PAGES_PER_HUGE ( HUGE_PAGE_SIZE / PAGE_SIZE )
+
+// A few freed huge page frames are kept whole, and compaction only moves pages out of blocks that
+// are at least half free
+#define COMPACT_POOL_BLOCKS ( 2U )
+#define COMPACT_MIN_FREE    ( PAGES_PER_HUGE / 2U )
+#define COMPACT_MAX_TRIES   ( 4U )  // Blocks that may fail to compact before giving up
+
+// The allocation that takes the free page frames below the low watermark, a 64th of memory,
+// reclaims frames until twice as many are free
+#define WMARK_LOW_DIV   ( 64U )
+#define WMARK_MIN_PAGES ( 32U )
+
+// Per-CPU frame caches. A CPU refills its cache with a batch of frames from the NUMA free lists
+// when it runs dry, and drains a batch of its coldest frames back once it holds more than
+// `PCP_HIGH`.
+#define PCP_BATCH ( 16U )
+#define PCP_HIGH  ( 64U )
+
+// Page frame info flags
+#define PF_FLAG_FREE    ( 1U << 0U )  // On the free list of its node
+#define PF_FLAG_MOVABLE ( 1U << 1U )  // Backs an anonymous page at an `IS_MOVABLE_ADDR()` address
+
+// Ranges larger than this many pages are cheaper to drop with a full flush than with `invlpg`
+#define TLB_FLUSH_THRESHOLD ( 32U )
+
+// Reading an estimate scans again once the last scan is 2^30 TSC cycles old, a fraction of a second
+// on most CPUs. Interrupts are enabled between batches of pages.
+#define WSS_SCAN_CYCLES ( 1UL << 30U )
+#define WSS_BATCH_PAGES ( 64U )
+#define WSS_AGE_MAX     ( 255U )
+
+// Boot data that has to stay identity mapped past the first `MAP_INIT_SIZE` bytes
+#define BOOT_RANGES_MAX ( 4U )
+
+// Number of virtual range nodes that fit in one page frame
+#define VA_NODES_PER_PAGE ( PAGE_SIZE / sizeof( va_range_t ) )
 
 /* Private Types and Enums */
 
+// Free range of virtual pages, kept in a list sorted by address
+typedef struct va_range_s va_range_t;
+struct va_range_s
+{
+    uint64_t start;      // Address of the first free page
+    uint64_t num_pages;  // Number of free pages in the range
+    va_range_t *next;    // Next free range (higher address)
+};
+
+// Virtual address region with its own free range list
+typedef struct va_region_s
+{
+    uint64_t start;         // First usable address
+    uint64_t end;           // One past the last usable address
+    bool top_down;          // Stacks and heaps hand out ranges from the top of the region
+    va_range_t *free_list;  // Free ranges sorted by address
+} va_region_t;
+
 // Entry in a Linked List of Page Frames
 typedef struct pf_list_entry_s pf_list_entry_t;
 struct pf_list_entry_s
 {
     pf_list_entry_t *next;  // 8 bytes
+    pf_list_entry_t *prev;  // 8 bytes
 };
 
 // Entry in a Linked List of Valid Physical Address Ranges
@@ -104,9 +270,32 @@ struct pf_addr_range_s
     void *start;
     void *curr_frame;
     void *end;
+    uint32_t node;  // NUMA node the frames belong to
     pf_range_entry_t *next_entry;
 };
 
+// NUMA node with its own pool of page frames
+typedef struct numa_node_s
+{
+    uint32_t domain;             // ACPI proximity domain
+    pf_list_entry_t *free_list;  // Freed page frames
+    pf_range_entry_t *range;     // First range of the node that may still have untouched frames
+    uint64_t num_frames;         // Page frames in the ranges of the node
+    uint64_t num_free;           // Page frames on the free list or not handed out yet
+} numa_node_t;
+
+// Page frames a CPU keeps for itself. Frames freed on the CPU are likely still in its caches and
+// go on the hot list, which is used first. Frames from the free lists go on the cold list. The lock
+// is only contended when another CPU drains the cache.
+typedef struct pcp_cache_s
+{
+    pf_list_entry_t *hot;
+    pf_list_entry_t *cold;
+    uint32_t num_hot;
+    uint32_t num_cold;
+    binary_semaphore_t lock;
+} pcp_cache_t;
+
 // CR3 Register Entry
 typedef struct page_map_entry_s
 {                                 // 8 bytes (64 bits)
@@ -126,85 +315,345 @@ typedef struct page_directory_entry_s
     uint64_t write_through : 1;   // Page Write-Through ........ 0 = Write-Back, 1 = Write-Through
     uint64_t cache_disabled : 1;  // Page Cache Disable ........ 0 = Enabled,    1 = Disabled
     uint64_t accessed : 1;        // Accessed Bit .............. 1 = Data has been accessed
-    uint64_t bit_6 : 1;           // Unused Bit
-    uint64_t bit_7 : 1;           // Unused Bit
-    uint64_t bit_8 : 1;           // Unused Bit
     uint64_t dirty : 1;           // Dirty Bit ................. 1 = Data has been written to
+    uint64_t huge : 1;            // Page Size Bit ............. 1 = PD entry maps a 2 MiB page
+    uint64_t global : 1;          // Global Bit ................ 1 = Keep TLB entry across CR3 loads
+    uint64_t swapped : 1;         // Swapped Out Bit ........... 1 = Page is in the swap area
     uint64_t alloc : 1;           // Allocate on Demand Bit .... 1 = Allocate before accessing
-    uint64_t bit_B : 1;           // Unused Bit
+    uint64_t cow : 1;             // Copy-on-Write Bit ......... 1 = Copy the page on a write
     uint64_t frame_addr : 40;     // Frame Address ............. Address of the Child Table/Page
-    uint64_t unused : 11;         // Unused Bits
+    uint64_t num_used : 11;       // Available Bits ............ Used entries in the child table
     uint64_t no_execute : 1;      // No-Execute Bit ............ 0 = Execute, 1 = No-Execute
 } __packed pg_dir_entry_t;        // 64 bits Total
 
-/* Global Variables */
+// Per page frame bookkeeping, indexed by frame number
+typedef struct pf_info_s
+{
+    uint32_t refcnt;  // Number of mappings of the frame, or of entries pointing at a page table
+    uint8_t flags;    // PF_FLAG_* bits
+    uint8_t node;     // NUMA node of the frame
+    uint8_t age;      // Working set scans since the frame was last accessed
+    uint8_t wss_gen;  // Working set scan that last aged the frame, 0 if none did
+} pf_info_t;
+
+// Mapping of a range of pages of an object
+typedef struct map_area_s
+{
+    PC_object_t *obj;      // Mapped object
+    uint64_t first_index;  // Page of the object mapped at `start`
+    uint64_t start;        // Address of the first page
+    uint64_t num_pages;    // Size of the mapping in pages
+    bool writable;         // Writes through the mapping reach the object
+    addr_space_t *as;      // Address space of the mapping, the kernel one for kernel mappings
+    uint64_t next_fault;   // Page the next fault of a sequential scan would be at
+    uint64_t ra_pages;     // Current read-ahead window
+    uint64_t clone_id;     // Id of the copy made by the last clone of `as`
+} map_area_t;
+
+// State of a page frame of the contiguous memory area
+typedef enum cma_state_e {
+    CMA_FREE = 0,  // Unused
+    CMA_MOVABLE,   // Lent out to a page that can be moved elsewhere
+    CMA_CONTIG     // Part of a contiguous allocation
+} cma_state_t;
+
+// Reverse map entry of a page frame lent out by the contiguous memory area
+typedef struct cma_rmap_s
+{
+    addr_space_t *as;  // Address space the frame was lent to
+    uint64_t va;       // Address of the page using the frame
+} cma_rmap_t;
+
+// Address space. The kernel half of the PML4 points at page directory pointer tables shared by
+// every address space, while the user half and the user regions are private.
+struct addr_space_s
+{
+    pg_dir_entry_t *pml4;                        // Page Map Table (Level 4)
+    uint16_t pcid;                               // PCID tagging this address space's TLB entries
+    bool needs_flush;                            // The PCID may still tag stale TLB entries
+    uint32_t refcnt;                             // Number of users of the address space
+    va_region_t user_regions[NUM_USER_REGIONS];  // User stack and heap regions
+    uint64_t uheap_brk;                          // Program break of the user heap
+    uint64_t swap_cursor;                        // Next user page the reclaim scan looks at
+    mmu_wss_t wss[NUM_USER_REGIONS];             // Working set estimates of the user regions
+    addr_space_t *next;                          // List of every address space
+};
 
-// MMAP entries from multiboot2
-static mb_mmap_entry_t *mmap_entries = NULL;
-static uint32_t num_mmap_entries = 0;
+/* Global Variables */
 
-// Free physical address ranges
+// Free physical address ranges, handed over by memblock
 pf_range_entry_t *addr_range_head = NULL;
-pf_range_entry_t *addr_range_curr = NULL;
 pf_range_entry_t *addr_range_tail = NULL;
 
+// Range entries set aside by memblock, including room for the NUMA splits
+static pf_range_entry_t *range_pool = NULL;
+static uint64_t range_pool_left = 0;
+
 // Kernel start and end addresses
 extern uint64_t kernel_start, kernel_end;
+
+// Init section of the kernel image, both page aligned
+extern uint64_t init_start, init_end;
 void *kernel_start_addr = NULL, *kernel_end_addr = NULL;
 
-// Page Map Table (Level 4)
-static pg_dir_entry_t *pml4 = NULL;
-
-// Free page frames
-static pf_list_entry_t *pf_free_list_head = NULL;
-
-// Local Heap for the Linked List of Valid Physical Address Ranges
-static uint8_t *local_heap_ptr = (uint8_t *)( PAGE_SIZE );
-
-// Next available virtual address in each region (Physical region skips the first page)
-static void *virt_addr_bank[MMU_VADDR_MAX] = {
-    [MMU_VADDR_PHYS] = (void *)( PHYS_START + PAGE_SIZE ),
-    [MMU_VADDR_KHEAP] = (void *)KHEAP_START,
-    [MMU_VADDR_RES] = (void *)RES_START,
-    [MMU_VADDR_IST1] = (void *)IST1_START,
-    [MMU_VADDR_IST2] = (void *)IST2_START,
-    [MMU_VADDR_IST3] = (void *)IST3_START,
-    [MMU_VADDR_IST4] = (void *)IST4_START,
-    [MMU_VADDR_KSTACK] = (void *)KSTACK_START,
-    [MMU_VADDR_USTACK] = (void *)USTACK_START,
-    [MMU_VADDR_UHEAP] = (void *)UHEAP_START
+// Kernel address space, which only has the shared kernel half mapped
+static addr_space_t kernel_as = {
+    .pcid = KERNEL_PCID, .refcnt = 1, .uheap_brk = UHEAP_START, .swap_cursor = USTACK_END
+};
+
+// Address space currently loaded into CR3
+static addr_space_t *curr_as = &kernel_as;
+
+// Every address space, and the one the reclaim scan is working through
+static addr_space_t *as_list_head = &kernel_as;
+static addr_space_t *swap_cursor_as = &kernel_as;
+static uint64_t num_addr_spaces = 1;
+
+// PCIDs in use, the kernel and shared PCIDs are never handed out
+static uint64_t pcid_bitmap[PCID_MAX / 64U] = {
+    [KERNEL_PCID / 64U] = ( 1UL << ( KERNEL_PCID % 64U ) ),
+    [SHARED_PCID / 64U] = ( 1UL << ( SHARED_PCID % 64U ) )
+};
+
+// TLB features enabled by `tlb_features_init()`
+static bool pge_enabled = false;
+static bool pcid_enabled = false;
+static bool invpcid_supported = false;
+
+// NUMA nodes. Machines without an SRAT are a single node holding every range.
+static numa_node_t numa_nodes[NUMA_MAX_NODES];
+static uint32_t num_numa_nodes = 1;
+static uint32_t numa_local_node = 0;  // Node of the boot CPU
+
+// Frame caches of the CPUs, which only hold frames of the node of their CPU
+static pcp_cache_t pcp_caches[MAX_CPUS];
+
+// Lock of the NUMA free lists, which are shared by every CPU. It is only taken with interrupts
+// disabled, so an interrupt can't try to take it again on the same CPU.
+static binary_semaphore_t pf_lock = { 0 };
+
+// Node selection of `MMU_pf_alloc()`
+static numa_policy_t numa_policy = MMU_NUMA_LOCAL;
+static uint32_t numa_preferred_node = 0;
+static uint32_t numa_interleave_node = 0;
+
+// NUMA topology from the SRAT, only needed while the address map is set up
+static acpi_numa_info_t numa_info __initdata;
+
+// Contiguous memory area. Frames that aren't part of a contiguous allocation are lent out to user
+// pages, and the reverse map finds the PT entry of every lent frame so the page can be moved.
+static uint8_t *cma_base = NULL;
+static uint64_t cma_num_frames = 0;
+static uint8_t *cma_state = NULL;
+static cma_rmap_t *cma_rmap = NULL;
+static uint64_t cma_next_free = 0;
+
+// Freed 2 MiB blocks kept whole for the next huge pages, linked through their first frame
+static pf_list_entry_t *huge_pool = NULL;
+static uint64_t num_huge_pool = 0;
+
+// Caches that give page frames back under memory pressure, and the watermarks on the number of
+// free frames that decide when they are asked to
+static mmu_shrinker_t *shrinker_list = NULL;
+static uint64_t wmark_low = 0, wmark_high = 0;
+static bool in_shrink = false;
+static bool wmark_low_hit = false;  // Set once reclaim ran, until the frames are back over the mark
+
+// The kernel heap gives back its cached blocks and the free pages at its top
+static mmu_shrinker_t kmalloc_shrinker = { kmalloc_shrink_count, kmalloc_shrink_scan, NULL };
+
+// Swap area, with a count of the PT entries using each of its slots
+static BlockDevice_t *swap_dev = NULL;
+static uint16_t *swap_map = NULL;
+static uint64_t num_swap_slots = 0;
+static uint64_t swap_next_slot = 1;
+static bool in_reclaim = false;
+
+// Object mappings by id
+static map_area_t *map_areas[MAP_AREAS_MAX];
+
+// Page frame info for every frame below the end of physical memory
+static pf_info_t *pf_info = NULL;
+static uint64_t num_pf_info = 0;
+
+// Physical ranges of the boot data, as start and end address pairs
+static uint64_t boot_ranges[BOOT_RANGES_MAX][2] __initdata;
+static uint32_t num_boot_ranges __initdata = 0;
+
+// Virtual address regions. Stack regions grow down, and the heap regions are handed out from
+// the top since the bottom of the region belongs to the program break.
+static va_region_t va_regions[MMU_VADDR_MAX] = {
+    [MMU_VADDR_PHYS] = { PHYS_START + PAGE_SIZE, PHYS_END + 1, false, NULL },
+    [MMU_VADDR_KHEAP] = { KHEAP_START, KHEAP_END + 1, true, NULL },
+    [MMU_VADDR_RES] = { RES_START, RES_END + 1, false, NULL },
+    [MMU_VADDR_IST1] = { IST1_END, IST1_START + 1, true, NULL },
+    [MMU_VADDR_IST2] = { IST2_END, IST2_START + 1, true, NULL },
+    [MMU_VADDR_IST3] = { IST3_END, IST3_START + 1, true, NULL },
+    [MMU_VADDR_IST4] = { IST4_END, IST4_START + 1, true, NULL },
+    [MMU_VADDR_KSTACK] = { KSTACK_END, KSTACK_START + 1, true, NULL },
+    [MMU_VADDR_USTACK] = { USTACK_END, USTACK_START + 1, true, NULL },
+    [MMU_VADDR_UHEAP] = { UHEAP_START, UHEAP_END + 1, true, NULL }
 };
 
+// Unused virtual range nodes
+static va_range_t *va_node_pool = NULL;
+
+// Program break for the kernel heap, user heap breaks are kept per address space
+static uint64_t kheap_brk = KHEAP_START;
+
+// Working set scan generation, frames are aged once per scan however many times they are mapped
+static uint8_t wss_gen = 0;
+static uint64_t wss_last_scan = 0;  // TSC at the end of the last scan
+
+// Working set estimates of the kernel regions, which every address space shares
+static mmu_wss_t kernel_wss[MMU_VADDR_USTACK];
+
 /* Private Functions */
 
-// Allocates a new page frame from the list of MMAP entries
-void *alloc_new_pf( void )
+static inline void cpuid( uint32_t leaf, uint32_t subleaf, uint32_t regs[4] )
 {
-    void *phys_page = NULL;
+    asm volatile( "cpuid"
+                  : "=a"( regs[0] ), "=b"( regs[1] ), "=c"( regs[2] ), "=d"( regs[3] )
+                  : "a"( leaf ), "c"( subleaf ) );
+}
+
+static inline uint64_t read_cr4( void )
+{
+    uint64_t cr4;
+    asm volatile( "movq %%cr4, %0" : "=r"( cr4 ) );
+    return cr4;
+}
+
+static inline void write_cr4( uint64_t cr4 )
+{
+    asm volatile( "movq %0, %%cr4" : : "r"( cr4 ) : "memory" );
+}
+
+static inline void invpcid( uint64_t type, uint16_t pcid, void *addr )
+{
+    struct
+    {
+        uint64_t pcid;
+        uint64_t addr;
+    } __packed desc = { pcid, (uint64_t)addr };
+
+    asm volatile( "invpcid %0, %1" : : "m"( desc ), "r"( type ) : "memory" );
+}
+
+// Detect and enable global pages and PCIDs. CR4.PCIDE can only be set while CR3[11:0] is zero,
+// which is always the case for the boot page tables.
+void __init tlb_features_init( void )
+{
+    uint32_t regs[4];
+    uint64_t cr4 = read_cr4();
 
-    // Make sure a page frame is available
-    if ( addr_range_curr == NULL || addr_range_curr->curr_frame == NULL )
+    cpuid( 0x1, 0, regs );
+
+    if ( regs[3] & CPUID_1_EDX_PGE )
     {
-        OS_ERROR_HALT( "addr_range_curr is NULL!\n" );
+        cr4 |= CR4_PGE_BIT;
+        pge_enabled = true;
     }
 
-    // Get the current page frame address
-    phys_page = addr_range_curr->curr_frame;
+    if ( regs[2] & CPUID_1_ECX_PCID )
+    {
+        cr4 |= CR4_PCIDE_BIT;
+        pcid_enabled = true;
+    }
 
-    // Adjust the current page frame address
-    addr_range_curr->curr_frame += PAGE_SIZE;
+    cpuid( 0x0, 0, regs );
+    if ( regs[0] >= 0x7 )
+    {
+        cpuid( 0x7, 0, regs );
+        invpcid_supported = ( regs[1] & CPUID_7_EBX_INVPCID ) != 0;
+    }
+
+    write_cr4( cr4 );
+
+    OS_INFO(
+        "TLB features: PGE %s, PCID %s, INVPCID %s\n", pge_enabled ? "on" : "off",
+        pcid_enabled ? "on" : "off", invpcid_supported ? "on" : "off"
+    );
+}
+
+// Load a PML4 into CR3. With PCIDs enabled, `preserve` keeps the TLB entries already tagged with
+// `pcid` instead of dropping them.
+void load_cr3( void *pml4_phys, uint16_t pcid, bool preserve )
+{
+    uint64_t cr3 = (uint64_t)pml4_phys;
+
+    if ( pcid_enabled )
+    {
+        cr3 |= ( pcid & CR3_PCID_MASK );
+
+        if ( preserve )
+        {
+            cr3 |= CR3_NO_FLUSH;
+        }
+    }
+
+    asm volatile( "movq %0, %%cr3" : : "r"( cr3 ) : "memory" );
+}
+
+// Invalidate a single page in the current address space
+void flush_tlb_page( void *addr ) { asm volatile( "invlpg (%0)" : : "r"( addr ) : "memory" ); }
+
+// Invalidate all non-global entries of the current address space
+void flush_tlb_local( void )
+{
+    uint64_t cr3;
+
+    asm volatile( "movq %%cr3, %0" : "=r"( cr3 ) );
+
+    // Reloading CR3 without the no-flush bit drops the non-global entries of the current PCID
+    asm volatile( "movq %0, %%cr3" : : "r"( cr3 & ~CR3_NO_FLUSH ) : "memory" );
+}
+
+// Invalidate every TLB entry, including global entries and entries tagged with other PCIDs
+void flush_tlb_all( void )
+{
+    if ( invpcid_supported )
+    {
+        invpcid( INVPCID_ALL_GLOBAL, 0, NULL );
+        return;
+    }
 
-    // Check if we need to go to the next range
-    if ( (uint64_t)addr_range_curr->curr_frame >= (uint64_t)addr_range_curr->end )
+    // Any change to CR4.PGE invalidates the entire TLB
+    uint64_t cr4 = read_cr4();
+    write_cr4( cr4 ^ CR4_PGE_BIT );
+    write_cr4( cr4 );
+}
+
+// Allocates a new page frame from the ranges of a NUMA node, or returns NULL once every range of
+// the node has been used up
+void *alloc_new_pf( uint32_t node )
+{
+    pf_range_entry_t *range;
+    void *phys_page = NULL;
+
+    for ( range = numa_nodes[node].range; range != NULL; range = range->next_entry )
     {
-        if ( addr_range_curr->next_entry == NULL )
+        if ( range->node == node && (uint64_t)range->curr_frame < (uint64_t)range->end )
         {
-            OS_ERROR_HALT( "All memory has been allocated!\n" );
+            break;
         }
+    }
 
-        addr_range_curr = addr_range_curr->next_entry;
+    // Used up ranges are skipped from now on
+    numa_nodes[node].range = range;
+
+    if ( range == NULL )
+    {
+        return NULL;
     }
 
+    // Get the current page frame address
+    phys_page = range->curr_frame;
+
+    // Adjust the current page frame address
+    range->curr_frame += PAGE_SIZE;
+    numa_nodes[node].num_free--;
+
     OS_INFO( "Allocated NEW physical page %p\n", phys_page );
 
     return phys_page;
@@ -216,6 +665,11 @@ void alloc_table_entry( pg_dir_entry_t *parent_entry )
     // Allocate a new entry
     pg_dir_entry_t *new_pd = (pg_dir_entry_t *)MMU_pf_alloc();
 
+    if ( new_pd == NULL )
+    {
+        OS_ERROR_HALT( "Out of memory for page tables!\n" );
+    }
+
     // Clear the new entry
     memset( new_pd, 0, PAGE_SIZE );
 
@@ -224,75 +678,233 @@ void alloc_table_entry( pg_dir_entry_t *parent_entry )
     parent_entry->present = 1;
 }
 
-// Get the Page Table Entry for a virtual address
-pg_dir_entry_t *get_pt_entry( void *virt_addr )
+// Get the PD entry of a virtual address without changing the page tables, or NULL if its page
+// directory doesn't exist
+pg_dir_entry_t *find_pd_entry( pg_dir_entry_t *pml4_table, void *virt_addr )
+{
+    pg_dir_entry_t *entry = pml4_table + GET_TBL_INDEX( virt_addr, PT_LEVEL_PML4 );
+
+    if ( !entry->present )
+    {
+        return NULL;
+    }
+
+    entry = (pg_dir_entry_t *)READ_FRAME_ADDR( entry ) + GET_TBL_INDEX( virt_addr, PT_LEVEL_PDPT );
+
+    if ( !entry->present )
+    {
+        return NULL;
+    }
+
+    return (pg_dir_entry_t *)READ_FRAME_ADDR( entry ) + GET_TBL_INDEX( virt_addr, PT_LEVEL_PD );
+}
+
+// Split a huge page back into a page table mapping the same frames, so its pages can be changed
+// one at a time. The frames already count one mapping each. The new page table goes in `pt`.
+void huge_page_demote( pg_dir_entry_t *pd_entry, pg_dir_entry_t *pt )
+{
+    pg_dir_entry_t new_entry = *pd_entry;
+    uint8_t *frame = READ_FRAME_ADDR( pd_entry );
+    uint64_t i;
+
+    // Every page keeps the flags of the huge page
+    new_entry.huge = 0;
+
+    for ( i = 0; i < PAGES_PER_HUGE; ++i )
+    {
+        WRITE_FRAME_ADDR( &new_entry, frame + i * PAGE_SIZE );
+        pt[i] = new_entry;
+    }
+
+    // Every entry of the new page table is used
+    new_entry = (pg_dir_entry_t){ 0 };
+    WRITE_FRAME_ADDR( &new_entry, pt );
+    new_entry.present = 1;
+    new_entry.writable = 1;
+    new_entry.num_used = PAGES_PER_HUGE;
+
+    *pd_entry = new_entry;
+
+    // Huge pages are only made of kernel pages, which every PCID can have cached
+    flush_tlb_all();
+}
+
+// Walk the page tables for a virtual address, recording the entry used at every level in `path`.
+// Missing tables are allocated if `alloc` is set, otherwise NULL is returned. Lookups stop at a
+// huge page and return its PD entry, so callers have to check the `huge` bit of the entry.
+pg_dir_entry_t *pt_walk( void *virt_addr, bool alloc, pg_dir_entry_t *path[PT_LEVELS] )
 {
     // DEBUG: Verify alignment
     CHECK_PAGE_ALIGNED( virt_addr );
 
-    // Get the PML4 entry (Level 4)
-    pg_dir_entry_t *dir_table = pml4;
-    uint64_t offset = GET_PAGE_MAP_INDEX( virt_addr );
-    pg_dir_entry_t *entry = dir_table + offset;
+    // Start at the PML4 (Level 4) of the current address space
+    pg_dir_entry_t *dir_table = curr_as->pml4;
+    uint8_t level;
 
-    // Check if the PML4 entry is present
-    if ( !entry->present )
+    for ( level = PT_LEVEL_PML4; level < PT_LEVEL_PT; ++level )
     {
-        // Allocate a new PDPT entry
-        alloc_table_entry( entry );
+        path[level] = dir_table + GET_TBL_INDEX( virt_addr, level );
 
-        // Set the writable flag
-        entry->writable = 1;
+        // Check if the next table is present
+        if ( !path[level]->present )
+        {
+            if ( !alloc )
+            {
+                return NULL;
+            }
+
+            // Allocate the next table
+            alloc_table_entry( path[level] );
+
+            // Set the writable flag
+            path[level]->writable = 1;
+
+            // The parent table gained a used entry
+            if ( level > PT_LEVEL_PML4 )
+            {
+                path[level - 1]->num_used++;
+            }
+        }
+
+        if ( path[level]->huge )
+        {
+            // New mappings never go inside a huge page, the whole block is already mapped
+            if ( alloc )
+            {
+                OS_ERROR_HALT( "Page at %p is part of a huge page!\n", virt_addr );
+            }
+
+            return path[level];
+        }
+
+        dir_table = (pg_dir_entry_t *)READ_FRAME_ADDR( path[level] );
     }
 
-    // Get the PDPT entry (Level 3)
-    dir_table = (pg_dir_entry_t *)READ_FRAME_ADDR( entry );
-    offset = GET_PAGE_DIR_PTR_INDEX( virt_addr );
-    entry = (pg_dir_entry_t *)( (uint8_t *)dir_table ) + offset;
+    // Get the PT entry (Level 1)
+    path[PT_LEVEL_PT] = dir_table + GET_TBL_INDEX( virt_addr, PT_LEVEL_PT );
 
-    // Check if the PDPT entry is present
-    if ( !entry->present )
+    return path[PT_LEVEL_PT];
+}
+
+// Get the Page Table Entry for a virtual address, or NULL if its page table doesn't exist. Pages
+// of a huge page get the huge PD entry.
+pg_dir_entry_t *find_pt_entry( void *virt_addr )
+{
+    pg_dir_entry_t *path[PT_LEVELS];
+
+    return pt_walk( virt_addr, false, path );
+}
+
+// Write a PT entry and keep the occupancy count of its page table up to date
+void write_pt_entry( pg_dir_entry_t *path[PT_LEVELS], pg_dir_entry_t new_entry )
+{
+    pg_dir_entry_t *pt_entry = path[PT_LEVEL_PT];
+    bool was_used = IS_ENTRY_USED( pt_entry );
+
+    *pt_entry = new_entry;
+
+    if ( !was_used && IS_ENTRY_USED( pt_entry ) )
+    {
+        path[PT_LEVEL_PD]->num_used++;
+    }
+    else if ( was_used && !IS_ENTRY_USED( pt_entry ) )
     {
-        // Allocate a new PD entry
-        alloc_table_entry( entry );
+        path[PT_LEVEL_PD]->num_used--;
+    }
+}
 
-        // Set the writable flag
-        entry->writable = 1;
+// Free every table along `path` that no longer has any used entries, walking up from the table
+// that `path[level]` points at
+void reclaim_tables( pg_dir_entry_t *path[PT_LEVELS], int level, void *virt_addr )
+{
+    void *empty_tables[PT_LEVELS];
+    uint8_t num_empty = 0;
+
+    // Unlink every empty table on the way up
+    for ( ; level >= (int)PT_LEVEL_PML4; --level )
+    {
+        if ( !path[level]->present || path[level]->num_used != 0 )
+        {
+            break;
+        }
+
+        // The kernel half of the PML4 is shared by every address space and must stay linked
+        if ( level == (int)PT_LEVEL_PML4 && IS_KERNEL_ADDR( virt_addr ) )
+        {
+            break;
+        }
+
+        empty_tables[num_empty++] = READ_FRAME_ADDR( path[level] );
+        memset( path[level], 0, sizeof( pg_dir_entry_t ) );
+
+        // The parent table lost a used entry
+        if ( level > (int)PT_LEVEL_PML4 )
+        {
+            path[level - 1]->num_used--;
+        }
     }
 
-    // Get the PD entry (Level 2)
-    dir_table = (pg_dir_entry_t *)READ_FRAME_ADDR( entry );
-    offset = GET_PAGE_DIR_INDEX( virt_addr );
-    entry = (pg_dir_entry_t *)( (uint8_t *)dir_table ) + offset;
+    if ( num_empty == 0 )
+    {
+        return;
+    }
 
-    // Check if the PD entry is present
-    if ( !entry->present )
+    // `invlpg` drops every paging-structure cache entry of the current PCID, but kernel tables are
+    // shared by all PCIDs and have to be dropped everywhere
+    if ( IS_KERNEL_ADDR( virt_addr ) && pcid_enabled )
+    {
+        flush_tlb_all();
+    }
+    else
     {
-        // Allocate a new PT entry
-        alloc_table_entry( entry );
+        flush_tlb_page( virt_addr );
+    }
 
-        // Set the writable flag
-        entry->writable = 1;
+    // Only now is it safe to reuse the tables
+    while ( num_empty > 0 )
+    {
+        MMU_pf_free( empty_tables[--num_empty] );
     }
+}
 
-    dir_table = (pg_dir_entry_t *)READ_FRAME_ADDR( entry );
-    offset = GET_PAGE_TBL_INDEX( virt_addr );
-    entry = (pg_dir_entry_t *)( (uint8_t *)dir_table ) + offset;
+// Clear bits in the PT entry of a mapped page, or in the PD entry of the huge page it is part of.
+// Returns whether any of the bits were set.
+bool test_and_clear_pte_bits( void *virt_addr, uint64_t mask )
+{
+    pg_dir_entry_t *pt_entry = find_pt_entry( virt_addr );
 
-    // Get the PT entry (Level 1)
-    return entry;
+    if ( pt_entry == NULL || !pt_entry->present )
+    {
+        return false;
+    }
+
+    // The CPU sets the accessed and dirty bits behind our back, so clear them atomically
+    uint64_t old_entry = __atomic_fetch_and( (uint64_t *)pt_entry, ~mask, __ATOMIC_SEQ_CST );
+
+    if ( ( old_entry & mask ) == 0 )
+    {
+        return false;
+    }
+
+    // The cached translation still has the bits set and would never set them in the entry again
+    flush_tlb_page( virt_addr );
+
+    return true;
 }
 
 // Map a virtual page to a physical page
 void map_page( void *phys_addr, void *virt_addr )
 {
+    pg_dir_entry_t *path[PT_LEVELS];
+    pg_dir_entry_t new_entry = { 0 };
+
     // DEBUG: Verify alignment of the physical address
     CHECK_PAGE_ALIGNED( phys_addr );
 
     // OS_INFO( "Mapping page at %p to %p\n", virt_addr, phys_addr );
 
     // Get the PT entry
-    pg_dir_entry_t *pt_entry = get_pt_entry( virt_addr );
+    pg_dir_entry_t *pt_entry = pt_walk( virt_addr, true, path );
 
     // Check if the PT entry is present
     if ( pt_entry->present )
@@ -300,14 +912,17 @@ void map_page( void *phys_addr, void *virt_addr )
         OS_ERROR_HALT( "Page at %p is already present!\n", virt_addr );
     }
 
-    // Clear the PT entry
-    memset( pt_entry, 0, sizeof( pg_dir_entry_t ) );
-
     // Setup the PT entry
-    WRITE_FRAME_ADDR( pt_entry, phys_addr );
-    pt_entry->present = 1;
-    pt_entry->writable = 1;
-    pt_entry->alloc = 0;
+    WRITE_FRAME_ADDR( &new_entry, phys_addr );
+    new_entry.present = 1;
+    new_entry.writable = 1;
+    new_entry.alloc = 0;
+
+    // Kernel mappings are identical in every address space, so keep them in the TLB across CR3
+    // loads
+    new_entry.global = IS_KERNEL_ADDR( virt_addr ) && pge_enabled;
+
+    write_pt_entry( path, new_entry );
 
     // OS_INFO( "Mapped page at %p to %p\n", virt_addr, phys_addr );
 }
@@ -316,15 +931,21 @@ void map_page( void *phys_addr, void *virt_addr )
 void *virt_to_phys( void *virt_addr )
 {
     // Get the PT entry
-    pg_dir_entry_t *pt_entry = get_pt_entry( virt_addr );
+    pg_dir_entry_t *pt_entry = find_pt_entry( virt_addr );
 
     // Check if the PT entry is present
-    if ( !pt_entry->present )
+    if ( pt_entry == NULL || !pt_entry->present )
     {
         OS_ERROR( "Page at %p is not present!\n", virt_addr );
         return NULL;
     }
 
+    // Huge pages map 2 MiB with a single entry
+    if ( pt_entry->huge )
+    {
+        return READ_FRAME_ADDR( pt_entry ) + ( (uint64_t)virt_addr & ( HUGE_PAGE_SIZE - 1 ) );
+    }
+
     // Get the physical address
     void *phys_addr = (void *)( READ_FRAME_ADDR( pt_entry ) + GET_PHYS_PAGE_INDEX( virt_addr ) );
 
@@ -333,191 +954,2890 @@ void *virt_to_phys( void *virt_addr )
     return phys_addr;
 }
 
-void decode_error_flags( uint16_t err )
+#pragma region Virtual Address Allocator
+
+// Get a virtual range node, carving a fresh page frame into nodes when the pool is empty
+va_range_t *va_node_alloc( void )
 {
-    /*
-     * Error Flags:
-     *   Bit 0 (P) is the Present flag.
-     *   Bit 1 (R/W) is the Read/Write flag.
-     *   Bit 2 (U/S) is the User/Supervisor flag.
-     *   Bit 3 (RSVD) indicates whether a reserved bit was set in some page-structure entry
-     *   Bit 4 (I/D) is the Instruction/Data flag (1=instruction fetch, 0=data access)
-     *   Bit 5 (PK) indicates a protection-key violation
-     *   Bit 6 (SS) indicates a shadow-stack access fault
-     *   Bit 15 (SGX) indicates an SGX violaton
-     */
+    uint64_t i;
 
-    printk(
-        "Error Flags:\n"
-        "------------\n"
-        "Present: %d \n"
-        "R/W:     %d \n"
-        "User:    %d \n"
-        "------------\n"
-        "RSVD:    %d \n"
-        "I/D:     %d \n"
-        "PK:      %d \n"
-        "SS:      %d \n"
-        "SGX:     %d \n"
-        "\n",
-        ( err & 0x1 ), ( err >> 1 ) & 0x1, ( err >> 2 ) & 0x1, ( err >> 3 ) & 0x1,
-        ( err >> 4 ) & 0x1, ( err >> 5 ) & 0x1, ( err >> 6 ) & 0x1, ( err >> 15 ) & 0x1
-    );
+    if ( va_node_pool == NULL )
+    {
+        va_range_t *nodes = (va_range_t *)MMU_pf_alloc();
 
-    /*
-     *  User/Supervisor   ( Bit 2 )
-     *  |  Read/Write     ( Bit 1 )
-     *  |  |  Present Bit ( Bit 0 )
-     *  |  |  |
-     *  0  0  0 - Supervisory process tried to read a non-present page entry
-     *  0  0  1 - Supervisory process tried to read a page and caused a protection fault
-     *  0  1  0 - Supervisory process tried to write to a non-present page entry
-     *  0  1  1 - Supervisory process tried to write a page and caused a protection fault
-     *  1  0  0 - User process tried to read a non-present page entry
-     *  1  0  1 - User process tried to read a page and caused a protection fault
-     *  1  1  0 - User process tried to write to a non-present page entry
-     *  1  1  1 - User process tried to write a page and caused a protection fault
-     */
+        if ( nodes == NULL )
+        {
+            OS_ERROR_HALT( "Out of memory for virtual range nodes!\n" );
+        }
 
-    // Check the User/Supervisor bit
-    if ( err & 0b100 )
+        for ( i = 0; i < VA_NODES_PER_PAGE; ++i )
+        {
+            nodes[i].next = va_node_pool;
+            va_node_pool = &nodes[i];
+        }
+    }
+
+    va_range_t *node = va_node_pool;
+    va_node_pool = node->next;
+
+    memset( node, 0, sizeof( va_range_t ) );
+
+    return node;
+}
+
+// Return a virtual range node to the pool
+void va_node_free( va_range_t *node )
+{
+    node->next = va_node_pool;
+    va_node_pool = node;
+}
+
+// Get the region that owns a virtual address
+virt_addr_t va_region_of( uint64_t addr )
+{
+    virt_addr_t region;
+
+    for ( region = MMU_VADDR_PHYS; region < MMU_VADDR_MAX; ++region )
     {
-        printk( "User process " );
+        if ( va_regions[region].start <= addr && addr < va_regions[region].end )
+        {
+            return region;
+        }
     }
-    else
+
+    return MMU_VADDR_MAX;
+}
+
+// Get the free range list of a region, user regions belong to the current address space
+va_region_t *va_region_get( virt_addr_t region_id )
+{
+    if ( IS_USER_REGION( region_id ) )
     {
-        printk( "Supervisory process " );
+        return &curr_as->user_regions[region_id - MMU_VADDR_USTACK];
     }
 
-    printk( "tried to " );
+    return &va_regions[region_id];
+}
 
-    // Check the Read/Write bit
-    if ( err & 0b010 )
+// Make the whole region available
+void va_region_init( va_region_t *region )
+{
+    region->free_list = va_node_alloc();
+    region->free_list->start = region->start;
+    region->free_list->num_pages = ( region->end - region->start ) / PAGE_SIZE;
+    region->free_list->next = NULL;
+}
+
+// Take `num_pages` pages out of the region, returning the address of the first page or 0
+uint64_t va_alloc( virt_addr_t region_id, uint64_t num_pages )
+{
+    va_region_t *region = va_region_get( region_id );
+    va_range_t *prev = NULL, *curr, *best = NULL, *best_prev = NULL;
+    uint64_t addr;
+
+    if ( num_pages == 0 )
     {
-        printk( "write " );
+        return 0;
     }
-    else
+
+    // First fit from the bottom, or last fit from the top for downward growing regions
+    for ( curr = region->free_list; curr != NULL; prev = curr, curr = curr->next )
     {
-        printk( "read " );
+        if ( curr->num_pages < num_pages )
+        {
+            continue;
+        }
+
+        best = curr;
+        best_prev = prev;
+
+        if ( !region->top_down )
+        {
+            break;
+        }
     }
 
-    // Check the Present bit
-    if ( err & 0b001 )
+    if ( best == NULL )
     {
-        printk( "a page and caused a protection fault\n" );
+        return 0;
+    }
+
+    if ( region->top_down )
+    {
+        addr = best->start + ( best->num_pages - num_pages ) * PAGE_SIZE;
     }
     else
     {
-        printk( "to a non-present page entry\n" );
+        addr = best->start;
+        best->start += num_pages * PAGE_SIZE;
+    }
+
+    best->num_pages -= num_pages;
+
+    // Drop ranges that have been used up
+    if ( best->num_pages == 0 )
+    {
+        if ( best_prev == NULL )
+        {
+            region->free_list = best->next;
+        }
+        else
+        {
+            best_prev->next = best->next;
+        }
+
+        va_node_free( best );
+    }
+
+    return addr;
+}
+
+// Take a specific range out of the region. Returns false if any part of it is already in use.
+bool va_claim( virt_addr_t region_id, uint64_t addr, uint64_t num_pages )
+{
+    va_region_t *region = va_region_get( region_id );
+    va_range_t *prev = NULL, *curr;
+    uint64_t end = addr + num_pages * PAGE_SIZE;
+
+    for ( curr = region->free_list; curr != NULL; prev = curr, curr = curr->next )
+    {
+        uint64_t curr_end = curr->start + curr->num_pages * PAGE_SIZE;
+
+        if ( addr < curr->start || curr_end < end )
+        {
+            continue;
+        }
+
+        // Claiming the front of the range
+        if ( addr == curr->start )
+        {
+            curr->start = end;
+            curr->num_pages -= num_pages;
+
+            if ( curr->num_pages == 0 )
+            {
+                if ( prev == NULL )
+                {
+                    region->free_list = curr->next;
+                }
+                else
+                {
+                    prev->next = curr->next;
+                }
+
+                va_node_free( curr );
+            }
+        }
+        // Claiming the back of the range
+        else if ( end == curr_end )
+        {
+            curr->num_pages -= num_pages;
+        }
+        // Claiming the middle splits the range in two
+        else
+        {
+            va_range_t *tail = va_node_alloc();
+
+            tail->start = end;
+            tail->num_pages = ( curr_end - end ) / PAGE_SIZE;
+            tail->next = curr->next;
+
+            curr->num_pages = ( addr - curr->start ) / PAGE_SIZE;
+            curr->next = tail;
+        }
+
+        return true;
     }
+
+    return false;
 }
 
-void flush_pg_tbl( void *addr )
+// Give a range back to its region, merging it with its neighbours
+void va_free( uint64_t addr, uint64_t num_pages )
 {
-    if ( addr == NULL )
+    virt_addr_t region_id = va_region_of( addr );
+    va_region_t *region;
+    va_range_t *prev = NULL, *next, *node;
+    uint64_t end = addr + num_pages * PAGE_SIZE;
+
+    if ( region_id == MMU_VADDR_MAX || num_pages == 0 )
+    {
+        OS_ERROR( "Cannot free %lu virtual pages at %p!\n", num_pages, (void *)addr );
+        return;
+    }
+
+    region = va_region_get( region_id );
+
+    // Find the free ranges on either side of the freed range
+    for ( next = region->free_list; next != NULL && next->start < addr; next = next->next )
+    {
+        prev = next;
+    }
+
+    // DEBUG: Catch double frees
+    if ( ( prev != NULL && prev->start + prev->num_pages * PAGE_SIZE > addr ) ||
+         ( next != NULL && next->start < end ) )
+    {
+        OS_ERROR( "Virtual range at %p is already free!\n", (void *)addr );
+        return;
+    }
+
+    // Merge with the previous range
+    if ( prev != NULL && prev->start + prev->num_pages * PAGE_SIZE == addr )
+    {
+        prev->num_pages += num_pages;
+
+        // The freed range may have closed the gap to the next range as well
+        if ( next != NULL && next->start == end )
+        {
+            prev->num_pages += next->num_pages;
+            prev->next = next->next;
+            va_node_free( next );
+        }
+
+        return;
+    }
+
+    // Merge with the next range
+    if ( next != NULL && next->start == end )
     {
-        OS_INFO( "Reloading CR3 Register...\n" );
-        asm volatile( "movq %0, %%cr3" : : "r"( pml4 ) );
+        next->start = addr;
+        next->num_pages += num_pages;
+        return;
+    }
+
+    // Otherwise insert a new range
+    node = va_node_alloc();
+    node->start = addr;
+    node->num_pages = num_pages;
+    node->next = next;
+
+    if ( prev == NULL )
+    {
+        region->free_list = node;
     }
     else
     {
-        OS_INFO( "Flushing Page Table Entry...\n" );
-        asm volatile( "invlpg (%0)" : : "r"( addr ) );
+        prev->next = node;
     }
 }
 
-void walk_virt_addr( void *virt_addr )
+// Mark pages as allocate-on-demand
+void reserve_pages( uint64_t addr, uint64_t num_pages )
 {
-    printk( "\n" );
-    OS_INFO( "Walking virtual address: %p\n", virt_addr );
+    uint64_t i;
 
-    // Get the PML4 entry (Level 4)
-    pg_dir_entry_t *dir_table = pml4;
-    uint64_t offset = GET_PAGE_MAP_INDEX( virt_addr );
-    pg_dir_entry_t *entry = dir_table + offset;
+    pg_dir_entry_t *path[PT_LEVELS];
+    pg_dir_entry_t new_entry = { 0 };
 
-    printk(
-        "PML4 Entry:      \n"
-        "    Address: %p  \n"
-        "    Present: %d  \n"
-        "    Writable: %d \n"
-        "    User: %d     \n"
-        "    Accessed: %d \n"
-        "    Dirty: %d    \n"
-        "    Alloc: %d    \n"
-        "    Frame: %p    \n"
-        "    \n",
-        entry, entry->present, entry->writable, entry->user, entry->accessed, entry->dirty,
-        entry->alloc, READ_FRAME_ADDR( entry )
-    );
+    // Set the allocate on demand bit
+    new_entry.alloc = 1;
+    new_entry.present = 0;
 
-    // Check if the next entry is present
-    if ( !entry->present )
+    for ( i = 0; i < num_pages; ++i )
     {
-        printk( "PDPT entry in PML4 is not present!\n" );
-        return;
+        pt_walk( (void *)( addr + i * PAGE_SIZE ), true, path );
+        write_pt_entry( path, new_entry );
     }
+}
 
-    // Get the PDPT entry (Level 3)
-    dir_table = (pg_dir_entry_t *)READ_FRAME_ADDR( entry );
-    offset = GET_PAGE_DIR_PTR_INDEX( virt_addr );
-    entry = (pg_dir_entry_t *)( (uint8_t *)dir_table ) + offset;
+// Move a program break by `increment` bytes, growing or shrinking the pages behind it
+void *move_brk( uint64_t *brk, int64_t increment, virt_addr_t region )
+{
+    uint64_t old_brk = *brk, new_brk = *brk + increment;
+    uint64_t old_top = (uint64_t)PAGE_ALIGN_ADDR( old_brk );
+    uint64_t new_top = (uint64_t)PAGE_ALIGN_ADDR( new_brk );
 
-    printk(
-        "PDPT Entry:      \n"
-        "    Address: %p  \n"
-        "    Present: %d  \n"
-        "    Writable: %d \n"
-        "    User: %d     \n"
-        "    Accessed: %d \n"
-        "    Dirty: %d    \n"
-        "    Alloc: %d    \n"
-        "    Frame: %p    \n"
-        "    \n",
-        entry, entry->present, entry->writable, entry->user, entry->accessed, entry->dirty,
-        entry->alloc, READ_FRAME_ADDR( entry )
-    );
+    // Check if the increment is valid
+    if ( increment == 0 )
+    {
+        return (void *)old_brk;
+    }
 
-    // Check if the next entry is present
-    if ( !entry->present )
+    // The break can't leave its region
+    if ( new_brk < va_regions[region].start || va_regions[region].end < new_brk )
     {
-        printk( "PD entry is not present!\n" );
-        return;
+        return (void *)( -1 );
     }
 
-    // Get the PD entry (Level 2)
-    dir_table = (pg_dir_entry_t *)READ_FRAME_ADDR( entry );
-    offset = GET_PAGE_DIR_INDEX( virt_addr );
-    entry = (pg_dir_entry_t *)( (uint8_t *)dir_table ) + offset;
+    if ( new_top > old_top )
+    {
+        // Claim the pages right above the break
+        if ( !va_claim( region, old_top, ( new_top - old_top ) / PAGE_SIZE ) )
+        {
+            OS_ERROR( "Program break at %p ran into a mapped range!\n", (void *)old_top );
+            return (void *)( -1 );
+        }
 
-    printk(
-        "PD Entry:        \n"
-        "    Address: %p  \n"
-        "    Present: %d  \n"
-        "    Writable: %d \n"
-        "    User: %d     \n"
-        "    Accessed: %d \n"
-        "    Dirty: %d    \n"
-        "    Alloc: %d    \n"
-        "    Frame: %p    \n"
-        "    \n",
-        entry, entry->present, entry->writable, entry->user, entry->accessed, entry->dirty,
-        entry->alloc, READ_FRAME_ADDR( entry )
-    );
+        reserve_pages( old_top, ( new_top - old_top ) / PAGE_SIZE );
+    }
+    else if ( new_top < old_top )
+    {
+        // Give the pages above the new break back to the region
+        MMU_free_pages( (void *)new_top, ( old_top - new_top ) / PAGE_SIZE );
+    }
 
-    // Check if the next entry is present
-    if ( !entry->present )
+    *brk = new_brk;
+
+    return (void *)old_brk;
+}
+
+#pragma endregion
+
+#pragma region Boot Data
+
+// Keep the boot data at `start` identity mapped once the kernel page tables are loaded. Memblock
+// hands it out below `BOOT_MAP_SIZE`, but the kernel page tables only map `MAP_INIT_SIZE` bytes.
+void __init boot_range_add( void *start, uint64_t size )
+{
+    if ( num_boot_ranges == BOOT_RANGES_MAX )
     {
-        printk( "PT entry is not present!\n" );
+        OS_ERROR_HALT( "Too many boot data ranges!\n" );
+    }
+
+    boot_ranges[num_boot_ranges][0] = (uint64_t)start & ~( (uint64_t)PAGE_SIZE - 1 );
+    boot_ranges[num_boot_ranges][1] = (uint64_t)PAGE_ALIGN_ADDR( (uint64_t)start + size );
+    num_boot_ranges++;
+}
+
+// Identity map the boot data pages past the first `MAP_INIT_SIZE` bytes
+void __init boot_ranges_map( void )
+{
+    uint64_t addr;
+    uint32_t i;
+
+    for ( i = 0; i < num_boot_ranges; ++i )
+    {
+        for ( addr = boot_ranges[i][0]; addr < boot_ranges[i][1]; addr += PAGE_SIZE )
+        {
+            if ( addr > MAP_INIT_SIZE )
+            {
+                map_page( (void *)addr, (void *)addr );
+            }
+        }
+    }
+}
+
+// Take the boot data pages mapped by `boot_ranges_map()` out of the physical mapping region
+void __init boot_ranges_claim( void )
+{
+    uint64_t start;
+    uint32_t i;
+
+    for ( i = 0; i < num_boot_ranges; ++i )
+    {
+        start = boot_ranges[i][0];
+        start = ( start > MAP_INIT_SIZE ? start : MAP_INIT_SIZE + PAGE_SIZE );
+
+        if ( start < boot_ranges[i][1] &&
+             !va_claim( MMU_VADDR_PHYS, start, ( boot_ranges[i][1] - start ) / PAGE_SIZE ) )
+        {
+            OS_WARN( "Boot data at %p is already in use!\n", (void *)start );
+        }
+    }
+}
+
+#pragma endregion
+
+#pragma region Page Frame Info
+
+// Allocate the page frame info array from memblock, covering every frame up to the end of memory
+void __init pf_info_init( void )
+{
+    uint64_t size;
+
+    num_pf_info = MEMBLOCK_phys_end() / PAGE_SIZE;
+    size = (uint64_t)PAGE_ALIGN_ADDR( num_pf_info * sizeof( pf_info_t ) );
+    pf_info = (pf_info_t *)MEMBLOCK_alloc( size, PAGE_SIZE, BOOT_MAP_SIZE );
+
+    if ( pf_info == NULL )
+    {
+        OS_ERROR_HALT( "No room for %lu bytes of page frame info!\n", size );
+    }
+
+    memset( pf_info, 0, size );
+    boot_range_add( pf_info, size );
+}
+
+// Get the info of the frame containing a physical address
+pf_info_t *pf_info_of( void *phys_addr )
+{
+    uint64_t pfn = (uint64_t)phys_addr / PAGE_SIZE;
+
+    if ( pf_info == NULL || pfn >= num_pf_info )
+    {
+        OS_ERROR_HALT( "Page frame %p has no page frame info!\n", phys_addr );
+    }
+
+    return &pf_info[pfn];
+}
+
+// Add a mapping to a page frame
+void pf_get( void *pf ) { pf_info_of( pf )->refcnt++; }
+
+// Drop a mapping of a page frame, freeing the frame with the last mapping
+void pf_put( void *pf )
+{
+    pf_info_t *info = pf_info_of( pf );
+
+    if ( info->refcnt > 1 )
+    {
+        info->refcnt--;
         return;
     }
 
-    dir_table = (pg_dir_entry_t *)READ_FRAME_ADDR( entry );
-    offset = GET_PAGE_TBL_INDEX( virt_addr );
-    entry = (pg_dir_entry_t *)( (uint8_t *)dir_table ) + offset;
+    MMU_pf_free( pf );
+}
 
-    printk(
-        "PT Entry:        \n"
+// Check if the latest working set scan found a page accessed. The scan clears the accessed bit, so
+// this is the only trace of the access until the page is used again.
+bool wss_page_young( pg_dir_entry_t *pt_entry )
+{
+    pf_info_t *info = pf_info_of( READ_FRAME_ADDR( pt_entry ) );
+
+    return wss_gen != 0 && info->wss_gen == wss_gen && info->age == 0;
+}
+
+// Move a present page of `as` to `new_pf`. The contents are copied and the PT entry pointed at the
+// new frame, the old frame is left unused for the caller to take.
+void migrate_page( addr_space_t *as, pg_dir_entry_t *pt_entry, void *virt_addr, void *new_pf )
+{
+    void *old_pf = READ_FRAME_ADDR( pt_entry );
+    unsigned long flags;
+
+    // Nothing may write to the page between the copy and the switch to the new frame
+    flags = save_irqdisable();
+
+    memcpy( new_pf, old_pf, PAGE_SIZE );
+    pf_info_of( new_pf )->refcnt = 1;
+    pf_info_of( new_pf )->flags |= PF_FLAG_MOVABLE;
+    WRITE_FRAME_ADDR( pt_entry, new_pf );
+
+    // Kernel pages are global, so they're cached whatever address space is loaded
+    if ( as == curr_as || IS_KERNEL_ADDR( virt_addr ) )
+    {
+        flush_tlb_page( virt_addr );
+    }
+    else
+    {
+        as->needs_flush = true;
+    }
+
+    irqrestore( flags );
+
+    pf_info_of( old_pf )->refcnt = 0;
+    pf_info_of( old_pf )->flags &= ~PF_FLAG_MOVABLE;
+}
+
+#pragma endregion
+
+#pragma region Swap
+
+// Take a free swap slot, or `SWAP_NO_SLOT` if the swap area is full
+uint64_t swap_slot_alloc( void )
+{
+    uint64_t i, slot;
+
+    // Start looking after the last slot handed out
+    for ( i = 0; i < num_swap_slots - 1; ++i )
+    {
+        slot = 1 + ( swap_next_slot - 1 + i ) % ( num_swap_slots - 1 );
+
+        if ( swap_map[slot] == 0 )
+        {
+            swap_map[slot] = 1;
+            swap_next_slot = slot + 1;
+            return slot;
+        }
+    }
+
+    return SWAP_NO_SLOT;
+}
+
+// Add a PT entry to a swap slot
+void swap_slot_get( uint64_t slot )
+{
+    if ( IS_ZRAM_SLOT( slot ) )
+    {
+        ZRAM_get( slot & ~SWAP_ZRAM_BIT );
+        return;
+    }
+
+    if ( swap_map[slot] == SWAP_SLOT_MAX )
+    {
+        OS_ERROR_HALT( "Swap slot %lu is shared too many times!\n", slot );
+    }
+
+    swap_map[slot]++;
+}
+
+// Drop a PT entry from a swap slot, freeing it with the last one
+void swap_slot_put( uint64_t slot )
+{
+    if ( IS_ZRAM_SLOT( slot ) )
+    {
+        ZRAM_put( slot & ~SWAP_ZRAM_BIT );
+        return;
+    }
+
+    if ( slot == SWAP_NO_SLOT || slot >= num_swap_slots || swap_map[slot] == 0 )
+    {
+        OS_ERROR( "Swap slot %lu is not in use!\n", slot );
+        return;
+    }
+
+    swap_map[slot]--;
+}
+
+// Read or write a page frame from or to a swap slot
+int swap_io( uint64_t slot, void *frame, bool write )
+{
+    uint64_t i, blks_per_page = PAGE_SIZE / swap_dev->blk_size;
+    uint8_t *data = (uint8_t *)frame;
+
+    for ( i = 0; i < blks_per_page; ++i, data += swap_dev->blk_size )
+    {
+        if ( ( write ? BD_write( swap_dev, slot * blks_per_page + i, data )
+                     : BD_read( swap_dev, slot * blks_per_page + i, data ) ) != 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Unmap a page that is being swapped out, leaving `slot` in its PT entry
+void swap_unmap_page( addr_space_t *as, pg_dir_entry_t *pt_entry, void *virt_addr, uint64_t slot )
+{
+    pt_entry->present = 0;
+    pt_entry->swapped = 1;
+    WRITE_SWAP_SLOT( pt_entry, slot );
+
+    if ( as == curr_as )
+    {
+        flush_tlb_page( virt_addr );
+    }
+    else
+    {
+        as->needs_flush = true;
+    }
+}
+
+// Put back a page that failed to swap out
+void swap_remap_page( pg_dir_entry_t *pt_entry, void *frame )
+{
+    // Only anonymous pages are swapped
+    pf_info_of( frame )->flags |= PF_FLAG_MOVABLE;
+
+    pt_entry->swapped = 0;
+    WRITE_FRAME_ADDR( pt_entry, frame );
+    pt_entry->present = 1;
+}
+
+// Compress a page into zram and leave its handle in the PT entry. Storing the page can take a new
+// pool page and grow the pool tables, which may fail when memory is low, so the frame is only let
+// go once the compressed copy is stored.
+bool swap_out_zram( addr_space_t *as, pg_dir_entry_t *pt_entry, void *virt_addr )
+{
+    void *frame = READ_FRAME_ADDR( pt_entry );
+    uint64_t handle;
+
+    // Pages that do not compress well go to the swap area
+    if ( ZRAM_compress( frame ) == 0 )
+    {
+        return false;
+    }
+
+    // Nothing can write to the page once it is unmapped, so the compressed copy is the final one
+    swap_unmap_page( as, pt_entry, virt_addr, SWAP_NO_SLOT );
+
+    handle = ZRAM_commit();
+
+    if ( handle == ZRAM_NO_HANDLE )
+    {
+        // The pool is full or out of memory, the page keeps its frame
+        swap_remap_page( pt_entry, frame );
+        return false;
+    }
+
+    WRITE_SWAP_SLOT( pt_entry, handle | SWAP_ZRAM_BIT );
+    pf_put( frame );
+
+    return true;
+}
+
+// Swap a page out to zram, or write it out to the swap area, and leave its slot in the PT entry
+bool swap_out_page( addr_space_t *as, pg_dir_entry_t *pt_entry, void *virt_addr )
+{
+    uint64_t slot;
+    void *frame;
+
+    if ( ZRAM_enabled() && swap_out_zram( as, pt_entry, virt_addr ) )
+    {
+        return true;
+    }
+
+    if ( swap_dev == NULL || ( slot = swap_slot_alloc() ) == SWAP_NO_SLOT )
+    {
+        return false;
+    }
+
+    // Unmap the page before writing it, so the copy in the swap area is the final one
+    frame = READ_FRAME_ADDR( pt_entry );
+    swap_unmap_page( as, pt_entry, virt_addr, slot );
+
+    if ( swap_io( slot, frame, true ) != 0 )
+    {
+        OS_ERROR( "Failed to swap out page %p!\n", virt_addr );
+
+        swap_remap_page( pt_entry, frame );
+        swap_slot_put( slot );
+
+        return false;
+    }
+
+    pf_put( frame );
+
+    return true;
+}
+
+// Read a swapped out page back into a fresh page frame
+void swap_in_page( pg_dir_entry_t *pt_entry, void *virt_addr )
+{
+    uint64_t slot = READ_SWAP_SLOT( pt_entry );
+    void *frame = MMU_pf_alloc();
+
+    if ( frame == NULL )
+    {
+        OS_ERROR_HALT( "Out of memory swapping in page %p!\n", virt_addr );
+    }
+
+    if ( IS_ZRAM_SLOT( slot ) ? !ZRAM_load( slot & ~SWAP_ZRAM_BIT, frame )
+                              : swap_io( slot, frame, false ) != 0 )
+    {
+        OS_ERROR_HALT( "Failed to swap in page %p from slot %lx!\n", virt_addr, slot );
+    }
+
+    // Non-present entries are never cached, so there is nothing to flush
+    pt_entry->accessed = 0;
+    swap_remap_page( pt_entry, frame );
+
+    swap_slot_put( slot );
+}
+
+// Find the next present leaf entry at or above `*addr` and below `end` in a PML4, a PT entry or a
+// huge PD entry, skipping the ranges that have no page tables. `*addr` is left at the address of
+// the entry, the start of the 2 MiB block for a huge page.
+pg_dir_entry_t *pt_find_next( pg_dir_entry_t *pml4_table, uint64_t *addr, uint64_t end )
+{
+    pg_dir_entry_t *table, *entry;
+    uint64_t span;
+    uint8_t level;
+
+    while ( *addr < end )
+    {
+        table = pml4_table;
+
+        for ( level = PT_LEVEL_PML4; level < PT_LEVEL_PT; ++level )
+        {
+            entry = table + GET_TBL_INDEX( *addr, level );
+
+            if ( !entry->present )
+            {
+                break;
+            }
+
+            // Huge pages have no page table
+            if ( level == PT_LEVEL_PD && entry->huge )
+            {
+                *addr &= ~( HUGE_PAGE_SIZE - 1 );
+                return entry;
+            }
+
+            table = (pg_dir_entry_t *)READ_FRAME_ADDR( entry );
+        }
+
+        // Skip everything the missing table would have mapped
+        if ( level < PT_LEVEL_PT )
+        {
+            span = 1UL << ( 39U - 9U * level );
+            *addr = ( *addr & ~( span - 1 ) ) + span;
+            continue;
+        }
+
+        entry = table + GET_TBL_INDEX( *addr, PT_LEVEL_PT );
+
+        if ( entry->present )
+        {
+            return entry;
+        }
+
+        *addr += PAGE_SIZE;
+    }
+
+    return NULL;
+}
+
+// Swap out up to `target` cold user pages. The scan goes round the user pages of every address
+// space like a clock hand, pages that have been accessed since the last lap get a second chance.
+// Returns the number of pages swapped out.
+uint64_t swap_reclaim( uint64_t target )
+{
+    uint64_t reclaimed = 0, laps = 0;
+    addr_space_t *as;
+    pg_dir_entry_t *pt_entry;
+    void *virt_addr;
+
+    if ( ( swap_dev == NULL && !ZRAM_enabled() ) || in_reclaim )
+    {
+        return 0;
+    }
+
+    in_reclaim = true;
+
+    // Two laps over every address space are enough to clear and then find every cold page
+    while ( reclaimed < target && laps < 2 * num_addr_spaces )
+    {
+        as = swap_cursor_as;
+        pt_entry = pt_find_next( as->pml4, &as->swap_cursor, UHEAP_END + 1 );
+
+        // Move on to the next address space once this one has been scanned
+        if ( pt_entry == NULL )
+        {
+            as->swap_cursor = USTACK_END;
+            swap_cursor_as = ( as->next != NULL ? as->next : as_list_head );
+            laps++;
+            continue;
+        }
+
+        virt_addr = (void *)as->swap_cursor;
+        as->swap_cursor += LEAF_ENTRY_SIZE( pt_entry );
+
+        // Object pages belong to the page cache, and huge pages are never swapped
+        if ( IS_OBJECT_ENTRY( pt_entry ) || pt_entry->huge )
+        {
+            continue;
+        }
+
+        // Frames shared copy-on-write are mapped elsewhere too
+        if ( pf_info_of( READ_FRAME_ADDR( pt_entry ) )->refcnt > 1 )
+        {
+            continue;
+        }
+
+        // Give recently used pages a second chance
+        if ( pt_entry->accessed || wss_page_young( pt_entry ) )
+        {
+            pt_entry->accessed = 0;
+            pf_info_of( READ_FRAME_ADDR( pt_entry ) )->age = 0;
+
+            // The CPU only sets the bit again once the cached translation is gone
+            if ( as == curr_as )
+            {
+                flush_tlb_page( virt_addr );
+            }
+            else
+            {
+                as->needs_flush = true;
+            }
+
+            continue;
+        }
+
+        if ( !swap_out_page( as, pt_entry, virt_addr ) )
+        {
+            break;
+        }
+
+        reclaimed++;
+    }
+
+    in_reclaim = false;
+
+    return reclaimed;
+}
+
+#pragma endregion
+
+#pragma region Shrinkers
+
+// Count the free page frames of every node and every CPU cache, not counting the contiguous
+// memory area
+uint64_t num_free_frames( void )
+{
+    uint64_t num_free = 0;
+    uint32_t i;
+
+    for ( i = 0; i < num_numa_nodes; ++i )
+    {
+        num_free += numa_nodes[i].num_free;
+    }
+
+    for ( i = 0; i < MAX_CPUS; ++i )
+    {
+        num_free += pcp_caches[i].num_hot + pcp_caches[i].num_cold;
+    }
+
+    return num_free;
+}
+
+// Count the frames the ranges have left once the page frame info and the contiguous memory area
+// are carved out, and set the watermarks from the total
+void __init wmark_init( void )
+{
+    pf_range_entry_t *range;
+
+    for ( range = addr_range_head; range != NULL; range = range->next_entry )
+    {
+        numa_nodes[range->node].num_free +=
+            ( (uint64_t)range->end - (uint64_t)range->curr_frame ) / PAGE_SIZE;
+    }
+
+    wmark_low = num_free_frames() / WMARK_LOW_DIV;
+    wmark_low = ( wmark_low < WMARK_MIN_PAGES ? WMARK_MIN_PAGES : wmark_low );
+    wmark_high = 2 * wmark_low;
+}
+
+// Ask the shrinkers to free `target` page frames between them, each in proportion to how many it
+// holds. Shrinkers free through the kernel heap, so they are skipped while the heap is changing
+// its blocks or already shrinking. Returns the number of frames freed.
+uint64_t shrink_caches( uint64_t target )
+{
+    uint64_t total = 0, freed = 0, count;
+    mmu_shrinker_t *shrinker;
+
+    if ( in_shrink || kmalloc_busy() )
+    {
+        return 0;
+    }
+
+    in_shrink = true;
+
+    for ( shrinker = shrinker_list; shrinker != NULL; shrinker = shrinker->next )
+    {
+        total += shrinker->count();
+    }
+
+    for ( shrinker = shrinker_list; shrinker != NULL && freed < target; shrinker = shrinker->next )
+    {
+        if ( ( count = shrinker->count() ) == 0 )
+        {
+            continue;
+        }
+
+        // Round up so small caches still give something back
+        freed += shrinker->scan( ( target * count + total - 1 ) / total );
+    }
+
+    in_shrink = false;
+
+    return freed;
+}
+
+// Free page frames until `target` of them are free, first from the caches and then by swapping
+// out cold pages. Returns false if nothing is left to give back before the target is reached.
+bool reclaim_frames( uint64_t target )
+{
+    uint64_t num_free;
+
+    while ( ( num_free = num_free_frames() ) < target )
+    {
+        if ( shrink_caches( target - num_free ) == 0 && swap_reclaim( target - num_free ) == 0 )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Check if `num_pages` pages can be backed by page frames, reclaiming frames if needed. Demand
+// allocated memory is only backed when it is touched, so this is a best guess.
+bool pf_can_commit( uint64_t num_pages )
+{
+    return num_free_frames() >= num_pages || reclaim_frames( num_pages );
+}
+
+#pragma endregion
+
+#pragma region NUMA
+
+// Get the node of a proximity domain, adding a node for new domains
+uint32_t __init numa_node_of_domain( uint32_t domain )
+{
+    uint32_t node;
+
+    for ( node = 0; node < num_numa_nodes; ++node )
+    {
+        if ( numa_nodes[node].domain == domain )
+        {
+            return node;
+        }
+    }
+
+    if ( num_numa_nodes == NUMA_MAX_NODES )
+    {
+        OS_WARN( "Too many NUMA nodes, domain %u goes to node 0!\n", domain );
+        return 0;
+    }
+
+    numa_nodes[num_numa_nodes].domain = domain;
+
+    return num_numa_nodes++;
+}
+
+// Take a range entry from the ones set aside by memblock
+pf_range_entry_t __init *range_alloc( void )
+{
+    if ( range_pool_left == 0 )
+    {
+        OS_ERROR_HALT( "Out of free range entries!\n" );
+    }
+
+    range_pool_left--;
+
+    return range_pool++;
+}
+
+// Split a free range in two at `addr`, returning the upper half
+pf_range_entry_t __init *split_free_range( pf_range_entry_t *range, void *addr )
+{
+    pf_range_entry_t *upper = range_alloc();
+
+    upper->start = addr;
+    upper->curr_frame = addr;
+    upper->end = range->end;
+    upper->node = range->node;
+    upper->next_entry = range->next_entry;
+
+    range->end = addr;
+    range->next_entry = upper;
+
+    if ( addr_range_tail == range )
+    {
+        addr_range_tail = upper;
+    }
+
+    return upper;
+}
+
+// Give every free range the node of the SRAT memory range it starts in, splitting ranges that
+// cross into another memory range. The ACPI tables are read through the boot identity map, so this
+// has to run before CR3 is loaded.
+void __init numa_init( void *tag_ptr )
+{
+    pf_range_entry_t *range;
+    acpi_mem_range_t *mem;
+    uint64_t mem_end;
+    uint8_t *pf;
+    uint32_t i, regs[4];
+
+    if ( ACPI_get_numa_info( tag_ptr, &numa_info ) == SUCCESS )
+    {
+        numa_nodes[0].domain = numa_info.mem_ranges[0].domain;
+
+        for ( range = addr_range_head; range != NULL; range = range->next_entry )
+        {
+            for ( i = 0; i < numa_info.num_mem_ranges; ++i )
+            {
+                mem = &numa_info.mem_ranges[i];
+                mem_end = mem->base + mem->len;
+
+                if ( (uint64_t)range->start < mem->base || (uint64_t)range->start >= mem_end )
+                {
+                    continue;
+                }
+
+                range->node = numa_node_of_domain( mem->domain );
+
+                // The rest of the range is matched on the next iteration
+                if ( (uint64_t)range->end > mem_end )
+                {
+                    split_free_range( range, (void *)mem_end );
+                }
+
+                break;
+            }
+        }
+
+        // Find the node of the boot CPU by its initial APIC ID
+        cpuid( 1, 0, regs );
+
+        for ( i = 0; i < numa_info.num_cpus; ++i )
+        {
+            if ( numa_info.cpus[i].apic_id == regs[1] >> 24 )
+            {
+                numa_local_node = numa_node_of_domain( numa_info.cpus[i].domain );
+                break;
+            }
+        }
+    }
+
+    // Record the node in the info of every frame, so a free doesn't have to look up its range
+    for ( range = addr_range_head; range != NULL; range = range->next_entry )
+    {
+        numa_nodes[range->node].num_frames +=
+            ( (uint64_t)range->end - (uint64_t)range->start ) / PAGE_SIZE;
+
+        for ( pf = range->start; (uint64_t)pf < (uint64_t)range->end; pf += PAGE_SIZE )
+        {
+            pf_info_of( pf )->node = range->node;
+        }
+    }
+
+    // Every node starts looking for untouched frames at the first range
+    for ( i = 0; i < num_numa_nodes; ++i )
+    {
+        numa_nodes[i].range = addr_range_head;
+
+        OS_INFO(
+            "NUMA node %u (domain %u): %lu MiB%s\n", i, numa_nodes[i].domain,
+            numa_nodes[i].num_frames * PAGE_SIZE >> 20, ( i == numa_local_node ? ", local" : "" )
+        );
+    }
+}
+
+// Get the node of a page frame
+uint32_t numa_node_of_pf( void *pf ) { return pf_info_of( pf )->node; }
+
+// Pick the node the next page frame comes from
+uint32_t numa_policy_node( void )
+{
+    uint32_t node;
+
+    switch ( numa_policy )
+    {
+        case MMU_NUMA_INTERLEAVE:
+            node = numa_interleave_node;
+            numa_interleave_node = ( node + 1 ) % num_numa_nodes;
+            return node;
+
+        case MMU_NUMA_PREFERRED:
+            return numa_preferred_node;
+
+        default:
+            return numa_local_node;
+    }
+}
+
+// Add a free page frame to the free list of a node, with the allocator lock held
+void free_list_push( uint32_t node, void *pf )
+{
+    pf_list_entry_t *entry = (pf_list_entry_t *)pf;
+
+    entry->prev = NULL;
+    entry->next = numa_nodes[node].free_list;
+
+    if ( entry->next != NULL )
+    {
+        entry->next->prev = entry;
+    }
+
+    numa_nodes[node].free_list = entry;
+    numa_nodes[node].num_free++;
+    pf_info_of( pf )->flags |= PF_FLAG_FREE;
+}
+
+// Take a page frame off the free list of a node, wherever it is in the list, with the allocator
+// lock held
+void free_list_remove( uint32_t node, void *pf )
+{
+    pf_list_entry_t *entry = (pf_list_entry_t *)pf;
+
+    if ( entry->prev != NULL )
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        numa_nodes[node].free_list = entry->next;
+    }
+
+    if ( entry->next != NULL )
+    {
+        entry->next->prev = entry->prev;
+    }
+
+    numa_nodes[node].num_free--;
+    pf_info_of( pf )->flags &= ~PF_FLAG_FREE;
+}
+
+// Take a page frame from the pool of a node, or NULL if the node is out of memory. The allocator
+// lock has to be held.
+void *numa_pf_alloc( uint32_t node )
+{
+    pf_list_entry_t *pf = numa_nodes[node].free_list;
+
+    if ( pf == NULL )
+    {
+        return alloc_new_pf( node );
+    }
+
+    free_list_remove( node, pf );
+
+    return pf;
+}
+
+// Take a page frame, starting with `node` and falling back to the other nodes in order
+void *numa_pf_alloc_any( uint32_t node )
+{
+    void *pf = NULL;
+    uint32_t i;
+
+    for ( i = 0; i < num_numa_nodes && pf == NULL; ++i )
+    {
+        pf = numa_pf_alloc( ( node + i ) % num_numa_nodes );
+    }
+
+    return pf;
+}
+
+// Give the frames of a block kept for huge pages back to their node. Returns false if no block is
+// kept.
+bool huge_pool_break( void )
+{
+    uint8_t *block = (uint8_t *)huge_pool;
+    uint32_t node;
+    uint64_t i;
+
+    if ( block == NULL )
+    {
+        return false;
+    }
+
+    huge_pool = huge_pool->next;
+    num_huge_pool--;
+
+    node = numa_node_of_pf( block );
+
+    for ( i = 0; i < PAGES_PER_HUGE; ++i )
+    {
+        free_list_push( node, block + i * PAGE_SIZE );
+    }
+
+    return true;
+}
+
+#pragma endregion
+
+#pragma region Per-CPU Frame Caches
+
+// Take up to `num_pages` page frames from the free lists under the allocator lock, starting with
+// `node` and, if `any_node` is set, falling back to the other nodes. The blocks kept for huge pages
+// are only broken up if nothing else is left. The frames are added to `*list`, returns how many
+// were taken.
+uint32_t global_pf_take( uint32_t node, bool any_node, pf_list_entry_t **list, uint32_t num_pages )
+{
+    pf_list_entry_t *pf;
+    uint32_t num_taken = 0;
+    unsigned long flags;
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( pf_lock );
+
+    while ( num_taken < num_pages )
+    {
+        pf = ( any_node ? numa_pf_alloc_any( node ) : numa_pf_alloc( node ) );
+
+        if ( pf == NULL && num_taken == 0 && huge_pool_break() )
+        {
+            pf = ( any_node ? numa_pf_alloc_any( node ) : numa_pf_alloc( node ) );
+        }
+
+        if ( pf == NULL )
+        {
+            break;
+        }
+
+        pf->next = *list;
+        *list = pf;
+        num_taken++;
+    }
+
+    binary_semaphore_unlock( pf_lock );
+    irqrestore( flags );
+
+    return num_taken;
+}
+
+// Take a single page frame from the free lists under the allocator lock, starting with `node`.
+// Unlike `global_pf_take()` the blocks kept for huge pages are left alone. Returns NULL if the free
+// lists are empty.
+void *global_pf_alloc( uint32_t node )
+{
+    unsigned long flags;
+    void *pf;
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( pf_lock );
+
+    pf = numa_pf_alloc_any( node );
+
+    binary_semaphore_unlock( pf_lock );
+    irqrestore( flags );
+
+    return pf;
+}
+
+// Give a list of page frames back to the free lists of their nodes under the allocator lock
+void global_pf_put( pf_list_entry_t *list )
+{
+    pf_list_entry_t *next;
+    unsigned long flags;
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( pf_lock );
+
+    for ( ; list != NULL; list = next )
+    {
+        next = list->next;
+        free_list_push( numa_node_of_pf( list ), list );
+    }
+
+    binary_semaphore_unlock( pf_lock );
+    irqrestore( flags );
+}
+
+// Drain up to `num_pages` frames from a CPU cache back to the free lists, the cold ones first.
+// The hot frames drained are the ones freed longest ago, at the end of the hot list. The lock of
+// the cache has to be held.
+void pcp_drain( pcp_cache_t *pcp, uint32_t num_pages )
+{
+    pf_list_entry_t *list = NULL, **tail, *pf;
+    uint32_t num_kept;
+
+    while ( num_pages > 0 && pcp->cold != NULL )
+    {
+        pf = pcp->cold;
+        pcp->cold = pf->next;
+        pcp->num_cold--;
+        pf->next = list;
+        list = pf;
+        num_pages--;
+    }
+
+    if ( num_pages > 0 && pcp->num_hot > 0 )
+    {
+        num_kept = ( pcp->num_hot > num_pages ? pcp->num_hot - num_pages : 0 );
+
+        for ( tail = &pcp->hot; num_kept > 0; --num_kept )
+        {
+            tail = &( *tail )->next;
+        }
+
+        // Splice the end of the hot list onto the frames to drain
+        for ( ; *tail != NULL; pcp->num_hot-- )
+        {
+            pf = *tail;
+            *tail = pf->next;
+            pf->next = list;
+            list = pf;
+        }
+    }
+
+    global_pf_put( list );
+}
+
+// Drain every CPU cache completely, so the free lists hold every free frame again. The caches of
+// the other CPUs are drained under their locks while those CPUs keep running.
+void pcp_drain_all( void )
+{
+    unsigned long flags;
+    pcp_cache_t *pcp;
+    uint32_t cpu;
+
+    for ( cpu = 0; cpu < MAX_CPUS; ++cpu )
+    {
+        pcp = &pcp_caches[cpu];
+
+        flags = save_irqdisable();
+        binary_semaphore_lock( pcp->lock );
+
+        pcp_drain( pcp, pcp->num_hot + pcp->num_cold );
+
+        binary_semaphore_unlock( pcp->lock );
+        irqrestore( flags );
+    }
+}
+
+// Take a frame from the cache of the running CPU, refilling it with a batch of frames of `node`
+// if it is empty. Only the refill touches the free lists, and it never takes frames of other nodes.
+void *pcp_alloc( uint32_t node )
+{
+    pcp_cache_t *pcp;
+    pf_list_entry_t *pf;
+    unsigned long flags;
+
+    // Interrupts may allocate as well
+    flags = save_irqdisable();
+    pcp = &pcp_caches[this_cpu()];
+    binary_semaphore_lock( pcp->lock );
+
+    if ( pcp->hot == NULL && pcp->cold == NULL )
+    {
+        pcp->num_cold = global_pf_take( node, false, &pcp->cold, PCP_BATCH );
+    }
+
+    if ( ( pf = pcp->hot ) != NULL )
+    {
+        pcp->hot = pf->next;
+        pcp->num_hot--;
+    }
+    else if ( ( pf = pcp->cold ) != NULL )
+    {
+        pcp->cold = pf->next;
+        pcp->num_cold--;
+    }
+
+    binary_semaphore_unlock( pcp->lock );
+    irqrestore( flags );
+
+    return pf;
+}
+
+// Free a page frame that isn't part of the contiguous memory area. Frames of the node of the
+// running CPU go to its cache, on the cold list if the caller knows they aren't cached anymore.
+void pf_free( void *pf, bool cold )
+{
+    pf_list_entry_t *entry = (pf_list_entry_t *)pf;
+    pcp_cache_t *pcp;
+    unsigned long flags;
+
+    pf_info_of( pf )->refcnt = 0;
+    pf_info_of( pf )->age = 0;
+    pf_info_of( pf )->flags &= ~PF_FLAG_MOVABLE;
+
+    if ( numa_node_of_pf( pf ) != numa_local_node )
+    {
+        entry->next = NULL;
+        global_pf_put( entry );
+        return;
+    }
+
+    flags = save_irqdisable();
+    pcp = &pcp_caches[this_cpu()];
+    binary_semaphore_lock( pcp->lock );
+
+    if ( cold )
+    {
+        entry->next = pcp->cold;
+        pcp->cold = entry;
+        pcp->num_cold++;
+    }
+    else
+    {
+        entry->next = pcp->hot;
+        pcp->hot = entry;
+        pcp->num_hot++;
+    }
+
+    if ( pcp->num_hot + pcp->num_cold > PCP_HIGH )
+    {
+        pcp_drain( pcp, PCP_BATCH );
+    }
+
+    binary_semaphore_unlock( pcp->lock );
+    irqrestore( flags );
+}
+
+// Allocate a page frame, starting with `node`, or return NULL if there is no memory left. Frames of
+// the node of the running CPU come from its cache. Frames of other nodes, including the fallback
+// once `node` runs dry, come straight from the free lists. Once every node is out of memory the
+// other CPU caches are drained, and then the caches are shrunk and cold pages swapped out.
+void *pf_alloc( uint32_t node )
+{
+    pf_list_entry_t *pf = NULL;
+
+    if ( node == numa_local_node )
+    {
+        pf = pcp_alloc( node );
+    }
+
+    if ( pf == NULL )
+    {
+        global_pf_take( node, true, &pf, 1 );
+    }
+
+    if ( pf == NULL )
+    {
+        pcp_drain_all();
+        global_pf_take( node, true, &pf, 1 );
+    }
+
+    if ( pf == NULL && reclaim_frames( wmark_low ) )
+    {
+        pcp_drain_all();
+        global_pf_take( node, true, &pf, 1 );
+    }
+
+    if ( pf == NULL )
+    {
+        OS_WARN( "All memory has been allocated!\n" );
+        return NULL;
+    }
+
+    // The frame starts out with a single user
+    pf_info_of( pf )->refcnt = 1;
+
+    // Reclaim in one go when the frames drop below the low watermark, instead of a few frames on
+    // every allocation after that. If reclaim comes up short it waits for the frames to recover.
+    if ( num_free_frames() >= wmark_low )
+    {
+        wmark_low_hit = false;
+    }
+    else if ( !wmark_low_hit )
+    {
+        wmark_low_hit = true;
+        reclaim_frames( wmark_high );
+    }
+
+    // OS_INFO( "Allocated physical page %p\n", pf );
+
+    return pf;
+}
+
+#pragma endregion
+
+#pragma region Compaction
+
+// Get the free range a page frame belongs to, or NULL if no range hands it out
+pf_range_entry_t *range_of_pf( void *pf )
+{
+    pf_range_entry_t *range;
+
+    for ( range = addr_range_head; range != NULL; range = range->next_entry )
+    {
+        if ( (uint64_t)range->start <= (uint64_t)pf && (uint64_t)pf < (uint64_t)range->end )
+        {
+            return range;
+        }
+    }
+
+    return NULL;
+}
+
+// Check if a page frame of `range` is free, either on a free list or not handed out yet
+bool pf_is_free( pf_range_entry_t *range, void *pf )
+{
+    return (uint64_t)pf >= (uint64_t)range->curr_frame ||
+           ( pf_info_of( pf )->flags & PF_FLAG_FREE ) != 0;
+}
+
+// Take a free page frame of `range` away from the allocator, with the allocator lock held.
+// Untouched frames below it go to the free list so the range can skip past it.
+void pf_take( pf_range_entry_t *range, void *pf )
+{
+    if ( (uint64_t)pf < (uint64_t)range->curr_frame )
+    {
+        free_list_remove( range->node, pf );
+        return;
+    }
+
+    // The untouched frames were already counted as free
+    while ( range->curr_frame != pf )
+    {
+        free_list_push( range->node, range->curr_frame );
+        numa_nodes[range->node].num_free--;
+        range->curr_frame += PAGE_SIZE;
+    }
+
+    range->curr_frame += PAGE_SIZE;
+    numa_nodes[range->node].num_free--;
+}
+
+// Count the free page frames of a block. Blocks holding a frame that isn't the only mapping of an
+// anonymous page, such as a shared frame, a page table or a kernel stack, can't be compacted and
+// count as 0.
+uint64_t block_free_frames( pf_range_entry_t *range, uint8_t *block )
+{
+    uint64_t i, num_free = 0;
+    uint8_t *pf;
+
+    for ( i = 0; i < PAGES_PER_HUGE; ++i )
+    {
+        pf = block + i * PAGE_SIZE;
+
+        if ( pf_is_free( range, pf ) )
+        {
+            num_free++;
+        }
+        else if ( pf_info_of( pf )->refcnt != 1 ||
+                  ( pf_info_of( pf )->flags & PF_FLAG_MOVABLE ) == 0 )
+        {
+            return 0;
+        }
+    }
+
+    return num_free;
+}
+
+// Find the block with the most free page frames, leaving out the `num_skip` blocks in `skip` and
+// the blocks with less than `COMPACT_MIN_FREE` free frames. Blocks have to lie within one range.
+uint8_t *compact_find_block( uint8_t *skip[], uint32_t num_skip, pf_range_entry_t **best_range )
+{
+    pf_range_entry_t *range;
+    uint8_t *block, *best = NULL;
+    uint64_t num_free, best_free = COMPACT_MIN_FREE - 1;
+    uint32_t i;
+
+    for ( range = addr_range_head; range != NULL; range = range->next_entry )
+    {
+        for ( block = (uint8_t *)ALIGN( (uint64_t)range->start, HUGE_PAGE_SIZE );
+              block + HUGE_PAGE_SIZE <= (uint8_t *)range->end; block += HUGE_PAGE_SIZE )
+        {
+            for ( i = 0; i < num_skip && skip[i] != block; ++i )
+            {
+            }
+
+            if ( i < num_skip || ( num_free = block_free_frames( range, block ) ) <= best_free )
+            {
+                continue;
+            }
+
+            best = block;
+            best_free = num_free;
+            *best_range = range;
+
+            // Nothing beats a block that is already free
+            if ( num_free == PAGES_PER_HUGE )
+            {
+                return best;
+            }
+        }
+    }
+
+    return best;
+}
+
+// Move the anonymous pages of `as` between `addr` and `end` that use frames of a block to frames
+// of `node` outside of it, setting the bits of the vacated frames in `taken`. Returns the number of
+// pages moved.
+uint64_t compact_range(
+    addr_space_t *as, uint64_t addr, uint64_t end, uint8_t *block, uint32_t node, uint64_t taken[]
+)
+{
+    pg_dir_entry_t *pt_entry;
+    uint64_t idx, moved = 0;
+    uint8_t *pf;
+    void *new_pf;
+
+    while ( ( pt_entry = pt_find_next( as->pml4, &addr, end ) ) != NULL )
+    {
+        pf = READ_FRAME_ADDR( pt_entry );
+        idx = ( (uint64_t)pf - (uint64_t)block ) / PAGE_SIZE;
+
+        // Object pages belong to the page cache, shared frames are mapped elsewhere too and huge
+        // pages fill their own block
+        if ( pf >= block && idx < PAGES_PER_HUGE && !IS_OBJECT_ENTRY( pt_entry ) &&
+             !pt_entry->huge && pf_info_of( pf )->refcnt == 1 &&
+             ( pf_info_of( pf )->flags & PF_FLAG_MOVABLE ) != 0 )
+        {
+            if ( ( new_pf = global_pf_alloc( node ) ) == NULL )
+            {
+                break;
+            }
+
+            migrate_page( as, pt_entry, (void *)addr, new_pf );
+            taken[idx / 64U] |= 1UL << ( idx % 64U );
+            moved++;
+        }
+
+        addr += LEAF_ENTRY_SIZE( pt_entry );
+    }
+
+    return moved;
+}
+
+// Move the anonymous pages of `as` out of a block, the kernel heap along with the kernel address
+// space since every address space shares it. Returns the number of pages moved.
+uint64_t compact_addr_space( addr_space_t *as, uint8_t *block, uint32_t node, uint64_t taken[] )
+{
+    uint64_t moved = 0;
+
+    if ( as == &kernel_as )
+    {
+        moved += compact_range( as, KHEAP_START, KHEAP_END + 1, block, node, taken );
+    }
+
+    return moved + compact_range( as, USTACK_END, UHEAP_END + 1, block, node, taken );
+}
+
+// Empty a block and take every one of its frames. The free frames are taken first so no page gets
+// moved into the block. If any page of the block can't be moved the frames are given back and
+// false is returned.
+bool compact_block( pf_range_entry_t *range, uint8_t *block )
+{
+    uint64_t taken[PAGES_PER_HUGE / 64U] = { 0 };
+    uint64_t i, num_taken = 0;
+    unsigned long flags;
+    addr_space_t *as;
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( pf_lock );
+
+    for ( i = 0; i < PAGES_PER_HUGE; ++i )
+    {
+        if ( pf_is_free( range, block + i * PAGE_SIZE ) )
+        {
+            pf_take( range, block + i * PAGE_SIZE );
+            taken[i / 64U] |= 1UL << ( i % 64U );
+            num_taken++;
+        }
+    }
+
+    binary_semaphore_unlock( pf_lock );
+    irqrestore( flags );
+
+    for ( as = as_list_head; as != NULL && num_taken < PAGES_PER_HUGE; as = as->next )
+    {
+        num_taken += compact_addr_space( as, block, range->node, taken );
+    }
+
+    if ( num_taken == PAGES_PER_HUGE )
+    {
+        return true;
+    }
+
+    // Pages of other kernel regions and page tables can't be moved
+    for ( i = 0; i < PAGES_PER_HUGE; ++i )
+    {
+        if ( taken[i / 64U] & ( 1UL << ( i % 64U ) ) )
+        {
+            MMU_pf_free( block + i * PAGE_SIZE );
+        }
+    }
+
+    return false;
+}
+
+// Take a block kept whole for huge pages, or return NULL if the pool is empty
+uint8_t *huge_pool_take( void )
+{
+    unsigned long flags;
+    uint8_t *block;
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( pf_lock );
+
+    if ( ( block = (uint8_t *)huge_pool ) != NULL )
+    {
+        huge_pool = huge_pool->next;
+        num_huge_pool--;
+    }
+
+    binary_semaphore_unlock( pf_lock );
+    irqrestore( flags );
+
+    return block;
+}
+
+// Free up the best block for a huge page frame and take it. Returns NULL if no block could be
+// emptied.
+uint8_t *compact_one( void )
+{
+    uint8_t *skip[COMPACT_MAX_TRIES], *block;
+    pf_range_entry_t *range = NULL;
+    uint32_t tries;
+
+    // Frames in the CPU caches look like used frames that can't be moved
+    pcp_drain_all();
+
+    for ( tries = 0; tries < COMPACT_MAX_TRIES; ++tries )
+    {
+        if ( ( block = compact_find_block( skip, tries, &range ) ) == NULL )
+        {
+            return NULL;
+        }
+
+        if ( compact_block( range, block ) )
+        {
+            return block;
+        }
+
+        skip[tries] = block;
+    }
+
+    return NULL;
+}
+
+#pragma endregion
+
+#pragma region Huge Page Promotion
+
+// Check if a block of the kernel heap can be promoted. Every page has to be present, writable and
+// the only mapping of its frame, so no one else knows the physical addresses about to change.
+bool thp_block_ready( pg_dir_entry_t *pd_entry )
+{
+    pg_dir_entry_t *pt;
+    uint64_t i;
+
+    if ( pd_entry == NULL || !pd_entry->present || pd_entry->huge ||
+         pd_entry->num_used != PAGES_PER_HUGE )
+    {
+        return false;
+    }
+
+    pt = (pg_dir_entry_t *)READ_FRAME_ADDR( pd_entry );
+
+    for ( i = 0; i < PAGES_PER_HUGE; ++i )
+    {
+        if ( !pt[i].present || !pt[i].writable || pt[i].cow || IS_OBJECT_ENTRY( &pt[i] ) ||
+             pf_info_of( READ_FRAME_ADDR( &pt[i] ) )->refcnt != 1 )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Copy a block of the kernel heap into a huge page frame and map it with a single PD entry. The
+// old frames and the page table are freed. Promotion runs inside `kbrk()` with the heap locked, so
+// it only takes blocks kept in the pool and never compacts. Returns false once the pool is empty.
+bool thp_promote( pg_dir_entry_t *pd_entry, uint8_t *block )
+{
+    pg_dir_entry_t *pt = (pg_dir_entry_t *)READ_FRAME_ADDR( pd_entry ), new_entry = { 0 };
+    unsigned long flags;
+    uint8_t *huge_pf;
+    uint64_t i;
+
+    if ( ( huge_pf = huge_pool_take() ) == NULL )
+    {
+        return false;
+    }
+
+    // Nothing may write to the block between the copy and the switch to the huge page
+    flags = save_irqdisable();
+
+    // The block may have changed while the frame was taken
+    if ( !thp_block_ready( pd_entry ) )
+    {
+        irqrestore( flags );
+        MMU_pf_free_huge( huge_pf );
+        return true;
+    }
+
+    for ( i = 0; i < PAGES_PER_HUGE; ++i )
+    {
+        pf_info_of( huge_pf + i * PAGE_SIZE )->refcnt = 1;
+    }
+
+    for ( i = 0; i < PAGES_PER_HUGE; ++i )
+    {
+        memcpy( huge_pf + i * PAGE_SIZE, block + i * PAGE_SIZE, PAGE_SIZE );
+
+        new_entry.accessed |= pt[i].accessed;
+        new_entry.dirty |= pt[i].dirty;
+    }
+
+    WRITE_FRAME_ADDR( &new_entry, huge_pf );
+    new_entry.present = 1;
+    new_entry.writable = 1;
+    new_entry.huge = 1;
+    new_entry.global = pge_enabled;
+
+    *pd_entry = new_entry;
+
+    // The old translations and the cached page table are in every PCID
+    flush_tlb_all();
+
+    irqrestore( flags );
+
+    // The old frames were only read by the copy
+    for ( i = 0; i < PAGES_PER_HUGE; ++i )
+    {
+        pf_free( READ_FRAME_ADDR( &pt[i] ), true );
+    }
+
+    pf_free( pt, true );
+
+    return true;
+}
+
+// Promote the fully populated 2 MiB blocks of the kernel heap below the program break, until the
+// huge page pool runs dry. Unmapping part of a huge page splits it up again.
+void thp_scan( void )
+{
+    pg_dir_entry_t *pd_entry;
+    uint64_t addr;
+
+    for ( addr = ALIGN( KHEAP_START, HUGE_PAGE_SIZE ); addr + HUGE_PAGE_SIZE <= kheap_brk;
+          addr += HUGE_PAGE_SIZE )
+    {
+        pd_entry = find_pd_entry( kernel_as.pml4, (void *)addr );
+
+        if ( thp_block_ready( pd_entry ) && !thp_promote( pd_entry, (uint8_t *)addr ) )
+        {
+            break;
+        }
+    }
+}
+
+#pragma endregion
+
+#pragma region Contiguous Memory Area
+
+// Allocate the contiguous memory area from the top of memory below `CMA_LIMIT`, settling for a
+// smaller area if memory is fragmented. The state and reverse map of its frames are allocated from
+// low memory, so they can be cleared before the kernel page tables are loaded.
+void __init cma_init( void )
+{
+    uint64_t size, meta_size;
+
+    size = MEMBLOCK_total() / CMA_FRACTION;
+    size = ( size > CMA_MAX_SIZE ? CMA_MAX_SIZE : size ) & ~0xFFFUL;
+
+    while ( size > PAGE_SIZE &&
+            ( cma_base = (uint8_t *)MEMBLOCK_alloc_top( size, PAGE_SIZE, CMA_LIMIT ) ) == NULL )
+    {
+        size = ( size / 2 ) & ~0xFFFUL;
+    }
+
+    meta_size = (uint64_t)PAGE_ALIGN_ADDR( size / PAGE_SIZE * ( 1 + sizeof( cma_rmap_t ) ) + 8 );
+
+    if ( cma_base == NULL ||
+         ( cma_state = (uint8_t *)MEMBLOCK_alloc( meta_size, PAGE_SIZE, BOOT_MAP_SIZE ) ) == NULL )
+    {
+        OS_WARN( "No room for a contiguous memory area!\n" );
+        cma_base = NULL;
+        return;
+    }
+
+    cma_rmap = (cma_rmap_t *)ALIGN_ADDR_8_BYTES( cma_state + size / PAGE_SIZE );
+    cma_num_frames = size / PAGE_SIZE;
+
+    memset( cma_state, 0, meta_size );
+    boot_range_add( cma_state, meta_size );
+
+    OS_INFO( "Contiguous memory area of %lu pages at %p\n", cma_num_frames, (void *)cma_base );
+}
+
+// Check if a page frame belongs to the contiguous memory area
+bool cma_contains( void *pf )
+{
+    return (uint8_t *)pf >= cma_base && (uint8_t *)pf < cma_base + cma_num_frames * PAGE_SIZE;
+}
+
+// Lend a free frame of the contiguous memory area to the movable page at `virt_addr` of `as`, or
+// return NULL if every frame is in use
+void *cma_alloc_movable( addr_space_t *as, void *virt_addr )
+{
+    uint8_t *pf = NULL;
+    unsigned long flags;
+    uint64_t i, idx;
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( pf_lock );
+
+    for ( i = 0; i < cma_num_frames; ++i )
+    {
+        idx = ( cma_next_free + i ) % cma_num_frames;
+
+        if ( cma_state[idx] == CMA_FREE )
+        {
+            cma_state[idx] = CMA_MOVABLE;
+            cma_rmap[idx].as = as;
+            cma_rmap[idx].va = (uint64_t)virt_addr;
+            cma_next_free = idx + 1;
+
+            pf = cma_base + idx * PAGE_SIZE;
+            break;
+        }
+    }
+
+    binary_semaphore_unlock( pf_lock );
+    irqrestore( flags );
+
+    return pf;
+}
+
+// Return a frame to the contiguous memory area
+void cma_free( void *pf )
+{
+    uint64_t idx = ( (uint8_t *)pf - cma_base ) / PAGE_SIZE;
+    unsigned long flags;
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( pf_lock );
+
+    cma_state[idx] = CMA_FREE;
+    cma_rmap[idx].as = NULL;
+
+    binary_semaphore_unlock( pf_lock );
+    irqrestore( flags );
+}
+
+// Hand out a run of frames of the contiguous memory area, if every one of them is free. Returns
+// false if a frame was lent out again since its page was moved.
+bool cma_claim_run( uint64_t start, uint64_t num_frames )
+{
+    unsigned long flags;
+    uint64_t idx;
+    bool claimed = false;
+
+    flags = save_irqdisable();
+    binary_semaphore_lock( pf_lock );
+
+    for ( idx = start; idx < start + num_frames && cma_state[idx] == CMA_FREE; ++idx )
+    {
+    }
+
+    if ( idx == start + num_frames )
+    {
+        for ( idx = start; idx < start + num_frames; ++idx )
+        {
+            cma_state[idx] = CMA_CONTIG;
+            pf_info_of( cma_base + idx * PAGE_SIZE )->refcnt = 1;
+        }
+
+        claimed = true;
+    }
+
+    binary_semaphore_unlock( pf_lock );
+    irqrestore( flags );
+
+    return claimed;
+}
+
+// Check if an address space still exists
+bool addr_space_is_live( addr_space_t *as )
+{
+    addr_space_t *curr;
+
+    for ( curr = as_list_head; curr != NULL; curr = curr->next )
+    {
+        if ( curr == as )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Find the PT entry of a lent frame, or NULL if the page can't be moved. The borrower may have
+// gone away or shared the page with a clone since the frame was lent.
+pg_dir_entry_t *cma_rmap_lookup( uint64_t idx )
+{
+    cma_rmap_t *rmap = &cma_rmap[idx];
+    uint8_t *pf = cma_base + idx * PAGE_SIZE;
+    uint64_t addr = rmap->va;
+    pg_dir_entry_t *pt_entry;
+
+    if ( cma_state[idx] != CMA_MOVABLE || !addr_space_is_live( rmap->as ) ||
+         pf_info_of( pf )->refcnt != 1 )
+    {
+        return NULL;
+    }
+
+    pt_entry = pt_find_next( rmap->as->pml4, &addr, rmap->va + PAGE_SIZE );
+
+    if ( pt_entry == NULL || pt_entry->huge || READ_FRAME_ADDR( pt_entry ) != pf ||
+         IS_OBJECT_ENTRY( pt_entry ) )
+    {
+        return NULL;
+    }
+
+    return pt_entry;
+}
+
+// Move the page using a lent frame to a frame outside of the area. Returns false if the page
+// can't be moved or there is no memory to move it to.
+bool cma_migrate( uint64_t idx )
+{
+    pg_dir_entry_t *pt_entry = cma_rmap_lookup( idx );
+    void *new_pf;
+
+    if ( pt_entry == NULL || ( new_pf = global_pf_alloc( numa_policy_node() ) ) == NULL )
+    {
+        return false;
+    }
+
+    migrate_page( cma_rmap[idx].as, pt_entry, (void *)cma_rmap[idx].va, new_pf );
+    cma_free( cma_base + idx * PAGE_SIZE );
+
+    return true;
+}
+
+// Find the first run of `num_frames` frames ending below `max_phys_addr` that holds no contiguous
+// allocation and no page that can't be moved. Returns the index of the run or `cma_num_frames`.
+uint64_t cma_find_run( uint64_t num_frames, uint64_t max_phys_addr )
+{
+    uint64_t start = 0, len = 0, idx;
+
+    for ( idx = 0; idx < cma_num_frames; ++idx )
+    {
+        if ( (uint64_t)( cma_base + ( idx + 1 ) * PAGE_SIZE ) > max_phys_addr )
+        {
+            break;
+        }
+
+        if ( cma_state[idx] == CMA_CONTIG ||
+             ( cma_state[idx] == CMA_MOVABLE && cma_rmap_lookup( idx ) == NULL ) )
+        {
+            len = 0;
+            continue;
+        }
+
+        if ( len++ == 0 )
+        {
+            start = idx;
+        }
+
+        if ( len == num_frames )
+        {
+            return start;
+        }
+    }
+
+    return cma_num_frames;
+}
+
+// Use a frame outside of the contiguous memory area for a movable page if there is one, and only
+// lend out a frame of the area before swapping anything out. Kernel heap pages are looked up in the
+// kernel address space and user pages in the loaded one.
+void *pf_alloc_movable( void *virt_addr )
+{
+    addr_space_t *as = ( IS_KERNEL_ADDR( virt_addr ) ? &kernel_as : curr_as );
+    uint32_t node = numa_policy_node();
+    void *pf = global_pf_alloc( node );
+
+    if ( pf == NULL && ( pf = cma_alloc_movable( as, virt_addr ) ) == NULL )
+    {
+        return pf_alloc( node );
+    }
+
+    pf_info_of( pf )->refcnt = 1;
+
+    return pf;
+}
+
+#pragma endregion
+
+#pragma region Object Mappings
+
+// Add an object mapping to the table, returning its id or `MAP_AREAS_MAX` if the table is full
+uint64_t map_area_alloc(
+    PC_object_t *obj, uint64_t first_index, uint64_t start, uint64_t num_pages, bool writable,
+    addr_space_t *as
+)
+{
+    map_area_t *area;
+    uint64_t id;
+
+    for ( id = 0; id < MAP_AREAS_MAX && map_areas[id] != NULL; ++id )
+    {
+    }
+
+    if ( id == MAP_AREAS_MAX )
+    {
+        return MAP_AREAS_MAX;
+    }
+
+    area = (map_area_t *)kcalloc( 1, sizeof( map_area_t ) );
+
+    if ( area == NULL )
+    {
+        return MAP_AREAS_MAX;
+    }
+
+    area->obj = obj;
+    area->first_index = first_index;
+    area->start = start;
+    area->num_pages = num_pages;
+    area->writable = writable;
+    area->as = as;
+
+    // A scan from the start of the mapping counts as sequential
+    area->next_fault = first_index;
+
+    map_areas[id] = area;
+
+    return id;
+}
+
+// Get the mapping of an object entry
+map_area_t *map_area_of( pg_dir_entry_t *pt_entry )
+{
+    uint64_t id = READ_MAP_ID( pt_entry );
+
+    if ( id >= MAP_AREAS_MAX || map_areas[id] == NULL )
+    {
+        OS_ERROR_HALT( "Invalid object mapping id %lu!\n", id );
+    }
+
+    return map_areas[id];
+}
+
+// Find the id of the mapping starting at `addr` in the loaded address space, or `MAP_AREAS_MAX`
+uint64_t map_area_find( uint64_t addr )
+{
+    uint64_t id;
+
+    for ( id = 0; id < MAP_AREAS_MAX; ++id )
+    {
+        if ( map_areas[id] != NULL && map_areas[id]->start == addr &&
+             ( map_areas[id]->as == curr_as || map_areas[id]->as == &kernel_as ) )
+        {
+            return id;
+        }
+    }
+
+    return MAP_AREAS_MAX;
+}
+
+// Page of the object mapped at `virt_addr`
+uint64_t map_area_index( map_area_t *area, void *virt_addr )
+{
+    return area->first_index + ( (uint64_t)virt_addr - area->start ) / PAGE_SIZE;
+}
+
+// Non-present entry of a page of mapping `id`
+pg_dir_entry_t object_entry( uint64_t id )
+{
+    pg_dir_entry_t entry = { 0 };
+
+    entry.swapped = 1;
+    entry.alloc = 1;
+    WRITE_MAP_ID( &entry, id );
+
+    return entry;
+}
+
+// Map a page of an object onto the page frame of its cached copy, pinning it in the page cache.
+// Returns false if the page couldn't be read in.
+bool map_object_page( map_area_t *area, pg_dir_entry_t *pt_entry, void *virt_addr )
+{
+    void *data = PC_map_page( area->obj, map_area_index( area, virt_addr ) );
+
+    if ( data == NULL )
+    {
+        return false;
+    }
+
+    // The frame is mapped twice now, which keeps compaction from moving it under this entry
+    pf_get( virt_to_phys( data ) );
+
+    // The entry stays an object entry, so it keeps its mapping id
+    WRITE_FRAME_ADDR( pt_entry, virt_to_phys( data ) );
+    pt_entry->writable = area->writable;
+    pt_entry->global = IS_KERNEL_ADDR( virt_addr ) && pge_enabled;
+    pt_entry->present = 1;
+
+    return true;
+}
+
+// Unpin the page behind an object entry that is being unmapped, handing its dirty bit over to the
+// page cache
+void unmap_object_page( pg_dir_entry_t *pt_entry, void *virt_addr )
+{
+    map_area_t *area = map_area_of( pt_entry );
+
+    if ( pt_entry->present )
+    {
+        pf_put( READ_FRAME_ADDR( pt_entry ) );
+        PC_unmap_page( area->obj, map_area_index( area, virt_addr ), pt_entry->dirty );
+    }
+}
+
+// Resolve a fault on an object entry from the page cache. Faults that continue a sequential scan
+// also map a growing window of the pages after them, so the scan takes fewer faults.
+void object_fault( pg_dir_entry_t *pt_entry, void *virt_addr )
+{
+    map_area_t *area = map_area_of( pt_entry );
+    uint64_t i, index = map_area_index( area, virt_addr );
+    uint64_t end = area->first_index + area->num_pages;
+    pg_dir_entry_t *entry;
+    void *addr;
+
+    if ( !map_object_page( area, pt_entry, virt_addr ) )
+    {
+        OS_ERROR_HALT( "Failed to read in page %lu of object at %p!\n", index, virt_addr );
+    }
+
+    if ( index != area->next_fault )
+    {
+        area->ra_pages = 0;
+    }
+    else if ( area->ra_pages < MAP_RA_MAX_PAGES )
+    {
+        area->ra_pages = ( area->ra_pages == 0 ? MAP_RA_MIN_PAGES : 2 * area->ra_pages );
+    }
+
+    // Read ahead, stopping at the end of the mapping or at the first page that is already mapped
+    for ( i = 1; i <= area->ra_pages && index + i < end; ++i )
+    {
+        addr = virt_addr + i * PAGE_SIZE;
+        entry = find_pt_entry( addr );
+
+        if ( entry == NULL || !IS_OBJECT_ENTRY( entry ) || entry->present ||
+             !map_object_page( area, entry, addr ) )
+        {
+            break;
+        }
+    }
+
+    // Non-present entries are never cached, so there is nothing to flush
+    area->next_fault = index + i;
+}
+
+// Give `dst` a copy of every object mapping of `src`, recording the id of each copy for
+// `clone_user_table()`. Returns false if the mapping table is full.
+bool map_areas_clone( addr_space_t *src, addr_space_t *dst )
+{
+    map_area_t *area;
+    uint64_t id;
+
+    for ( id = 0; id < MAP_AREAS_MAX; ++id )
+    {
+        if ( ( area = map_areas[id] ) == NULL || area->as != src )
+        {
+            continue;
+        }
+
+        area->clone_id = map_area_alloc(
+            area->obj, area->first_index, area->start, area->num_pages, area->writable, dst
+        );
+
+        if ( area->clone_id == MAP_AREAS_MAX )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Drop every object mapping of an address space that is being destroyed. Only the pinned pages
+// have to be released, the page tables go along with the rest of the address space.
+void map_areas_release( addr_space_t *as )
+{
+    pg_dir_entry_t *pt_entry;
+    map_area_t *area;
+    uint64_t id, addr, end;
+
+    for ( id = 0; id < MAP_AREAS_MAX; ++id )
+    {
+        if ( ( area = map_areas[id] ) == NULL || area->as != as )
+        {
+            continue;
+        }
+
+        addr = area->start;
+        end = area->start + area->num_pages * PAGE_SIZE;
+
+        while ( ( pt_entry = pt_find_next( as->pml4, &addr, end ) ) != NULL )
+        {
+            unmap_object_page( pt_entry, (void *)addr );
+            addr += PAGE_SIZE;
+        }
+
+        kfree( area );
+        map_areas[id] = NULL;
+    }
+}
+
+#pragma endregion
+
+#pragma region Address Spaces
+
+// Take a free PCID, or `SHARED_PCID` once every PCID is in use
+uint16_t pcid_alloc( void )
+{
+    uint16_t pcid;
+
+    if ( !pcid_enabled )
+    {
+        return KERNEL_PCID;
+    }
+
+    for ( pcid = 0; pcid < PCID_MAX; ++pcid )
+    {
+        if ( !( pcid_bitmap[pcid / 64U] & ( 1UL << ( pcid % 64U ) ) ) )
+        {
+            pcid_bitmap[pcid / 64U] |= ( 1UL << ( pcid % 64U ) );
+            return pcid;
+        }
+    }
+
+    OS_WARN( "Out of PCIDs, address spaces will share PCID %u\n", SHARED_PCID );
+
+    return SHARED_PCID;
+}
+
+// Return a PCID to the pool
+void pcid_free( uint16_t pcid )
+{
+    if ( pcid == KERNEL_PCID || pcid == SHARED_PCID )
+    {
+        return;
+    }
+
+    pcid_bitmap[pcid / 64U] &= ~( 1UL << ( pcid % 64U ) );
+}
+
+// Setup the user regions of an address space
+void addr_space_regions_init( addr_space_t *as )
+{
+    uint64_t i;
+
+    for ( i = 0; i < NUM_USER_REGIONS; ++i )
+    {
+        as->user_regions[i] = va_regions[MMU_VADDR_USTACK + i];
+        va_region_init( &as->user_regions[i] );
+    }
+
+    as->uheap_brk = UHEAP_START;
+}
+
+// Free a page table and every page frame and table below it
+void free_user_table( pg_dir_entry_t *table, uint8_t level, uint64_t first, uint64_t end )
+{
+    uint64_t i;
+
+    for ( i = first; i < end; ++i )
+    {
+        // Object pages were released along with their mappings
+        if ( level == PT_LEVEL_PT && IS_OBJECT_ENTRY( &table[i] ) )
+        {
+            continue;
+        }
+
+        if ( level == PT_LEVEL_PT && table[i].swapped )
+        {
+            swap_slot_put( READ_SWAP_SLOT( &table[i] ) );
+            continue;
+        }
+
+        if ( !table[i].present )
+        {
+            continue;
+        }
+
+        if ( level < PT_LEVEL_PT )
+        {
+            free_user_table( (pg_dir_entry_t *)READ_FRAME_ADDR( &table[i] ), level + 1, 0, 512 );
+            pf_put( READ_FRAME_ADDR( &table[i] ) );
+        }
+        else
+        {
+            // Pages may still be shared with a clone
+            pf_put( READ_FRAME_ADDR( &table[i] ) );
+        }
+    }
+}
+
+// Copy a user page table and every table below it. Writable pages are made read-only and marked
+// copy-on-write in both tables, so only the page tables get copied and not the pages themselves.
+void clone_user_table(
+    pg_dir_entry_t *src, pg_dir_entry_t *dst, uint8_t level, uint64_t first, uint64_t end
+)
+{
+    uint64_t i;
+
+    for ( i = first; i < end; ++i )
+    {
+        if ( !IS_ENTRY_USED( &src[i] ) )
+        {
+            continue;
+        }
+
+        if ( level < PT_LEVEL_PT )
+        {
+            if ( !src[i].present )
+            {
+                continue;
+            }
+
+            // Give the clone its own copy of the child table, keeping the occupancy count
+            dst[i] = src[i];
+            alloc_table_entry( &dst[i] );
+            clone_user_table(
+                (pg_dir_entry_t *)READ_FRAME_ADDR( &src[i] ),
+                (pg_dir_entry_t *)READ_FRAME_ADDR( &dst[i] ), level + 1, 0, 512
+            );
+            continue;
+        }
+
+        // Object pages get faulted in again through the clone's copy of their mapping
+        if ( IS_OBJECT_ENTRY( &src[i] ) )
+        {
+            dst[i] = object_entry( map_area_of( &src[i] )->clone_id );
+            continue;
+        }
+
+        // Pages that are still allocate-on-demand get their own frame in each address space
+        if ( src[i].swapped )
+        {
+            swap_slot_get( READ_SWAP_SLOT( &src[i] ) );
+        }
+        else if ( src[i].present )
+        {
+            if ( src[i].writable || src[i].cow )
+            {
+                src[i].writable = 0;
+                src[i].cow = 1;
+            }
+
+            pf_get( READ_FRAME_ADDR( &src[i] ) );
+        }
+
+        dst[i] = src[i];
+    }
+}
+
+// Resolve a write to a copy-on-write page. The last mapping of a frame takes the frame over,
+// otherwise the page gets a private copy.
+void cow_fault( pg_dir_entry_t *pt_entry, void *virt_addr )
+{
+    void *frame = READ_FRAME_ADDR( pt_entry );
+    pf_info_t *info = pf_info_of( frame );
+
+    if ( info->refcnt > 1 )
+    {
+        void *copy = pf_alloc_movable( virt_addr );
+
+        if ( copy == NULL )
+        {
+            OS_ERROR_HALT( "Out of memory copying page %p!\n", virt_addr );
+        }
+
+        memcpy( copy, frame, PAGE_SIZE );
+        pf_info_of( copy )->flags |= PF_FLAG_MOVABLE;
+        info->refcnt--;
+
+        WRITE_FRAME_ADDR( pt_entry, copy );
+    }
+
+    pt_entry->cow = 0;
+    pt_entry->writable = 1;
+
+    // Drop the read-only translation
+    flush_tlb_page( virt_addr );
+}
+
+// Tear down an address space once its last reference has been dropped
+void addr_space_destroy( addr_space_t *as )
+{
+    addr_space_t **prev;
+    va_range_t *node;
+    uint64_t i;
+
+    // Never tear down the page tables that are loaded. The loaded address space holds a reference,
+    // so this only happens if the references got unbalanced.
+    if ( as == curr_as )
+    {
+        OS_WARN( "Destroying the loaded address space %p!\n", (void *)as );
+
+        load_cr3( kernel_as.pml4, KERNEL_PCID, true );
+        curr_as = &kernel_as;
+    }
+
+    // Unlink the address space, moving the reclaim scan along if it was working on it
+    for ( prev = &as_list_head; *prev != as; prev = &( *prev )->next )
+    {
+    }
+
+    *prev = as->next;
+    num_addr_spaces--;
+
+    if ( swap_cursor_as == as )
+    {
+        swap_cursor_as = as_list_head;
+    }
+
+    // Unpin the object pages before the page tables pointing at them go away
+    map_areas_release( as );
+
+    // Free the private half, and drop the references to the kernel half
+    free_user_table( as->pml4, PT_LEVEL_PML4, KERNEL_PML4_ENTRIES, USER_PML4_END );
+
+    for ( i = 0; i < KERNEL_PML4_ENTRIES; ++i )
+    {
+        pf_put( READ_FRAME_ADDR( &as->pml4[i] ) );
+    }
+
+    pf_put( as->pml4 );
+
+    // Return the free range nodes of the user regions
+    for ( i = 0; i < NUM_USER_REGIONS; ++i )
+    {
+        while ( ( node = as->user_regions[i].free_list ) != NULL )
+        {
+            as->user_regions[i].free_list = node->next;
+            va_node_free( node );
+        }
+    }
+
+    // Stale entries tagged with the PCID get dropped the next time it is loaded
+    pcid_free( as->pcid );
+
+    kfree( as );
+}
+
+#pragma endregion
+
+#pragma region Working Set
+
+// Get the working set estimate of a region, NULL for the user regions of the kernel address space
+mmu_wss_t *wss_of( addr_space_t *as, virt_addr_t region )
+{
+    if ( region < MMU_VADDR_USTACK )
+    {
+        return &kernel_wss[region];
+    }
+
+    return ( as == NULL || as == &kernel_as ? NULL : &as->wss[region - MMU_VADDR_USTACK] );
+}
+
+// Get the age histogram bucket of a page
+uint32_t wss_bucket( uint8_t age )
+{
+    uint32_t bucket = ( age == 0 ? 0 : 64U - __builtin_clzl( age ) );
+
+    return ( bucket < MMU_WSS_AGE_BUCKETS ? bucket : MMU_WSS_AGE_BUCKETS - 1 );
+}
+
+// Sample and clear the accessed bit of a present page. Accessed frames are young again, the others
+// get a scan older, once per scan for frames shared by several pages. Returns the age of the frame.
+uint8_t wss_age_page( pg_dir_entry_t *pt_entry, bool *accessed )
+{
+    pf_info_t *info = pf_info_of( READ_FRAME_ADDR( pt_entry ) );
+
+    // The CPU sets the accessed bit behind our back, so clear it atomically
+    *accessed = ( __atomic_fetch_and( (uint64_t *)pt_entry, ~ACCESSED_BIT_MASK, __ATOMIC_SEQ_CST ) &
+                  ACCESSED_BIT_MASK ) != 0;
+
+    if ( *accessed )
+    {
+        info->age = 0;
+    }
+    else if ( info->wss_gen != wss_gen && info->age < WSS_AGE_MAX )
+    {
+        info->age++;
+    }
+
+    info->wss_gen = wss_gen;
+
+    return info->age;
+}
+
+// Drop the cached translations of a batch of pages whose accessed bits were cleared, otherwise the
+// CPU won't set the bits again. Address spaces that aren't loaded are flushed by their next load.
+void wss_flush( addr_space_t *as, void *pages[], uint32_t num_pages )
+{
+    uint32_t i;
+
+    if ( num_pages == 0 )
+    {
+        return;
+    }
+
+    if ( as != curr_as && as != &kernel_as )
+    {
+        as->needs_flush = true;
+        return;
+    }
+
+    if ( num_pages > TLB_FLUSH_THRESHOLD )
+    {
+        // Kernel pages are global and survive a CR3 reload
+        if ( as == &kernel_as && pge_enabled )
+        {
+            flush_tlb_all();
+        }
+        else
+        {
+            flush_tlb_local();
+        }
+
+        return;
+    }
+
+    for ( i = 0; i < num_pages; ++i )
+    {
+        flush_tlb_page( pages[i] );
+    }
+}
+
+// Scan the resident pages of a region, with interrupts enabled between batches. A huge page counts
+// as all of its pages, aged by its first frame.
+void wss_scan_region( addr_space_t *as, va_region_t *region, mmu_wss_t *wss )
+{
+    uint64_t addr = region->start, num_pages = 0, wss_pages = 0, hist[MMU_WSS_AGE_BUCKETS] = { 0 };
+    pg_dir_entry_t *pt_entry = NULL;
+    void *cleared[WSS_BATCH_PAGES];
+    uint32_t i, num_cleared;
+    unsigned long flags;
+    uint64_t size;
+    bool accessed;
+    uint8_t age;
+
+    while ( true )
+    {
+        // The page tables may not change under a batch
+        flags = save_irqdisable();
+        num_cleared = 0;
+
+        for ( i = 0; i < WSS_BATCH_PAGES; ++i, addr += size )
+        {
+            pt_entry = pt_find_next( as->pml4, &addr, region->end );
+
+            if ( pt_entry == NULL )
+            {
+                break;
+            }
+
+            age = wss_age_page( pt_entry, &accessed );
+            size = LEAF_ENTRY_SIZE( pt_entry );
+
+            if ( accessed )
+            {
+                cleared[num_cleared++] = (void *)addr;
+            }
+
+            hist[wss_bucket( age )] += size / PAGE_SIZE;
+            wss_pages += ( age < MMU_WSS_WINDOW ? size / PAGE_SIZE : 0 );
+            num_pages += size / PAGE_SIZE;
+        }
+
+        wss_flush( as, cleared, num_cleared );
+
+        if ( pt_entry == NULL )
+        {
+            break;
+        }
+
+        irqrestore( flags );
+    }
+
+    wss->num_scans++;
+    wss->num_pages = num_pages;
+    wss->wss_pages = wss_pages;
+    memcpy( wss->age_hist, hist, sizeof( hist ) );
+
+    irqrestore( flags );
+}
+
+// Scan every region of every address space once. The identity map and the reserved region hold
+// no pages worth tracking.
+void wss_scan( void )
+{
+    addr_space_t *as;
+    uint32_t region;
+
+    // Generation 0 marks frames no scan has aged yet
+    if ( ++wss_gen == 0 )
+    {
+        wss_gen = 1;
+    }
+
+    for ( region = MMU_VADDR_KHEAP; region < MMU_VADDR_USTACK; ++region )
+    {
+        if ( region != MMU_VADDR_RES )
+        {
+            wss_scan_region( &kernel_as, &va_regions[region], &kernel_wss[region] );
+        }
+    }
+
+    for ( as = as_list_head; as != NULL; as = as->next )
+    {
+        for ( region = MMU_VADDR_USTACK; as != &kernel_as && region < MMU_VADDR_MAX; ++region )
+        {
+            wss_scan_region(
+                as, &as->user_regions[region - MMU_VADDR_USTACK],
+                &as->wss[region - MMU_VADDR_USTACK]
+            );
+        }
+    }
+
+    wss_last_scan = rdtsc();
+}
+
+#pragma endregion
+
+void decode_error_flags( uint16_t err )
+{
+    /*
+     * Error Flags:
+     *   Bit 0 (P) is the Present flag.
+     *   Bit 1 (R/W) is the Read/Write flag.
+     *   Bit 2 (U/S) is the User/Supervisor flag.
+     *   Bit 3 (RSVD) indicates whether a reserved bit was set in some page-structure entry
+     *   Bit 4 (I/D) is the Instruction/Data flag (1=instruction fetch, 0=data access)
+     *   Bit 5 (PK) indicates a protection-key violation
+     *   Bit 6 (SS) indicates a shadow-stack access fault
+     *   Bit 15 (SGX) indicates an SGX violaton
+     */
+
+    printk(
+        "Error Flags:\n"
+        "------------\n"
+        "Present: %d \n"
+        "R/W:     %d \n"
+        "User:    %d \n"
+        "------------\n"
+        "RSVD:    %d \n"
+        "I/D:     %d \n"
+        "PK:      %d \n"
+        "SS:      %d \n"
+        "SGX:     %d \n"
+        "\n",
+        ( err & 0x1 ), ( err >> 1 ) & 0x1, ( err >> 2 ) & 0x1, ( err >> 3 ) & 0x1,
+        ( err >> 4 ) & 0x1, ( err >> 5 ) & 0x1, ( err >> 6 ) & 0x1, ( err >> 15 ) & 0x1
+    );
+
+    /*
+     *  User/Supervisor   ( Bit 2 )
+     *  |  Read/Write     ( Bit 1 )
+     *  |  |  Present Bit ( Bit 0 )
+     *  |  |  |
+     *  0  0  0 - Supervisory process tried to read a non-present page entry
+     *  0  0  1 - Supervisory process tried to read a page and caused a protection fault
+     *  0  1  0 - Supervisory process tried to write to a non-present page entry
+     *  0  1  1 - Supervisory process tried to write a page and caused a protection fault
+     *  1  0  0 - User process tried to read a non-present page entry
+     *  1  0  1 - User process tried to read a page and caused a protection fault
+     *  1  1  0 - User process tried to write to a non-present page entry
+     *  1  1  1 - User process tried to write a page and caused a protection fault
+     */
+
+    // Check the User/Supervisor bit
+    if ( err & 0b100 )
+    {
+        printk( "User process " );
+    }
+    else
+    {
+        printk( "Supervisory process " );
+    }
+
+    printk( "tried to " );
+
+    // Check the Read/Write bit
+    if ( err & 0b010 )
+    {
+        printk( "write " );
+    }
+    else
+    {
+        printk( "read " );
+    }
+
+    // Check the Present bit
+    if ( err & 0b001 )
+    {
+        printk( "a page and caused a protection fault\n" );
+    }
+    else
+    {
+        printk( "to a non-present page entry\n" );
+    }
+}
+
+void walk_virt_addr( void *virt_addr )
+{
+    printk( "\n" );
+    OS_INFO( "Walking virtual address: %p\n", virt_addr );
+
+    // Get the PML4 entry (Level 4)
+    pg_dir_entry_t *dir_table = curr_as->pml4;
+    uint64_t offset = GET_PAGE_MAP_INDEX( virt_addr );
+    pg_dir_entry_t *entry = dir_table + offset;
+
+    printk(
+        "PML4 Entry:      \n"
+        "    Address: %p  \n"
+        "    Present: %d  \n"
+        "    Writable: %d \n"
+        "    User: %d     \n"
+        "    Accessed: %d \n"
+        "    Dirty: %d    \n"
+        "    Alloc: %d    \n"
+        "    Frame: %p    \n"
+        "    \n",
+        entry, entry->present, entry->writable, entry->user, entry->accessed, entry->dirty,
+        entry->alloc, READ_FRAME_ADDR( entry )
+    );
+
+    // Check if the next entry is present
+    if ( !entry->present )
+    {
+        printk( "PDPT entry in PML4 is not present!\n" );
+        return;
+    }
+
+    // Get the PDPT entry (Level 3)
+    dir_table = (pg_dir_entry_t *)READ_FRAME_ADDR( entry );
+    offset = GET_PAGE_DIR_PTR_INDEX( virt_addr );
+    entry = (pg_dir_entry_t *)( (uint8_t *)dir_table ) + offset;
+
+    printk(
+        "PDPT Entry:      \n"
+        "    Address: %p  \n"
+        "    Present: %d  \n"
+        "    Writable: %d \n"
+        "    User: %d     \n"
+        "    Accessed: %d \n"
+        "    Dirty: %d    \n"
+        "    Alloc: %d    \n"
+        "    Frame: %p    \n"
+        "    \n",
+        entry, entry->present, entry->writable, entry->user, entry->accessed, entry->dirty,
+        entry->alloc, READ_FRAME_ADDR( entry )
+    );
+
+    // Check if the next entry is present
+    if ( !entry->present )
+    {
+        printk( "PD entry is not present!\n" );
+        return;
+    }
+
+    // Get the PD entry (Level 2)
+    dir_table = (pg_dir_entry_t *)READ_FRAME_ADDR( entry );
+    offset = GET_PAGE_DIR_INDEX( virt_addr );
+    entry = (pg_dir_entry_t *)( (uint8_t *)dir_table ) + offset;
+
+    printk(
+        "PD Entry:        \n"
+        "    Address: %p  \n"
+        "    Present: %d  \n"
+        "    Writable: %d \n"
+        "    User: %d     \n"
+        "    Accessed: %d \n"
+        "    Dirty: %d    \n"
+        "    Alloc: %d    \n"
+        "    Frame: %p    \n"
+        "    \n",
+        entry, entry->present, entry->writable, entry->user, entry->accessed, entry->dirty,
+        entry->alloc, READ_FRAME_ADDR( entry )
+    );
+
+    // Check if the next entry is present
+    if ( !entry->present )
+    {
+        printk( "PT entry is not present!\n" );
+        return;
+    }
+
+    // Huge pages end the walk at the PD
+    if ( entry->huge )
+    {
+        printk(
+            "Physical Address: %p (huge page)\n\n",
+            READ_FRAME_ADDR( entry ) + ( (uint64_t)virt_addr & ( HUGE_PAGE_SIZE - 1 ) )
+        );
+        return;
+    }
+
+    dir_table = (pg_dir_entry_t *)READ_FRAME_ADDR( entry );
+    offset = GET_PAGE_TBL_INDEX( virt_addr );
+    entry = (pg_dir_entry_t *)( (uint8_t *)dir_table ) + offset;
+
+    printk(
+        "PT Entry:        \n"
         "    Address: %p  \n"
         "    Present: %d  \n"
         "    Writable: %d \n"
@@ -531,429 +3851,1191 @@ void walk_virt_addr( void *virt_addr )
         entry->alloc, READ_FRAME_ADDR( entry )
     );
 
-    // Check if the page frame is present
-    if ( !entry->present )
+    // Check if the page frame is present
+    if ( !entry->present )
+    {
+        printk( "PT entry is not present!\n" );
+        return;
+    }
+
+    printk(
+        "Physical Address: %p\n\n", READ_FRAME_ADDR( entry ) + GET_PHYS_PAGE_INDEX( virt_addr )
+    );
+}
+
+void __init addr_map_init( void *tag_ptr )
+{
+    // Check if the tag pointer is valid
+    if ( tag_ptr == NULL )
+    {
+        OS_ERROR_HALT( "Invalid multiboot2 tag pointer\n" );
+    }
+
+    kernel_start_addr = &kernel_start;
+    kernel_end_addr = &kernel_end;
+
+    // DEBUG: Check if the kernel start and end addresses are valid
+    if ( kernel_start_addr >= kernel_end_addr )
+    {
+        OS_ERROR_HALT(
+            "Kernel start address (%p) is greater than or equal to the kernel end address (%p)!\n",
+            kernel_start_addr, kernel_end_addr
+        );
+    }
+    // DEBUG: Kernel start address should be 0x100000
+    if ( (uint64_t)kernel_start_addr != 0x100000 )
+    {
+        OS_ERROR_HALT( "Kernel start address (%p) is not 0x100000\n", &kernel_start_addr );
+    }
+
+    // Collect the usable memory and everything in it that must not be handed out
+    if ( MEMBLOCK_init( tag_ptr ) == FAILURE )
+    {
+        OS_ERROR_HALT( "No memory to boot with!\n" );
+    }
+}
+
+// Hand the free memblock ranges over to the page frame allocator, and retire memblock. The range
+// entries are the last thing allocated from memblock.
+void __init pf_ranges_init( void *tag_ptr )
+{
+    uint64_t addr = 0, base, end, num_ranges = 0;
+    pf_range_entry_t *range;
+
+    while ( MEMBLOCK_next_free( &addr, &base, &end ) )
+    {
+        num_ranges++;
+    }
+
+    // Allocating the entries can split a free range in two
+    range_pool_left = num_ranges + 1 + ACPI_MAX_MEM_RANGES;
+    range_pool = (pf_range_entry_t *)MEMBLOCK_alloc(
+        range_pool_left * sizeof( pf_range_entry_t ), PAGE_SIZE, BOOT_MAP_SIZE
+    );
+
+    if ( range_pool == NULL )
+    {
+        OS_ERROR_HALT( "No room for %lu free range entries!\n", range_pool_left );
+    }
+
+    boot_range_add( range_pool, range_pool_left * sizeof( pf_range_entry_t ) );
+
+    MEMBLOCK_retire();
+
+    for ( addr = 0; MEMBLOCK_next_free( &addr, &base, &end ); )
+    {
+        range = range_alloc();
+
+        range->start = (void *)base;
+        range->curr_frame = (void *)base;
+        range->end = (void *)end;
+        range->node = 0;
+        range->next_entry = NULL;
+
+        if ( addr_range_tail == NULL )
+        {
+            addr_range_head = range;
+        }
+        else
+        {
+            addr_range_tail->next_entry = range;
+        }
+
+        addr_range_tail = range;
+    }
+
+    if ( addr_range_head == NULL )
+    {
+        OS_ERROR_HALT( "No free memory left after boot!\n" );
+    }
+
+    // Sort the ranges into NUMA nodes
+    numa_init( tag_ptr );
+}
+
+void page_fault_irq( int __unused irq, int err, void __unused *arg )
+{
+    // Get the CR2 register
+    void *cr2;
+    asm volatile( "movq %%cr2, %0" : "=r"( cr2 ) );
+
+    // Print the error code
+    // OS_ERROR(
+    //    "Page Fault IRQ!\n"
+    //    "  CR2:  %p     \n"
+    //    "  Code: %X     \n"
+    //    "\n",
+    //    cr2, err
+    //);
+
+    // Check if the address needs to be aligned
+    if ( (uint64_t)cr2 % PAGE_SIZE != 0 )
+    {
+        // OS_WARN( "Address %p is not page aligned!\n", cr2 );
+
+        // Align the address
+        cr2 = (void *)( (uint64_t)cr2 & ~( (uint64_t)PAGE_SIZE - 1 ) );
+
+        // OS_WARN( "Address aligned to %p\n\n", cr2 );
+
+        // DEBUG: Walk the virtual address
+        // walk_virt_addr( cr2 );
+    }
+
+    // Get the PT entry, without creating page tables for stray addresses
+    pg_dir_entry_t *pt_entry = find_pt_entry( cr2 );
+
+    // Untouched addresses in a stack region are guard pages
+    if ( ( pt_entry == NULL || !IS_ENTRY_USED( pt_entry ) ) &&
+         ( va_region_of( (uint64_t)cr2 ) == MMU_VADDR_KSTACK ||
+           va_region_of( (uint64_t)cr2 ) == MMU_VADDR_USTACK ) )
+    {
+        OS_ERROR_HALT( "Stack overflow, guard page at %p was hit!\n", cr2 );
+    }
+
+    if ( pt_entry == NULL )
+    {
+        // DEBUG: Walk the virtual address
+        walk_virt_addr( cr2 );
+
+        // Decode the error flags
+        decode_error_flags( err );
+
+        OS_ERROR_HALT( "Page fault at unmapped virtual address %p cannot be recovered!\n", cr2 );
+    }
+
+    // Check for a page of a mapped object
+    if ( !pt_entry->present && IS_OBJECT_ENTRY( pt_entry ) )
+    {
+        object_fault( pt_entry, cr2 );
+    }
+    // Check for allocate on demand
+    else if ( !pt_entry->present && pt_entry->alloc )
+    {
+        // Allocate a new page frame, movable pages can borrow from the contiguous memory area
+        void *phys_page = ( IS_MOVABLE_ADDR( cr2 ) ? pf_alloc_movable( cr2 ) : MMU_pf_alloc() );
+
+        if ( phys_page == NULL )
+        {
+            OS_ERROR_HALT( "Out of memory for page %p!\n", cr2 );
+        }
+
+        // Compaction can move the page to another frame
+        if ( IS_MOVABLE_ADDR( cr2 ) )
+        {
+            pf_info_of( phys_page )->flags |= PF_FLAG_MOVABLE;
+        }
+
+        // Map the page
+        map_page( phys_page, cr2 );
+
+        // Clear the alloc flag
+        pt_entry->alloc = 0;
+
+        // Set the writable flag
+        pt_entry->writable = 1;
+
+        // Non-present entries are never cached by the TLB, so there is nothing to flush here
+
+        // OS_INFO( "PF handler allocated page frame %p for virtual address %p\n\n", phys_page, cr2
+        // );
+    }
+    // Check for a swapped out page
+    else if ( !pt_entry->present && pt_entry->swapped )
+    {
+        swap_in_page( pt_entry, cr2 );
+    }
+    // Check for a write to a copy-on-write page
+    else if ( pt_entry->present && pt_entry->cow && ( err & PF_ERR_WRITE ) )
+    {
+        cow_fault( pt_entry, cr2 );
+    }
+    else
+    {
+        // DEBUG: Walk the virtual address
+        walk_virt_addr( cr2 );
+
+        // Decode the error flags
+        decode_error_flags( err );
+
+        OS_ERROR_HALT(
+            "Page fault at virtual address %p cannot be recovered!\n"
+            "pt_entry->present ......... %d\n"
+            "pt_entry->writable ........ %d\n"
+            "pt_entry->user ............ %d\n"
+            "pt_entry->write_through ... %d\n"
+            "pt_entry->cache_disabled .. %d\n"
+            "pt_entry->accessed ........ %d\n"
+            "pt_entry->dirty ........... %d\n"
+            "pt_entry->huge ............ %d\n"
+            "pt_entry->global .......... %d\n"
+            "pt_entry->swapped ......... %d\n"
+            "pt_entry->alloc ........... %d\n"
+            "pt_entry->cow ............. %d\n"
+            "pt_entry->frame_addr ...... %p\n"
+            "pt_entry->num_used ........ %d\n"
+            "pt_entry->no_execute ...... %d\n"
+            "\n",
+            cr2, pt_entry->present, pt_entry->writable, pt_entry->user, pt_entry->write_through,
+            pt_entry->cache_disabled, pt_entry->accessed, pt_entry->dirty, pt_entry->huge,
+            pt_entry->global, pt_entry->swapped, pt_entry->alloc, pt_entry->cow,
+            READ_FRAME_ADDR( pt_entry ), pt_entry->num_used, pt_entry->no_execute
+        );
+    }
+}
+
+/* Public Functions */
+
+// Initialize the MMU and the address space
+driver_status_t __init MMU_init( void *tag_ptr )
+{
+    uint64_t i;
+
+    // Initialize the address map
+    addr_map_init( tag_ptr );
+
+    // Track the page frames before any of them are handed out
+    pf_info_init();
+
+    // Set aside the contiguous memory area
+    cma_init();
+
+    // Let the page frame allocator take over the free memory
+    pf_ranges_init( tag_ptr );
+
+    // Count the free page frames left over
+    wmark_init();
+    MMU_register_shrinker( &kmalloc_shrinker );
+
+    // Enable global pages and PCIDs before any kernel pages get mapped
+    tlb_features_init();
+
+    // Allocate the Page Map Table (Level 4)
+    kernel_as.pml4 = MMU_pf_alloc();
+
+    // Clear the PML4
+    memset( kernel_as.pml4, 0, PAGE_SIZE );
+
+    // Allocate every kernel page directory pointer table up front, so new address spaces can share
+    // them by copying the kernel half of the PML4 and later kernel mappings show up everywhere
+    for ( i = 0; i < KERNEL_PML4_ENTRIES; ++i )
+    {
+        alloc_table_entry( &kernel_as.pml4[i] );
+        kernel_as.pml4[i].writable = 1;
+    }
+
+    // The kernel image can outgrow the first 2 MiB
+    boot_range_add( kernel_start_addr, (uint64_t)kernel_end_addr - (uint64_t)kernel_start_addr );
+
+    // Map the first 2 MiB of memory
+    void *temp = (void *)MAP_INIT_SIZE;
+    // printk( "\n" );
+    // OS_INFO( "Mapping physical pages from %p to %p\n", NULL, temp );
+    for ( i = 0; i <= (uint64_t)temp; i += PAGE_SIZE )
+    {
+        map_page( (void *)i, (void *)i );
+    }
+
+    // DEBUG: Check if the kernel pages are mapped
+    for ( i = PAGE_SIZE; i < (uint64_t)temp; i += PAGE_SIZE )
+    {
+        void *temp = virt_to_phys( (void *)i );
+
+        if ( (void *)i != temp )
+        {
+            OS_ERROR_HALT(
+                "Pointer mismatch:    \n"
+                "        Physical: %p \n"
+                "        Virtual:  %p \n"
+                "        \n",
+                (void *)i, temp
+            );
+        }
+    }
+    // OS_INFO( "Successfully mapped %lu kernel pages\n\n", i >> 12 );
+
+    // Map the rest of the boot data, it's still used once the boot page tables are gone
+    boot_ranges_map();
+
+    // Load the CR3 Register
+    load_cr3( kernel_as.pml4, KERNEL_PCID, false );
+
+    // OS_INFO( "CR3 Register setup complete\n" );
+
+    // Setup the kernel virtual address regions, the user regions belong to the address space
+    for ( i = 0; i < MMU_VADDR_USTACK; ++i )
+    {
+        va_region_init( &va_regions[i] );
+    }
+
+    addr_space_regions_init( &kernel_as );
+
+    // The identity mapped pages are already in use
+    va_claim( MMU_VADDR_PHYS, PAGE_SIZE, MAP_INIT_SIZE / PAGE_SIZE );
+    boot_ranges_claim();
+
+    // Setup the page fault IRQ
+    if ( IRQ_set_exception_handler( IRQ14_PAGE_FAULT, page_fault_irq, NULL ) )
+    {
+        OS_ERROR_HALT( "Failed to set the page fault IRQ handler\n" );
+    }
+
+    return SUCCESS;
+}
+
+// Allocate a physical page frame from the node picked by the NUMA policy
+void *MMU_pf_alloc( void ) { return pf_alloc( numa_policy_node() ); }
+
+// Allocate a physical page frame from a specific NUMA node, or the closest node with free memory
+void *MMU_pf_alloc_node( uint32_t node )
+{
+    if ( node >= num_numa_nodes )
+    {
+        OS_ERROR( "NUMA node %u does not exist!\n", node );
+        return pf_alloc( numa_policy_node() );
+    }
+
+    return pf_alloc( node );
+}
+
+// Free a physical page frame
+void MMU_pf_free( void *pf )
+{
+    // DEBUG: Check if the page frame is aligned
+    CHECK_PAGE_ALIGNED( pf );
+
+    // DEBUG: Check if the page frame is valid
+    if ( pf == NULL )
+    {
+        OS_ERROR_HALT( "Page frame is NULL!\n" );
+    }
+    else if ( (uint64_t)pf > PHYS_END )
+    {
+        OS_ERROR_HALT( "Page frame is out of bounds!\n" );
+    }
+
+    // Frames lent out by the contiguous memory area go back to it
+    if ( cma_contains( pf ) )
+    {
+        pf_info_of( pf )->refcnt = 0;
+        pf_info_of( pf )->flags &= ~PF_FLAG_MOVABLE;
+        cma_free( pf );
+        return;
+    }
+
+    pf_free( pf, false );
+
+    // OS_INFO( "Page deallocated at %p\n", pf );
+}
+
+// Allocate `num_pages` physically contiguous page frames ending below `max_phys_addr`, or anywhere
+// in the contiguous memory area if it is 0. User pages using the frames are moved elsewhere first.
+// Returns the physical address of the first frame, or NULL.
+void *MMU_alloc_contig( uint64_t num_pages, uint64_t max_phys_addr )
+{
+    uint64_t start, idx;
+
+    if ( num_pages == 0 || num_pages > cma_num_frames )
+    {
+        OS_ERROR( "Can't allocate %lu contiguous pages!\n", num_pages );
+        return NULL;
+    }
+
+    max_phys_addr = ( max_phys_addr == 0 ? ~0UL : max_phys_addr );
+
+    // Pages that fail to move make the run unusable, so look for another one
+    while ( ( start = cma_find_run( num_pages, max_phys_addr ) ) != cma_num_frames )
+    {
+        for ( idx = start; idx < start + num_pages; ++idx )
+        {
+            if ( cma_state[idx] == CMA_MOVABLE && !cma_migrate( idx ) )
+            {
+                break;
+            }
+        }
+
+        if ( idx == start + num_pages && cma_claim_run( start, num_pages ) )
+        {
+            return cma_base + start * PAGE_SIZE;
+        }
+
+        // Out of memory to move pages to
+        if ( idx < start + num_pages && cma_state[idx] == CMA_MOVABLE &&
+             cma_rmap_lookup( idx ) != NULL )
+        {
+            break;
+        }
+    }
+
+    OS_ERROR( "No run of %lu contiguous pages below %p!\n", num_pages, (void *)max_phys_addr );
+
+    return NULL;
+}
+
+// Free page frames allocated with `MMU_alloc_contig()`
+void MMU_free_contig( void *pf, uint64_t num_pages )
+{
+    uint64_t i;
+
+    if ( !cma_contains( pf ) || !cma_contains( (uint8_t *)pf + ( num_pages - 1 ) * PAGE_SIZE ) )
+    {
+        OS_ERROR( "Page frames at %p are not contiguous allocations!\n", pf );
+        return;
+    }
+
+    // Frames that are free or lent out to a page would be handed out twice
+    for ( i = 0; i < num_pages; ++i )
+    {
+        if ( cma_state[( (uint8_t *)pf - cma_base ) / PAGE_SIZE + i] != CMA_CONTIG )
+        {
+            OS_ERROR( "Page frame %p is not a contiguous allocation!\n",
+                      (void *)( (uint8_t *)pf + i * PAGE_SIZE ) );
+            return;
+        }
+    }
+
+    for ( i = 0; i < num_pages; ++i )
+    {
+        MMU_pf_free( (uint8_t *)pf + i * PAGE_SIZE );
+    }
+}
+
+// Give the page frames of the init section back to the allocator. They are filled with `int3`
+// first, so a call into freed init code traps instead of running whatever the frame holds next.
+void MMU_free_init_mem( void )
+{
+    uint8_t *pf;
+
+    for ( pf = (uint8_t *)&init_start; pf < (uint8_t *)&init_end; pf += PAGE_SIZE )
+    {
+        memset( pf, 0xCC, PAGE_SIZE );
+        MMU_pf_free( pf );
+    }
+
+    OS_INFO(
+        "Freed %lu KiB of init memory\n", ( (uint64_t)&init_end - (uint64_t)&init_start ) >> 10
+    );
+}
+
+// Add a cache to the ones asked to give page frames back under memory pressure
+void MMU_register_shrinker( mmu_shrinker_t *shrinker )
+{
+    if ( shrinker == NULL || shrinker->count == NULL || shrinker->scan == NULL )
+    {
+        OS_ERROR( "Invalid shrinker!\n" );
+        return;
+    }
+
+    shrinker->next = shrinker_list;
+    shrinker_list = shrinker;
+}
+
+void MMU_unregister_shrinker( mmu_shrinker_t *shrinker )
+{
+    mmu_shrinker_t **prev;
+
+    for ( prev = &shrinker_list; *prev != NULL; prev = &( *prev )->next )
+    {
+        if ( *prev == shrinker )
+        {
+            *prev = shrinker->next;
+            return;
+        }
+    }
+}
+
+// Number of free page frames, not counting the contiguous memory area
+uint64_t MMU_num_free_frames( void ) { return num_free_frames(); }
+
+// Copy the working set estimate of a region of an address space, NULL being the kernel address
+// space. The kernel regions are shared, so every address space has the same estimate of them.
+// Every estimate is scanned again first if the last scan is older than `WSS_SCAN_CYCLES`.
+driver_status_t MMU_wss_get( addr_space_t *as, virt_addr_t region, mmu_wss_t *wss )
+{
+    mmu_wss_t *src = ( region < MMU_VADDR_MAX ? wss_of( as, region ) : NULL );
+    unsigned long flags;
+
+    if ( src == NULL || wss == NULL )
+    {
+        OS_ERROR( "No working set estimate of region %u!\n", region );
+        return FAILURE;
+    }
+
+    // Nothing scans in the background, so an estimate that has gone stale is brought up to date
+    if ( rdtsc() - wss_last_scan >= WSS_SCAN_CYCLES )
+    {
+        wss_scan();
+    }
+
+    // Scans update the estimate with interrupts disabled
+    flags = save_irqdisable();
+    memcpy( wss, src, sizeof( mmu_wss_t ) );
+    irqrestore( flags );
+
+    return SUCCESS;
+}
+
+// Age every resident page by a scan and update every working set estimate
+void MMU_wss_scan( void ) { wss_scan(); }
+
+// Allocate a 2 MiB aligned block of 512 page frames for a huge page. Freed blocks kept in the pool
+// go first, otherwise the best block gets compacted on the spot. Returns the physical address of
+// the block, or NULL.
+void *MMU_pf_alloc_huge( void )
+{
+    uint8_t *block;
+    uint64_t i;
+
+    if ( ( block = huge_pool_take() ) == NULL )
+    {
+        block = compact_one();
+    }
+
+    if ( block == NULL )
+    {
+        OS_WARN( "No free block for a huge page frame!\n" );
+        return NULL;
+    }
+
+    for ( i = 0; i < PAGES_PER_HUGE; ++i )
+    {
+        pf_info_of( block + i * PAGE_SIZE )->refcnt = 1;
+    }
+
+    return block;
+}
+
+// Free a block allocated with `MMU_pf_alloc_huge()`
+void MMU_pf_free_huge( void *pf )
+{
+    pf_list_entry_t *list = NULL, *entry;
+    unsigned long flags;
+    uint64_t i;
+
+    if ( (uint64_t)pf & ( HUGE_PAGE_SIZE - 1 ) )
+    {
+        OS_ERROR( "Huge page frame %p is not aligned!\n", pf );
+        return;
+    }
+
+    for ( i = 0; i < PAGES_PER_HUGE; ++i )
+    {
+        entry = (pf_list_entry_t *)( (uint8_t *)pf + i * PAGE_SIZE );
+        pf_info_of( entry )->refcnt = 0;
+        pf_info_of( entry )->age = 0;
+        entry->next = list;
+        list = entry;
+    }
+
+    // Keep a few blocks whole, so the next huge pages don't have to be compacted
+    flags = save_irqdisable();
+    binary_semaphore_lock( pf_lock );
+
+    if ( num_huge_pool < COMPACT_POOL_BLOCKS )
+    {
+        entry = (pf_list_entry_t *)pf;
+        entry->next = huge_pool;
+        huge_pool = entry;
+        num_huge_pool++;
+        list = NULL;
+    }
+
+    binary_semaphore_unlock( pf_lock );
+    irqrestore( flags );
+
+    // The block would only flood the CPU cache, so it goes straight back to the free lists
+    global_pf_put( list );
+}
+
+// Number of NUMA nodes
+uint32_t MMU_num_nodes( void ) { return num_numa_nodes; }
+
+// Set the NUMA policy of `MMU_pf_alloc()`, and with it of every demand allocated page including
+// the kernel heap. `node` is only used by `MMU_NUMA_PREFERRED`.
+driver_status_t MMU_set_numa_policy( numa_policy_t policy, uint32_t node )
+{
+    if ( policy == MMU_NUMA_PREFERRED && node >= num_numa_nodes )
+    {
+        OS_ERROR( "NUMA node %u does not exist!\n", node );
+        return FAILURE;
+    }
+
+    numa_policy = policy;
+    numa_preferred_node = node;
+
+    return SUCCESS;
+}
+
+// Allocate a virtual page in a specific region
+void *MMU_alloc_page( virt_addr_t region ) { return MMU_alloc_pages( 1, region ); }
+
+// Allocate multiple contiguous virtual pages from a specific region
+void *MMU_alloc_pages( uint64_t num_pages, virt_addr_t region )
+{
+    // Don't hand out memory that can't be backed
+    if ( !pf_can_commit( num_pages ) )
+    {
+        OS_WARN( "Out of memory for %lu pages!\n", num_pages );
+        return NULL;
+    }
+
+    // Get a free range of virtual addresses
+    uint64_t starting_page = va_alloc( region, num_pages );
+
+    if ( starting_page == 0 )
+    {
+        OS_ERROR( "Out of virtual addresses in region %d!\n", region );
+        return NULL;
+    }
+
+    // Set the allocate on demand bits
+    reserve_pages( starting_page, num_pages );
+
+    // OS_INFO( "Allocated %lu virtual pages starting at %p\n", num_pages, virt_page );
+
+    return (void *)starting_page;
+}
+
+// Reserve a stack of `num_pages` pages with a guard page below it. Only the top page is backed
+// right away, the rest of the stack is allocated on demand. Returns the top of the stack.
+void *MMU_alloc_stack( uint64_t num_pages, virt_addr_t region )
+{
+    uint64_t window = num_pages + STACK_GUARD_PAGES;
+    uint64_t base = ( num_pages == 0 ? 0 : va_alloc( region, window ) );
+
+    if ( base == 0 )
+    {
+        OS_ERROR( "Failed to allocate a %lu page stack in region %d!\n", num_pages, region );
+        return NULL;
+    }
+
+    uint64_t top = base + window * PAGE_SIZE;
+    void *top_pf = MMU_pf_alloc();
+
+    if ( top_pf == NULL )
+    {
+        va_free( base, window );
+        return NULL;
+    }
+
+    // The guard pages at the bottom of the window stay unmapped
+    reserve_pages( base + STACK_GUARD_PAGES * PAGE_SIZE, num_pages - 1 );
+
+    // Back the top page so the first push never faults
+    map_page( top_pf, (void *)( top - PAGE_SIZE ) );
+
+    return (void *)top;
+}
+
+// Free a stack allocated with `MMU_alloc_stack()`, including its guard pages
+void MMU_free_stack( void *stack_top, uint64_t num_pages )
+{
+    uint64_t window = num_pages + STACK_GUARD_PAGES;
+
+    MMU_free_pages( stack_top - window * PAGE_SIZE, window );
+}
+
+// Unmap a virtual page and free its page frame without flushing its TLB entry
+void unmap_page( void *page )
+{
+    pg_dir_entry_t *path[PT_LEVELS];
+    pg_dir_entry_t empty_entry = { 0 };
+
+    // DEBUG: Check if the page is aligned
+    CHECK_PAGE_ALIGNED( page );
+
+    // Get the PT entry
+    pg_dir_entry_t *pt_entry = pt_walk( page, false, path );
+
+    // Nothing to do if the page was never mapped
+    if ( pt_entry == NULL || !IS_ENTRY_USED( pt_entry ) )
+    {
+        return;
+    }
+
+    // Only a part of a huge page goes away, so the huge page is split up. The frame of the page is
+    // free to hold the new page table, which saves allocating one while memory may be short.
+    if ( pt_entry->huge )
+    {
+        void *frame = READ_FRAME_ADDR( pt_entry ) + ( (uint64_t)page & ( HUGE_PAGE_SIZE - 1 ) );
+
+        huge_page_demote( pt_entry, (pg_dir_entry_t *)frame );
+        pt_walk( page, false, path );
+        write_pt_entry( path, empty_entry );
+
+        return;
+    }
+
+    // Object pages go back to the page cache
+    if ( IS_OBJECT_ENTRY( pt_entry ) )
+    {
+        unmap_object_page( pt_entry, page );
+    }
+    // Pages that were never touched don't have a page frame yet
+    else if ( pt_entry->present )
+    {
+        // Free the page frame, unless a clone still maps it
+        pf_put( READ_FRAME_ADDR( pt_entry ) );
+    }
+    else if ( pt_entry->swapped )
+    {
+        swap_slot_put( READ_SWAP_SLOT( pt_entry ) );
+    }
+
+    // Reset the PT entry
+    write_pt_entry( path, empty_entry );
+
+    // Free the page tables that are now empty
+    reclaim_tables( path, PT_LEVEL_PD, page );
+}
+
+// Unmap a huge page and give its block back without splitting it up or flushing its TLB entry.
+// Returns false if `block` isn't the start of a huge page.
+bool unmap_huge_page( void *block )
+{
+    pg_dir_entry_t *path[PT_LEVELS];
+    pg_dir_entry_t *pd_entry = pt_walk( block, false, path );
+
+    if ( pd_entry == NULL || !pd_entry->huge )
+    {
+        return false;
+    }
+
+    MMU_pf_free_huge( READ_FRAME_ADDR( pd_entry ) );
+
+    memset( pd_entry, 0, sizeof( pg_dir_entry_t ) );
+    path[PT_LEVEL_PDPT]->num_used--;
+
+    reclaim_tables( path, PT_LEVEL_PDPT, block );
+
+    return true;
+}
+
+// Free a virtual page
+void MMU_free_page( void *page )
+{
+    unmap_page( page );
+
+    // Only the freed page has to leave the TLB
+    flush_tlb_page( page );
+
+    // Return the address to its region
+    va_free( (uint64_t)page, 1 );
+
+    // OS_INFO( "Freed virtual page at %p\n", page );
+}
+
+// Free multiple contiguous virtual pages
+void MMU_free_pages( void *page, uint64_t num_pages )
+{
+    uint64_t i;
+    void *addr;
+
+    for ( i = 0; i < num_pages; ++i )
+    {
+        addr = page + ( i * PAGE_SIZE );
+
+        // Huge pages entirely inside the range are freed whole, only the ends get split up
+        if ( (uint64_t)addr % HUGE_PAGE_SIZE == 0 && num_pages - i >= PAGES_PER_HUGE &&
+             unmap_huge_page( addr ) )
+        {
+            i += PAGES_PER_HUGE - 1;
+            continue;
+        }
+
+        unmap_page( addr );
+    }
+
+    // Invalidate the whole range at once
+    MMU_flush_tlb_range( page, num_pages );
+
+    // Return the addresses to their region
+    va_free( (uint64_t)page, num_pages );
+
+    // OS_INFO( "Freed %lu virtual pages starting at %p\n", num_pages, page );
+}
+
+// Map `len` bytes of an object starting at `offset`, which has to be page aligned. Pages are read
+// in through the page cache as they are touched, and writable mappings write to the cached pages.
+// Kernel mappings go in the kernel heap, the rest in the user heap of the loaded address space.
+void *MMU_map_object( PC_object_t *obj, uint64_t offset, uint64_t len, uint32_t prot )
+{
+    bool kernel = ( prot & MMU_PROT_KERNEL ) != 0;
+    virt_addr_t region = ( kernel ? MMU_VADDR_KHEAP : MMU_VADDR_UHEAP );
+    uint64_t num_pages = ( len + PAGE_SIZE - 1 ) / PAGE_SIZE;
+    uint64_t i, id, start;
+    pg_dir_entry_t *path[PT_LEVELS];
+
+    if ( obj == NULL || len == 0 || offset % PAGE_SIZE != 0 || offset >= PC_object_size( obj ) ||
+         len > PC_object_size( obj ) - offset )
+    {
+        OS_ERROR( "Invalid mapping of %lu bytes at offset %lu!\n", len, offset );
+        return NULL;
+    }
+
+    start = va_alloc( region, num_pages );
+
+    if ( start == 0 )
+    {
+        OS_ERROR( "Out of virtual addresses in region %d!\n", region );
+        return NULL;
+    }
+
+    id = map_area_alloc(
+        obj, offset / PAGE_SIZE, start, num_pages, ( prot & MMU_PROT_WRITE ) != 0,
+        ( kernel ? &kernel_as : curr_as )
+    );
+
+    if ( id == MAP_AREAS_MAX )
     {
-        printk( "PT entry is not present!\n" );
+        OS_ERROR( "Too many object mappings!\n" );
+        va_free( start, num_pages );
+        return NULL;
+    }
+
+    // Every page starts out non-present, pointing at the mapping
+    for ( i = 0; i < num_pages; ++i )
+    {
+        pt_walk( (void *)( start + i * PAGE_SIZE ), true, path );
+        write_pt_entry( path, object_entry( id ) );
+    }
+
+    return (void *)start;
+}
+
+// Unmap a mapping made by `MMU_map_object()`. Dirty pages are left to the page cache to write back.
+void MMU_unmap_object( void *addr )
+{
+    uint64_t id = map_area_find( (uint64_t)addr );
+
+    if ( id == MAP_AREAS_MAX )
+    {
+        OS_ERROR( "No object mapping at %p!\n", addr );
         return;
     }
 
-    printk(
-        "Physical Address: %p\n\n", READ_FRAME_ADDR( entry ) + GET_PHYS_PAGE_INDEX( virt_addr )
-    );
+    // Unmapping the pages unpins them
+    MMU_free_pages( addr, map_areas[id]->num_pages );
+
+    kfree( map_areas[id] );
+    map_areas[id] = NULL;
 }
 
-void addr_map_init( void *tag_ptr )
+// Write back the pages dirtied through a mapping made by `MMU_map_object()`. Returns 0 on success.
+int MMU_sync_object( void *addr )
 {
-    uint64_t i;
+    uint64_t i, id = map_area_find( (uint64_t)addr );
+    map_area_t *area;
 
-    // Check if the tag pointer is valid
-    if ( tag_ptr == NULL )
+    if ( id == MAP_AREAS_MAX )
     {
-        OS_ERROR_HALT( "Invalid multiboot2 tag pointer\n" );
+        OS_ERROR( "No object mapping at %p!\n", addr );
+        return -1;
     }
 
-    // Get the MMAP entries from the multiboot2 tag
-    get_multiboot2_mmap_info( tag_ptr, &mmap_entries, &num_mmap_entries );
+    area = map_areas[id];
 
-    // Check if there are any MMAP entries
-    if ( num_mmap_entries == 0 )
+    // The page cache only sees the dirty bits of its own mappings
+    for ( i = 0; i < area->num_pages; ++i )
     {
-        OS_ERROR( "No memory map entries found???\n" );
-        HLT();
+        if ( test_and_clear_pte_bits( (void *)( area->start + i * PAGE_SIZE ), DIRTY_BIT_MASK ) )
+        {
+            PC_set_dirty( area->obj, area->first_index + i );
+        }
     }
 
-    kernel_start_addr = &kernel_start;
-    kernel_end_addr = &kernel_end;
+    return PC_sync( area->obj );
+}
 
-    // DEBUG: Check if the kernel start and end addresses are valid
-    if ( kernel_start_addr >= kernel_end_addr )
+// Use `dev` as the swap area. Cold user pages get swapped out to it once physical memory runs out.
+// Writing to the device must not need new page frames, so a RAM disk has to be fully backed.
+driver_status_t MMU_swap_init( BlockDevice_t *dev )
+{
+    if ( dev == NULL || dev->blk_size == 0 || PAGE_SIZE % dev->blk_size != 0 )
     {
-        OS_ERROR_HALT(
-            "Kernel start address (%p) is greater than or equal to the kernel end address (%p)!\n",
-            kernel_start_addr, kernel_end_addr
-        );
+        OS_ERROR( "Invalid swap device!\n" );
+        return FAILURE;
     }
-    // DEBUG: Kernel start address should be 0x100000
-    if ( (uint64_t)kernel_start_addr != 0x100000 )
+
+    num_swap_slots = dev->num_blks / ( PAGE_SIZE / dev->blk_size );
+
+    // Slot 0 is never used
+    if ( num_swap_slots < 2 )
     {
-        OS_ERROR_HALT( "Kernel start address (%p) is not 0x100000\n", &kernel_start_addr );
+        OS_ERROR( "Swap device is too small!\n" );
+        return FAILURE;
     }
-    // DEBUG: Throw an error if the mmap entries don't start at 0x0
-    if ( mmap_entries[0].addr != 0x0 )
+
+    swap_map = (uint16_t *)kcalloc( num_swap_slots, sizeof( uint16_t ) );
+
+    if ( swap_map == NULL )
     {
-        OS_ERROR_HALT( "First MMAP entries start at %p, not 0x0!\n", (void *)mmap_entries[0].addr );
+        OS_ERROR( "Failed to allocate the swap map!\n" );
+        return FAILURE;
     }
 
-    // Setup the local heap
-    memset( local_heap_ptr, 0, PAGE_SIZE );
+    swap_dev = dev;
+    swap_next_slot = 1;
 
-    addr_range_head = (pf_range_entry_t *)local_heap_ptr;
-    addr_range_curr = addr_range_head;
+    OS_INFO( "Swap area with %lu pages is ready\n", num_swap_slots - 1 );
 
-    void *mmap_start, *mmap_end;
+    return SUCCESS;
+}
 
-    // Start moving the MMAP entries to the linked list of valid addresses
-    for ( i = 0; i < num_mmap_entries; ++i )
-    {
-        // Check if the MMAP entry is available
-        if ( mmap_entries[i].type != MULTIBOOT_MEMORY_AVAILABLE )
-        {
-            continue;
-        }
+// Test and clear the accessed bit of a page, so the next access to the page sets it again. An
+// access the latest working set scan found counts as well, and is used up the same way.
+bool MMU_test_and_clear_accessed( void *page )
+{
+    pg_dir_entry_t *pt_entry;
+    bool accessed;
 
-        // Check the kernel heap pointer first
-        if ( local_heap_ptr == NULL || local_heap_ptr > (uint8_t *)( PAGE_SIZE << 1 ) )
-        {
-            OS_ERROR_HALT( "Heap pointer is NULL!? :(\n" );
-        }
+    accessed = test_and_clear_pte_bits( page, ACCESSED_BIT_MASK );
+    pt_entry = find_pt_entry( page );
 
-        mmap_start = (void *)mmap_entries[i].addr;
-        mmap_end = (void *)( mmap_entries[i].addr + mmap_entries[i].len );
+    if ( pt_entry != NULL && pt_entry->present && wss_page_young( pt_entry ) )
+    {
+        pf_info_of( READ_FRAME_ADDR( pt_entry ) )->wss_gen = 0;
+        accessed = true;
+    }
 
-        // Add a new entry to the linked list
-        addr_range_curr->next_entry = (pf_range_entry_t *)local_heap_ptr;
-        local_heap_ptr += sizeof( pf_range_entry_t );
+    return accessed;
+}
 
-        // Move the current pointer to the next entry
-        addr_range_curr = addr_range_curr->next_entry;
+// Test and clear the dirty bit of a page, so the next write to the page sets it again
+bool MMU_test_and_clear_dirty( void *page )
+{
+    return test_and_clear_pte_bits( page, DIRTY_BIT_MASK );
+}
 
-        // Does the kernel reside in the MMAP entry?
-        if ( mmap_start <= kernel_start_addr && kernel_end_addr <= mmap_end )
-        {
-            // If the kernel starts at the beginning of the MMAP entry, then we need can skip
-            // the entry that would have come before the kernel
-            if ( kernel_start_addr != mmap_start )
-            {
-                // Setup the first entry before the kernel
-                addr_range_curr->start = mmap_start;
-                addr_range_curr->end = kernel_start_addr;
-                addr_range_curr->curr_frame = addr_range_curr->start;
+// Check if a page is mapped as part of a huge page
+bool MMU_is_huge_page( void *page )
+{
+    pg_dir_entry_t *pt_entry = find_pt_entry( page );
 
-                addr_range_curr->next_entry = (pf_range_entry_t *)local_heap_ptr;
-                local_heap_ptr += sizeof( pf_range_entry_t );
+    return pt_entry != NULL && pt_entry->present && pt_entry->huge;
+}
 
-                addr_range_curr = addr_range_curr->next_entry;
-            }
+// Invalidate the TLB entries for a range of pages, falling back to a full flush for large ranges
+void MMU_flush_tlb_range( void *start, uint64_t num_pages )
+{
+    uint64_t i;
 
-            // Setup the next entry after the kernel
-            addr_range_curr->start = PAGE_ALIGN_ADDR( kernel_end_addr );
-            addr_range_curr->end = mmap_end;
-            addr_range_curr->curr_frame = addr_range_curr->start;
-            addr_range_curr->next_entry = NULL;
+    if ( num_pages > TLB_FLUSH_THRESHOLD )
+    {
+        // Kernel pages are global and survive a CR3 reload
+        if ( IS_KERNEL_ADDR( start ) && pge_enabled )
+        {
+            flush_tlb_all();
         }
         else
         {
-            // Setup the new entry
-            addr_range_curr->start = mmap_start;
-            addr_range_curr->end = mmap_end;
-            addr_range_curr->curr_frame = addr_range_curr->start;
-            addr_range_curr->next_entry = NULL;
+            flush_tlb_local();
         }
 
-        // DEBUG: Check if the linked list of valid addresses is valid
-        if ( addr_range_curr == NULL )
-        {
-            OS_ERROR_HALT( "addr_range_curr is NULL!? i = %ld\n", i );
-        }
+        return;
     }
 
-    // Point the tail to the current entry
-    addr_range_tail = addr_range_curr;
-
-    // Move the current pointer to the head
-    addr_range_curr = addr_range_head;
-
-    // Adjust the current frame to start on page 2
-    addr_range_curr->curr_frame = (void *)( PAGE_SIZE << 1 );
-
-    // DEBUG: Check if the linked list of valid addresses is valid
-    if ( addr_range_head == NULL || addr_range_tail == NULL )
+    for ( i = 0; i < num_pages; ++i )
     {
-        OS_ERROR_HALT( "addr_range_head or addr_range_tail is NULL!\n" );
+        flush_tlb_page( start + ( i * PAGE_SIZE ) );
     }
 }
 
-void page_fault_irq( int __unused irq, int err, void __unused *arg )
+// Create an empty address space that shares the kernel half of the kernel address space
+addr_space_t *MMU_addr_space_create( void )
 {
-    // Get the CR2 register
-    void *cr2;
-    asm volatile( "movq %%cr2, %0" : "=r"( cr2 ) );
-
-    // Print the error code
-    // OS_ERROR(
-    //    "Page Fault IRQ!\n"
-    //    "  CR2:  %p     \n"
-    //    "  Code: %X     \n"
-    //    "\n",
-    //    cr2, err
-    //);
+    addr_space_t *as = (addr_space_t *)kmalloc( sizeof( addr_space_t ) );
+    uint64_t i;
 
-    // Check if the address needs to be aligned
-    if ( (uint64_t)cr2 % PAGE_SIZE != 0 )
+    if ( as == NULL )
     {
-        // OS_WARN( "Address %p is not page aligned!\n", cr2 );
-
-        // Align the address
-        cr2 = (void *)( (uint64_t)cr2 & ~( (uint64_t)PAGE_SIZE - 1 ) );
-
-        // OS_WARN( "Address aligned to %p\n\n", cr2 );
-
-        // DEBUG: Walk the virtual address
-        // walk_virt_addr( cr2 );
+        return NULL;
     }
 
-    // Get the PT entry
-    pg_dir_entry_t *pt_entry = get_pt_entry( cr2 );
+    as->pml4 = MMU_pf_alloc();
 
-    // Check for allocate on demand
-    if ( !pt_entry->present && pt_entry->alloc )
+    if ( as->pml4 == NULL )
     {
-        // Allocate a new page frame
-        void *phys_page = MMU_pf_alloc();
-
-        // Map the page
-        map_page( phys_page, cr2 );
-
-        // Clear the alloc flag
-        pt_entry->alloc = 0;
+        kfree( as );
+        return NULL;
+    }
 
-        // Set the writable flag
-        pt_entry->writable = 1;
+    memset( as->pml4, 0, PAGE_SIZE );
 
-        // Flush the page table
-        flush_pg_tbl( cr2 );
+    // Share the kernel page directory pointer tables by reference, each one counts every PML4
+    // pointing at it
+    memcpy( as->pml4, kernel_as.pml4, KERNEL_PML4_ENTRIES * sizeof( pg_dir_entry_t ) );
 
-        // OS_INFO( "PF handler allocated page frame %p for virtual address %p\n\n", phys_page, cr2
-        // );
+    for ( i = 0; i < KERNEL_PML4_ENTRIES; ++i )
+    {
+        pf_get( READ_FRAME_ADDR( &as->pml4[i] ) );
     }
-    // else if ( pt_entry->present )
-    //{
-    //     // TODO: Check if the page is read-only and if it can be made writable
 
-    //    // Flush the entire page table
-    //    flush_pg_tbl( NULL );
-    //}
-    else
-    {
-        // DEBUG: Walk the virtual address
-        walk_virt_addr( cr2 );
+    // A reused PCID can still tag entries of its previous owner, so the first load flushes them
+    as->pcid = pcid_alloc();
+    as->needs_flush = true;
+    as->refcnt = 1;
 
-        // Decode the error flags
-        decode_error_flags( err );
+    addr_space_regions_init( as );
+    memset( as->wss, 0, sizeof( as->wss ) );
 
-        OS_ERROR_HALT(
-            "Page fault at virtual address %p cannot be recovered!\n"
-            "pt_entry->present ......... %d\n"
-            "pt_entry->writable ........ %d\n"
-            "pt_entry->user ............ %d\n"
-            "pt_entry->write_through ... %d\n"
-            "pt_entry->cache_disabled .. %d\n"
-            "pt_entry->accessed ........ %d\n"
-            "pt_entry->bit_6 ........... %d\n"
-            "pt_entry->bit_7 ........... %d\n"
-            "pt_entry->bit_8 ........... %d\n"
-            "pt_entry->dirty ........... %d\n"
-            "pt_entry->alloc ........... %d\n"
-            "pt_entry->bit_B ........... %d\n"
-            "pt_entry->frame_addr ...... %p\n"
-            "pt_entry->unused .......... %d\n"
-            "pt_entry->no_execute ...... %d\n"
-            "\n",
-            cr2, pt_entry->present, pt_entry->writable, pt_entry->user, pt_entry->write_through,
-            pt_entry->cache_disabled, pt_entry->accessed, pt_entry->bit_6, pt_entry->bit_7,
-            pt_entry->bit_8, pt_entry->dirty, pt_entry->alloc, pt_entry->bit_B,
-            READ_FRAME_ADDR( pt_entry ), pt_entry->unused, pt_entry->no_execute
-        );
-    }
-}
+    // Add the address space to the list the reclaim scan goes through
+    as->swap_cursor = USTACK_END;
+    as->next = as_list_head;
+    as_list_head = as;
+    num_addr_spaces++;
 
-/* Public Functions */
+    return as;
+}
 
-// Initialize the MMU and the address space
-driver_status_t MMU_init( void *tag_ptr )
+// Clone an address space. The clone shares every page with `src` copy-on-write, so the cost is
+// the copy of the user page tables.
+addr_space_t *MMU_addr_space_clone( addr_space_t *src )
 {
+    addr_space_t *as;
+    va_range_t *range, **tail;
     uint64_t i;
 
-    // Initialize the address map
-    addr_map_init( tag_ptr );
+    if ( src == NULL )
+    {
+        src = curr_as;
+    }
 
-    // Allocate the Page Map Table (Level 4)
-    pml4 = MMU_pf_alloc();
+    as = MMU_addr_space_create();
 
-    // Clear the PML4
-    memset( pml4, 0, PAGE_SIZE );
+    if ( as == NULL )
+    {
+        return NULL;
+    }
 
-    // Map the first 2 MiB of memory
-    void *temp = (void *)MAP_INIT_SIZE;
-    // printk( "\n" );
-    // OS_INFO( "Mapping physical pages from %p to %p\n", NULL, temp );
-    for ( i = 0; i <= (uint64_t)temp; i += PAGE_SIZE )
+    // Object mappings are shared rather than copied, but every address space has its own
+    if ( !map_areas_clone( src, as ) )
     {
-        map_page( (void *)i, (void *)i );
+        OS_ERROR( "Too many object mappings to clone address space %p!\n", (void *)src );
+        MMU_addr_space_put( as );
+        return NULL;
     }
 
-    // DEBUG: Check if the kernel pages are mapped
-    for ( i = PAGE_SIZE; i < (uint64_t)temp; i += PAGE_SIZE )
+    clone_user_table( src->pml4, as->pml4, PT_LEVEL_PML4, KERNEL_PML4_ENTRIES, USER_PML4_END );
+
+    // Copy the free ranges of the user regions
+    for ( i = 0; i < NUM_USER_REGIONS; ++i )
     {
-        void *temp = virt_to_phys( (void *)i );
+        va_region_t *region = &as->user_regions[i];
 
-        if ( (void *)i != temp )
+        va_node_free( region->free_list );
+        tail = &region->free_list;
+
+        for ( range = src->user_regions[i].free_list; range != NULL; range = range->next )
         {
-            OS_ERROR_HALT(
-                "Pointer mismatch:    \n"
-                "        Physical: %p \n"
-                "        Virtual:  %p \n"
-                "        \n",
-                (void *)i, temp
-            );
+            *tail = va_node_alloc();
+            ( *tail )->start = range->start;
+            ( *tail )->num_pages = range->num_pages;
+            tail = &( *tail )->next;
         }
-    }
-    // OS_INFO( "Successfully mapped %lu kernel pages\n\n", i >> 12 );
 
-    // Load the CR3 Register
-    asm volatile( "movq %0, %%cr3" : : "r"( pml4 ) );
+        *tail = NULL;
+    }
 
-    // OS_INFO( "CR3 Register setup complete\n" );
+    as->uheap_brk = src->uheap_brk;
 
-    // Setup the page fault IRQ
-    if ( IRQ_set_exception_handler( IRQ14_PAGE_FAULT, page_fault_irq, NULL ) )
+    // The writable translations of `src` are stale now
+    if ( src == curr_as )
     {
-        OS_ERROR_HALT( "Failed to set the page fault IRQ handler\n" );
+        flush_tlb_local();
+    }
+    else
+    {
+        src->needs_flush = true;
     }
 
-    return SUCCESS;
+    return as;
 }
 
-// Allocate a physical page frame
-void *MMU_pf_alloc( void )
+// Take a reference to an address space
+void MMU_addr_space_get( addr_space_t *as )
 {
-    // Check if there are any free pages
-    if ( pf_free_list_head == NULL )
+    // The kernel address space is never destroyed and doesn't need counting
+    if ( as != NULL && as != &kernel_as )
     {
-        // Allocate a new page frame
-        return alloc_new_pf();
+        as->refcnt++;
     }
-
-    // Get the next free page frame
-    pf_list_entry_t *pf = pf_free_list_head;
-    pf_free_list_head = pf_free_list_head->next;
-
-    // OS_INFO( "Allocated physical page %p\n", pf );
-
-    return pf;
 }
 
-// Free a physical page frame
-void MMU_pf_free( void *pf )
+// Drop a reference to an address space, destroying it with the last reference
+void MMU_addr_space_put( addr_space_t *as )
 {
-    // DEBUG: Check if the page frame is aligned
-    CHECK_PAGE_ALIGNED( pf );
-
-    // DEBUG: Check if the page frame is valid
-    if ( pf == NULL )
+    // The kernel address space is never destroyed
+    if ( as == NULL || as == &kernel_as )
     {
-        OS_ERROR_HALT( "Page frame is NULL!\n" );
+        return;
     }
-    else if ( (uint64_t)pf > PHYS_END )
+
+    if ( as->refcnt == 0 )
     {
-        OS_ERROR_HALT( "Page frame is out of bounds!\n" );
+        OS_ERROR( "Address space %p has already been destroyed!\n", (void *)as );
+        return;
     }
 
-    // Add the page frame to the free list
-    ( (pf_list_entry_t *)pf )->next = pf_free_list_head;
-    pf_free_list_head = pf;
-
-    // OS_INFO( "Page deallocated at %p\n", pf_free_list_head );
-}
-
-// Allocate a virtual page in a specific region
-void *MMU_alloc_page( virt_addr_t region )
-{
-    // Get the next available virtual address
-    void *virt_page = virt_addr_bank[region];
-
-    // Setup the page table entry
-    pg_dir_entry_t *pt_entry = get_pt_entry( virt_page );
-
-    // Set the allocate on demand bit
-    pt_entry->alloc = 1;
-    pt_entry->present = 0;
-
-    // Increment the virtual address
-    virt_addr_bank[region] += PAGE_SIZE;
-
-    // OS_INFO( "Allocated virtual page at %p\n", virt_page );
-
-    return virt_page;
+    if ( --as->refcnt == 0 )
+    {
+        addr_space_destroy( as );
+    }
 }
 
-// Allocate multiple contiguous virtual pages from a specific region
-void *MMU_alloc_pages( uint64_t num_pages, virt_addr_t region )
+// Switch to an address space. CR3 is only loaded if the address space actually changes, and with
+// PCIDs the TLB entries of both are kept. Kernel threads pass NULL and borrow whichever address
+// space is loaded ("lazy TLB"), since they only ever touch the shared kernel half.
+void MMU_addr_space_switch( addr_space_t *as )
 {
-    uint64_t i;
-    void *starting_page = virt_addr_bank[region];
+    addr_space_t *prev = curr_as;
 
-    for ( i = 0; i < num_pages; ++i )
+    if ( as == NULL || as == curr_as )
     {
-        MMU_alloc_page( region );
+        return;
     }
 
-    // OS_INFO( "Allocated %lu virtual pages starting at %p\n", num_pages, virt_page );
-
-    return starting_page;
-}
-
-// Free a virtual page
-void MMU_free_page( void *page )
-{
-    // DEBUG: Check if the page is aligned
-    CHECK_PAGE_ALIGNED( page );
-
-    // Get the PT entry
-    pg_dir_entry_t *pt_entry = get_pt_entry( page );
+    // The loaded address space holds a reference, so its page tables stay alive while kernel
+    // threads borrow it after its last thread is gone
+    MMU_addr_space_get( as );
 
-    // Get the page frame
-    void *pf = READ_FRAME_ADDR( pt_entry );
+    load_cr3( as->pml4, as->pcid, !as->needs_flush );
 
-    // Free the page frame
-    MMU_pf_free( pf );
+    // Every address space on the shared PCID has to flush whatever the last one left behind
+    as->needs_flush = ( as->pcid == SHARED_PCID );
 
-    // Reset the PT entry
-    memset( pt_entry, 0, sizeof( pg_dir_entry_t ) );
+    curr_as = as;
 
-    // OS_INFO( "Freed virtual page at %p\n", page );
+    // Tears down the previous address space if only the borrowed reference was left
+    MMU_addr_space_put( prev );
 }
 
-// Free multiple contiguous virtual pages
-void MMU_free_pages( void *page, uint64_t num_pages )
-{
-    uint64_t i;
-
-    for ( i = 0; i < num_pages; ++i )
-    {
-        MMU_free_page( page + ( i * PAGE_SIZE ) );
-    }
-
-    // OS_INFO( "Freed %lu virtual pages starting at %p\n", num_pages, page );
-}
+// Get the address space loaded into CR3
+addr_space_t *MMU_addr_space_current( void ) { return curr_as; }
 
 /**
  * @brief Increments the kernels's heap by `increment` bytes. Calling with an increment of 0 can
- *        be used to find the current location of the program break.
+ *        be used to find the current location of the program break. A negative increment shrinks
+ *        the heap and releases the pages above the new break.
  */
-void *kbrk( uint64_t increment )
+void *kbrk( int64_t increment )
 {
-    void *old_brk = virt_addr_bank[MMU_VADDR_KHEAP];
+    void *old_brk;
 
-    // Check if the increment is valid
-    if ( increment == 0 )
+    // Fail the heap rather than the page faults that would back it
+    if ( increment > 0 && !pf_can_commit( (uint64_t)increment / PAGE_SIZE + 1 ) )
     {
-        return old_brk;
+        return (void *)( -1 );
     }
 
-    // Allocate the new pages
-    MMU_alloc_pages( increment / PAGE_SIZE, MMU_VADDR_KHEAP );
+    old_brk = move_brk( &kheap_brk, increment, MMU_VADDR_KHEAP );
+
+    // The heap has moved on to a new 2 MiB block, so the ones below it may have filled up
+    if ( increment > 0 && old_brk != (void *)( -1 ) &&
+         (uint64_t)old_brk / HUGE_PAGE_SIZE != kheap_brk / HUGE_PAGE_SIZE )
+    {
+        thp_scan();
+    }
 
     return old_brk;
 }
@@ -962,20 +5044,14 @@ void *kbrk( uint64_t increment )
  * @brief Increments the program's data space by increment bytes. Calling with an
  *        increment of 0 can be used to find the current location of the program break.
  */
-void *sbrk( uint64_t increment )
+void *sbrk( int64_t increment )
 {
-    void *old_brk = virt_addr_bank[MMU_VADDR_UHEAP];
-
-    // Check if the increment is valid
-    if ( increment == 0 )
+    if ( increment > 0 && !pf_can_commit( (uint64_t)increment / PAGE_SIZE + 1 ) )
     {
-        return old_brk;
+        return (void *)( -1 );
     }
 
-    // Allocate the new pages
-    MMU_alloc_pages( increment / PAGE_SIZE, MMU_VADDR_UHEAP );
-
-    return old_brk;
+    return move_brk( &curr_as->uheap_brk, increment, MMU_VADDR_UHEAP );
 }
 
 /*** End of File ***/
\ No newline at end of file
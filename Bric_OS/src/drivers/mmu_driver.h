@@ -14,13 +14,26 @@
 
 /* Includes */
 
+# include "block_dev.h"
 # include "common.h"
 # include "multiboot2.h"
+# include "page_cache.h"
 
 /* Defines */
 
 # define PAGE_SIZE ( 4096U )  // 4 KB Pages
 
+// Object mapping protection flags, every mapping can be read
+# define MMU_PROT_READ   ( 1U << 0U )
+# define MMU_PROT_WRITE  ( 1U << 1U )
+# define MMU_PROT_KERNEL ( 1U << 2U )  // Map into the kernel heap instead of the user heap
+
+// Working set estimates. Bucket 0 of the age histogram holds the pages accessed since the last
+// scan, bucket `i` the pages last accessed 2^(i-1) to 2^i - 1 scans ago, and the last bucket every
+// older page. The working set is the pages accessed in the last `MMU_WSS_WINDOW` scans.
+# define MMU_WSS_AGE_BUCKETS ( 8U )
+# define MMU_WSS_WINDOW      ( 4U )
+
 /* Macros */
 
 /* Typedefs */
@@ -39,22 +52,114 @@ typedef enum virt_addr_t {
     MMU_VADDR_MAX
 } virt_addr_t;
 
+// NUMA allocation policies of `MMU_pf_alloc()`
+typedef enum numa_policy_t {
+    MMU_NUMA_LOCAL = 0,   // Node of the running CPU
+    MMU_NUMA_INTERLEAVE,  // Round robin over every node
+    MMU_NUMA_PREFERRED    // One chosen node
+} numa_policy_t;
+
+// Opaque address space, see `MMU_addr_space_create()`
+typedef struct addr_space_s addr_space_t;
+
+// Cache that gives page frames back under memory pressure. `count` returns how many frames the
+// cache could free, `scan` frees up to `num_pages` of them and returns how many it freed.
+typedef struct mmu_shrinker_s mmu_shrinker_t;
+struct mmu_shrinker_s
+{
+    uint64_t ( *count )( void );
+    uint64_t ( *scan )( uint64_t num_pages );
+    mmu_shrinker_t *next;  // Used by the MMU
+};
+
+// Working set estimate of a virtual address region, updated by every scan of the region
+typedef struct mmu_wss_s
+{
+    uint64_t num_scans;                      // Completed scans of the region
+    uint64_t num_pages;                      // Resident pages found by the last scan
+    uint64_t wss_pages;                      // Resident pages in the working set
+    uint64_t age_hist[MMU_WSS_AGE_BUCKETS];  // Resident pages by scans since their last access
+} mmu_wss_t;
+
 /* Public Functions */
 
 driver_status_t MMU_init( void *tag_ptr );
 
+/**
+ * @brief Frees the code and data marked `__init`, and the boot page tables. Nothing marked `__init`
+ * can be used after this.
+ */
+void MMU_free_init_mem( void );
+
 // Physical Address Functions
 void *MMU_pf_alloc( void );
 void MMU_pf_free( void *pf );
 
+// Memory Pressure Functions
+void MMU_register_shrinker( mmu_shrinker_t *shrinker );
+void MMU_unregister_shrinker( mmu_shrinker_t *shrinker );
+uint64_t MMU_num_free_frames( void );
+
+// Working Set Functions
+driver_status_t MMU_wss_get( addr_space_t *as, virt_addr_t region, mmu_wss_t *wss );
+
+/**
+ * @brief Ages every resident page by a scan and updates every working set estimate. Page ages are
+ * counted in scans, so calling this at a steady rate, like from a timer tick, keeps them in step
+ * with time. `MMU_wss_get()` scans by itself once the last scan has gone stale.
+ */
+void MMU_wss_scan( void );
+
+// Huge Page Frame Functions
+void *MMU_pf_alloc_huge( void );
+void MMU_pf_free_huge( void *pf );
+
+// Contiguous Allocation Functions
+void *MMU_alloc_contig( uint64_t num_pages, uint64_t max_phys_addr );
+void MMU_free_contig( void *pf, uint64_t num_pages );
+
+// NUMA Functions
+void *MMU_pf_alloc_node( uint32_t node );
+uint32_t MMU_num_nodes( void );
+driver_status_t MMU_set_numa_policy( numa_policy_t policy, uint32_t node );
+
 // Virtual Address Functions
 void *MMU_alloc_page( virt_addr_t region );
 void *MMU_alloc_pages( uint64_t num_pages, virt_addr_t region );
 void MMU_free_page( void *page );
+void MMU_free_pages( void *page, uint64_t num_pages );
+
+// Stack Functions
+void *MMU_alloc_stack( uint64_t num_pages, virt_addr_t region );
+void MMU_free_stack( void *stack_top, uint64_t num_pages );
+
+// Address Space Functions
+addr_space_t *MMU_addr_space_create( void );
+addr_space_t *MMU_addr_space_clone( addr_space_t *src );
+void MMU_addr_space_get( addr_space_t *as );
+void MMU_addr_space_put( addr_space_t *as );
+void MMU_addr_space_switch( addr_space_t *as );
+addr_space_t *MMU_addr_space_current( void );
+
+// Object Mapping Functions
+void *MMU_map_object( PC_object_t *obj, uint64_t offset, uint64_t len, uint32_t prot );
+void MMU_unmap_object( void *addr );
+int MMU_sync_object( void *addr );
+
+// TLB Functions
+void MMU_flush_tlb_range( void *start, uint64_t num_pages );
+
+// Swap Functions
+driver_status_t MMU_swap_init( BlockDevice_t *dev );
+
+// Page Table Entry Functions
+bool MMU_test_and_clear_accessed( void *page );
+bool MMU_test_and_clear_dirty( void *page );
+bool MMU_is_huge_page( void *page );
 
 // Heap Functions
-void *kbrk( uint64_t increment );
-void *sbrk( uint64_t increment );
+void *kbrk( int64_t increment );
+void *sbrk( int64_t increment );
 
 #endif /* MMU_DRIVER_H */
 
@@ -0,0 +1,642 @@
+/** @file page_cache.c
+ *
+ * @brief Page cache for block device backed objects. Cached pages are looked up by (object,
+ * offset) in a radix tree per object, and replaced with a clock policy driven by the accessed bits
+ * of their kernel mappings. Dirty pages are found through the dirty bits and written back before
+ * they are evicted. Pages mapped into an address space are pinned until they are unmapped.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#include "page_cache.h"
+
+#include "errno.h"
+#include "kmalloc.h"
+#include "mmu_driver.h"
+
+/* Private Defines and Macros */
+
+// Radix tree nodes have 64 slots, so 10 levels cover any page index
+#define PC_RADIX_BITS   ( 6U )
+#define PC_RADIX_FANOUT ( 1U << PC_RADIX_BITS )
+#define PC_RADIX_MASK   ( PC_RADIX_FANOUT - 1U )
+#define PC_MAX_HEIGHT   ( 10U )
+
+#define GET_RADIX_INDEX( index, level ) \
+    ( ( ( index ) >> ( ( level ) * PC_RADIX_BITS ) ) & PC_RADIX_MASK )
+
+#define BLKS_PER_PAGE( dev ) ( PAGE_SIZE / ( dev )->blk_size )
+
+/* Private Types and Enums */
+
+// Radix tree node
+typedef struct pc_node_s pc_node_t;
+struct pc_node_s
+{
+    void *slots[PC_RADIX_FANOUT];  // Child nodes, or cached pages in the bottom level
+    uint32_t count;                // Number of used slots
+};
+
+// Cached page
+typedef struct pc_page_s pc_page_t;
+struct pc_page_s
+{
+    PC_object_t *obj;   // Object the page belongs to
+    uint64_t index;     // Page offset in the object
+    void *data;         // Kernel mapping of the page
+    bool dirty;         // Dirtied through a mapping other than `data`
+    uint32_t mapcount;  // Number of mappings other than `data`, mapped pages are never evicted
+    pc_page_t *prev;    // Clock ring
+    pc_page_t *next;
+};
+
+// Cached object
+struct pc_object_s
+{
+    BlockDevice_t *dev;   // Backing block device
+    uint64_t first_blk;   // First block of the object on the device
+    uint64_t num_blks;    // Size of the object in blocks
+    pc_node_t *root;      // Radix tree of cached pages
+    uint8_t height;       // Number of levels in the radix tree
+    uint64_t num_cached;  // Number of cached pages
+    uint64_t num_mapped;  // Number of page mappings other than the kernel ones
+};
+
+/* Global Variables */
+
+// Every cached page sits in the clock ring, the hand points at the next page to look at
+static pc_page_t *clock_hand = NULL;
+static uint64_t num_cached_pages = 0;
+static uint64_t pc_capacity = PC_DEFAULT_CAPACITY;
+
+// Gives cached pages back to the memory manager when it runs low
+static mmu_shrinker_t pc_shrinker;
+
+/* Private Functions */
+
+#pragma region Radix Tree
+
+// Number of page indices a tree of `height` levels can hold
+uint64_t radix_capacity( uint8_t height )
+{
+    return ( height == 0 ? 0 : 1UL << ( height * PC_RADIX_BITS ) );
+}
+
+pc_node_t *radix_node_alloc( void ) { return (pc_node_t *)kcalloc( 1, sizeof( pc_node_t ) ); }
+
+// Find the cached page at `index`
+pc_page_t *radix_lookup( PC_object_t *obj, uint64_t index )
+{
+    pc_node_t *node = obj->root;
+    int level;
+
+    if ( node == NULL || index >= radix_capacity( obj->height ) )
+    {
+        return NULL;
+    }
+
+    for ( level = obj->height - 1; level > 0 && node != NULL; --level )
+    {
+        node = node->slots[GET_RADIX_INDEX( index, level )];
+    }
+
+    return ( node == NULL ? NULL : node->slots[GET_RADIX_INDEX( index, 0 )] );
+}
+
+// Insert a page at `index`, growing the tree as needed. Returns false if out of memory.
+bool radix_insert( PC_object_t *obj, uint64_t index, pc_page_t *page )
+{
+    pc_node_t *node, **slot;
+    int level;
+
+    // Add levels on top of the root until the index fits
+    while ( obj->root == NULL || index >= radix_capacity( obj->height ) )
+    {
+        if ( obj->height >= PC_MAX_HEIGHT || ( node = radix_node_alloc() ) == NULL )
+        {
+            return false;
+        }
+
+        if ( obj->root != NULL )
+        {
+            node->slots[0] = obj->root;
+            node->count = 1;
+        }
+
+        obj->root = node;
+        obj->height++;
+    }
+
+    // Walk down, allocating the missing nodes
+    node = obj->root;
+    for ( level = obj->height - 1; level > 0; --level )
+    {
+        slot = (pc_node_t **)&node->slots[GET_RADIX_INDEX( index, level )];
+
+        if ( *slot == NULL )
+        {
+            if ( ( *slot = radix_node_alloc() ) == NULL )
+            {
+                return false;
+            }
+
+            node->count++;
+        }
+
+        node = *slot;
+    }
+
+    node->slots[GET_RADIX_INDEX( index, 0 )] = page;
+    node->count++;
+
+    return true;
+}
+
+// Remove the page at `index`, freeing the nodes that become empty
+void radix_delete( PC_object_t *obj, uint64_t index )
+{
+    pc_node_t *path[PC_MAX_HEIGHT];
+    pc_node_t *node = obj->root;
+    int level;
+
+    if ( node == NULL || index >= radix_capacity( obj->height ) )
+    {
+        return;
+    }
+
+    // Record the nodes on the way down
+    for ( level = obj->height - 1; level >= 0; --level )
+    {
+        if ( node == NULL )
+        {
+            return;
+        }
+
+        path[level] = node;
+
+        if ( level > 0 )
+        {
+            node = node->slots[GET_RADIX_INDEX( index, level )];
+        }
+    }
+
+    if ( path[0]->slots[GET_RADIX_INDEX( index, 0 )] == NULL )
+    {
+        return;
+    }
+
+    // Clear the slot and free every node that is left empty on the way back up
+    for ( level = 0; level < obj->height; ++level )
+    {
+        path[level]->slots[GET_RADIX_INDEX( index, level )] = NULL;
+
+        if ( --path[level]->count != 0 )
+        {
+            return;
+        }
+
+        kfree( path[level] );
+    }
+
+    // The whole tree is empty
+    obj->root = NULL;
+    obj->height = 0;
+}
+
+#pragma endregion
+
+#pragma region Clock Ring
+
+// Add a page right behind the hand, so it is the last page the hand gets to
+void clock_insert( pc_page_t *page )
+{
+    if ( clock_hand == NULL )
+    {
+        page->prev = page;
+        page->next = page;
+        clock_hand = page;
+        return;
+    }
+
+    page->next = clock_hand;
+    page->prev = clock_hand->prev;
+    clock_hand->prev->next = page;
+    clock_hand->prev = page;
+}
+
+void clock_remove( pc_page_t *page )
+{
+    if ( page->next == page )
+    {
+        clock_hand = NULL;
+    }
+    else
+    {
+        page->prev->next = page->next;
+        page->next->prev = page->prev;
+
+        if ( clock_hand == page )
+        {
+            clock_hand = page->next;
+        }
+    }
+
+    page->prev = NULL;
+    page->next = NULL;
+}
+
+#pragma endregion
+
+// Read or write the blocks of a cached page that lie inside its object
+int pc_page_io( pc_page_t *page, bool write )
+{
+    PC_object_t *obj = page->obj;
+    uint64_t i, blk = page->index * BLKS_PER_PAGE( obj->dev );
+    uint8_t *data = (uint8_t *)page->data;
+
+    for ( i = 0; i < BLKS_PER_PAGE( obj->dev ); ++i, ++blk, data += obj->dev->blk_size )
+    {
+        // The tail of the last page is past the end of the object
+        if ( blk >= obj->num_blks )
+        {
+            if ( !write )
+            {
+                memset( data, 0, obj->dev->blk_size );
+            }
+
+            continue;
+        }
+
+        if ( ( write ? BD_write( obj->dev, obj->first_blk + blk, data )
+                     : BD_read( obj->dev, obj->first_blk + blk, data ) ) != 0 )
+        {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Write a page back if it has been written to since it was last written back
+int pc_page_writeback( pc_page_t *page )
+{
+    // Always test the dirty bit so it gets cleared along with the software flag
+    bool dirty = MMU_test_and_clear_dirty( page->data ) || page->dirty;
+
+    if ( !dirty )
+    {
+        return 0;
+    }
+
+    page->dirty = false;
+
+    if ( pc_page_io( page, true ) != 0 )
+    {
+        // Try again next time
+        page->dirty = true;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Drop a clean page from the cache
+void pc_page_drop( pc_page_t *page )
+{
+    radix_delete( page->obj, page->index );
+    clock_remove( page );
+
+    page->obj->num_cached--;
+    num_cached_pages--;
+
+    MMU_free_page( page->data );
+    kfree( page );
+}
+
+// Read a page into the cache
+pc_page_t *pc_page_fill( PC_object_t *obj, uint64_t index )
+{
+    pc_page_t *page;
+
+    // Make room first
+    if ( num_cached_pages >= pc_capacity )
+    {
+        PC_evict( 1 );
+    }
+
+    page = (pc_page_t *)kcalloc( 1, sizeof( pc_page_t ) );
+
+    if ( page == NULL )
+    {
+        return NULL;
+    }
+
+    page->obj = obj;
+    page->index = index;
+    page->data = MMU_alloc_page( MMU_VADDR_KHEAP );
+
+    if ( page->data == NULL || pc_page_io( page, false ) != 0 || !radix_insert( obj, index, page ) )
+    {
+        if ( page->data != NULL )
+        {
+            MMU_free_page( page->data );
+        }
+
+        kfree( page );
+        return NULL;
+    }
+
+    // Reading the page in wrote to it, but it matches the device
+    MMU_test_and_clear_dirty( page->data );
+
+    clock_insert( page );
+
+    obj->num_cached++;
+    num_cached_pages++;
+
+    return page;
+}
+
+// Find a cached page of an object, reading it in if it isn't cached
+pc_page_t *pc_page_get( PC_object_t *obj, uint64_t index )
+{
+    pc_page_t *page;
+
+    if ( index * PAGE_SIZE >= PC_object_size( obj ) )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    page = radix_lookup( obj, index );
+
+    return ( page == NULL ? pc_page_fill( obj, index ) : page );
+}
+
+// Find a cached page that is mapped
+pc_page_t *pc_page_get_mapped( PC_object_t *obj, uint64_t index )
+{
+    pc_page_t *page = radix_lookup( obj, index );
+
+    if ( page == NULL || page->mapcount == 0 )
+    {
+        OS_ERROR( "Page %lu of object %p is not mapped!\n", index, (void *)obj );
+        return NULL;
+    }
+
+    return page;
+}
+
+// Number of pages the shrinker could evict
+uint64_t pc_shrink_count( void ) { return num_cached_pages; }
+
+/* Public Functions */
+
+// Create an object for `num_blks` blocks of `dev`, starting at block `first_blk`
+PC_object_t *PC_object_create( BlockDevice_t *dev, uint64_t first_blk, uint64_t num_blks )
+{
+    PC_object_t *obj;
+
+    if ( dev == NULL || dev->blk_size == 0 || PAGE_SIZE % dev->blk_size != 0 ||
+         first_blk + num_blks > dev->num_blks )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    obj = (PC_object_t *)kcalloc( 1, sizeof( PC_object_t ) );
+
+    if ( obj == NULL )
+    {
+        return NULL;
+    }
+
+    obj->dev = dev;
+    obj->first_blk = first_blk;
+    obj->num_blks = num_blks;
+
+    // The cache can shrink under memory pressure once it has something to cache
+    if ( pc_shrinker.scan == NULL )
+    {
+        pc_shrinker.count = pc_shrink_count;
+        pc_shrinker.scan = PC_evict;
+        MMU_register_shrinker( &pc_shrinker );
+    }
+
+    return obj;
+}
+
+// Write back and drop every cached page of an object, then free the object
+void PC_object_destroy( PC_object_t *obj )
+{
+    pc_page_t *page, *next;
+    uint64_t i, n = num_cached_pages;
+
+    if ( obj == NULL ) return;
+
+    // Dropping mapped pages would free page frames that are still mapped
+    if ( obj->num_mapped != 0 )
+    {
+        OS_ERROR( "Object %p still has %lu mapped pages!\n", (void *)obj, obj->num_mapped );
+        return;
+    }
+
+    if ( PC_sync( obj ) != 0 )
+    {
+        OS_WARN( "Lost dirty pages of object %p!\n", (void *)obj );
+    }
+
+    for ( i = 0, page = clock_hand; i < n && obj->num_cached > 0; ++i, page = next )
+    {
+        next = page->next;
+
+        if ( page->obj == obj )
+        {
+            pc_page_drop( page );
+        }
+    }
+
+    kfree( obj );
+}
+
+// Size of an object in bytes
+uint64_t PC_object_size( PC_object_t *obj ) { return obj->num_blks * obj->dev->blk_size; }
+
+// Get the kernel mapping of a page of an object, reading it in if it isn't cached
+void *PC_get_page( PC_object_t *obj, uint64_t index )
+{
+    pc_page_t *page = pc_page_get( obj, index );
+
+    return ( page == NULL ? NULL : page->data );
+}
+
+// Pin a page of an object for a mapping, reading it in if it isn't cached. Returns the kernel
+// mapping of the page, the new mapping has to use the same page frame.
+void *PC_map_page( PC_object_t *obj, uint64_t index )
+{
+    pc_page_t *page = pc_page_get( obj, index );
+
+    if ( page == NULL )
+    {
+        return NULL;
+    }
+
+    page->mapcount++;
+    obj->num_mapped++;
+
+    return page->data;
+}
+
+// Unpin a page of an object once a mapping of it is gone. `dirty` is the dirty bit of the mapping.
+void PC_unmap_page( PC_object_t *obj, uint64_t index, bool dirty )
+{
+    pc_page_t *page = pc_page_get_mapped( obj, index );
+
+    if ( page == NULL )
+    {
+        return;
+    }
+
+    page->dirty |= dirty;
+    page->mapcount--;
+    obj->num_mapped--;
+}
+
+// Mark a mapped page as written to through its mapping, so it gets written back
+void PC_set_dirty( PC_object_t *obj, uint64_t index )
+{
+    pc_page_t *page = pc_page_get_mapped( obj, index );
+
+    if ( page != NULL )
+    {
+        page->dirty = true;
+    }
+}
+
+// Read up to `len` bytes at `offset` through the cache. Returns the number of bytes read.
+int64_t PC_read( PC_object_t *obj, uint64_t offset, void *dst, uint64_t len )
+{
+    uint64_t done = 0, size = PC_object_size( obj );
+
+    // Stop at the end of the object
+    len = ( offset >= size ? 0 : ( len > size - offset ? size - offset : len ) );
+
+    while ( done < len )
+    {
+        uint64_t page_off = ( offset + done ) % PAGE_SIZE;
+        uint64_t chunk = PAGE_SIZE - page_off;
+        uint8_t *data = PC_get_page( obj, ( offset + done ) / PAGE_SIZE );
+
+        if ( data == NULL )
+        {
+            return ( done == 0 ? -1 : (int64_t)done );
+        }
+
+        chunk = ( chunk > len - done ? len - done : chunk );
+        memcpy( (uint8_t *)dst + done, data + page_off, chunk );
+        done += chunk;
+    }
+
+    return (int64_t)done;
+}
+
+// Write up to `len` bytes at `offset` through the cache. The pages are written back later.
+int64_t PC_write( PC_object_t *obj, uint64_t offset, const void *src, uint64_t len )
+{
+    uint64_t done = 0, size = PC_object_size( obj );
+
+    // Objects don't grow
+    len = ( offset >= size ? 0 : ( len > size - offset ? size - offset : len ) );
+
+    while ( done < len )
+    {
+        uint64_t page_off = ( offset + done ) % PAGE_SIZE;
+        uint64_t chunk = PAGE_SIZE - page_off;
+        uint8_t *data = PC_get_page( obj, ( offset + done ) / PAGE_SIZE );
+
+        if ( data == NULL )
+        {
+            return ( done == 0 ? -1 : (int64_t)done );
+        }
+
+        // The CPU sets the dirty bit of the page
+        chunk = ( chunk > len - done ? len - done : chunk );
+        memcpy( data + page_off, (const uint8_t *)src + done, chunk );
+        done += chunk;
+    }
+
+    return (int64_t)done;
+}
+
+// Write back every dirty page of an object, or of every object if `obj` is NULL
+int PC_sync( PC_object_t *obj )
+{
+    pc_page_t *page = clock_hand;
+    uint64_t i;
+    int ret = 0;
+
+    for ( i = 0; i < num_cached_pages; ++i, page = page->next )
+    {
+        if ( ( obj == NULL || page->obj == obj ) && pc_page_writeback( page ) != 0 )
+        {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+// Evict up to `num_pages` pages. The hand gives every recently accessed page a second chance and
+// writes dirty pages back before dropping them. Returns the number of pages evicted.
+uint64_t PC_evict( uint64_t num_pages )
+{
+    uint64_t evicted = 0, scanned = 0;
+    uint64_t max_scan = 2 * num_cached_pages;
+    pc_page_t *page;
+
+    while ( evicted < num_pages && clock_hand != NULL && scanned++ < max_scan )
+    {
+        page = clock_hand;
+        clock_hand = page->next;
+
+        // The accessed bits of the other mappings can't be seen from here
+        if ( page->mapcount > 0 )
+        {
+            continue;
+        }
+
+        // Clear the accessed bit and come back on the next lap
+        if ( MMU_test_and_clear_accessed( page->data ) )
+        {
+            continue;
+        }
+
+        if ( pc_page_writeback( page ) != 0 )
+        {
+            continue;
+        }
+
+        pc_page_drop( page );
+        evicted++;
+    }
+
+    return evicted;
+}
+
+// Change the number of pages the cache holds, evicting pages over the new capacity
+void PC_set_capacity( uint64_t num_pages )
+{
+    pc_capacity = num_pages;
+
+    if ( num_cached_pages > pc_capacity )
+    {
+        PC_evict( num_cached_pages - pc_capacity );
+    }
+}
+
+/*** End of File ***/
@@ -0,0 +1,54 @@
+/** @file page_cache.h
+ *
+ * @brief Page cache for block device backed objects.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#ifndef PAGE_CACHE_H
+# define PAGE_CACHE_H
+
+/* Includes */
+
+# include "block_dev.h"
+# include "common.h"
+
+/* Defines */
+
+// Default number of pages kept in the cache
+# define PC_DEFAULT_CAPACITY ( 1024U )  // 4 MiB
+
+/* Typedefs */
+
+// Cached object, a range of blocks on a block device
+typedef struct pc_object_s PC_object_t;
+
+/* Public Functions */
+
+// Object Functions
+PC_object_t *PC_object_create( BlockDevice_t *dev, uint64_t first_blk, uint64_t num_blks );
+void PC_object_destroy( PC_object_t *obj );
+uint64_t PC_object_size( PC_object_t *obj );
+
+// Cached I/O Functions
+void *PC_get_page( PC_object_t *obj, uint64_t index );
+int64_t PC_read( PC_object_t *obj, uint64_t offset, void *dst, uint64_t len );
+int64_t PC_write( PC_object_t *obj, uint64_t offset, const void *src, uint64_t len );
+int PC_sync( PC_object_t *obj );
+
+// Mapping Functions
+void *PC_map_page( PC_object_t *obj, uint64_t index );
+void PC_unmap_page( PC_object_t *obj, uint64_t index, bool dirty );
+void PC_set_dirty( PC_object_t *obj, uint64_t index );
+
+// Replacement Functions
+uint64_t PC_evict( uint64_t num_pages );
+void PC_set_capacity( uint64_t num_pages );
+
+#endif /* PAGE_CACHE_H */
+
+/*** End of File ***/
@@ -378,6 +378,40 @@ size_t serial_write( const char *buff, size_t len )
     return i;
 }
 
+/**
+ * @brief Write data straight to the UART with interrupts disabled, waiting for each byte to be
+ * sent. Nothing else is written in between, which binary dumps need.
+ * @param buff - A pointer to the data to be written.
+ * @param len - The number of bytes to write.
+ */
+void serial_write_polled( const void *buff, size_t len )
+{
+    const uint8_t *data = (const uint8_t *)buff;
+    unsigned long flags;
+    size_t i;
+
+    // Error checking
+    if ( buff == NULL )
+    {
+        return;
+    }
+
+    // The TX IRQ handler prints, so it can't run in the middle of the data
+    flags = save_irqdisable();
+
+    for ( i = 0; i < len; ++i )
+    {
+        // Wait for the HW TX buffer to be empty
+        while ( !IS_HW_TX_EMPTY() )
+        {
+        }
+
+        outb( SERIAL_PORT, data[i] );
+    }
+
+    irqrestore( flags );
+}
+
 /**
  * @brief Write a string to the serial port.
  * @param str - A pointer to the string to be written.
@@ -0,0 +1,308 @@
+/** @file zram.c
+ *
+ * @brief Compressed in-memory store for swapped out pages. Pages are compressed with LZ4 and kept
+ * in pool pages split into fixed size objects, one size class per 64 bytes of compressed size.
+ * Stored pages are referred to by handles, which fit in a swapped out PT entry.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#include "zram.h"
+
+#include "kmalloc.h"
+#include "lz4.h"
+#include "mmu_driver.h"
+
+/* Private Defines and Macros */
+
+#define ZS_ALIGN       ( 64U )
+#define ZS_MAX_SIZE    ( PAGE_SIZE * 3U / 4U )  // Pages that compress worse are left to the disk
+#define ZS_NUM_CLASSES ( ZS_MAX_SIZE / ZS_ALIGN )
+
+// Objects start with their compressed size and reference count
+#define ZS_HDR_SIZE ( 2U * sizeof( uint16_t ) )
+
+// Handles are the pool page id and object index, plus one so 0 is never a handle
+#define ZS_OBJ_BITS               ( 6U )  // At most 64 objects per pool page
+#define ZS_OBJ_MASK               ( ( 1U << ZS_OBJ_BITS ) - 1U )
+#define ZS_MAKE_HANDLE( id, obj ) ( ( ( ( id ) << ZS_OBJ_BITS ) | ( obj ) ) + 1U )
+#define ZS_HANDLE_ID( h )         ( ( ( h ) - 1U ) >> ZS_OBJ_BITS )
+#define ZS_HANDLE_OBJ( h )        ( ( ( h ) - 1U ) & ZS_OBJ_MASK )
+
+#define ZS_CLASS_SIZE( c )        ( ( ( c ) + 1U ) * ZS_ALIGN )
+#define ZS_CLASS_OF( len )        ( ( ( len ) + ZS_HDR_SIZE - 1U ) / ZS_ALIGN )
+#define ZS_OBJS_PER_PAGE( c )     ( PAGE_SIZE / ZS_CLASS_SIZE( c ) )
+#define ZS_OBJ_ADDR( zp, obj )    ( ( zp )->frame + ( obj ) * ZS_CLASS_SIZE( ( zp )->class_id ) )
+#define ZS_OBJ_LEN( addr )        ( ( (uint16_t *)( addr ) )[0] )
+#define ZS_OBJ_REFCNT( addr )     ( ( (uint16_t *)( addr ) )[1] )
+
+/* Private Types and Enums */
+
+// Pool page holding objects of a single size class
+typedef struct zs_page_s zs_page_t;
+struct zs_page_s
+{
+    uint8_t *frame;     // Page frame holding the objects
+    uint64_t id;        // Index in the pool page table
+    uint8_t class_id;   // Size class of the objects
+    uint8_t num_used;   // Number of stored objects
+    uint64_t free_map;  // Set bits are free objects
+    zs_page_t *next;    // Next pool page of the class with free objects
+    bool on_partial;    // In the list of pages with free objects
+};
+
+/* Global Variables */
+
+// Pool pages by id, and the pool pages of every class that still have room
+static zs_page_t **zs_pages = NULL;
+static uint64_t zs_num_ids = 0;
+static zs_page_t *zs_partial[ZS_NUM_CLASSES];
+
+// Pool limits and statistics
+static bool zram_enabled = false;
+static uint64_t zs_pool_pages = 0, zs_max_pool_pages = 0;
+static uint64_t zs_stored_pages = 0, zs_stored_bytes = 0, zs_rejected_pages = 0;
+
+// Last compressed page
+static uint8_t zs_buf[ZS_MAX_SIZE];
+static uint64_t zs_buf_len = 0;
+
+/* Private Functions */
+
+// Get a pool page by the handle of one of its objects
+zs_page_t *zs_page_of( uint64_t handle )
+{
+    uint64_t id = ZS_HANDLE_ID( handle );
+
+    if ( handle == ZRAM_NO_HANDLE || id >= zs_num_ids || zs_pages[id] == NULL ||
+         ( zs_pages[id]->free_map & ( 1UL << ZS_HANDLE_OBJ( handle ) ) ) )
+    {
+        OS_ERROR_HALT( "Invalid zram handle %lu!\n", handle );
+    }
+
+    return zs_pages[id];
+}
+
+// Add a pool page to a class
+zs_page_t *zs_page_alloc( uint8_t class_id )
+{
+    zs_page_t *zp, **new_pages;
+    uint64_t id, num_objs;
+
+    if ( zs_pool_pages >= zs_max_pool_pages )
+    {
+        return NULL;
+    }
+
+    // Reuse the id of a freed pool page, or grow the table
+    for ( id = 0; id < zs_num_ids && zs_pages[id] != NULL; ++id )
+    {
+    }
+
+    if ( id == zs_num_ids )
+    {
+        new_pages = (zs_page_t **)krealloc( zs_pages, 2 * ( zs_num_ids + 1 ) * sizeof( void * ) );
+
+        if ( new_pages == NULL )
+        {
+            return NULL;
+        }
+
+        memset( new_pages + zs_num_ids, 0, ( zs_num_ids + 2 ) * sizeof( void * ) );
+        zs_pages = new_pages;
+        zs_num_ids = 2 * ( zs_num_ids + 1 );
+    }
+
+    zp = (zs_page_t *)kcalloc( 1, sizeof( zs_page_t ) );
+
+    if ( zp == NULL )
+    {
+        return NULL;
+    }
+
+    zp->frame = (uint8_t *)MMU_pf_alloc();
+
+    if ( zp->frame == NULL )
+    {
+        kfree( zp );
+        return NULL;
+    }
+
+    zp->id = id;
+    zp->class_id = class_id;
+    num_objs = ZS_OBJS_PER_PAGE( class_id );
+    zp->free_map = ( num_objs == 64 ? ~0UL : ( 1UL << num_objs ) - 1 );
+    zp->next = zs_partial[class_id];
+    zp->on_partial = true;
+
+    zs_partial[class_id] = zp;
+    zs_pages[id] = zp;
+    zs_pool_pages++;
+
+    return zp;
+}
+
+// Free an empty pool page
+void zs_page_free( uint64_t id )
+{
+    zs_page_t *zp = zs_pages[id], **prev;
+
+    for ( prev = &zs_partial[zp->class_id]; *prev != NULL; prev = &( *prev )->next )
+    {
+        if ( *prev == zp )
+        {
+            *prev = zp->next;
+            break;
+        }
+    }
+
+    MMU_pf_free( zp->frame );
+    kfree( zp );
+
+    zs_pages[id] = NULL;
+    zs_pool_pages--;
+}
+
+/* Public Functions */
+
+// Enable the compressed store, with at most `max_pool_pages` page frames of compressed pages
+driver_status_t ZRAM_init( uint64_t max_pool_pages )
+{
+    if ( max_pool_pages == 0 )
+    {
+        return FAILURE;
+    }
+
+    zs_max_pool_pages = max_pool_pages;
+    zram_enabled = true;
+
+    OS_INFO( "zram pool of up to %lu pages is ready\n", max_pool_pages );
+
+    return SUCCESS;
+}
+
+bool ZRAM_enabled( void ) { return zram_enabled; }
+
+uint64_t ZRAM_compress( const void *page )
+{
+    zs_buf_len = LZ4_compress( page, PAGE_SIZE, zs_buf, ZS_MAX_SIZE - ZS_HDR_SIZE );
+
+    if ( zs_buf_len == 0 )
+    {
+        zs_rejected_pages++;
+    }
+
+    return zs_buf_len;
+}
+
+uint64_t ZRAM_commit( void )
+{
+    uint8_t class_id = ZS_CLASS_OF( zs_buf_len );
+    zs_page_t *zp = zs_partial[class_id];
+    uint8_t *obj_addr;
+    uint64_t obj;
+
+    if ( zs_buf_len == 0 )
+    {
+        return ZRAM_NO_HANDLE;
+    }
+
+    // Every page of the class is full
+    if ( zp == NULL && ( zp = zs_page_alloc( class_id ) ) == NULL )
+    {
+        return ZRAM_NO_HANDLE;
+    }
+
+    obj = __builtin_ctzl( zp->free_map );
+    zp->free_map &= ~( 1UL << obj );
+    zp->num_used++;
+
+    // Full pages leave the partial list
+    if ( zp->free_map == 0 )
+    {
+        zs_partial[class_id] = zp->next;
+        zp->next = NULL;
+        zp->on_partial = false;
+    }
+
+    obj_addr = ZS_OBJ_ADDR( zp, obj );
+    ZS_OBJ_LEN( obj_addr ) = (uint16_t)zs_buf_len;
+    ZS_OBJ_REFCNT( obj_addr ) = 1;
+    memcpy( obj_addr + ZS_HDR_SIZE, zs_buf, zs_buf_len );
+
+    zs_stored_pages++;
+    zs_stored_bytes += zs_buf_len;
+
+    return ZS_MAKE_HANDLE( zp->id, obj );
+}
+
+// Decompress a stored page into `page`
+bool ZRAM_load( uint64_t handle, void *page )
+{
+    zs_page_t *zp = zs_page_of( handle );
+    uint8_t *obj_addr = ZS_OBJ_ADDR( zp, ZS_HANDLE_OBJ( handle ) );
+
+    return LZ4_decompress( obj_addr + ZS_HDR_SIZE, ZS_OBJ_LEN( obj_addr ), page, PAGE_SIZE ) ==
+           PAGE_SIZE;
+}
+
+// Add a PT entry to a stored page
+void ZRAM_get( uint64_t handle )
+{
+    zs_page_t *zp = zs_page_of( handle );
+    uint8_t *obj_addr = ZS_OBJ_ADDR( zp, ZS_HANDLE_OBJ( handle ) );
+
+    if ( ZS_OBJ_REFCNT( obj_addr ) == 0xFFFFU )
+    {
+        OS_ERROR_HALT( "zram handle %lu is shared too many times!\n", handle );
+    }
+
+    ZS_OBJ_REFCNT( obj_addr )++;
+}
+
+// Drop a PT entry from a stored page, freeing it with the last one
+void ZRAM_put( uint64_t handle )
+{
+    zs_page_t *zp = zs_page_of( handle );
+    uint64_t obj = ZS_HANDLE_OBJ( handle );
+    uint8_t *obj_addr = ZS_OBJ_ADDR( zp, obj );
+
+    if ( --ZS_OBJ_REFCNT( obj_addr ) != 0 )
+    {
+        return;
+    }
+
+    zs_stored_pages--;
+    zs_stored_bytes -= ZS_OBJ_LEN( obj_addr );
+
+    zp->free_map |= ( 1UL << obj );
+    zp->num_used--;
+
+    if ( zp->num_used == 0 )
+    {
+        zs_page_free( ZS_HANDLE_ID( handle ) );
+        return;
+    }
+
+    // The page has room again
+    if ( !zp->on_partial )
+    {
+        zp->next = zs_partial[zp->class_id];
+        zp->on_partial = true;
+        zs_partial[zp->class_id] = zp;
+    }
+}
+
+void ZRAM_print_stats( void )
+{
+    OS_INFO(
+        "zram: %lu pages stored in %lu pool pages (%lu compressed bytes), %lu rejected\n",
+        zs_stored_pages, zs_pool_pages, zs_stored_bytes, zs_rejected_pages
+    );
+}
+
+/*** End of File ***/
@@ -0,0 +1,56 @@
+/** @file zram.h
+ *
+ * @brief Compressed in-memory store for swapped out pages.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#ifndef ZRAM_H
+# define ZRAM_H
+
+/* Includes */
+
+# include "common.h"
+
+/* Defines */
+
+# define ZRAM_NO_HANDLE ( 0U )
+
+// Most page frames the pool can take, set to 0 to leave zram off
+# ifndef ZRAM_POOL_PAGES
+#  define ZRAM_POOL_PAGES ( 1024U )  // 4 MiB
+# endif
+
+/* Public Functions */
+
+driver_status_t ZRAM_init( uint64_t max_pool_pages );
+bool ZRAM_enabled( void );
+
+/**
+ * @brief Compresses a page into the staging buffer. The compressed copy is only stored once
+ * `ZRAM_commit()` is called, which lets the caller unmap the page first.
+ * @return The compressed size, or 0 if the page doesn't compress well enough to be worth storing
+ */
+uint64_t ZRAM_compress( const void *page );
+
+/**
+ * @brief Stores the staging buffer in the pool. A new pool page takes a page frame and heap
+ * memory, so this can fail when memory is low.
+ * @return A handle to the stored page, or `ZRAM_NO_HANDLE` if the pool is full or out of memory
+ */
+uint64_t ZRAM_commit( void );
+
+// Handle Functions
+bool ZRAM_load( uint64_t handle, void *page );
+void ZRAM_get( uint64_t handle );
+void ZRAM_put( uint64_t handle );
+
+void ZRAM_print_stats( void );
+
+#endif /* ZRAM_H */
+
+/*** End of File ***/
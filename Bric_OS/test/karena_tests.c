@@ -0,0 +1,193 @@
+/** @file karena_tests.c
+ *
+ * @brief Kernel Arena Allocator Tests
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#include "tests.h"
+
+#include "errno.h"
+#include "karena.h"
+#include "mmu_driver.h"
+#include "printk.h"
+
+#define RUN_TEST( test )                        \
+    OS_INFO( "Running test `%s`...\n", #test ); \
+    test();                                     \
+    OS_INFO( "Test `%s` complete.\n", #test )
+
+#define TEST_ASSERT( cond )                               \
+    if ( !( cond ) )                                      \
+    {                                                     \
+        OS_ERROR_HALT( "Assertion failed: %s\n", #cond ); \
+        return 1;                                         \
+    }
+
+#define TEST_ASSERT_EQUAL_PTR( exp, act ) TEST_ASSERT( (void *)( exp ) == (void *)( act ) )
+#define TEST_ASSERT_NOT_NULL( exp )       TEST_ASSERT( ( exp ) != NULL )
+#define TEST_ASSERT_NULL( exp )           TEST_ASSERT( ( exp ) == NULL )
+
+#define NUM_SMALL_ALLOCS 4096U
+
+int arena_alignment( void )
+{
+    karena_t arena;
+    size_t align;
+    void *ptr;
+
+    karena_init( &arena, 0 );
+
+    for ( align = 1; align <= PAGE_SIZE; align <<= 1 )
+    {
+        // Knock the arena off alignment first
+        TEST_ASSERT_NOT_NULL( karena_alloc_aligned( &arena, 1, 1 ) );
+
+        ptr = karena_alloc_aligned( &arena, 24, align );
+        TEST_ASSERT_NOT_NULL( ptr );
+        TEST_ASSERT( (uintptr_t)ptr % align == 0 );
+    }
+
+    errno = 0;
+    TEST_ASSERT_NULL( karena_alloc_aligned( &arena, 8, 24 ) );
+    TEST_ASSERT( errno == EINVAL );
+
+    karena_destroy( &arena );
+
+    return 0;
+}
+
+int arena_many_small( void )
+{
+    karena_t arena;
+    uint32_t *ptr, *prev = NULL;
+    uint32_t i;
+
+    karena_init( &arena, 1 );
+
+    // Spans many one page chunks, every allocation keeps its value
+    for ( i = 0; i < NUM_SMALL_ALLOCS; ++i )
+    {
+        ptr = (uint32_t *)karena_alloc( &arena, sizeof( uint32_t ) );
+        TEST_ASSERT_NOT_NULL( ptr );
+        TEST_ASSERT( (uintptr_t)ptr % KARENA_ALIGN == 0 );
+        TEST_ASSERT( ptr != prev );
+
+        *ptr = i;
+        prev = ptr;
+    }
+
+    karena_destroy( &arena );
+
+    return 0;
+}
+
+int arena_large( void )
+{
+    karena_t arena;
+    uint8_t *ptr;
+
+    karena_init( &arena, 1 );
+
+    // Bigger than a chunk, gets a chunk of its own
+    ptr = (uint8_t *)karena_calloc( &arena, 3, PAGE_SIZE );
+    TEST_ASSERT_NOT_NULL( ptr );
+    TEST_ASSERT( ptr[0] == 0 && ptr[3 * PAGE_SIZE - 1] == 0 );
+
+    TEST_ASSERT_NOT_NULL( karena_alloc( &arena, 64 ) );
+
+    karena_destroy( &arena );
+
+    return 0;
+}
+
+int arena_rollback( void )
+{
+    karena_t arena;
+    karena_mark_t mark;
+    void *first, *ptr;
+    uint32_t i;
+
+    karena_init( &arena, 1 );
+
+    TEST_ASSERT_NOT_NULL( karena_alloc( &arena, 100 ) );
+
+    mark = karena_save( &arena );
+    first = karena_alloc( &arena, 100 );
+    TEST_ASSERT_NOT_NULL( first );
+
+    for ( i = 0; i < 3 * PAGE_SIZE / 100; ++i )
+    {
+        TEST_ASSERT_NOT_NULL( karena_alloc( &arena, 100 ) );
+    }
+
+    // The same memory comes back after a rollback
+    karena_rollback( &arena, mark );
+    ptr = karena_alloc( &arena, 100 );
+    TEST_ASSERT_EQUAL_PTR( first, ptr );
+
+    // A mark saved before the first allocation empties the arena
+    karena_rollback( &arena, ( karena_mark_t ){ 0 } );
+    TEST_ASSERT_NULL( arena.chunks );
+
+    karena_destroy( &arena );
+    TEST_ASSERT_NULL( arena.spare );
+
+    return 0;
+}
+
+int arena_reset( void )
+{
+    karena_t arena;
+    void *first, *ptr;
+    uint32_t i;
+
+    karena_init( &arena, 0 );
+
+    first = karena_alloc( &arena, 32 );
+    TEST_ASSERT_NOT_NULL( first );
+
+    for ( i = 0; i < NUM_SMALL_ALLOCS; ++i )
+    {
+        TEST_ASSERT_NOT_NULL( karena_alloc( &arena, 32 ) );
+    }
+
+    // The chunks are reused, so the arena starts over at a chunk it had
+    karena_reset( &arena );
+    TEST_ASSERT_NULL( arena.chunks );
+
+    ptr = karena_alloc( &arena, 32 );
+    TEST_ASSERT_NOT_NULL( ptr );
+
+    for ( i = 0; i < NUM_SMALL_ALLOCS; ++i )
+    {
+        TEST_ASSERT_NOT_NULL( karena_alloc( &arena, 32 ) );
+    }
+
+    TEST_ASSERT_NULL( arena.spare );
+
+    karena_destroy( &arena );
+
+    return 0;
+}
+
+int test_karena_all( void )
+{
+    OS_INFO( "Running karena unit tests...\n" );
+
+    RUN_TEST( arena_alignment );
+    RUN_TEST( arena_many_small );
+    RUN_TEST( arena_large );
+    RUN_TEST( arena_rollback );
+    RUN_TEST( arena_reset );
+
+    OS_INFO( "Unit tests complete!\n" );
+
+    return 0;
+}
+
+/*** End of File ***/
@@ -55,6 +55,13 @@
         return 1;                                                                   \
     }
 
+#define TEST_ASSERT_NOT_EQUAL_UINT( exp, act )                                      \
+    if ( ( exp ) == ( act ) )                                                       \
+    {                                                                               \
+        OS_ERROR_HALT( "Assertion failed: %s (%lu) is not %s\n", #act, act, #exp ); \
+        return 1;                                                                   \
+    }
+
 #define TEST_ASSERT_LESS_OR_EQUAL_UINT( exp, act )                                              \
     if ( ( act ) > ( exp ) )                                                                    \
     {                                                                                           \
@@ -98,6 +105,12 @@
 #define MAX_LOOPS 200U
 #define NOERR     0U
 
+#define BULK_OBJS   64U
+#define BENCH_LOOPS 100U
+
+// More blocks of one class than the CPU's magazines and a full depot hold
+#define MAG_OBJS ( ( DEPOT_MAX_FULL + 4U ) * MAG_ROUNDS )
+
 #define TEST_VAL ( (uint8_t)( 0xA5 ) )
 
 size_t i, size;
@@ -716,6 +729,214 @@ int verify_alignment( void )
     return 0;
 }
 
+int malloc_bulk( void )
+{
+    void *ptrs[BULK_OBJS];
+    size_t j;
+
+    errno = 0;
+    TEST_ASSERT_EQUAL_UINT( (size_t)BULK_OBJS, kmalloc_bulk( ALLOC_LEN_192U, BULK_OBJS, ptrs ) );
+
+    for ( i = 0; i < BULK_OBJS; i++ )
+    {
+        TEST_ASSERT_NOT_NULL( ptrs[i] );
+        TEST_ASSERT_LESS_OR_EQUAL_UINT( MALLOC_USABLE_SIZE( ptrs[i] ), ALLOC_LEN_192U );
+        TEST_ASSERT_EQUAL_UINT( 0UL, (uintptr_t)ptrs[i] % 16 );
+
+        memset( ptrs[i], (int)i, ALLOC_LEN_192U );
+    }
+
+    // No block may overlap another
+    for ( i = 0; i < BULK_OBJS; i++ )
+    {
+        for ( j = 0; j < ALLOC_LEN_192U; j++ )
+        {
+            if ( ( (uint8_t *)ptrs[i] )[j] != (uint8_t)i )
+            {
+                OS_ERROR_HALT( "Block %zu was overwritten at byte %zu", i, j );
+                TEST_FAIL();
+            }
+        }
+    }
+
+    kfree_bulk( BULK_OBJS, ptrs );
+    TEST_ASSERT_ERRNO( NOERR );
+
+    // Blocks too big to be cached are carved out of one span
+    TEST_ASSERT_EQUAL_UINT( (size_t)BULK_OBJS, kmalloc_bulk( 3 * PAGE_SIZE, BULK_OBJS, ptrs ) );
+    kfree_bulk( BULK_OBJS, ptrs );
+    TEST_ASSERT_ERRNO( NOERR );
+
+    TEST_ASSERT_EQUAL_UINT( 0UL, kmalloc_bulk( SIZE_MAX, BULK_OBJS, ptrs ) );
+    TEST_ASSERT_ERRNO( ENOMEM );
+
+    return 0;
+}
+
+int mag_reuse( void )
+{
+    void *ptr, *next;
+
+    errno = 0;
+    ptr = kmalloc( ALLOC_LEN_64U );
+    TEST_ASSERT_NOT_NULL( ptr );
+
+    kfree( ptr );
+    TEST_ASSERT_ERRNO( NOERR );
+
+    // The last block freed to a magazine is the first one handed out
+    next = kmalloc( ALLOC_LEN_64U );
+    TEST_ASSERT_EQUAL_PTR( ptr, next );
+
+    kfree( next );
+    TEST_ASSERT_ERRNO( NOERR );
+
+    return 0;
+}
+
+int mag_depot_full( void )
+{
+    static void *ptrs[MAG_OBJS];
+    void *top;
+
+    errno = 0;
+    for ( i = 0; i < MAG_OBJS; i++ )
+    {
+        ptrs[i] = kmalloc( ALLOC_LEN_64U );
+        TEST_ASSERT_NOT_NULL( ptrs[i] );
+    }
+
+    for ( i = 0; i < MAG_OBJS; i++ )
+    {
+        kfree( ptrs[i] );
+    }
+
+    TEST_ASSERT_ERRNO( NOERR );
+
+    // The blocks the depot had no room for went back to the block list, so the heap doesn't grow
+    top = kbrk( 0 );
+
+    for ( i = 0; i < MAG_OBJS; i++ )
+    {
+        ptrs[i] = kmalloc( ALLOC_LEN_64U );
+        TEST_ASSERT_NOT_NULL( ptrs[i] );
+    }
+
+    TEST_ASSERT_EQUAL_PTR( top, kbrk( 0 ) );
+
+    for ( i = 0; i < MAG_OBJS; i++ )
+    {
+        kfree( ptrs[i] );
+    }
+
+    TEST_ASSERT_ERRNO( NOERR );
+
+    return 0;
+}
+
+int heap_shrink( void )
+{
+    uint64_t freed;
+    void *ptr, *top;
+
+    errno = 0;
+    ptr = kmalloc( 4 * BIN_SIZE );
+    TEST_ASSERT_NOT_NULL( ptr );
+
+    kfree( ptr );
+    TEST_ASSERT_ERRNO( NOERR );
+
+    // The freed block is at the top of the heap, so its pages can go back
+    top = kbrk( 0 );
+    TEST_ASSERT_NOT_EQUAL_UINT( 0UL, kmalloc_shrink_count() );
+
+    freed = kmalloc_shrink_scan( ~0UL );
+    TEST_ASSERT_NOT_EQUAL_UINT( 0UL, freed );
+    TEST_ASSERT_EQUAL_PTR( (uint8_t *)top - freed * PAGE_SIZE, kbrk( 0 ) );
+    TEST_ASSERT_EQUAL_UINT( 0UL, kmalloc_shrink_scan( ~0UL ) );
+
+    // The heap grows back on demand
+    ptr = kmalloc( 4 * BIN_SIZE );
+    TEST_ASSERT_NOT_NULL( ptr );
+
+    kfree( ptr );
+    TEST_ASSERT_ERRNO( NOERR );
+
+    return 0;
+}
+
+int mag_double_free( void )
+{
+    void *ptr, *next, *other;
+
+    errno = 0;
+    ptr = kmalloc( ALLOC_LEN_64U );
+    TEST_ASSERT_NOT_NULL( ptr );
+
+    kfree( ptr );
+    TEST_ASSERT_ERRNO( NOERR );
+
+    // The block is on a magazine already, so it's left there and handed out only once
+    kfree( ptr );  // NOLINT
+
+    next = kmalloc( ALLOC_LEN_64U );
+    other = kmalloc( ALLOC_LEN_64U );
+    TEST_ASSERT_EQUAL_PTR( ptr, next );
+    TEST_ASSERT_NOT_EQUAL_PTR( ptr, other );
+
+    errno = 0;
+    kfree( next );
+    kfree( other );
+    TEST_ASSERT_ERRNO( NOERR );
+
+    return 0;
+}
+
+// Compare the cycles per object of allocating and freeing one block at a time and in bulk
+int bench_bulk( void )
+{
+    static const size_t sizes[] = { ALLOC_LEN_64U, ALLOC_LEN_512U, 4 * PAGE_SIZE };
+    void *ptrs[BULK_OBJS];
+    uint64_t start, single, bulk;
+    size_t s, loop;
+
+    for ( s = 0; s < sizeof( sizes ) / sizeof( sizes[0] ); s++ )
+    {
+        start = rdtsc();
+
+        for ( loop = 0; loop < BENCH_LOOPS; loop++ )
+        {
+            for ( i = 0; i < BULK_OBJS; i++ )
+            {
+                ptrs[i] = kmalloc( sizes[s] );
+            }
+
+            for ( i = 0; i < BULK_OBJS; i++ )
+            {
+                kfree( ptrs[i] );
+            }
+        }
+
+        single = ( rdtsc() - start ) / ( BENCH_LOOPS * BULK_OBJS );
+        start = rdtsc();
+
+        for ( loop = 0; loop < BENCH_LOOPS; loop++ )
+        {
+            TEST_ASSERT_EQUAL_UINT( (size_t)BULK_OBJS, kmalloc_bulk( sizes[s], BULK_OBJS, ptrs ) );
+            kfree_bulk( BULK_OBJS, ptrs );
+        }
+
+        bulk = ( rdtsc() - start ) / ( BENCH_LOOPS * BULK_OBJS );
+
+        OS_INFO(
+            "%lu byte blocks: %lu cycles per object one at a time, %lu in bulk\n", sizes[s], single,
+            bulk
+        );
+    }
+
+    return 0;
+}
+
 int test_kfree( void )
 {
     RUN_TEST( free_std );
@@ -774,6 +995,28 @@ int test_krealloc( void )
     return 0;
 }
 
+int test_kmalloc_cache( void )
+{
+    RUN_TEST( mag_reuse );
+
+    RUN_TEST( mag_depot_full );
+
+    RUN_TEST( mag_double_free );
+
+    RUN_TEST( heap_shrink );
+
+    return 0;
+}
+
+int test_kmalloc_bulk( void )
+{
+    RUN_TEST( malloc_bulk );
+
+    RUN_TEST( bench_bulk );
+
+    return 0;
+}
+
 int test_kmalloc_all( void )
 {
     UNITY_BEGIN();
@@ -786,6 +1029,10 @@ int test_kmalloc_all( void )
 
     RUN_TEST( test_krealloc );
 
+    RUN_TEST( test_kmalloc_cache );
+
+    RUN_TEST( test_kmalloc_bulk );
+
     RUN_TEST( verify_alignment );
 
     UNITY_END();
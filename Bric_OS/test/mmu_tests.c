@@ -0,0 +1,506 @@
+/** @file mmu_tests.c
+ *
+ * @brief Memory Manager Tests
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#include "tests.h"
+
+#include "block_dev.h"
+#include "mmu_driver.h"
+#include "page_cache.h"
+#include "printk.h"
+
+#define RUN_TEST( test )                        \
+    OS_INFO( "Running test `%s`...\n", #test ); \
+    test();                                     \
+    OS_INFO( "Test `%s` complete.\n", #test )
+
+#define TEST_ASSERT( cond )                               \
+    if ( !( cond ) )                                      \
+    {                                                     \
+        OS_ERROR_HALT( "Assertion failed: %s\n", #cond ); \
+        return 1;                                         \
+    }
+
+#define TEST_ASSERT_NOT_NULL( exp ) TEST_ASSERT( ( exp ) != NULL )
+
+#define HUGE_SIZE  ( 0x200000UL )
+#define PAGE_WORDS ( PAGE_SIZE / sizeof( uint64_t ) )
+
+// User pages of the address space that gets cloned
+#define AS_PAGES ( 4U )
+
+// Kernel heap pages spread over a few 2 MiB blocks, and the most huge pages held at once
+#define FRAG_PAGES    ( 2048U )
+#define HUGE_HELD_MAX ( 512U )
+
+// Kernel heap pages made to borrow frames of the contiguous memory area
+#define LENT_PAGES ( 16U )
+
+// Most runs of `LENT_PAGES` frames held at once, enough for the largest area
+#define CONTIG_HELD_MAX ( 1024U )
+
+// User pages swapped out to a RAM disk with room for a few times as many
+#define SWAP_PAGES      ( 64U )
+#define SWAP_DISK_PAGES ( 256U )
+#define SWAP_DISK_BLKS  ( SWAP_DISK_PAGES * PAGE_SIZE / BLOCK_DEV_SIZE )
+
+// Pages of the RAM disk cached by the page cache and object mapping tests
+#define PC_DISK_PAGES ( 64U )
+#define PC_DISK_BLKS  ( PC_DISK_PAGES * PAGE_SIZE / BLOCK_DEV_SIZE )
+
+static void *huge_held[HUGE_HELD_MAX];
+static void *contig_held[CONTIG_HELD_MAX];
+static RamDisk_t swap_disk, pc_disk;
+static uint64_t pc_buf[PAGE_WORDS];
+
+// Take every page frame outside of the contiguous memory area, chained through their first word.
+// Reclaim runs on the way down.
+void *hoard_frames( void )
+{
+    void *hoard = NULL, *pf;
+
+    while ( ( pf = MMU_pf_alloc() ) != NULL )
+    {
+        *(void **)pf = hoard;
+        hoard = pf;
+    }
+
+    return hoard;
+}
+
+void release_frames( void *hoard )
+{
+    void *pf;
+
+    while ( hoard != NULL )
+    {
+        pf = hoard;
+        hoard = *(void **)pf;
+        MMU_pf_free( pf );
+    }
+}
+
+// Fill a page with words that don't compress, so it is written to the swap area instead of zram
+void fill_random( uint64_t *page, uint64_t seed )
+{
+    uint64_t i, x = seed * 0x9E3779B97F4A7C15UL + 1;
+
+    for ( i = 0; i < PAGE_WORDS; ++i )
+    {
+        // xorshift64
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+
+        page[i] = x;
+    }
+}
+
+bool page_is_random( const uint64_t *page, uint64_t seed )
+{
+    uint64_t i, x = seed * 0x9E3779B97F4A7C15UL + 1;
+
+    for ( i = 0; i < PAGE_WORDS; ++i )
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+
+        if ( page[i] != x )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Count the resident pages of a region of the loaded address space, ageing every page by a scan
+uint64_t resident_pages( virt_addr_t region )
+{
+    mmu_wss_t wss;
+
+    MMU_wss_scan();
+    MMU_wss_get( MMU_addr_space_current(), region, &wss );
+
+    return wss.num_pages;
+}
+
+int compact_fragmented( void )
+{
+    uint64_t *pages, i, num_held = 0;
+
+    pages = (uint64_t *)MMU_alloc_pages( FRAG_PAGES, MMU_VADDR_KHEAP );
+    TEST_ASSERT_NOT_NULL( pages );
+
+    // Every page gets a frame, then every other page is freed, leaving the blocks the frames came
+    // from half free and half used by pages that compaction can move
+    for ( i = 0; i < FRAG_PAGES; ++i )
+    {
+        pages[i * PAGE_SIZE / sizeof( uint64_t )] = i;
+    }
+
+    for ( i = 1; i < FRAG_PAGES; i += 2 )
+    {
+        MMU_free_page( (uint8_t *)pages + i * PAGE_SIZE );
+    }
+
+    // Take huge pages until none are left, the last ones only exist once the blocks are compacted
+    while ( num_held < HUGE_HELD_MAX && ( huge_held[num_held] = MMU_pf_alloc_huge() ) != NULL )
+    {
+        TEST_ASSERT( (uint64_t)huge_held[num_held] % HUGE_SIZE == 0 );
+        num_held++;
+    }
+
+    TEST_ASSERT( num_held > 0 );
+
+    // The pages that were moved kept what they held
+    for ( i = 0; i < FRAG_PAGES; i += 2 )
+    {
+        TEST_ASSERT( pages[i * PAGE_SIZE / sizeof( uint64_t )] == i );
+    }
+
+    while ( num_held > 0 )
+    {
+        MMU_pf_free_huge( huge_held[--num_held] );
+    }
+
+    for ( i = 0; i < FRAG_PAGES; i += 2 )
+    {
+        MMU_free_page( (uint8_t *)pages + i * PAGE_SIZE );
+    }
+
+    return 0;
+}
+
+int contig_while_lent( void )
+{
+    uint64_t *pages, i, num_contig = 0;
+    void *hoard;
+
+    // Map the pages first, their tables can't be allocated once memory is gone
+    pages = (uint64_t *)MMU_alloc_pages( LENT_PAGES, MMU_VADDR_KHEAP );
+    TEST_ASSERT_NOT_NULL( pages );
+
+    hoard = hoard_frames();
+
+    // With nothing else left, the heap pages borrow frames of the area
+    for ( i = 0; i < LENT_PAGES; ++i )
+    {
+        pages[i * PAGE_SIZE / sizeof( uint64_t )] = i;
+    }
+
+    // Give the frames back so the borrowed pages have somewhere to move to
+    release_frames( hoard );
+
+    // Allocate the whole area in runs, the runs holding the heap pages have to move them first
+    while ( num_contig < CONTIG_HELD_MAX &&
+            ( contig_held[num_contig] = MMU_alloc_contig( LENT_PAGES, 0 ) ) != NULL )
+    {
+        num_contig++;
+    }
+
+    TEST_ASSERT( num_contig > 0 );
+
+    for ( i = 0; i < LENT_PAGES; ++i )
+    {
+        TEST_ASSERT( pages[i * PAGE_SIZE / sizeof( uint64_t )] == i );
+    }
+
+    while ( num_contig > 0 )
+    {
+        MMU_free_contig( contig_held[--num_contig], LENT_PAGES );
+    }
+
+    MMU_free_pages( pages, LENT_PAGES );
+
+    return 0;
+}
+
+int swap_out_in( void )
+{
+    uint64_t *pages, *kpage, i, resident;
+    void *hoard;
+
+    // Writing to the swap area must not need page frames, so the whole disk is touched first. The
+    // disk stays the swap area once the test is done.
+    TEST_ASSERT_NOT_NULL( RamDisk_init( &swap_disk, SWAP_DISK_BLKS ) );
+    memset( swap_disk.data, 0, SWAP_DISK_PAGES * PAGE_SIZE );
+    TEST_ASSERT( MMU_swap_init( &swap_disk.block_dev ) == SUCCESS );
+
+    pages = (uint64_t *)MMU_alloc_pages( SWAP_PAGES, MMU_VADDR_UHEAP );
+    kpage = (uint64_t *)MMU_alloc_page( MMU_VADDR_KHEAP );
+    TEST_ASSERT_NOT_NULL( pages );
+    TEST_ASSERT_NOT_NULL( kpage );
+
+    for ( i = 0; i < SWAP_PAGES; ++i )
+    {
+        fill_random( pages + i * PAGE_WORDS, i );
+    }
+
+    fill_random( kpage, SWAP_PAGES );
+
+    // Two scans without an access in between leave the pages cold
+    MMU_wss_scan();
+    resident = resident_pages( MMU_VADDR_UHEAP );
+
+    // Running out of frames swaps the cold user pages out, kernel heap pages are never swapped
+    hoard = hoard_frames();
+    TEST_ASSERT( resident_pages( MMU_VADDR_UHEAP ) < resident );
+    release_frames( hoard );
+
+    // Touching the pages swaps them back in
+    for ( i = 0; i < SWAP_PAGES; ++i )
+    {
+        TEST_ASSERT( page_is_random( pages + i * PAGE_WORDS, i ) );
+    }
+
+    TEST_ASSERT( page_is_random( kpage, SWAP_PAGES ) );
+
+    MMU_free_pages( pages, SWAP_PAGES );
+    MMU_free_page( kpage );
+
+    return 0;
+}
+
+int page_cache_evict( void )
+{
+    PC_object_t *obj;
+    void *hoard;
+    uint64_t i;
+
+    // Evicting pages writes them to the disk, which must not need page frames either
+    TEST_ASSERT_NOT_NULL( RamDisk_init( &pc_disk, PC_DISK_BLKS ) );
+    memset( pc_disk.data, 0, PC_DISK_PAGES * PAGE_SIZE );
+
+    obj = PC_object_create( &pc_disk.block_dev, 0, PC_DISK_BLKS );
+    TEST_ASSERT_NOT_NULL( obj );
+
+    // Fill the cache with dirty pages, nothing is written to the disk yet
+    for ( i = 0; i < PC_DISK_PAGES; ++i )
+    {
+        fill_random( pc_buf, i );
+        TEST_ASSERT( PC_write( obj, i * PAGE_SIZE, pc_buf, PAGE_SIZE ) == PAGE_SIZE );
+    }
+
+    TEST_ASSERT( !page_is_random( (uint64_t *)pc_disk.data, 0 ) );
+
+    // Running out of frames makes the shrinker evict every page, writing it back first
+    hoard = hoard_frames();
+    release_frames( hoard );
+
+    for ( i = 0; i < PC_DISK_PAGES; ++i )
+    {
+        TEST_ASSERT( page_is_random( (uint64_t *)( pc_disk.data + i * PAGE_SIZE ), i ) );
+    }
+
+    // The evicted pages are read back in from the disk
+    for ( i = 0; i < PC_DISK_PAGES; ++i )
+    {
+        TEST_ASSERT( PC_read( obj, i * PAGE_SIZE, pc_buf, PAGE_SIZE ) == PAGE_SIZE );
+        TEST_ASSERT( page_is_random( pc_buf, i ) );
+    }
+
+    PC_object_destroy( obj );
+    RamDisk_destroy( &pc_disk );
+
+    return 0;
+}
+
+int map_object_sync( void )
+{
+    PC_object_t *obj;
+    uint64_t *map, i;
+
+    TEST_ASSERT_NOT_NULL( RamDisk_init( &pc_disk, PC_DISK_BLKS ) );
+
+    for ( i = 0; i < PC_DISK_PAGES; ++i )
+    {
+        fill_random( (uint64_t *)( pc_disk.data + i * PAGE_SIZE ), i );
+    }
+
+    obj = PC_object_create( &pc_disk.block_dev, 0, PC_DISK_BLKS );
+    TEST_ASSERT_NOT_NULL( obj );
+
+    // Map all but the first page, the pages are read in through the cache as they are touched
+    map = (uint64_t *)MMU_map_object(
+        obj, PAGE_SIZE, ( PC_DISK_PAGES - 1 ) * PAGE_SIZE,
+        MMU_PROT_READ | MMU_PROT_WRITE | MMU_PROT_KERNEL
+    );
+    TEST_ASSERT_NOT_NULL( map );
+
+    for ( i = 1; i < PC_DISK_PAGES; ++i )
+    {
+        TEST_ASSERT( page_is_random( map + ( i - 1 ) * PAGE_WORDS, i ) );
+    }
+
+    // Writes go to the cached pages, and only reach the disk once synced
+    for ( i = 1; i < PC_DISK_PAGES; i += 2 )
+    {
+        fill_random( map + ( i - 1 ) * PAGE_WORDS, PC_DISK_PAGES + i );
+    }
+
+    TEST_ASSERT( page_is_random( (uint64_t *)( pc_disk.data + PAGE_SIZE ), 1 ) );
+    TEST_ASSERT( MMU_sync_object( map ) == 0 );
+
+    for ( i = 1; i < PC_DISK_PAGES; ++i )
+    {
+        TEST_ASSERT( page_is_random( (uint64_t *)( pc_disk.data + i * PAGE_SIZE ),
+                                     ( i % 2 == 1 ? PC_DISK_PAGES + i : i ) ) );
+    }
+
+    MMU_unmap_object( map );
+    PC_object_destroy( obj );
+    RamDisk_destroy( &pc_disk );
+
+    return 0;
+}
+
+// Clone an address space with a few user pages, write to the shared pages on both sides and drop
+// both
+int clone_and_drop( void )
+{
+    addr_space_t *kernel = MMU_addr_space_current(), *as, *clone;
+    uint64_t *pages, i;
+
+    as = MMU_addr_space_create();
+    TEST_ASSERT_NOT_NULL( as );
+
+    // Give the user half some page tables of its own
+    MMU_addr_space_switch( as );
+
+    pages = (uint64_t *)MMU_alloc_pages( AS_PAGES, MMU_VADDR_UHEAP );
+    TEST_ASSERT_NOT_NULL( pages );
+
+    for ( i = 0; i < AS_PAGES; ++i )
+    {
+        pages[i * PAGE_WORDS] = i;
+    }
+
+    MMU_addr_space_switch( kernel );
+
+    // The clone shares the kernel half and copies the user tables
+    clone = MMU_addr_space_clone( as );
+    TEST_ASSERT_NOT_NULL( clone );
+
+    // The first write to a shared page copies it
+    MMU_addr_space_switch( clone );
+    pages[0] = AS_PAGES;
+    TEST_ASSERT( pages[0] == AS_PAGES );
+    TEST_ASSERT( pages[PAGE_WORDS] == 1 );
+
+    // The parent still sees its own page. It is the last user now and takes the frame back without
+    // a copy, while the page still shared with the clone is copied.
+    MMU_addr_space_switch( as );
+    TEST_ASSERT( pages[0] == 0 );
+    pages[0] = AS_PAGES + 1;
+    pages[PAGE_WORDS] = AS_PAGES + 2;
+
+    MMU_addr_space_switch( clone );
+    TEST_ASSERT( pages[0] == AS_PAGES );
+    TEST_ASSERT( pages[PAGE_WORDS] == 1 );
+
+    MMU_addr_space_switch( as );
+    TEST_ASSERT( pages[0] == AS_PAGES + 1 );
+    TEST_ASSERT( pages[PAGE_WORDS] == AS_PAGES + 2 );
+
+    MMU_addr_space_switch( kernel );
+
+    MMU_addr_space_put( as );
+    MMU_addr_space_put( clone );
+
+    return 0;
+}
+
+int addr_space_tables( void )
+{
+    uint64_t num_free;
+
+    // The first round grows the heap and the range node pool, which keep their frames
+    TEST_ASSERT( clone_and_drop() == 0 );
+    num_free = MMU_num_free_frames();
+
+    // Every private table and page is freed, and the shared tables are left alone
+    TEST_ASSERT( clone_and_drop() == 0 );
+    TEST_ASSERT( MMU_num_free_frames() == num_free );
+
+    return 0;
+}
+
+int huge_promote_demote( void )
+{
+    uint8_t *brk = (uint8_t *)kbrk( 0 ), *block;
+    uint64_t num_free, i;
+    void *pool;
+
+    // Move the break up to a 2 MiB boundary first, which promotes any full blocks below it before
+    // the frames are counted
+    block = (uint8_t *)ALIGN( (uint64_t)brk, HUGE_SIZE );
+    TEST_ASSERT( kbrk( block - brk ) != (void *)( -1 ) );
+
+    // Promotion only takes blocks kept in the pool
+    pool = MMU_pf_alloc_huge();
+    TEST_ASSERT_NOT_NULL( pool );
+    MMU_pf_free_huge( pool );
+    num_free = MMU_num_free_frames();
+
+    // Stop the break right before the end of the block and fill every page of it
+    TEST_ASSERT( kbrk( HUGE_SIZE - sizeof( uint64_t ) ) != (void *)( -1 ) );
+
+    for ( i = 0; i < HUGE_SIZE / PAGE_SIZE; ++i )
+    {
+        fill_random( (uint64_t *)( block + i * PAGE_SIZE ), i );
+    }
+
+    TEST_ASSERT( !MMU_is_huge_page( block ) );
+
+    // Crossing into the next block promotes the full one
+    TEST_ASSERT( kbrk( sizeof( uint64_t ) ) != (void *)( -1 ) );
+    TEST_ASSERT( MMU_is_huge_page( block ) );
+
+    for ( i = 0; i < HUGE_SIZE / PAGE_SIZE; ++i )
+    {
+        TEST_ASSERT( page_is_random( (uint64_t *)( block + i * PAGE_SIZE ), i ) );
+    }
+
+    // Shrinking the break into the block splits it up again
+    TEST_ASSERT( kbrk( -(int64_t)( HUGE_SIZE / 2 ) ) != (void *)( -1 ) );
+    TEST_ASSERT( !MMU_is_huge_page( block ) );
+
+    for ( i = 0; i < HUGE_SIZE / PAGE_SIZE / 2; ++i )
+    {
+        TEST_ASSERT( page_is_random( (uint64_t *)( block + i * PAGE_SIZE ), i ) );
+    }
+
+    // Every frame of the block is freed on its own, rather than going back to the pool
+    TEST_ASSERT( kbrk( brk - (uint8_t *)kbrk( 0 ) ) != (void *)( -1 ) );
+    TEST_ASSERT( MMU_num_free_frames() == num_free + HUGE_SIZE / PAGE_SIZE );
+
+    return 0;
+}
+
+int test_mmu_all( void )
+{
+    OS_INFO( "Running memory manager unit tests...\n" );
+
+    RUN_TEST( addr_space_tables );
+    RUN_TEST( compact_fragmented );
+    RUN_TEST( contig_while_lent );
+    RUN_TEST( swap_out_in );
+    RUN_TEST( page_cache_evict );
+    RUN_TEST( map_object_sync );
+    RUN_TEST( huge_promote_demote );
+
+    OS_INFO( "Unit tests complete!\n" );
+
+    return 0;
+}
+
+/*** End of File ***/
@@ -79,14 +79,6 @@ int rand( void )
     return (int)seed;
 }
 
-// Delay functions
-unsigned long rdtsc( void )
-{
-    unsigned long tsc;
-    asm volatile( "rdtsc" : "=a"( tsc ) );
-    return tsc;
-}
-
 snake new_snake( int y, int x, int len, int dir, int color )
 {
     // if parts of a snake would be off the screen, it starts
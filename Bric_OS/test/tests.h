@@ -22,8 +22,18 @@ int test_kmalloc( void );
 int test_kcalloc( void );
 int test_krealloc( void );
 int test_kfree( void );
+int test_kmalloc_bulk( void );
 int test_kmalloc_all( void );
 
+// karena_tests.c
+int test_karena_all( void );
+
+// mmu_tests.c
+int test_mmu_all( void );
+
+// zram_tests.c
+int test_zram_all( void );
+
 #endif /* TESTS_H */
 
 /*** End of File ***/
\ No newline at end of file
@@ -0,0 +1,157 @@
+/** @file zram_tests.c
+ *
+ * @brief LZ4 and zram Tests
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#include "tests.h"
+
+#include "lz4.h"
+#include "mmu_driver.h"
+#include "printk.h"
+#include "zram.h"
+
+#define RUN_TEST( test )                        \
+    OS_INFO( "Running test `%s`...\n", #test ); \
+    test();                                     \
+    OS_INFO( "Test `%s` complete.\n", #test )
+
+#define TEST_ASSERT( cond )                               \
+    if ( !( cond ) )                                      \
+    {                                                     \
+        OS_ERROR_HALT( "Assertion failed: %s\n", #cond ); \
+        return 1;                                         \
+    }
+
+// Pages start with this many random bytes and end in zeros, one page per step of 256 bytes up to
+// the largest size zram stores. Every few steps lands in another size class.
+#define RAND_STEP  ( 256U )
+#define NUM_PAGES  ( 12U )
+#define PAGE_WORDS ( PAGE_SIZE / sizeof( uint64_t ) )
+
+static uint64_t page[PAGE_WORDS], copy[PAGE_WORDS];
+static uint8_t packed[PAGE_SIZE + PAGE_SIZE / 255 + 16];
+static uint64_t handles[NUM_PAGES];
+
+// Fill `page` with `rand_len` bytes that don't compress, then zeros
+void fill_page( uint64_t *buf, uint64_t seed, uint64_t rand_len )
+{
+    uint64_t i, x = seed * 0x9E3779B97F4A7C15UL + 1;
+
+    for ( i = 0; i < PAGE_WORDS; ++i )
+    {
+        // xorshift64
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+
+        buf[i] = ( i * sizeof( uint64_t ) < rand_len ? x : 0 );
+    }
+}
+
+bool pages_match( const uint64_t *a, const uint64_t *b )
+{
+    uint64_t i;
+
+    for ( i = 0; i < PAGE_WORDS && a[i] == b[i]; ++i )
+    {
+    }
+
+    return i == PAGE_WORDS;
+}
+
+int lz4_round_trip( void )
+{
+    uint64_t i, len;
+
+    for ( i = 0; i <= PAGE_SIZE / RAND_STEP; ++i )
+    {
+        fill_page( page, i, i * RAND_STEP );
+
+        len = LZ4_compress( page, PAGE_SIZE, packed, sizeof( packed ) );
+        TEST_ASSERT( len > 0 );
+
+        TEST_ASSERT( LZ4_decompress( packed, len, copy, PAGE_SIZE ) == PAGE_SIZE );
+        TEST_ASSERT( pages_match( page, copy ) );
+    }
+
+    // A block that doesn't fit is refused rather than cut short
+    fill_page( page, 0, PAGE_SIZE );
+    TEST_ASSERT( LZ4_compress( page, PAGE_SIZE, packed, PAGE_SIZE / 2 ) == 0 );
+
+    len = LZ4_compress( page, PAGE_SIZE, packed, sizeof( packed ) );
+    TEST_ASSERT( LZ4_decompress( packed, len, copy, PAGE_SIZE / 2 ) == -1 );
+
+    return 0;
+}
+
+int zram_round_trip( void )
+{
+    uint64_t i;
+
+    if ( !ZRAM_enabled() )
+    {
+        OS_WARN( "zram is off, see `ZRAM_POOL_PAGES`\n" );
+        return 0;
+    }
+
+    // Store every page before loading any, so several classes and pool pages are in use at once
+    for ( i = 0; i < NUM_PAGES; ++i )
+    {
+        fill_page( page, i, i * RAND_STEP );
+
+        TEST_ASSERT( ZRAM_compress( page ) > 0 );
+        handles[i] = ZRAM_commit();
+        TEST_ASSERT( handles[i] != ZRAM_NO_HANDLE );
+    }
+
+    for ( i = 0; i < NUM_PAGES; ++i )
+    {
+        fill_page( page, i, i * RAND_STEP );
+        memset( copy, 0xA5, PAGE_SIZE );
+
+        TEST_ASSERT( ZRAM_load( handles[i], copy ) );
+        TEST_ASSERT( pages_match( page, copy ) );
+    }
+
+    // A shared page outlives its first put
+    ZRAM_get( handles[1] );
+    ZRAM_put( handles[1] );
+
+    fill_page( page, 1, RAND_STEP );
+    TEST_ASSERT( ZRAM_load( handles[1], copy ) );
+    TEST_ASSERT( pages_match( page, copy ) );
+
+    for ( i = 0; i < NUM_PAGES; ++i )
+    {
+        ZRAM_put( handles[i] );
+    }
+
+    // Pages that don't compress are left to the swap area
+    fill_page( page, NUM_PAGES, PAGE_SIZE );
+    TEST_ASSERT( ZRAM_compress( page ) == 0 );
+    TEST_ASSERT( ZRAM_commit() == ZRAM_NO_HANDLE );
+
+    ZRAM_print_stats();
+
+    return 0;
+}
+
+int test_zram_all( void )
+{
+    OS_INFO( "Running LZ4 and zram unit tests...\n" );
+
+    RUN_TEST( lz4_round_trip );
+    RUN_TEST( zram_round_trip );
+
+    OS_INFO( "Unit tests complete!\n" );
+
+    return 0;
+}
+
+/*** End of File ***/
@@ -0,0 +1,102 @@
+/** @file kernel_stubs.c
+ *
+ * @brief The kernel functions `lib/kmalloc.c` needs, for running it in a host process. The heap
+ * grows into a large reserved mapping, so its pages only count towards the RSS once touched, the
+ * same as kernel heap pages that are only mapped on a page fault.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "kernel_stubs.h"
+
+/* Private Defines and Macros */
+
+// Address space reserved for the heap
+#define HEAP_RESERVE ( 16ULL << 30 )
+
+/* Global Variables */
+
+static uint8_t *heap_base = NULL;
+static uint64_t heap_brk = 0;
+static uint64_t heap_peak = 0;
+
+static int kernel_errno = 0;
+
+bool kernel_verbose = false;
+
+/* Kernel Functions */
+
+void *kbrk( int64_t increment )
+{
+    void *old_brk;
+
+    if ( heap_base == NULL )
+    {
+        heap_base = (uint8_t *)mmap(
+            NULL, HEAP_RESERVE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+        );
+
+        if ( heap_base == MAP_FAILED )
+        {
+            heap_base = NULL;
+            return (void *)( -1 );
+        }
+    }
+
+    if ( (int64_t)heap_brk + increment < 0 || heap_brk + increment > HEAP_RESERVE )
+    {
+        return (void *)( -1 );
+    }
+
+    old_brk = heap_base + heap_brk;
+    heap_brk += increment;
+    heap_peak = ( heap_brk > heap_peak ? heap_brk : heap_peak );
+
+    return old_brk;
+}
+
+int printk( const char *fmt, ... )
+{
+    va_list args;
+    int len = 0;
+
+    if ( kernel_verbose )
+    {
+        va_start( args, fmt );
+        len = vfprintf( stderr, fmt, args );
+        va_end( args );
+    }
+
+    return len;
+}
+
+int *__geterrno( void ) { return &kernel_errno; }
+
+// Only one CPU, and nothing to interrupt it
+unsigned long save_irqdisable( void ) { return 0; }
+void irqrestore( unsigned long flags ) { (void)flags; }
+uint32_t this_cpu( void ) { return 0; }
+void io_wait( void ) {}
+
+int atomic_test_and_set( int *value, int compare, int swap )
+{
+    return __sync_val_compare_and_swap( value, compare, swap );
+}
+
+/* Public Functions */
+
+uint64_t kernel_heap_size( void ) { return heap_brk; }
+
+uint64_t kernel_heap_peak( void ) { return heap_peak; }
+
+/*** End of File ***/
@@ -0,0 +1,41 @@
+/** @file kernel_stubs.h
+ *
+ * @brief The kernel heap, built for the host. These are the `lib/kmalloc.c` functions the replay
+ * calls, and the state of the stubbed `kbrk()` under it.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#ifndef KERNEL_STUBS_H
+# define KERNEL_STUBS_H
+
+/* Includes */
+
+# include <stdbool.h>
+# include <stddef.h>
+# include <stdint.h>
+
+/* Global Variables */
+
+// Print the kernel's messages to stderr
+extern bool kernel_verbose;
+
+/* Public Functions */
+
+// From lib/kmalloc.c
+void *kmalloc( size_t size );
+void *kcalloc( size_t nmemb, size_t size );
+void *krealloc( void *ptr, size_t size );
+void kfree( void *ptr );
+
+// Current and highest break of the heap, in bytes
+uint64_t kernel_heap_size( void );
+uint64_t kernel_heap_peak( void );
+
+#endif /* KERNEL_STUBS_H */
+
+/*** End of File ***/
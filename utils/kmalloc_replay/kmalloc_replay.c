@@ -0,0 +1,584 @@
+/** @file kmalloc_replay.c
+ *
+ * @brief Replays an allocation trace from a `make trace` kernel against the kernel heap and other
+ * allocators, and compares their throughput, peak RSS and fragmentation.
+ *
+ * The trace is read from a serial log, or any file holding a dump, and the last dump in it is
+ * used. Its address ids are first turned into block numbers, so the timed runs only index an
+ * array. Each allocator runs in its own process: one pass follows the live and footprint bytes
+ * after every call, then the timed passes replay the whole trace and free what is left.
+ *
+ * @author Bryce Melander
+ * @date Oct-18-2026
+ *
+ * @copyright (c) 2026 by Bryce Melander under MIT License. All rights reserved.
+ * (See http://opensource.org/licenses/MIT for more details.)
+ */
+
+#define _GNU_SOURCE
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kernel_stubs.h"
+
+/* Private Defines and Macros */
+
+// The dump format of lib/kmalloc_trace.h
+#define KTRACE_MAGIC     "KTRACE\0\0"
+#define KTRACE_MAGIC_LEN ( 8U )
+#define KTRACE_VERSION   ( 1U )
+
+#define NUM_OPS ( 6U )
+
+/* Private Types and Enums */
+
+// Copies of the layouts in lib/kmalloc_trace.h
+typedef enum ktrace_op_e
+{
+    KTRACE_ALLOC = 1,
+    KTRACE_CALLOC = 2,
+    KTRACE_FREE = 3,
+    KTRACE_REALLOC = 4,
+    KTRACE_MOVE = 5,
+} ktrace_op_t;
+
+typedef struct __attribute__( ( packed ) ) ktrace_rec_s
+{
+    uint64_t tsc : 56;
+    uint64_t op : 8;
+    uint32_t id;
+    uint32_t size;
+} ktrace_rec_t;
+
+typedef struct __attribute__( ( packed ) ) ktrace_hdr_s
+{
+    char magic[KTRACE_MAGIC_LEN];
+    uint32_t version;
+    uint32_t rec_size;
+    uint64_t num_recs;
+    uint64_t num_lost;
+} ktrace_hdr_t;
+
+// A call of the trace, its block numbered in the order the blocks were allocated
+typedef struct replay_op_s
+{
+    uint32_t op;    // ktrace_op_t, but never KTRACE_MOVE
+    uint32_t obj;   // Block number
+    uint32_t size;  // Requested size
+} replay_op_t;
+
+typedef struct replay_s
+{
+    replay_op_t *ops;
+    size_t num_ops;
+    uint32_t num_objs;            // Blocks in the trace
+    uint64_t num_recs;            // Records in the dump
+    uint64_t num_lost;            // Records the kernel overwrote before the dump
+    uint64_t num_unmatched;       // Frees of blocks allocated before the trace starts
+    uint64_t cycles;              // Time stamp counter cycles the trace spans
+    uint64_t op_counts[NUM_OPS];  // Records of each ktrace_op_t
+} replay_t;
+
+typedef struct allocator_s
+{
+    const char *name;
+    void *( *alloc )( size_t size );
+    void *( *calloc )( size_t nmemb, size_t size );
+    void *( *realloc )( void *ptr, size_t size );
+    void ( *free )( void *ptr );
+    uint64_t ( *footprint )( void );  // Bytes the allocator got from the system
+} allocator_t;
+
+// Address id to block number, open addressing with tombstones
+typedef struct id_map_s
+{
+    uint64_t *keys;  // Address id + 1, 0 if unused, UINT64_MAX if removed
+    uint32_t *objs;
+    size_t mask;
+} id_map_t;
+
+/* Allocators */
+
+uint64_t libc_footprint( void )
+{
+    struct mallinfo2 info = mallinfo2();
+
+    // The heap arenas and the blocks that got mappings of their own
+    return info.arena + info.hblkhd;
+}
+
+static const allocator_t allocators[] = {
+    { "kmalloc", kmalloc, kcalloc, krealloc, kfree, kernel_heap_size },
+    // Also any malloc() that is LD_PRELOADed, like jemalloc or tcmalloc
+    { "libc", malloc, calloc, realloc, free, libc_footprint },
+};
+
+#define NUM_ALLOCATORS ( sizeof( allocators ) / sizeof( allocators[0] ) )
+
+/* Private Functions */
+
+void usage( const char *prog )
+{
+    fprintf(
+        stderr,
+        "Usage: %s [OPTION]... TRACE\n"
+        "Replay a kmalloc trace dumped by a `make trace` kernel, e.g. misc/serial.log\n"
+        "\n"
+        "Options:\n"
+        "  -a NAME   Only replay against allocator NAME (kmalloc, libc)\n"
+        "  -n RUNS   Timed runs of the trace, 10 by default\n"
+        "  -v        Print the kernel heap's messages\n"
+        "\n"
+        "Build with KMALLOC_SRC=path/to/kmalloc.c to replay against another version of the\n"
+        "kernel heap, or LD_PRELOAD another malloc() to replay it as `libc`.\n",
+        prog
+    );
+}
+
+uint8_t *read_file( const char *path, size_t *len )
+{
+    FILE *file = fopen( path, "rb" );
+    uint8_t *data = NULL;
+    long size;
+
+    if ( file == NULL )
+    {
+        perror( path );
+        return NULL;
+    }
+
+    if ( fseek( file, 0, SEEK_END ) == 0 && ( size = ftell( file ) ) >= 0 &&
+         fseek( file, 0, SEEK_SET ) == 0 && ( data = malloc( size + 1 ) ) != NULL )
+    {
+        *len = fread( data, 1, size, file );
+    }
+
+    fclose( file );
+
+    return data;
+}
+
+// Find the last dump in `data`, returns its header or NULL
+const ktrace_hdr_t *find_dump( const uint8_t *data, size_t len )
+{
+    const uint8_t *found = NULL, *at = data;
+    size_t left = len;
+
+    while ( ( at = memmem( at, left, KTRACE_MAGIC, KTRACE_MAGIC_LEN ) ) != NULL )
+    {
+        found = at;
+        at += KTRACE_MAGIC_LEN;
+        left = len - ( at - data );
+    }
+
+    if ( found == NULL || (size_t)( data + len - found ) < sizeof( ktrace_hdr_t ) )
+    {
+        return NULL;
+    }
+
+    return (const ktrace_hdr_t *)found;
+}
+
+bool id_map_init( id_map_t *map, size_t num_recs )
+{
+    size_t cap = 1;
+
+    // At most one block per record, at most half full
+    while ( cap < 2 * num_recs + 2 )
+    {
+        cap <<= 1;
+    }
+
+    map->keys = calloc( cap, sizeof( uint64_t ) );
+    map->objs = calloc( cap, sizeof( uint32_t ) );
+    map->mask = cap - 1;
+
+    return ( map->keys != NULL && map->objs != NULL );
+}
+
+// Find the slot of `id`, or NULL
+uint64_t *id_map_find( id_map_t *map, uint32_t id )
+{
+    size_t idx = ( (uint64_t)id * 0x9E3779B97F4A7C15ULL >> 20 ) & map->mask;
+
+    for ( ; map->keys[idx] != 0; idx = ( idx + 1 ) & map->mask )
+    {
+        if ( map->keys[idx] == (uint64_t)id + 1 )
+        {
+            return &map->keys[idx];
+        }
+    }
+
+    return NULL;
+}
+
+void id_map_put( id_map_t *map, uint32_t id, uint32_t obj )
+{
+    uint64_t *key = id_map_find( map, id );
+    size_t idx = ( (uint64_t)id * 0x9E3779B97F4A7C15ULL >> 20 ) & map->mask;
+
+    if ( key == NULL )
+    {
+        while ( map->keys[idx] != 0 && map->keys[idx] != UINT64_MAX )
+        {
+            idx = ( idx + 1 ) & map->mask;
+        }
+
+        key = &map->keys[idx];
+        *key = (uint64_t)id + 1;
+    }
+
+    map->objs[key - map->keys] = obj;
+}
+
+// Turn the records of a dump into replay calls on numbered blocks
+bool replay_load( replay_t *trace, const ktrace_hdr_t *hdr, size_t len )
+{
+    const ktrace_rec_t *recs = (const ktrace_rec_t *)( hdr + 1 );
+    const ktrace_rec_t *rec;
+    replay_op_t *op;
+    id_map_t map;
+    uint64_t *key;
+    size_t i;
+
+    memset( trace, 0, sizeof( replay_t ) );
+
+    if ( hdr->version != KTRACE_VERSION || hdr->rec_size != sizeof( ktrace_rec_t ) )
+    {
+        fprintf( stderr, "Unknown trace version %u\n", hdr->version );
+        return false;
+    }
+
+    trace->num_recs = hdr->num_recs;
+    trace->num_lost = hdr->num_lost;
+
+    // The log can end before the dump does
+    if ( trace->num_recs > ( len - sizeof( ktrace_hdr_t ) ) / sizeof( ktrace_rec_t ) )
+    {
+        trace->num_recs = ( len - sizeof( ktrace_hdr_t ) ) / sizeof( ktrace_rec_t );
+        fprintf(
+            stderr, "The trace is cut short, %lu of %lu records\n", trace->num_recs,
+            hdr->num_recs
+        );
+    }
+
+    trace->ops = calloc( trace->num_recs + 1, sizeof( replay_op_t ) );
+
+    if ( trace->ops == NULL || !id_map_init( &map, trace->num_recs ) )
+    {
+        fprintf( stderr, "Out of memory\n" );
+        return false;
+    }
+
+    if ( trace->num_recs > 0 )
+    {
+        trace->cycles = recs[trace->num_recs - 1].tsc - recs[0].tsc;
+    }
+
+    for ( i = 0; i < trace->num_recs; ++i )
+    {
+        rec = &recs[i];
+        op = &trace->ops[trace->num_ops];
+        key = id_map_find( &map, rec->id );
+
+        if ( rec->op < NUM_OPS )
+        {
+            trace->op_counts[rec->op]++;
+        }
+
+        switch ( rec->op )
+        {
+            case KTRACE_ALLOC:
+            case KTRACE_CALLOC:
+                // An id that is still live lost its free to the ring
+                *op = ( replay_op_t ){ rec->op, trace->num_objs++, rec->size };
+                id_map_put( &map, rec->id, op->obj );
+                trace->num_ops++;
+                break;
+
+            case KTRACE_FREE:
+                if ( key == NULL )
+                {
+                    trace->num_unmatched++;
+                    break;
+                }
+
+                *op = ( replay_op_t ){ KTRACE_FREE, map.objs[key - map.keys], 0 };
+                *key = UINT64_MAX;
+                trace->num_ops++;
+                break;
+
+            case KTRACE_REALLOC:
+                // A block from before the trace is allocated at its new size
+                if ( key == NULL )
+                {
+                    *op = ( replay_op_t ){ KTRACE_ALLOC, trace->num_objs++, rec->size };
+                    id_map_put( &map, rec->id, op->obj );
+                }
+                else
+                {
+                    *op = ( replay_op_t ){ KTRACE_REALLOC, map.objs[key - map.keys], rec->size };
+                }
+
+                trace->num_ops++;
+
+                // The block moved, it's found by its new id from now on
+                if ( i + 1 < trace->num_recs && recs[i + 1].op == KTRACE_MOVE )
+                {
+                    key = id_map_find( &map, rec->id );
+                    *key = UINT64_MAX;
+                    id_map_put( &map, recs[++i].id, op->obj );
+                    trace->op_counts[KTRACE_MOVE]++;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    free( map.keys );
+    free( map.objs );
+
+    return true;
+}
+
+// Make one call, returns false if an allocation failed
+static inline bool replay_op( const allocator_t *alloc, const replay_op_t *op, void **ptrs )
+{
+    void *ptr = NULL;
+
+    switch ( op->op )
+    {
+        case KTRACE_ALLOC:
+            ptr = ptrs[op->obj] = alloc->alloc( op->size );
+            break;
+
+        case KTRACE_CALLOC:
+            ptr = ptrs[op->obj] = alloc->calloc( 1, op->size );
+            break;
+
+        case KTRACE_REALLOC:
+            // A failed resize leaves the block as it was
+            if ( ( ptr = alloc->realloc( ptrs[op->obj], op->size ) ) != NULL )
+            {
+                ptrs[op->obj] = ptr;
+            }
+            break;
+
+        case KTRACE_FREE:
+            alloc->free( ptrs[op->obj] );
+            ptrs[op->obj] = NULL;
+            return true;
+    }
+
+    return ( ptr != NULL );
+}
+
+void replay_free_all( const allocator_t *alloc, const replay_t *trace, void **ptrs )
+{
+    uint32_t i;
+
+    for ( i = 0; i < trace->num_objs; ++i )
+    {
+        if ( ptrs[i] != NULL )
+        {
+            alloc->free( ptrs[i] );
+            ptrs[i] = NULL;
+        }
+    }
+}
+
+double now( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+long max_rss_kib( void )
+{
+    struct rusage usage;
+
+    getrusage( RUSAGE_SELF, &usage );
+
+    return usage.ru_maxrss;
+}
+
+// Replay the trace against one allocator and print its results, in a process of its own
+void replay_child( const allocator_t *alloc, const replay_t *trace, uint32_t num_runs )
+{
+    void **ptrs = calloc( trace->num_objs + 1, sizeof( void * ) );
+    uint32_t *sizes = calloc( trace->num_objs + 1, sizeof( uint32_t ) );
+    uint64_t live = 0, peak_live = 0, footprint, peak_footprint = 0, failed = 0;
+    long base_rss = max_rss_kib();
+    const replay_op_t *op;
+    double start, elapsed;
+    uint32_t run;
+    size_t i;
+
+    if ( ptrs == NULL || sizes == NULL )
+    {
+        fprintf( stderr, "Out of memory\n" );
+        exit( 1 );
+    }
+
+    // Memory pass, after every call
+    for ( i = 0; i < trace->num_ops; ++i )
+    {
+        op = &trace->ops[i];
+
+        if ( !replay_op( alloc, op, ptrs ) )
+        {
+            failed++;
+            continue;
+        }
+
+        live += ( op->op == KTRACE_FREE ? 0 : op->size );
+        live -= ( op->op == KTRACE_ALLOC || op->op == KTRACE_CALLOC ? 0 : sizes[op->obj] );
+        sizes[op->obj] = ( op->op == KTRACE_FREE ? 0 : op->size );
+
+        footprint = alloc->footprint();
+        peak_live = ( live > peak_live ? live : peak_live );
+        peak_footprint = ( footprint > peak_footprint ? footprint : peak_footprint );
+    }
+
+    replay_free_all( alloc, trace, ptrs );
+
+    // Timed passes, the blocks left at the end aren't part of the trace
+    for ( elapsed = 0, run = 0; run < num_runs; ++run )
+    {
+        start = now();
+
+        for ( i = 0; i < trace->num_ops; ++i )
+        {
+            replay_op( alloc, &trace->ops[i], ptrs );
+        }
+
+        elapsed += now() - start;
+
+        replay_free_all( alloc, trace, ptrs );
+    }
+
+    printf(
+        "%-10s %12.0f %8.1f %13ld %13lu %13lu %7.1f%% %8lu\n", alloc->name,
+        ( elapsed > 0 ? trace->num_ops * num_runs / elapsed : 0 ),
+        ( trace->num_ops > 0 ? elapsed * 1e9 / ( trace->num_ops * (double)num_runs ) : 0 ),
+        max_rss_kib() - base_rss, peak_live / 1024, peak_footprint / 1024,
+        ( peak_footprint > 0 ? 100.0 * ( 1.0 - (double)peak_live / peak_footprint ) : 0 ), failed
+    );
+    fflush( stdout );
+
+    exit( 0 );
+}
+
+/* Main */
+
+int main( int argc, char **argv )
+{
+    const char *only = NULL;
+    const ktrace_hdr_t *hdr;
+    uint32_t num_runs = 10;
+    replay_t trace;
+    uint8_t *data;
+    size_t len = 0, i;
+    int opt, status;
+    pid_t pid;
+
+    while ( ( opt = getopt( argc, argv, "a:n:vh" ) ) != -1 )
+    {
+        switch ( opt )
+        {
+            case 'a':
+                only = optarg;
+                break;
+
+            case 'n':
+                num_runs = (uint32_t)strtoul( optarg, NULL, 0 );
+                break;
+
+            case 'v':
+                kernel_verbose = true;
+                break;
+
+            default:
+                usage( argv[0] );
+                return ( opt == 'h' ? 0 : 1 );
+        }
+    }
+
+    if ( optind != argc - 1 )
+    {
+        usage( argv[0] );
+        return 1;
+    }
+
+    if ( ( data = read_file( argv[optind], &len ) ) == NULL )
+    {
+        return 1;
+    }
+
+    if ( ( hdr = find_dump( data, len ) ) == NULL )
+    {
+        fprintf( stderr, "%s: No kmalloc trace found\n", argv[optind] );
+        return 1;
+    }
+
+    if ( !replay_load( &trace, hdr, len - ( (const uint8_t *)hdr - data ) ) )
+    {
+        return 1;
+    }
+
+    free( data );
+
+    printf(
+        "Trace: %lu records, %lu lost, %lu cycles\n"
+        "       %lu allocs, %lu callocs, %lu reallocs (%lu moved), %lu frees, %lu unmatched\n"
+        "       %u blocks, %zu calls replayed %u times\n\n",
+        trace.num_recs, trace.num_lost, trace.cycles, trace.op_counts[KTRACE_ALLOC],
+        trace.op_counts[KTRACE_CALLOC], trace.op_counts[KTRACE_REALLOC],
+        trace.op_counts[KTRACE_MOVE], trace.op_counts[KTRACE_FREE], trace.num_unmatched,
+        trace.num_objs, trace.num_ops, num_runs
+    );
+
+    // Fragmentation compares the high-water marks of the live and footprint bytes
+    printf(
+        "%-10s %12s %8s %13s %13s %13s %8s %8s\n", "allocator", "calls/s", "ns/call",
+        "peak RSS KiB", "peak live KiB", "footprint KiB", "frag", "failed"
+    );
+    fflush( stdout );
+
+    for ( i = 0; i < NUM_ALLOCATORS; ++i )
+    {
+        if ( only != NULL && strcmp( only, allocators[i].name ) != 0 )
+        {
+            continue;
+        }
+
+        if ( ( pid = fork() ) == 0 )
+        {
+            replay_child( &allocators[i], &trace, num_runs );
+        }
+
+        if ( pid < 0 || waitpid( pid, &status, 0 ) < 0 || !WIFEXITED( status ) ||
+             WEXITSTATUS( status ) != 0 )
+        {
+            printf( "%-10s failed to replay the trace\n", allocators[i].name );
+        }
+    }
+
+    free( trace.ops );
+
+    return 0;
+}
+
+/*** End of File ***/